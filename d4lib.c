@@ -40,32 +40,89 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <signal.h>
 #include <fcntl.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <poll.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <ctype.h>
+#include <signal.h>
 
 #include "d4lib.h"
 
+#ifndef RUSAGE_THREAD
+#define RUSAGE_THREAD 1   /* Linux, declared only with _GNU_SOURCE */
+#endif
 
 #ifndef RDTIMEOUT
 #define RDTIMEOUT 10000
 #define WRTIMEOUT 10000
 #endif
 
-int d4WrTimeout = WRTIMEOUT;
-int d4RdTimeout = RDTIMEOUT;
+#ifndef PROBETIMEOUT
+#define PROBETIMEOUT 200
+#endif
+
+#define MAX_ENTER_IEEE 10
+
+/* timeouts are per thread, so each thread may drive its own device */
+__thread int d4WrTimeout = WRTIMEOUT;
+__thread int d4RdTimeout = RDTIMEOUT;
+__thread int d4ProbeTimeout = PROBETIMEOUT;
 int ppid        = 0;
 
 int debugD4     = 1;
 
-typedef void (*signalHandler_t)(int);
-static signalHandler_t sig;
-static int timeoutGot = 0;
-static int _readData(int fd, unsigned char *buf, int len);
+static __thread int timeoutGot = 0;
+
+/* bytes read from devices by this thread, so a probe knows whether */
+/* anything came, and whether a probe is running (short timeouts)   */
+static __thread unsigned long d4Received = 0;
+static __thread int d4Probing = 0;
+
+/* result of the last rejected command of this thread (the caller   */
+/* clears it), D4_RESULT_BUSY and D4_RESULT_RESOURCES tell that the */
+/* device is loaded and would accept the command later              */
+__thread int d4LastResult = 0;
+
+/* operation deadline, per thread as the timeouts, and cancellation */
+/* of all the operations (counted from signal handler), a thread is */
+/* cancelled if d4Cancel() was called since it's d4SetDeadline()    */
+static __thread struct timeval d4Deadline;   /* 0 - no deadline     */
+static __thread int d4IgnoreCancel = 0;      /* cleaning up         */
+static __thread int d4CancelsSeen = 0;       /* at d4SetDeadline    */
+static volatile sig_atomic_t d4Cancels = 0;
+
+/* upper bounds of transaction latency buckets */
+const int d4LatencyBounds[D4_LATENCY_BUCKETS] = { 1, 5, 10, 50, 100, 500, 1000, 5000 };
+__thread d4Stats_t d4Stats;
+static int _readData(int fd, unsigned char socketID, unsigned char *buf, int len);
+
+/* state of an opened channel: credits and packets received for it */
+/* while waiting for something else (per thread as the timeouts)   */
+#define D4_MAX_CHANNELS 8
+#define D4_QUEUE_LEN    8
+#define D4_MAX_PACKET   0x1000
+
+typedef struct d4Channel_s
+{
+   int            used;
+   int            fd;
+   unsigned char  socketID;
+   int            sndSize;      /* negotiated packet sizes            */
+   int            rcvSize;
+   int            credits;      /* packets we may send                */
+   int            peerCredits;  /* packets the peer may send to us,   */
+                                /* i.e. outstanding replies           */
+   int            head;         /* queue of received packets          */
+   int            queued;
+   int            qLen[D4_QUEUE_LEN];
+   unsigned char *queue[D4_QUEUE_LEN];
+} d4Channel_t;
+
+static __thread d4Channel_t d4Channels[D4_MAX_CHANNELS];
 
 /* commands for the D4 protocol
 
@@ -163,19 +220,6 @@ static errorMessage_t errorMessage[] =
    { 0x00, NULL                                                    ,0 }
 };
 
-#define RESET_TIMER(ti,oti) { signal(SIGALRM, sig); \
-                              memset((void*)&ti,0,sizeof(ti)); \
-                              memset((void*)&oti,0,sizeof(oti)); \
-                              setitimer( ITIMER_REAL ,&ti, &oti); \
-                            }
-
-#define SET_TIMER(ti,oti,val) { memset((void*)&ti,0,sizeof(ti)); \
-                                memset((void*)&oti,0,sizeof(oti)); \
-                                ti.it_value.tv_sec  = val/1000; \
-                                ti.it_value.tv_usec = (val%1000)*1000; \
-                                setitimer( ITIMER_REAL ,&ti, &oti); \
-                                sig = signal(SIGALRM, sigAlarm); \
-                              }
 
 /*******************************************************************/
 /* Function printHexValues                                         */
@@ -253,34 +297,929 @@ static void printHexValues(const char *dir, const unsigned char *buf, int len)
      }
 }
 
+/*******************************************************************/
+/* Function d4SetDeadline()                                        */
+/*        bound all the following operations of this thread, every */
+/*        read or write fails with ECANCELED after the deadline,   */
+/*        earlier d4Cancel() calls don't affect them anymore       */
+/* Input:  int   ms    time from now, 0 for no deadline            */
+/*                                                                 */
+/*******************************************************************/
+
+void d4SetDeadline(int ms)
+{
+   d4IgnoreCancel = 0;
+   d4CancelsSeen  = d4Cancels;
+   if ( ms <= 0 )
+   {
+      timerclear(&d4Deadline);
+      return;
+   }
+   gettimeofday(&d4Deadline, NULL);
+   d4Deadline.tv_sec  += ms / 1000;
+   d4Deadline.tv_usec += (ms % 1000) * 1000;
+   if ( d4Deadline.tv_usec >= 1000000 )
+   {
+      d4Deadline.tv_sec++;
+      d4Deadline.tv_usec -= 1000000;
+   }
+}
+
+/*******************************************************************/
+/* Function d4SetCleanupDeadline()                                 */
+/*        as d4SetDeadline(), but d4Cancel() is ignored until the  */
+/*        next d4SetDeadline(), so channels may be closed after    */
+/*        the operation was cancelled                              */
+/* Input:  int   ms    time from now                               */
+/*                                                                 */
+/*******************************************************************/
+
+void d4SetCleanupDeadline(int ms)
+{
+   d4SetDeadline(ms);
+   d4IgnoreCancel = 1;
+}
+
+/*******************************************************************/
+/* Function d4Cancel()                                             */
+/*        cancel the operations of all the threads until their     */
+/*        next d4SetDeadline() (may be called from signal handler) */
+/*                                                                 */
+/*******************************************************************/
+
+void d4Cancel(void)
+{
+   d4Cancels++;
+}
+
+/*******************************************************************/
+/* Function d4Remaining()                                          */
+/*        time left to the deadline of this thread                 */
+/*                                                                 */
+/* Return: ms left, 0 if expired or cancelled, -1 if no deadline   */
+/*                                                                 */
+/*******************************************************************/
+
+int d4Remaining(void)
+{
+   struct timeval now;
+   long left;
+
+   if ( d4Cancels != d4CancelsSeen && !d4IgnoreCancel )
+      return 0;
+   if ( !timerisset(&d4Deadline) )
+      return -1;
+   gettimeofday(&now, NULL);
+   left  = (d4Deadline.tv_sec  - now.tv_sec) * 1000;
+   left += (d4Deadline.tv_usec - now.tv_usec) / 1000;
+   return left > 0 ? left : 0;
+}
+
+/*******************************************************************/
+/* Function d4Expired()                                            */
+/*                                                                 */
+/* Return: 1 if the deadline passed or operations were cancelled   */
+/*                                                                 */
+/*******************************************************************/
+
+int d4Expired(void)
+{
+   return d4Remaining() == 0;
+}
+
+/*******************************************************************/
+/* Function boundTimeout()                                         */
+/*        limit the timeout of one read or write by the deadline   */
+/* Input:  int   timeout in ms                                     */
+/*                                                                 */
+/* Return: the timeout to use, -1 (errno ECANCELED) if expired     */
+/*                                                                 */
+/*******************************************************************/
+
+static int boundTimeout(int timeout)
+{
+   int left = d4Remaining();
+
+   if ( left == 0 )
+   {
+      errno = ECANCELED;
+      return -1;
+   }
+   return left > 0 && left < timeout ? left : timeout;
+}
+
+/*******************************************************************/
+/* cost accounting                                                 */
+/*                                                                 */
+/* Syscalls, sleeps and waiting for the device are counted where   */
+/* they happen, to the transaction in progress (costCurrent) or to */
+/* D4_COST_OTHER outside of transactions. Wall time (and CPU time  */
+/* if d4Accounting is set) is charged when costSwitch() enters or  */
+/* leaves a transaction, so the nested ones (CreditRequest of      */
+/* askForCredit()) aren't counted twice.                           */
+/*******************************************************************/
+
+const char *d4CostNames[D4_COSTS] =
+{
+   "Init", "OpenChannel", "CloseChannel", "Credit", "CreditRequest",
+   NULL, NULL, NULL, "Exit", "GetSocketID", "GetServiceName",
+   "Data", "Other"
+};
+const char *d4SleepNames[D4_SLEEP_SITES] =
+{
+   "write", "readAnswer", "flushData", "askForCredit", "readData", "OpenChannel"
+};
+int d4Accounting = 0;
+
+static __thread int costCurrent = -1;         /* -1 - outside        */
+static __thread struct timeval costSince;     /* costCurrent entered */
+static __thread struct rusage costUsage;      /* usage at costSince  */
+
+static double seconds(const struct timeval *beg, const struct timeval *end)
+{
+   return (end->tv_sec - beg->tv_sec) + (end->tv_usec - beg->tv_usec) / 1000000.0;
+}
+
+static d4Cost_t *cost(void)
+{
+   return &d4Stats.cost[costCurrent < 0 ? D4_COST_OTHER : costCurrent];
+}
+
+/*******************************************************************/
+/* Function costSwitch()                                           */
+/*        charge the time since the last switch to the current     */
+/*        transaction type and make <to> the current one           */
+/* Input:  int   to    transaction type, -1 to leave transactions  */
+/*                                                                 */
+/* Return: the previous type, to switch back to                    */
+/*                                                                 */
+/*******************************************************************/
+
+static int costSwitch(int to)
+{
+   struct timeval now;
+   struct rusage  usage;
+   int            from = costCurrent;
+   d4Cost_t      *c = cost();
+
+   gettimeofday(&now, NULL);
+   if ( from >= 0 )
+      c->wall += seconds(&costSince, &now);
+   if ( d4Accounting && getrusage(RUSAGE_THREAD, &usage) == 0 )
+   {
+      if ( from >= 0 )
+      {
+         c->cpu += seconds(&costUsage.ru_utime, &usage.ru_utime)
+                 + seconds(&costUsage.ru_stime, &usage.ru_stime);
+         c->csw += usage.ru_nvcsw - costUsage.ru_nvcsw;
+      }
+      costUsage = usage;
+   }
+   costSince   = now;
+   costCurrent = to;
+   return from;
+}
+
+/*******************************************************************/
+/* Function accountedSleep()                                       */
+/*        usleep() counted to the current transaction type and to  */
+/*        the place it is called from                              */
+/* Input:  int   us    time to sleep                               */
+/*         int   site  D4_SLEEP_*                                  */
+/*                                                                 */
+/*******************************************************************/
+
+static void accountedSleep(int us, int site)
+{
+   struct timeval beg, end;
+   double dt;
+
+   gettimeofday(&beg, NULL);
+   usleep(us);
+   gettimeofday(&end, NULL);
+   dt = seconds(&beg, &end);
+   cost()->sleeps++;
+   cost()->slept += dt;
+   d4Stats.slept[site] += dt;
+}
+
+/*******************************************************************/
+/* Function accountedPoll()                                        */
+/*        poll() for one file, the time is counted as waiting for  */
+/*        the device                                               */
+/* Input:  struct pollfd *pfd    the file                          */
+/*         int   timeout in ms                                     */
+/*                                                                 */
+/* Return: as poll()                                               */
+/*                                                                 */
+/*******************************************************************/
+
+static int accountedPoll(struct pollfd *pfd, int timeout)
+{
+   struct timeval beg, end;
+   int ret;
+
+   gettimeofday(&beg, NULL);
+   ret = poll(pfd, 1, timeout);
+   gettimeofday(&end, NULL);
+   cost()->polls++;
+   cost()->waited += seconds(&beg, &end);
+   return ret;
+}
+
+/*******************************************************************/
+/* capture and replay of the device traffic                        */
+/*                                                                 */
+/* A capture file starts with D4_CAPTURE_MAGIC followed by records:*/
+/*    8 bytes  time in microseconds since capture start            */
+/*    1 byte   direction: 'W' written to the device,               */
+/*                        'R' read from the device,                */
+/*                        'D' read and dropped (quickClearSndBuf)  */
+/*    4 bytes  data length                                         */
+/*    data                                                         */
+/* All the numbers are little-endian.                              */
+/* Transports are per thread as the timeouts.                      */
+/*******************************************************************/
+
+#define D4_MAX_TRANSPORTS 4
+#define D4_RECORD_HEAD    13
+
+/* injected fault, see d4Faults() */
+#define D4_MAX_FAULTS     8
+
+#define FAULT_LOSE        0   /* command written is lost            */
+#define FAULT_SHORT       1   /* <arg> write() calls write nothing  */
+#define FAULT_DROP        2   /* reply packet is lost               */
+#define FAULT_DELAY       3   /* reply packet comes <arg> ms later  */
+#define FAULT_TRUNCATE    4   /* only <arg> bytes of payload come   */
+#define FAULT_CORRUPT     5   /* a byte of reply packet is changed  */
+#define FAULT_ERROR       6   /* Error packet with code <arg> comes */
+#define FAULT_RESULT      7   /* reply comes with result <arg>      */
+
+typedef struct d4Fault_s
+{
+   int            kind;         /* FAULT_*                            */
+   int            arg;
+   int            point;        /* transaction type, -1 for any       */
+   unsigned long  nth;          /* only at n-th occurrence, or        */
+   int            percent;      /* with this chance if nth is 0       */
+   unsigned long  seen;         /* occurrences at point               */
+} d4Fault_t;
+
+static const struct
+{
+   const char *name;
+   int         kind;
+   int         arg;             /* default argument                   */
+   int         outgoing;        /* on write or on reply?              */
+} faultKinds[] =
+{
+   { "lose",     FAULT_LOSE,     0,    1 },
+   { "short",    FAULT_SHORT,    30,   1 },
+   { "drop",     FAULT_DROP,     0,    0 },
+   { "delay",    FAULT_DELAY,    1000, 0 },
+   { "truncate", FAULT_TRUNCATE, 0,    0 },
+   { "corrupt",  FAULT_CORRUPT,  0,    0 },
+   { "error",    FAULT_ERROR,    0x80, 0 },
+   { "result",   FAULT_RESULT,   0x04, 0 },
+   { NULL,       0,              0,    0 }
+};
+
+typedef struct d4Transport_s
+{
+   int            used;
+   int            fd;
+   FILE          *capture;      /* capture file or NULL               */
+   struct timeval start;        /* capture or replay start            */
+   unsigned char *replay;       /* whole replayed capture or NULL     */
+   long           replayLen;
+   long           pos;          /* current record                     */
+   long           done;         /* bytes of current record consumed   */
+   int            realtime;     /* replay with the original timing?   */
+   d4Fault_t      faults[D4_MAX_FAULTS];
+   int            faultsUsed;
+   unsigned int   seed;         /* of fault chances                   */
+   int            shortLeft;    /* write() calls left to fail         */
+} d4Transport_t;
+
+static __thread d4Transport_t d4Transports[D4_MAX_TRANSPORTS];
+static __thread int d4TransportsUsed = 0;
+
+static d4Transport_t *getTransport(int fd)
+{
+   int i;
+
+   if ( d4TransportsUsed == 0 )
+      return NULL;
+   for ( i = 0; i < D4_MAX_TRANSPORTS; i++ )
+   {
+      if ( d4Transports[i].used && d4Transports[i].fd == fd )
+         return &d4Transports[i];
+   }
+   return NULL;
+}
+
+static d4Transport_t *newTransport(int fd)
+{
+   int i;
+
+   d4Detach(fd);
+   for ( i = 0; i < D4_MAX_TRANSPORTS; i++ )
+   {
+      if ( !d4Transports[i].used )
+      {
+         memset(&d4Transports[i], 0, sizeof(d4Transport_t));
+         d4Transports[i].used = 1;
+         d4Transports[i].fd   = fd;
+         gettimeofday(&d4Transports[i].start, NULL);
+         d4TransportsUsed++;
+         return &d4Transports[i];
+      }
+   }
+   errno = EMFILE;
+   return NULL;
+}
+
+static unsigned long elapsedUs(const struct timeval *start)
+{
+   struct timeval now;
+
+   gettimeofday(&now, NULL);
+   return (now.tv_sec - start->tv_sec) * 1000000UL + now.tv_usec - start->tv_usec;
+}
+
+static unsigned long getLE(const unsigned char *p, int n)
+{
+   unsigned long v = 0;
+
+   while ( n-- > 0 )
+      v = (v << 8) | p[n];
+   return v;
+}
+
+static void captureRecord(d4Transport_t *t, char dir, const void *data, int len)
+{
+   unsigned char head[D4_RECORD_HEAD];
+   unsigned long us = elapsedUs(&t->start);
+   int i;
+
+   if ( len <= 0 || t->capture == NULL )
+      return;
+   for ( i = 0; i < 8; i++ )
+      head[i] = (us >> (8 * i)) & 0xff;
+   head[8] = dir;
+   for ( i = 0; i < 4; i++ )
+      head[9 + i] = (len >> (8 * i)) & 0xff;
+   fwrite(head, 1, sizeof(head), t->capture);
+   fwrite(data, 1, len, t->capture);
+}
+
+/* returns the direction of the current replay record, 0 at the end */
+static int replayNext(d4Transport_t *t)
+{
+   if ( t->pos < t->replayLen &&
+        t->done == (long)getLE(t->replay + t->pos + 9, 4) )
+   {
+      t->pos += D4_RECORD_HEAD + t->done;
+      t->done = 0;
+   }
+   return t->pos < t->replayLen ? t->replay[t->pos + 8] : 0;
+}
+
+static int replayRead(d4Transport_t *t, void *buf, int len, int timeout, char dir)
+{
+   long avail;
+   long wait;
+
+   if ( replayNext(t) != dir )
+   {
+      /* the device didn't answer at this point of the capture, */
+      /* nothing will come until we write something             */
+      if ( !t->realtime )
+      {
+         errno = ENODATA;
+         return -1;
+      }
+      if ( timeout > 0 )
+         usleep(timeout * 1000);
+      errno = ETIMEDOUT;
+      return -1;
+   }
+   if ( t->realtime )
+   {
+      wait = (long)getLE(t->replay + t->pos, 8) - (long)elapsedUs(&t->start);
+      if ( wait > 0 )
+         usleep(wait);
+   }
+   avail = getLE(t->replay + t->pos + 9, 4) - t->done;
+   if ( len > avail )
+      len = avail;
+   memcpy(buf, t->replay + t->pos + D4_RECORD_HEAD + t->done, len);
+   t->done += len;
+   return len;
+}
+
+static int replayWrite(d4Transport_t *t, const void *data, int len)
+{
+   long avail;
+
+   if ( replayNext(t) != 'W' )
+   {
+      if ( debugD4 )
+         fprintf(stderr,"replay: unexpected write at offset %ld\n", t->pos);
+      errno = EIO;
+      return -1;
+   }
+   avail = getLE(t->replay + t->pos + 9, 4) - t->done;
+   if ( len > avail )
+      len = avail;
+   if ( memcmp(data, t->replay + t->pos + D4_RECORD_HEAD + t->done, len) != 0 )
+   {
+      if ( debugD4 )
+         fprintf(stderr,"replay: written data differ from capture at offset %ld\n", t->pos);
+      errno = EIO;
+      return -1;
+   }
+   t->done += len;
+   return len;
+}
+
+/*******************************************************************/
+/* Function d4Capture()                                            */
+/*        record all the traffic of fd to a capture file           */
+/* Input:  int   fd    file handle                                 */
+/*         const char *file   the capture file                     */
+/*                                                                 */
+/* Return: 0 on success, -1 on error                               */
+/*                                                                 */
+/*******************************************************************/
+
+int d4Capture(int fd, const char *file)
+{
+   d4Transport_t *t;
+   FILE          *f;
+
+   f = fopen(file, "wb");
+   if ( f == NULL )
+      return -1;
+   t = newTransport(fd);
+   if ( t == NULL || fwrite(D4_CAPTURE_MAGIC, 1, 4, f) != 4 )
+   {
+      if ( t != NULL )
+         d4Detach(fd);
+      fclose(f);
+      return -1;
+   }
+   t->capture = f;
+   return 0;
+}
+
+/*******************************************************************/
+/* Function d4Replay()                                             */
+/*        feed a capture file back instead of the device           */
+/*        nothing is written to or read from fd, the written data  */
+/*        must match the capture                                   */
+/* Input:  int   fd    file handle                                 */
+/*         const char *file   the capture file                     */
+/*         int   realtime  if set, replies are delayed as at the   */
+/*                         capture time, else replayed at once     */
+/*                                                                 */
+/* Return: 0 on success, -1 on error                               */
+/*                                                                 */
+/*******************************************************************/
+
+int d4Replay(int fd, const char *file, int realtime)
+{
+   d4Transport_t *t;
+   FILE          *f;
+   unsigned char *data;
+   long           len;
+   long           pos;
+
+   f = fopen(file, "rb");
+   if ( f == NULL )
+      return -1;
+   if ( fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < 4 ||
+        fseek(f, 0, SEEK_SET) != 0 || (data = (unsigned char*)malloc(len)) == NULL )
+   {
+      fclose(f);
+      errno = EINVAL;
+      return -1;
+   }
+   if ( fread(data, 1, len, f) != (size_t)len || memcmp(data, D4_CAPTURE_MAGIC, 4) != 0 )
+   {
+      free(data);
+      fclose(f);
+      errno = EINVAL;
+      return -1;
+   }
+   fclose(f);
+
+   /* check the records, so the replay needn't */
+   for ( pos = 4; pos + D4_RECORD_HEAD <= len; )
+      pos += D4_RECORD_HEAD + getLE(data + pos + 9, 4);
+   if ( pos != len || (t = newTransport(fd)) == NULL )
+   {
+      free(data);
+      errno = EINVAL;
+      return -1;
+   }
+   t->replay    = data;
+   t->replayLen = len;
+   t->pos       = 4;
+   t->realtime  = realtime;
+   return 0;
+}
+
+/*******************************************************************/
+/* Function d4Detach()                                             */
+/*        stop capture or replay of fd                             */
+/* Input:  int   fd    file handle                                 */
+/*                                                                 */
+/* Return: count of capture bytes not replayed, 0 if there was no  */
+/*         replay                                                  */
+/*                                                                 */
+/*******************************************************************/
+
+long d4Detach(int fd)
+{
+   d4Transport_t *t = getTransport(fd);
+   long left = 0;
+
+   if ( t == NULL )
+      return 0;
+   if ( t->capture != NULL )
+      fclose(t->capture);
+   if ( t->replay != NULL )
+   {
+      if ( replayNext(t) )
+         left = t->replayLen - t->pos;
+      if ( debugD4 && left > 0 )
+         fprintf(stderr,"replay: %ld bytes of capture left\n", left);
+      free(t->replay);
+   }
+   t->used = 0;
+   d4TransportsUsed--;
+   return left;
+}
+
+/*******************************************************************/
+/* fault injection                                                 */
+/*                                                                 */
+/* Faults are bound to the transaction type in progress (see cost  */
+/* accounting) and happen either on write of a command or on a     */
+/* reply packet read, so the recovery of each failure type can be  */
+/* exercised and timed without unplugging the device.              */
+/*******************************************************************/
+
+/*******************************************************************/
+/* Function d4Faults()                                             */
+/*        inject faults to the traffic of fd                       */
+/* Input:  int   fd    file handle                                 */
+/*         const char *spec  comma separated rules:                */
+/*            seed=<n>  seed of fault chances (1 by default)       */
+/*            <fault>[=<arg>]:<point>[@<n>|~<percent>]             */
+/*         <fault> is lose (the command), short (<arg> writes      */
+/*         fail, 30 by default), drop (the reply), delay (the      */
+/*         reply by <arg> ms, 1000 by default), truncate (reply    */
+/*         payload to <arg> bytes), corrupt (a byte of reply),     */
+/*         error (Error packet with code <arg>, 0x80 by default    */
+/*         instead of reply) or result (<arg> in the result byte   */
+/*         of reply, 0x04 by default).                             */
+/*         <point> is a transaction (Init, OpenChannel, Credit,    */
+/*         ...), Data, Other or any.                               */
+/*         The fault happens at n-th occurrence of point only, or  */
+/*         with the percent chance, or always.                     */
+/*                                                                 */
+/* Return: 0 on success, -1 on error (EINVAL for wrong spec)       */
+/*                                                                 */
+/*******************************************************************/
+
+int d4Faults(int fd, const char *spec)
+{
+   d4Transport_t *t;
+   d4Fault_t      faults[D4_MAX_FAULTS];
+   d4Fault_t     *f;
+   unsigned int   seed = 1;
+   char           rule[64];
+   char          *point;
+   char          *arg;
+   char          *end;
+   int            n = 0;
+   int            len;
+   int            i;
+
+   while ( *spec )
+   {
+      len = strcspn(spec, ",");
+      if ( len >= (int)sizeof(rule) )
+         goto invalid;
+      memcpy(rule, spec, len);
+      rule[len] = '\0';
+      spec += spec[len] ? len + 1 : len;
+      if ( len == 0 )
+         continue;
+
+      if ( strncmp(rule, "seed=", 5) == 0 )
+      {
+         seed = strtoul(rule + 5, &end, 0);
+         if ( *end )
+            goto invalid;
+         continue;
+      }
+
+      if ( n == D4_MAX_FAULTS || (point = strchr(rule, ':')) == NULL )
+         goto invalid;
+      *point++ = '\0';
+      f = &faults[n];
+      memset(f, 0, sizeof(d4Fault_t));
+
+      /* when */
+      f->percent = 100;
+      if ( (arg = strpbrk(point, "@~")) != NULL )
+      {
+         if ( *arg == '@' )
+            f->nth = strtoul(arg + 1, &end, 0);
+         else
+            f->percent = strtol(arg + 1, &end, 0);
+         if ( *end || (f->nth == 0 && (f->percent <= 0 || f->percent > 100)) )
+            goto invalid;
+         *arg = '\0';
+      }
+
+      /* where */
+      f->point = -1;
+      if ( strcmp(point, "any") != 0 )
+      {
+         for ( i = 0; i < D4_COSTS; i++ )
+            if ( d4CostNames[i] != NULL && strcmp(point, d4CostNames[i]) == 0 )
+               break;
+         if ( i == D4_COSTS )
+            goto invalid;
+         f->point = i;
+      }
+
+      /* what */
+      if ( (arg = strchr(rule, '=')) != NULL )
+         *arg++ = '\0';
+      for ( i = 0; faultKinds[i].name != NULL; i++ )
+         if ( strcmp(rule, faultKinds[i].name) == 0 )
+            break;
+      if ( faultKinds[i].name == NULL )
+         goto invalid;
+      f->kind = faultKinds[i].kind;
+      f->arg  = faultKinds[i].arg;
+      if ( arg != NULL )
+      {
+         f->arg = strtol(arg, &end, 0);
+         if ( *end || f->arg < 0 )
+            goto invalid;
+      }
+      n++;
+   }
+
+   if ( (t = getTransport(fd)) == NULL && (t = newTransport(fd)) == NULL )
+      return -1;
+   memcpy(t->faults, faults, n * sizeof(d4Fault_t));
+   t->faultsUsed = n;
+   t->seed       = seed;
+   t->shortLeft  = 0;
+   return 0;
+
+invalid:
+   errno = EINVAL;
+   return -1;
+}
+
+/*******************************************************************/
+/* Function nextFault()                                            */
+/*        count an occurrence of the current transaction type and  */
+/*        tell which fault happens at it                           */
+/* Input:  d4Transport_t *t   transport of the device, may be NULL */
+/*         int   outgoing     1 on write, 0 on reply               */
+/*                                                                 */
+/* Return: the fault or NULL                                       */
+/*                                                                 */
+/*******************************************************************/
+
+static d4Fault_t *nextFault(d4Transport_t *t, int outgoing)
+{
+   d4Fault_t *hit = NULL;
+   d4Fault_t *f;
+   int        point = costCurrent < 0 ? D4_COST_OTHER : costCurrent;
+   int        i;
+
+   if ( t == NULL )
+      return NULL;
+   for ( i = 0; i < t->faultsUsed; i++ )
+   {
+      f = &t->faults[i];
+      if ( (f->point != -1 && f->point != point) ||
+           faultKinds[f->kind].outgoing != outgoing )
+         continue;
+      f->seen++;
+      if ( hit == NULL &&
+           (f->nth ? f->seen == f->nth : (int)(rand_r(&t->seed) % 100) < f->percent) )
+         hit = f;
+   }
+   if ( hit != NULL )
+   {
+      d4Stats.faults++;
+      if ( debugD4 )
+         fprintf(stderr,"fault: %s=%d at %s\n", faultKinds[hit->kind].name, hit->arg, d4CostNames[point]);
+   }
+   return hit;
+}
+
+/*******************************************************************/
+/* Function replyFault()                                           */
+/*        inject a fault to a reply packet read from the device    */
+/* Input:  int   fd    file handle                                 */
+/*         unsigned char *header  the packet header                */
+/*         unsigned char *buf     the payload                      */
+/*         int   len   the payload length                          */
+/*         int   size  the size of buf                             */
+/*                                                                 */
+/* Return: the new payload length, -1 if the packet is lost        */
+/*                                                                 */
+/*******************************************************************/
+
+static int replyFault(int fd, unsigned char *header, unsigned char *buf, int len, int size)
+{
+   d4Transport_t *t = getTransport(fd);
+   d4Fault_t     *f;
+   int            i;
+
+   if ( t == NULL || t->faultsUsed == 0 || (f = nextFault(t, 0)) == NULL )
+      return len;
+
+   switch ( f->kind )
+   {
+   case FAULT_DROP:
+      return -1;
+   case FAULT_DELAY:
+      usleep(f->arg * 1000);
+      break;
+   case FAULT_TRUNCATE:
+      if ( len > f->arg )
+         len = f->arg;
+      break;
+   case FAULT_CORRUPT:
+      i = rand_r(&t->seed) % (len + 6);
+      if ( i < 6 )
+         header[i] ^= 0xff;
+      else
+         buf[i - 6] ^= 0xff;
+      break;
+   case FAULT_ERROR:
+      if ( header[0] == 0 && header[1] == 0 && size >= 4 )
+      {
+         header[2] = 0;
+         header[3] = 10;
+         buf[0] = 0x7f;
+         buf[1] = header[0];
+         buf[2] = header[1];
+         buf[3] = f->arg;
+         len = 4;
+      }
+      break;
+   case FAULT_RESULT:
+      if ( header[0] == 0 && header[1] == 0 && len >= 2 )
+         buf[1] = f->arg;
+      break;
+   }
+   return len;
+}
+
 int SafeWrite(int fd, const void *data, int len)
 {
   int status;
   int retries=30;
+  d4Transport_t *t = getTransport(fd);
+  d4Fault_t *f;
   if (debugD4)
     printHexValues("SafeWrite: ", data, len);
+  if (t != NULL && t->faultsUsed && (f = nextFault(t, 1)) != NULL)
+    {
+      if (f->kind == FAULT_LOSE)
+	return len;
+      t->shortLeft = f->arg;
+    }
+  if (t != NULL && t->replay != NULL)
+    return replayWrite(t, data, len);
   do
     {
-      status = write(fd, data, len);
+      if (t != NULL && t->shortLeft > 0)
+	{
+	  /* injected: nothing written */
+	  t->shortLeft--;
+	  status = 0;
+	}
+      else
+	status = write(fd, data, len);
+      cost()->writes++;
+      if (t != NULL && status > 0)
+	captureRecord(t, 'W', data, status);
       if(status < len)
-	usleep(d4WrTimeout);
+	accountedSleep(d4WrTimeout, D4_SLEEP_WRITE);
       retries--;
     }
-  while ((status < len) && (retries > 0));
+  while ((status < len) && (retries > 0) && !d4Expired());
   return(status);
 }
 
 /*******************************************************************/
-/* Function sigAlarm(int code)                                     */
+/* Function timedRead()                                            */
+/*        read from the device, but don't wait longer as timeout   */
+/*        (poll() is used instead of SIGALRM timer in order to     */
+/*        allow several threads to use the library)                */
+/* Input:  int   fd      file handle                               */
+/*         void *buf     the data are to be put here               */
+/*         int   len     the number of bytes to read               */
+/*         int   timeout in ms                                     */
 /*                                                                 */
-/* do nothing, avoid printing of undesired messages and/or         */
-/* other not desirable actions                                     */
+/* Return: number of bytes read. -1 on error or timeout            */
+/*         (ENODATA if a replay has no more data at this point)    */
+/*                                                                 */
+/*******************************************************************/
+
+static int timedRead(int fd, void *buf, int len, int timeout)
+{
+   struct pollfd pfd;
+   d4Transport_t *t = getTransport(fd);
+   int ret;
+
+   if ( (timeout = boundTimeout(timeout)) < 0 )
+   {
+      timeoutGot = -1;
+      return -1;
+   }
+   if ( t != NULL && t->replay != NULL )
+   {
+      ret = replayRead(t, buf, len, timeout, 'R');
+      if ( ret < 0 )
+         timeoutGot = -1;
+      else
+         d4Received += ret;
+      return ret;
+   }
+   pfd.fd      = fd;
+   pfd.events  = POLLIN;
+   pfd.revents = 0;
+   ret = accountedPoll(&pfd, timeout);
+   if ( ret == 0 )
+   {
+      timeoutGot = -1;
+      errno = ETIMEDOUT;
+      return -1;
+   }
+   else if ( ret < 0 )
+   {
+      return -1;
+   }
+   ret = read(fd, buf, len);
+   cost()->reads++;
+   if ( ret > 0 )
+      d4Received += ret;
+   if ( t != NULL && ret > 0 )
+      captureRecord(t, 'R', buf, ret);
+   return ret;
+}
+
+/*******************************************************************/
+/* Function timedWrite()                                           */
+/*        as timedRead() but for SafeWrite()                       */
 /*                                                                 */
 /*******************************************************************/
 
-static void sigAlarm(int code)
+static int timedWrite(int fd, const void *data, int len, int timeout)
 {
-   timeoutGot = -1;
+   struct pollfd pfd;
+   d4Transport_t *t = getTransport(fd);
+   int ret;
+
+   if ( (timeout = boundTimeout(timeout)) < 0 )
+   {
+      timeoutGot = -1;
+      return -1;
+   }
+   if ( t != NULL && t->replay != NULL )
+      return SafeWrite(fd, data, len);
+   pfd.fd      = fd;
+   pfd.events  = POLLOUT;
+   pfd.revents = 0;
+   ret = accountedPoll(&pfd, timeout);
+   if ( ret == 0 )
+   {
+      timeoutGot = -1;
+      errno = ETIMEDOUT;
+      return -1;
+   }
+   else if ( ret < 0 )
+   {
+      return -1;
+   }
+   return SafeWrite(fd, data, len);
 }
 
 
@@ -365,7 +1304,6 @@ static int writeCmd(int fd, unsigned char *cmd, int len)
 {
    int w;
    int i = 0;
-   struct  itimerval ti, oti;
 
 # if PTIME
    struct timeval beg, end;
@@ -387,16 +1325,14 @@ static int writeCmd(int fd, unsigned char *cmd, int len)
       }
    }
 
-   usleep(1); /* according to Glen Steward, this will solve problems  */
+   accountedSleep(1, D4_SLEEP_WRITE); /* according to Glen Steward, this will solve problems  */
               /* for the cartridge exchange with the Stylus Color 580 */
 
    timeoutGot = 0;
    errno = 0;
    while ( i < len )
    {
-      SET_TIMER(ti,oti,d4WrTimeout);         
-      w = SafeWrite(fd, cmd+i,len-i);
-      RESET_TIMER(ti,oti);
+      w = timedWrite(fd, cmd+i, len-i, d4WrTimeout);
       if ( w < 0 )
       {
          if ( debugD4 )
@@ -421,7 +1357,10 @@ static int writeCmd(int fd, unsigned char *cmd, int len)
    }
 
    if ( timeoutGot )
+   {
+      d4Stats.timeouts++;
       return -1;
+   }
    return i;
 }
 
@@ -441,12 +1380,11 @@ int readAnswer(int fd, unsigned char *buf, int len)
    int rd    = 0;
    int total = 0;
    struct timeval beg, end;
-   struct itimerval ti, oti;
    long dt;
    int count = 0;
    int first_read = 1;
    /* wait a little bit before reading an answer */
-   usleep(d4RdTimeout);
+   accountedSleep(d4RdTimeout, D4_SLEEP_ANSWER);
 
    /* for error handling in case of timeout */
    timeoutGot = 0;
@@ -461,8 +1399,7 @@ int readAnswer(int fd, unsigned char *buf, int len)
      fprintf(stderr, "length: %i\n", len);
    while ( total < len )
    {
-      SET_TIMER(ti,oti, d4RdTimeout);
-      rd = read(fd, buf+total, len-total);
+      rd = timedRead(fd, buf+total, len-total, d4RdTimeout);
       if (debugD4)
 	{
 	  if (first_read)
@@ -478,13 +1415,12 @@ int readAnswer(int fd, unsigned char *buf, int len)
 	  else
 	    fprintf(stderr, "%i ", rd);
 	}
-      RESET_TIMER(ti,oti);
       if ( rd <= 0 )
       {
          gettimeofday(&end, NULL);
          dt  = (end.tv_sec  - beg.tv_sec) * 1000;
          dt += (end.tv_usec - beg.tv_usec) / 1000;
-         if ( dt > d4RdTimeout * 2 )
+         if ( dt > d4RdTimeout * 2 || (rd < 0 && errno == ENODATA) || d4Expired() )
          {
             if ( debugD4 )
                fprintf(stderr,"Timeout 1 at readAnswer() rcv %d bytes\n",total);
@@ -512,7 +1448,7 @@ int readAnswer(int fd, unsigned char *buf, int len)
 	    len = (len > sizeof(buf))?sizeof(buf) - 1:len;
          }
       }
-      usleep(d4RdTimeout);
+      accountedSleep(d4RdTimeout, D4_SLEEP_ANSWER);
    }
    
    if ( debugD4 )
@@ -530,6 +1466,7 @@ int readAnswer(int fd, unsigned char *buf, int len)
    }
    if ( timeoutGot )
    {
+      d4Stats.timeouts++;
       if ( debugD4 )
          fprintf(stderr,"Timeout 2 at readAnswer()\n");
       return -1;
@@ -540,11 +1477,10 @@ int readAnswer(int fd, unsigned char *buf, int len)
 static void _flushData(int fd)
 {
    int rd    = 0;
-   struct itimerval ti, oti;
    char buf[1024];
    int len = 1023;
    int count = 200;
-   usleep(d4RdTimeout);
+   accountedSleep(d4RdTimeout, D4_SLEEP_FLUSH);
 
    /* for error handling in case of timeout */
    timeoutGot = 0;
@@ -557,115 +1493,351 @@ static void _flushData(int fd)
      fprintf(stderr, "flush data: length: %i\n", len);
    do
      {
-       usleep(d4RdTimeout);
-       SET_TIMER(ti,oti, d4RdTimeout);
-       rd = read(fd, buf, len);
+       accountedSleep(d4RdTimeout, D4_SLEEP_FLUSH);
+       rd = timedRead(fd, buf, len, d4RdTimeout);
        if (debugD4)
 	 fprintf(stderr, "flush: read: %i %s\n", rd,
 		 rd < 0 && errno != 0 ?strerror(errno) : "");
-       RESET_TIMER(ti,oti);
        count--;
-     } while ( count > 0 && (rd > 0 || (rd < 0 && errno == EAGAIN)));
+     } while ( count > 0 && (rd > 0 || (rd < 0 && errno == EAGAIN)) && !d4Expired() );
 }
 
 /*******************************************************************/
-/* Function _readData()                                            */
-/*        Read the datas returned by the printer                   */
+/* Function getChannel()                                           */
+/*        find the channel state of socketID on fd                 */
 /* Input:  int   fd    file handle                                 */
-/*         char *buf   the data are to be put here                 */
+/*         unsigned char socketID  the channel socket              */
+/*         int   create  allocate the channel if not found         */
+/*                                                                 */
+/* Return: the channel or NULL                                     */
+/*                                                                 */
+/*******************************************************************/
+
+static d4Channel_t *getChannel(int fd, unsigned char socketID, int create)
+{
+   int i;
+   d4Channel_t *freeChannel = NULL;
+
+   for ( i = 0; i < D4_MAX_CHANNELS; i++ )
+   {
+      if ( d4Channels[i].used && d4Channels[i].fd == fd && d4Channels[i].socketID == socketID )
+         return &d4Channels[i];
+      if ( !d4Channels[i].used && freeChannel == NULL )
+         freeChannel = &d4Channels[i];
+   }
+   if ( create && freeChannel != NULL )
+   {
+      memset(freeChannel, 0, sizeof(d4Channel_t));
+      freeChannel->used     = 1;
+      freeChannel->fd       = fd;
+      freeChannel->socketID = socketID;
+      return freeChannel;
+   }
+   return NULL;
+}
+
+/*******************************************************************/
+/* Function dropChannel()                                          */
+/*        forget the channel state and its queued packets          */
+/* Input:  d4Channel_t *ch   the channel                           */
+/*                                                                 */
+/*******************************************************************/
+
+static void dropChannel(d4Channel_t *ch)
+{
+   int i;
+
+   if ( ch == NULL )
+      return;
+   for ( i = 0; i < D4_QUEUE_LEN; i++ )
+      free(ch->queue[i]);
+   memset(ch, 0, sizeof(d4Channel_t));
+}
+
+/*******************************************************************/
+/* Function dropChannels()                                         */
+/*        forget all channels of fd (after Init or Exit)           */
+/* Input:  int   fd    file handle                                 */
+/*                                                                 */
+/*******************************************************************/
+
+static void dropChannels(int fd)
+{
+   int i;
+
+   for ( i = 0; i < D4_MAX_CHANNELS; i++ )
+      if ( d4Channels[i].used && d4Channels[i].fd == fd )
+         dropChannel(&d4Channels[i]);
+}
+
+/*******************************************************************/
+/* Function readBytes()                                            */
+/*        read exactly len bytes, waiting up to 3 read timeouts    */
+/*        (one while probing, a silent device is the usual case)   */
+/* Input:  int   fd    file handle                                 */
+/*         char *buf   the data are to be put here, NULL to drop   */
 /*         int   len   the number of bytes to read                 */
 /*                                                                 */
-/* Return: number of bytes read. -1 on error                       */
+/* Return: len. -1 on error or timeout                             */
 /*                                                                 */
 /*******************************************************************/
 
-static int _readData(int fd, unsigned char *buf, int len)
+static int readBytes(int fd, unsigned char *buf, int len)
 {
+   unsigned char drop[256];
    int rd    = 0;
    int total = 0;
-   int toGet = 0;
-   unsigned char  header[6];
    struct timeval beg, end;
    long dt;
-   struct itimerval ti, oti;
-
-   /* set errno to 0 in order to get correct informations */
-   /* in case of error                                    */
-   errno = 0;
 
-   /* read the first 6 bytes */
    gettimeofday(&beg, NULL);
-   while ( total < 6 )
+   while ( total < len )
    {
-      SET_TIMER(ti,oti, d4RdTimeout);
-      rd = read(fd, header+total, 6-total);
-      RESET_TIMER(ti,oti);
+      if ( buf != NULL )
+         rd = timedRead(fd, buf+total, len-total, d4RdTimeout);
+      else
+         rd = timedRead(fd, drop, len-total < (int)sizeof(drop) ? len-total : (int)sizeof(drop), d4RdTimeout);
       if ( rd <= 0 )
       {
          gettimeofday(&end, NULL);
          dt  = (end.tv_sec  - beg.tv_sec) * 1000;
          dt += (end.tv_usec - beg.tv_usec) / 1000;
-         if ( dt > d4RdTimeout*3 )
+         if ( (d4Probing ? dt >= d4RdTimeout : dt > d4RdTimeout*3) || (rd < 0 && errno == ENODATA) || d4Expired() )
          {
+            d4Stats.timeouts++;
             if ( debugD4 )
-               fprintf(stderr,"Timeout at _readData(), dt = %ld ms\n", dt);
+               fprintf(stderr,"Timeout at readBytes(), dt = %ld ms\n", dt);
             return -1;
-            break;
          }
          continue;
       }
-      else
+      total += rd;
+   }
+   return total;
+}
+
+/*******************************************************************/
+/* Function readPayload()                                          */
+/*        read the payload of a packet which header was read       */
+/* Input:  int   fd    file handle                                 */
+/*         unsigned char *header  the packet header                */
+/*         unsigned char *buf     the payload is put here          */
+/*         int   len   the size of buf, longer payload is dropped  */
+/*                                                                 */
+/* Return: payload length put to buf. -1 on error                  */
+/*                                                                 */
+/*******************************************************************/
+
+static int readPayload(int fd, const unsigned char *header, unsigned char *buf, int len)
+{
+   int toGet = (header[2] << 8) + header[3] - 6;
+
+   if ( toGet < 0 )
+      return -1;
+   if ( toGet > len )
+   {
+      /* keep the stream in sync, drop the tail */
+      if ( readBytes(fd, buf, len) != len || readBytes(fd, NULL, toGet-len) != toGet-len )
+         return -1;
+      return len;
+   }
+   return readBytes(fd, buf, toGet) == toGet ? toGet : -1;
+}
+
+/*******************************************************************/
+/* Function accountPacket()                                        */
+/*        update channel credits for a received data packet        */
+/* Input:  d4Channel_t *ch       the channel                       */
+/*         unsigned char *header the packet header                 */
+/*                                                                 */
+/*******************************************************************/
+
+static void accountPacket(d4Channel_t *ch, const unsigned char *header)
+{
+   if ( ch->peerCredits > 0 )
+      ch->peerCredits--;
+   ch->credits += header[4]; /* piggybacked credit */
+}
+
+/*******************************************************************/
+/* Function queuePacket()                                          */
+/*        read the payload of a data packet for another channel    */
+/*        and put it to the queue of that channel                  */
+/* Input:  int   fd    file handle                                 */
+/*         unsigned char *header the packet header                 */
+/*                                                                 */
+/* Return: 0 if all is OK, -1 on error                             */
+/*                                                                 */
+/*******************************************************************/
+
+static int queuePacket(int fd, const unsigned char *header)
+{
+   d4Channel_t *ch;
+   int          slot;
+   int          rd;
+
+   ch = getChannel(fd, header[0], 0);
+   if ( ch != NULL && ch->queued < D4_QUEUE_LEN )
+   {
+      slot = (ch->head + ch->queued) % D4_QUEUE_LEN;
+      if ( ch->queue[slot] == NULL )
+         ch->queue[slot] = (unsigned char*)malloc(D4_MAX_PACKET);
+      if ( ch->queue[slot] != NULL )
       {
-         total += rd;
+         if ( (rd = readPayload(fd, header, ch->queue[slot], D4_MAX_PACKET)) < 0 )
+            return -1;
+         if ( debugD4 )
+            fprintf(stderr,"Packet for channel %d-%d queued\n", header[0], header[1]);
+         ch->qLen[slot] = rd;
+         ch->queued++;
+         accountPacket(ch, header);
+         return 0;
       }
    }
 
    if ( debugD4 )
-      printHexValues("Recv: ",header,total);
+      fprintf(stderr,"Packet for channel %d-%d dropped\n", header[0], header[1]);
+   return readPayload(fd, header, NULL, 0) < 0 ? -1 : 0;
+}
+
+/*******************************************************************/
+/* Function readReply()                                            */
+/*        read the reply of a transaction, data packets received   */
+/*        meanwhile are queued for their channels                  */
+/* Input:  int   fd    file handle                                 */
+/*         char *buf   the reply (with header) is put here         */
+/*         int   len   the size of buf                             */
+/*                                                                 */
+/* Return: number of bytes read. -1 on error                       */
+/*                                                                 */
+/*******************************************************************/
+
+static int readReply(int fd, unsigned char *buf, int len)
+{
+   int rd;
 
-   if ( total == 6 )
+   if ( len < 6 )
+      return -1;
+
+   for (;;)
    {
-      toGet = (header[2] >> 8) + header[3] - 6;
-      if (debugD4)
-	fprintf(stderr, "toGet: %i\n", toGet);	
-      if (toGet > len)
-        return -1;
-      total = 0;
-      gettimeofday(&beg, NULL);
-      while ( total < toGet )
+      if ( readBytes(fd, buf, 6) != 6 )
+         return -1;
+      if ( buf[0] != 0 || buf[1] != 0 )
       {
-         SET_TIMER(ti,oti, d4RdTimeout);
-         rd = read(fd, buf+total, toGet-total);
-         RESET_TIMER(ti,oti);
-         if ( rd <= 0 )
-         {
-            gettimeofday(&end, NULL);
-            dt  = (end.tv_sec  - beg.tv_sec) * 1000;
-            dt += (end.tv_usec - beg.tv_usec) / 1000;
-            if ( dt > d4RdTimeout*3 )
-            {
-               if ( debugD4 )
-                  fprintf(stderr,"Timeout at _readData(), dt = %ld ms\n",dt);
-               return -1;
-               break;
-            }
-            continue;
-         }
-         else
-         {
-            total += rd;
-         }
+         /* not for transaction channel */
+         if ( queuePacket(fd, buf) < 0 )
+            return -1;
+         continue;
       }
-      if ( debugD4 )
-         printHexValues("Recv: ",buf,total);
-      return total;
+      if ( (rd = readPayload(fd, buf, buf+6, len-6)) < 0 )
+         return -1;
+      if ( (rd = replyFault(fd, buf, buf+6, rd, len-6)) >= 0 )
+         break;
+      /* injected: the reply is lost */
    }
 
-   return -1;
+   if ( debugD4 )
+      printHexValues("Recv: ",buf,rd+6);
+   return rd + 6;
 }
 
 /*******************************************************************/
-/* Function sendReceiveCmd()                                       */
+/* Function _readData()                                            */
+/*        Read the datas returned by the printer on socketID,      */
+/*        packets for other channels are queued                    */
+/* Input:  int   fd    file handle                                 */
+/*         unsigned char socketID  the channel socket              */
+/*         char *buf   the data are to be put here                 */
+/*         int   len   the size of buf                             */
+/*                                                                 */
+/* Return: number of bytes read. -1 on error                       */
+/*                                                                 */
+/*******************************************************************/
+
+static int _readData(int fd, unsigned char socketID, unsigned char *buf, int len)
+{
+   unsigned char header[6];
+   d4Channel_t  *ch;
+   int           rd;
+
+   /* set errno to 0 in order to get correct informations */
+   /* in case of error                                    */
+   errno = 0;
+
+   ch = getChannel(fd, socketID, 1);
+   if ( ch != NULL && ch->queued )
+   {
+      /* the packet came while we waited for something else */
+      rd = ch->qLen[ch->head] < len ? ch->qLen[ch->head] : len;
+      memcpy(buf, ch->queue[ch->head], rd);
+      ch->head = (ch->head + 1) % D4_QUEUE_LEN;
+      ch->queued--;
+      return rd;
+   }
+
+   for (;;)
+   {
+      if ( readBytes(fd, header, 6) != 6 )
+         return -1;
+      if ( header[0] == socketID )
+      {
+         if ( (rd = readPayload(fd, header, buf, len)) < 0 )
+            return -1;
+         if ( ch != NULL )
+            accountPacket(ch, header);
+         if ( (rd = replyFault(fd, header, buf, rd, len)) >= 0 )
+            break;
+         /* injected: the packet is lost */
+         continue;
+      }
+      if ( header[0] == 0 && header[1] == 0 )
+      {
+         /* unexpected transaction reply (i.e. Error), drop it */
+         if ( debugD4 )
+            fprintf(stderr,"Unexpected transaction packet dropped\n");
+         if ( readPayload(fd, header, NULL, 0) < 0 )
+            return -1;
+         continue;
+      }
+      if ( queuePacket(fd, header) < 0 )
+         return -1;
+   }
+
+   if ( debugD4 )
+   {
+      printHexValues("Recv: ",header,6);
+      printHexValues("Recv: ",buf,rd);
+   }
+   return rd;
+}
+
+/*******************************************************************/
+/* Function countTransaction()                                     */
+/*        account a transaction in d4Stats                         */
+/* Input:  struct timeval *beg   when the transaction started      */
+/*         struct timeval *end   when the answer came              */
+/*                                                                 */
+/*******************************************************************/
+
+static void countTransaction(const struct timeval *beg, const struct timeval *end)
+{
+   long dt;
+   int  i;
+
+   dt  = (end->tv_sec  - beg->tv_sec) * 1000000;
+   dt += end->tv_usec - beg->tv_usec;
+
+   d4Stats.transactions++;
+   d4Stats.latencySum += (double)dt/1000000;
+   for ( i = 0; i < D4_LATENCY_BUCKETS; i++ )
+      if ( dt <= d4LatencyBounds[i] * 1000L )
+         break;
+   d4Stats.latency[i]++;
+}
+
+/*******************************************************************/
+/* Function _sendReceiveCmd()                                      */
 /*        send a command and get the answer.                       */
 /* Input:  int   fd    file handle                                 */
 /*         char *buf   the data are to be put here                 */
@@ -675,15 +1847,20 @@ static int _readData(int fd, unsigned char *buf, int len)
 /*                                                                 */
 /*******************************************************************/
 
-static int sendReceiveCmd(int fd, unsigned char *cmd, int len, unsigned char *answer, int expectedlen)
+static int _sendReceiveCmd(int fd, unsigned char *cmd, int len, unsigned char *answer, int expectedlen)
 {
    int rd;
+   struct timeval beg, end;
+
+   gettimeofday(&beg, NULL);
    if ( (rd = writeCmd(fd, cmd, len ) ) != len )
    {
       if ( rd < 0 ) return -1;
       return 0;
    }
-   rd = readAnswer(fd, answer, expectedlen );
+   rd = readReply(fd, answer, expectedlen );
+   gettimeofday(&end, NULL);
+   countTransaction(&beg, &end);
    if ( rd == 0 )
    {
       /* no answer from device */
@@ -701,11 +1878,13 @@ static int sendReceiveCmd(int fd, unsigned char *cmd, int len, unsigned char *an
       /* check result */
       if ( answer[6] == 0x7f )
       {
+         d4LastResult = answer[9];
          printError(answer[9]);
          return -1;
       }
       else if (  answer[7] != 0 )
       {
+         d4LastResult = answer[7];
          if ( printError(answer[7]) )
          {
             return -1;
@@ -720,7 +1899,26 @@ static int sendReceiveCmd(int fd, unsigned char *cmd, int len, unsigned char *an
 }
 
 /*******************************************************************/
-/* Function EnterIEEE()                                            */
+/* Function sendReceiveCmd()                                       */
+/*        as _sendReceiveCmd(), the cost is counted to the type of */
+/*        the command                                              */
+/*                                                                 */
+/*******************************************************************/
+
+static int sendReceiveCmd(int fd, unsigned char *cmd, int len, unsigned char *answer, int expectedlen)
+{
+   int type = cmd[6] < D4_COST_DATA && d4CostNames[cmd[6]] ? cmd[6] : D4_COST_OTHER;
+   int from = costSwitch(type);
+   int rd;
+
+   d4Stats.cost[type].count++;
+   rd = _sendReceiveCmd(fd, cmd, len, answer, expectedlen);
+   costSwitch(from);
+   return rd;
+}
+
+/*******************************************************************/
+/* Function _EnterIEEE()                                           */
 /*        send a command and get the answer.                       */
 /* Input:  int   fd    file handle                                 */
 /*                                                                 */
@@ -728,7 +1926,7 @@ static int sendReceiveCmd(int fd, unsigned char *cmd, int len, unsigned char *an
 /*                                                                 */
 /*******************************************************************/
 
-int EnterIEEE(int fd)
+static int _EnterIEEE(int fd)
 {
    unsigned char buf[200];
    unsigned char cmd[] = 
@@ -738,8 +1936,16 @@ int EnterIEEE(int fd)
       'L', 0x0a, '@', 'E', 'J', 'L', 0x0a
    };
    int rd;
+   int tries = 0;
    memset(buf, 0, sizeof(buf));
 Loop:
+   if ( tries++ >= MAX_ENTER_IEEE )
+   {
+      /* the device keeps answering with zeros, give up */
+      if ( debugD4 )
+         fprintf(stderr,"EnterIEEE: no valid answer after %d tries\n", MAX_ENTER_IEEE);
+      return 0;
+   }
    if ( writeCmd(fd, cmd, sizeof(cmd) ) != sizeof(cmd) )
    {
       return 0;
@@ -762,11 +1968,32 @@ Loop:
       for (i=0; i < rd; i++ )
         if ( buf[i] != 0 )
            break;
-      if ( i == rd ) goto Loop;
+      if ( i == rd )
+      {
+         d4Stats.retries++;
+         goto Loop;
+      }
       return 1;
    }
 }
 
+/*******************************************************************/
+/* Function EnterIEEE()                                            */
+/*        as _EnterIEEE(), the cost is counted as D4_COST_OTHER    */
+/*                                                                 */
+/*******************************************************************/
+
+int EnterIEEE(int fd)
+{
+   int from = costSwitch(D4_COST_OTHER);
+   int ret;
+
+   d4Stats.cost[D4_COST_OTHER].count++;
+   ret = _EnterIEEE(fd);
+   costSwitch(from);
+   return ret;
+}
+
 /*******************************************************************/
 /* Function Init()                                                 */
 /*        handle the init command                                  */
@@ -790,7 +2017,8 @@ int Init(int fd)
    cmd.head.control  = 0;
    cmd.head.command  = 0;
    cmd.revision      = 0x10;
-    
+
+   dropChannels(fd); /* a new conversation */
    rd = sendReceiveCmd(fd, (unsigned char*)&cmd, sizeof(cmd), buf, 9 );
    return rd == 9 ? 1 : 0;
 }
@@ -817,6 +2045,7 @@ int Exit(int fd)
    cmd.control  = 0;
    cmd.command  = 8;
 
+   dropChannels(fd);
    rd = sendReceiveCmd(fd, (unsigned char*)&cmd, sizeof(cmd), buf, 8 );
    return rd > 0 ? 1 : rd;
 }
@@ -859,6 +2088,249 @@ int GetSocketID(int fd, const char *serviceName)
    }
 }
 
+/*******************************************************************/
+/* Function GetServiceName()                                       */
+/*        handle the GetServiceName command                        */
+/* Input:  int   fd    file handle                                 */
+/*         unsigned char socketID  the socket                      */
+/*         char *name  the service name is put here (with '\0')    */
+/*         int   len   the size of name                            */
+/*                                                                 */
+/* Return: length of the name, 0 if there is no service on the     */
+/*         socket, -1 on error                                     */
+/*                                                                 */
+/*******************************************************************/
+
+int GetServiceName(int fd, unsigned char socketID, char *name, int len)
+{
+   unsigned char cmd[8];
+   unsigned char rBuf[9 + D4_SERVICE_LEN];
+   int rd;
+
+   cmd[0] = 0;          /* transaction sockets */
+   cmd[1] = 0;
+   cmd[2] = 0;          /* len */
+   cmd[3] = 8;          /* len */
+   cmd[4] = 1;          /* credit */
+   cmd[5] = 0;          /* control */
+   cmd[6] = 0x0a;       /* command */
+   cmd[7] = socketID;
+
+   d4LastResult = 0;
+   rBuf[6] = 0;
+   rd = sendReceiveCmd(fd, cmd, sizeof(cmd), rBuf, sizeof(rBuf));
+   if ( rd <= 0 )
+   {
+      /* a reply with not null result: no service there */
+      return d4LastResult && rBuf[6] == 0x8a ? 0 : -1;
+   }
+   if ( rd < 9 )
+      return -1;
+   rd -= 9;
+   if ( rd >= len )
+      rd = len - 1;
+   memcpy(name, rBuf + 9, rd);
+   name[rd] = '\0';
+   return rd;
+}
+
+/*******************************************************************/
+/* Function discoverCmd()                                          */
+/*        build the command of a d4Discover() probe                */
+/* Input:  int   probe  GetServiceName of socket probe+1 if it is  */
+/*                      less than D4_SOCKETS, else GetSocketID of  */
+/*                      names[probe - D4_SOCKETS]                  */
+/*         const char **names  service names                       */
+/*         unsigned char *cmd  the command is put here             */
+/*                                                                 */
+/* Return: the command length                                      */
+/*                                                                 */
+/*******************************************************************/
+
+static int discoverCmd(int probe, const char **names, unsigned char *cmd)
+{
+   int len = 8;
+
+   cmd[0] = 0;
+   cmd[1] = 0;
+   cmd[4] = 1;
+   cmd[5] = 0;
+   if ( probe < D4_SOCKETS )
+   {
+      cmd[6] = 0x0a;
+      cmd[7] = probe + 1;
+   }
+   else
+   {
+      len = 7 + strlen(names[probe - D4_SOCKETS]);
+      if ( len > 7 + D4_SERVICE_LEN )
+         len = 7 + D4_SERVICE_LEN;
+      cmd[6] = 0x09;
+      memcpy(cmd + 7, names[probe - D4_SOCKETS], len - 7);
+   }
+   cmd[2] = 0;
+   cmd[3] = len;
+   return len;
+}
+
+/*******************************************************************/
+/* Function discoverMatch()                                        */
+/*        find the d4Discover() probe a reply is for               */
+/* Input:  unsigned char *answer  the reply                        */
+/*         int   rd    the reply length                            */
+/*         const char **names  service names                       */
+/*         int   probes  number of probes                          */
+/*                                                                 */
+/* Return: the probe or -1 if the reply doesn't tell               */
+/*                                                                 */
+/*******************************************************************/
+
+static int discoverMatch(const unsigned char *answer, int rd, const char **names, int probes)
+{
+   int i;
+
+   if ( answer[6] == 0x8a && rd >= 9 && answer[8] >= 1 && answer[8] <= D4_SOCKETS )
+      return answer[8] - 1;
+   if ( answer[6] == 0x89 )
+   {
+      /* the reply repeats the name */
+      for ( i = D4_SOCKETS; i < probes; i++ )
+         if ( (int)strlen(names[i - D4_SOCKETS]) == rd - 9
+           && !memcmp(names[i - D4_SOCKETS], answer + 9, rd - 9) )
+            return i;
+   }
+   return -1;
+}
+
+/*******************************************************************/
+/* Function d4Discover()                                           */
+/*        find all services of the device: GetServiceName of      */
+/*        every socket and GetSocketID of every name given (for   */
+/*        services not reported by socket). Up to window commands */
+/*        are sent before their replies come, the replies are     */
+/*        matched to commands by contents. If the device doesn't  */
+/*        answer so many commands, the rest goes one by one.      */
+/* Input:  int   fd    file handle                                 */
+/*         const char **names  service names, NULL terminated      */
+/*         d4Service_t *services  the services are put here        */
+/*         int   max   the size of services                        */
+/*         int   window  commands sent at once                     */
+/*                                                                 */
+/* Return: number of services put (in order of socket) or -1       */
+/*                                                                 */
+/*******************************************************************/
+
+int d4Discover(int fd, const char **names, d4Service_t *services, int max, int window)
+{
+   unsigned char   cmd[7 + D4_SERVICE_LEN];
+   unsigned char   answer[9 + D4_SERVICE_LEN];
+   char          (*found)[D4_SERVICE_LEN + 1];  /* name by socket */
+   unsigned char  *state;   /* of probes: 0 - to send, 1 - sent, 2 - done */
+   struct timeval *sent;
+   struct timeval  end;
+   int probes = D4_SOCKETS;
+   int inflight = 0;
+   int count = -1;
+   int from;
+   int len;
+   int rd;
+   int i;
+
+   while ( names[probes - D4_SOCKETS] )
+      probes++;
+   found = calloc(D4_SOCKETS + 1, sizeof(*found));
+   state = calloc(probes, 1);
+   sent  = calloc(probes, sizeof(*sent));
+   if ( found == NULL || state == NULL || sent == NULL )
+      goto out;
+   if ( window < 1 )
+      window = 1;
+
+   from = costSwitch(0x0a);
+   for (;;)
+   {
+      for ( i = 0; i < probes && inflight < window; i++ )
+      {
+         if ( state[i] != 0 )
+            continue;
+         len = discoverCmd(i, names, cmd);
+         d4Stats.cost[cmd[6]].count++;
+         gettimeofday(&sent[i], NULL);
+         if ( writeCmd(fd, cmd, len) != len )
+            break;
+         state[i] = 1;
+         inflight++;
+      }
+      if ( i < probes && inflight < window )
+         break;   /* write failed */
+      if ( inflight == 0 )
+      {
+         count = 0;
+         break;
+      }
+
+      rd = readReply(fd, answer, sizeof(answer));
+      if ( rd < 8 )
+      {
+         if ( window == 1 || d4Expired() )
+            break;
+         /* replies are lost or never sent, ask the rest one by one */
+         if ( debugD4 )
+            fprintf(stderr,"no reply with %d commands in flight, asking one by one\n", inflight);
+         d4Stats.retries++;
+         window = 1;
+         inflight = 0;
+         for ( i = 0; i < probes; i++ )
+            if ( state[i] == 1 )
+               state[i] = 0;
+         continue;
+      }
+
+      i = discoverMatch(answer, rd, names, probes);
+      if ( i < 0 && inflight == 1 )
+      {
+         /* i.e. Error packet, it is for the only command in flight */
+         for ( i = 0; state[i] != 1; i++ )
+            ;
+      }
+      if ( i < 0 || state[i] != 1 )
+         continue;   /* late reply of a command asked again */
+      state[i] = 2;
+      inflight--;
+      gettimeofday(&end, NULL);
+      countTransaction(&sent[i], &end);
+
+      /* the socket byte comes from the device, check it before indexing */
+      if ( answer[6] == 0x7f || answer[7] != 0 || rd < 9 || answer[8] < 1 || answer[8] > D4_SOCKETS )
+         continue;   /* no service or invalid socket */
+      if ( found[answer[8]][0] )
+         continue;   /* known already */
+      if ( i < D4_SOCKETS )
+      {
+         len = rd - 9 < D4_SERVICE_LEN ? rd - 9 : D4_SERVICE_LEN;
+         memcpy(found[answer[8]], answer + 9, len);
+      }
+      else
+         strncpy(found[answer[8]], names[i - D4_SOCKETS], D4_SERVICE_LEN);
+   }
+   costSwitch(from);
+
+   for ( i = 1; count >= 0 && i <= D4_SOCKETS && count < max; i++ )
+   {
+      if ( !found[i][0] )
+         continue;
+      services[count].socketID = i;
+      strcpy(services[count].name, found[i]);
+      count++;
+   }
+
+out:
+   free(found);
+   free(state);
+   free(sent);
+   return count;
+}
+
 /*******************************************************************/
 /* Function OpenChannel()                                          */
 /*        handle the OpenChannel command                           */
@@ -874,7 +2346,10 @@ int OpenChannel(int fd, unsigned char sockId, int *sndSz, int *rcvSz)
 {
    unsigned char  cmd[17];
    unsigned char  buf[20];
+   d4Channel_t   *ch;
    int rd;
+   int tries = 0;
+   int wait;
 
    for(;;)
    {
@@ -903,9 +2378,17 @@ int OpenChannel(int fd, unsigned char sockId, int *sndSz, int *rcvSz)
       }
       else if ( rd == 16 )
       {
-         if ( buf[7] == 4 )
+         if ( buf[7] == D4_RESULT_RESOURCES )
          {
-            /* device cant allocate resources now */
+            /* device cant allocate resources now, give it some */
+            /* time to free them but not forever                  */
+            if ( ++tries > D4_OPEN_RETRIES )
+               return -1;
+            wait = boundTimeout(D4_OPEN_BACKOFF << (tries - 1));
+            if ( wait < 0 )
+               return -1;
+            d4Stats.retries++;
+            accountedSleep(wait * 1000, D4_SLEEP_OPEN);
             continue;
          }
          else if ( buf[7] != 0 )
@@ -915,6 +2398,12 @@ int OpenChannel(int fd, unsigned char sockId, int *sndSz, int *rcvSz)
          }
          *sndSz = (buf[10]<<8) + buf[11];
          *rcvSz = (buf[12]<<8) + buf[13];
+         dropChannel(getChannel(fd, sockId, 0));
+         if ( (ch = getChannel(fd, sockId, 1)) != NULL )
+         {
+            ch->sndSize = *sndSz;
+            ch->rcvSize = *rcvSz;
+         }
          break;
       }
       else
@@ -926,6 +2415,20 @@ int OpenChannel(int fd, unsigned char sockId, int *sndSz, int *rcvSz)
    return 1;                 
 }
 
+/*******************************************************************/
+/* Function d4Overloaded()                                         */
+/*        tell if the last command failed because the device is    */
+/*        loaded, so it would succeed if tried later               */
+/*                                                                 */
+/* Return: 1 if overloaded, 0 otherwise                            */
+/*                                                                 */
+/*******************************************************************/
+
+int d4Overloaded(void)
+{
+   return d4LastResult == D4_RESULT_BUSY || d4LastResult == D4_RESULT_RESOURCES;
+}
+
 /*******************************************************************/
 /* Function CloseChannel()                                         */
 /*        handle the CloseChannel command                          */
@@ -951,6 +2454,7 @@ int CloseChannel(int fd, unsigned char socketID)
    buf[sizeof(cmdHeader_t)+0] = socketID;
    buf[sizeof(cmdHeader_t)+1] = socketID;
    buf[sizeof(cmdHeader_t)+2] = 0;
+   dropChannel(getChannel(fd, socketID, 0));
    rd = sendReceiveCmd(fd, buf,10, buf, 10);
    return rd == 10 ? 1 : rd;
 }
@@ -967,6 +2471,7 @@ int CloseChannel(int fd, unsigned char socketID)
 
 int CreditRequest(int fd, unsigned char socketID)
 {
+   d4Channel_t  *ch;
    int           rd;
    unsigned char            buf[100];
    unsigned char            rBuf[100];
@@ -988,6 +2493,8 @@ int CreditRequest(int fd, unsigned char socketID)
    if ( rd == 12 )
    {
       /* this is the credit */
+      if ( (ch = getChannel(fd, socketID, 1)) != NULL )
+         ch->credits += (rBuf[10]*256)+rBuf[11];
       return (rBuf[10]*256)+rBuf[11];
    }
    else
@@ -1009,6 +2516,7 @@ int CreditRequest(int fd, unsigned char socketID)
 /* needed for sending of commands (channel 2) or scanning */
 int Credit(int fd, unsigned char socketID, int credit)
 {
+   d4Channel_t *ch;
    int rd;
    unsigned char buf[100];
    unsigned char rBuf[100];
@@ -1028,6 +2536,8 @@ int Credit(int fd, unsigned char socketID, int credit)
    rd = sendReceiveCmd(fd, buf, 11, rBuf, 10);
    if ( rd == 10 )
    {
+      if ( (ch = getChannel(fd, socketID, 1)) != NULL )
+         ch->peerCredits += credit;
       return 1;
    }
    else
@@ -1059,12 +2569,12 @@ int askForCredit(int fd, unsigned char socketID, int *sndSize, int *rcvSize)
    
    while (credit == 0 )
    {
-      while((credit=CreditRequest(fd,socketID)) == 0  && count < MAX_CREDIT_REQUEST )
-         usleep(d4RdTimeout);
+      while((credit=CreditRequest(fd,socketID)) == 0  && count < MAX_CREDIT_REQUEST && !d4Expired() )
+         accountedSleep(d4RdTimeout, D4_SLEEP_CREDIT);
 
       if ( credit == -1 )
       {
-         if ( errno == ENODEV || count == MAX_CREDIT_REQUEST )
+         if ( errno == ENODEV || count == MAX_CREDIT_REQUEST || d4Expired() )
          {
             break;
          }
@@ -1099,14 +2609,31 @@ int askForCredit(int fd, unsigned char socketID, int *sndSize, int *rcvSize)
 /*******************************************************************/
 
 int writeData(int fd, unsigned char socketID, const unsigned char *buf, int len, int eoj)
+{
+   return writeDataCredit(fd, socketID, buf, len, eoj, 0);
+}
+
+/*******************************************************************/
+/* Function writeDataCredit()                                      */
+/*        Convenience function                                     */
+/*        as writeData() but give credit to the device in the      */
+/*        packet header, so no Credit transaction is needed        */
+/* Input:  int   credit    credit piggybacked (0 .. 255)           */
+/*                                                                 */
+/* Return: number of bytes written or -1;                          */
+/*                                                                 */
+/*******************************************************************/
+
+int writeDataCredit(int fd, unsigned char socketID, const unsigned char *buf, int len, int eoj, int credit)
 {
    unsigned char  cmd[6];
+   d4Channel_t   *ch;
    int wr = 0;
    int ret = 0;
-   struct  itimerval ti, oti;
+   int from;
    struct timeval beg;
-   static unsigned char *buffer = NULL;
-   static int bLen   = 0;
+   static __thread unsigned char *buffer = NULL;
+   static __thread int bLen   = 0;
    if ( debugD4 )
    {
       fprintf(stderr,"--- Send Data      ---\n");
@@ -1127,16 +2654,16 @@ int writeData(int fd, unsigned char socketID, const unsigned char *buf, int len,
    cmd[1] = socketID;
    cmd[2] = len >> 8;
    cmd[3] = len & 0xff;
-   cmd[4] = 0;
+   cmd[4] = credit;
    cmd[5] = eoj ? 1 : 0;
 
    memcpy(buffer, cmd, 6);
    memcpy(buffer + 6, buf, len - 6 );
+   from = costSwitch(D4_COST_DATA);
+   d4Stats.cost[D4_COST_DATA].count++;
    while( ret > -1 && wr != len )
    {
-      SET_TIMER(ti,oti,d4WrTimeout);
-      ret = SafeWrite(fd, buffer+wr, len-wr );
-      RESET_TIMER(ti,oti);
+      ret = timedWrite(fd, buffer+wr, len-wr, d4WrTimeout);
       if ( ret == -1 )
       {
          perror("write: ");
@@ -1146,6 +2673,7 @@ int writeData(int fd, unsigned char socketID, const unsigned char *buf, int len,
          wr += ret;
       }
    }
+   costSwitch(from);
 
    if ( debugD4 )
    {
@@ -1161,13 +2689,78 @@ int writeData(int fd, unsigned char socketID, const unsigned char *buf, int len,
    }
 
    if (  wr > 6 )
+   {
       wr -= 6;
+      if ( (ch = getChannel(fd, socketID, 0)) != NULL )
+      {
+         if ( ch->credits > 0 )
+            ch->credits--;
+         ch->peerCredits += credit;
+      }
+   }
    else
       wr = -1;
    return wr;
 
 }
 
+/*******************************************************************/
+/* Function writePackets()                                         */
+/*        Convenience function                                     */
+/*        write data packets built by the caller (with headers)    */
+/*        by one write, credits are accounted as by writeData()    */
+/*        for every packet                                         */
+/* Input:  int   fd    file handle                                 */
+/*         char *buf   the packets                                 */
+/*         int   len   their total length                          */
+/*                                                                 */
+/* Return: number of bytes written or -1;                          */
+/*                                                                 */
+/*******************************************************************/
+
+int writePackets(int fd, const unsigned char *buf, int len)
+{
+   d4Channel_t *ch;
+   int wr = 0;
+   int ret = 0;
+   int from;
+   int i;
+
+   if ( debugD4 )
+      fprintf(stderr,"--- Send Packets   ---\n");
+
+   from = costSwitch(D4_COST_DATA);
+   for ( i = 0; i + 6 <= len && (buf[i+2] << 8) + buf[i+3] >= 6; i += (buf[i+2] << 8) + buf[i+3] )
+      d4Stats.cost[D4_COST_DATA].count++;
+   while( ret > -1 && wr != len )
+   {
+      ret = timedWrite(fd, buf+wr, len-wr, d4WrTimeout);
+      if ( ret == -1 )
+      {
+         perror("write: ");
+      }
+      else
+      {
+         wr += ret;
+      }
+   }
+   costSwitch(from);
+
+   if ( wr != len )
+      return -1;
+
+   for ( i = 0; i + 6 <= len && (buf[i+2] << 8) + buf[i+3] >= 6; i += (buf[i+2] << 8) + buf[i+3] )
+   {
+      if ( (ch = getChannel(fd, buf[i], 0)) != NULL )
+      {
+         if ( ch->credits > 0 )
+            ch->credits--;
+         ch->peerCredits += buf[i+4];
+      }
+   }
+   return wr;
+}
+
 /*******************************************************************/
 /* Function readData()                                             */
 /*        Convenience function                                     */
@@ -1184,12 +2777,16 @@ int writeData(int fd, unsigned char socketID, const unsigned char *buf, int len,
 int readData(int fd, unsigned char socketID, unsigned char *buf, int len)
 {
    int ret;
+   int from;
    /* give credit */
    if ( Credit(fd, socketID, 1) == 1 )
    {
+      from = costSwitch(D4_COST_DATA);
+      d4Stats.cost[D4_COST_DATA].count++;
       /* wait a little bit */
-      usleep(1000);
-      ret = _readData(fd, buf, len);
+      accountedSleep(1000, D4_SLEEP_DATA);
+      ret = _readData(fd, socketID, buf, len);
+      costSwitch(from);
       return ret; 
    }
    else
@@ -1198,6 +2795,115 @@ int readData(int fd, unsigned char socketID, unsigned char *buf, int len)
    }
 }
 
+/*******************************************************************/
+/* Function receiveData()                                          */
+/*        Convenience function                                     */
+/*        as readData() but don't give credit, it must be given    */
+/*        before (so one Credit may be used for several packets)   */
+/* Input:  int   fd    file handle                                 */
+/*         unsigned char    socketID  the channel socket           */
+/*         unsigned char   *buf       the buffer for datas         */
+/*         int   len       size of the buffer                      */
+/*                                                                 */
+/* Return: number of bytes read or -1;                             */
+/*                                                                 */
+/*******************************************************************/
+
+int receiveData(int fd, unsigned char socketID, unsigned char *buf, int len)
+{
+   int from = costSwitch(D4_COST_DATA);
+   int ret;
+
+   d4Stats.cost[D4_COST_DATA].count++;
+   ret = _readData(fd, socketID, buf, len);
+   costSwitch(from);
+   return ret;
+}
+
+/*******************************************************************/
+/* Function getCredits()                                           */
+/*        Convenience function                                     */
+/*        the credits known for the channel                        */
+/* Input:  int   fd    file handle                                 */
+/*         unsigned char    socketID  the channel socket           */
+/*         int  *peerCredits  if not NULL, credits given to the    */
+/*                            peer and not used yet are put here   */
+/*                                                                 */
+/* Return: number of packets we may send on the channel            */
+/*                                                                 */
+/*******************************************************************/
+
+int getCredits(int fd, unsigned char socketID, int *peerCredits)
+{
+   d4Channel_t *ch = getChannel(fd, socketID, 0);
+
+   if ( peerCredits != NULL )
+      *peerCredits = ch != NULL ? ch->peerCredits : 0;
+   return ch != NULL ? ch->credits : 0;
+}
+
+/*******************************************************************/
+/* Function resetCredits()                                         */
+/*        Convenience function                                     */
+/*        forget the credits of the channel (i.e. after an error,  */
+/*        when they are unknown)                                   */
+/* Input:  int   fd    file handle                                 */
+/*         unsigned char    socketID  the channel socket           */
+/*                                                                 */
+/*******************************************************************/
+
+void resetCredits(int fd, unsigned char socketID)
+{
+   d4Channel_t *ch = getChannel(fd, socketID, 0);
+
+   if ( ch != NULL )
+   {
+      ch->credits     = 0;
+      ch->peerCredits = 0;
+   }
+}
+
+/*******************************************************************/
+/* Function dropQueued()                                           */
+/*        Convenience function                                     */
+/*        drop the packets queued for the channel (i.e. late       */
+/*        replies after an error)                                  */
+/* Input:  int   fd    file handle                                 */
+/*         unsigned char    socketID  the channel socket           */
+/*                                                                 */
+/*******************************************************************/
+
+void dropQueued(int fd, unsigned char socketID)
+{
+   d4Channel_t *ch = getChannel(fd, socketID, 0);
+
+   if ( ch != NULL )
+   {
+      if ( debugD4 && ch->queued )
+         fprintf(stderr,"%d packets for channel %d-%d dropped\n", ch->queued, socketID, socketID);
+      ch->head   = 0;
+      ch->queued = 0;
+   }
+}
+
+/*******************************************************************/
+/* Function getPacketSize()                                        */
+/*        Convenience function                                     */
+/*        the packet size negotiated by OpenChannel()              */
+/* Input:  int   fd    file handle                                 */
+/*         unsigned char    socketID  the channel socket           */
+/*                                                                 */
+/* Return: packet size in send direction, 0 if unknown             */
+/*                                                                 */
+/*******************************************************************/
+
+int getPacketSize(int fd, unsigned char socketID)
+{
+   d4Channel_t *ch = getChannel(fd, socketID, 0);
+
+   return ch != NULL ? ch->sndSize : 0;
+}
+
 /*******************************************************************/
 /* Function readData()                                             */
 /*        Convenience function                                     */
@@ -1213,6 +2919,7 @@ int readData(int fd, unsigned char socketID, unsigned char *buf, int len)
 
 void flushData(int fd, unsigned char socketID)
 {
+  int from;
   if (debugD4)
     fprintf(stderr, "flushData %d\n", socketID);
    /* give credit */
@@ -1220,13 +2927,19 @@ void flushData(int fd, unsigned char socketID)
      {
        if ( Credit(fd, socketID, 1) == 1 )
 	 {
+	   from = costSwitch(D4_COST_OTHER);
 	   /* wait a little bit */
-	   usleep(1000);
+	   accountedSleep(1000, D4_SLEEP_FLUSH);
 	   _flushData(fd);
+	   costSwitch(from);
 	 }
      }
    else
-     _flushData(fd);
+     {
+       from = costSwitch(D4_COST_OTHER);
+       _flushData(fd);
+       costSwitch(from);
+     }
 }
 
 /*******************************************************************/
@@ -1241,12 +2954,97 @@ void flushData(int fd, unsigned char socketID)
 void clearSndBuf(int fd)
 {
    char             buf[256];
-   struct itimerval ti, oti;
-   
-   SET_TIMER(ti,oti, d4RdTimeout);
-   while ( read(fd, buf, sizeof(buf) ) > 0 )
-      SET_TIMER(ti,oti, d4RdTimeout);
-   RESET_TIMER(ti,oti);
+   int              from = costSwitch(D4_COST_OTHER);
+
+   while ( timedRead(fd, buf, sizeof(buf), d4RdTimeout) > 0 )
+      ;
+   costSwitch(from);
+}
+
+/*******************************************************************/
+/* Function quickClearSndBuf()                                     */
+/*        Convenience function                                     */
+/*        as clearSndBuf() but don't wait for the timer, only      */
+/*        drop what the device has already sent                    */
+/*                                                                 */
+/* Input:  int   fd    file handle                                 */
+/*                                                                 */
+/* Return: number of bytes dropped                                 */
+/*                                                                 */
+/*******************************************************************/
+
+int quickClearSndBuf(int fd)
+{
+   char buf[256];
+   d4Transport_t *t = getTransport(fd);
+   int  flags;
+   int  rd;
+   int  total = 0;
+
+   if ( t != NULL && t->replay != NULL )
+   {
+      while ( (rd = replayRead(t, buf, sizeof(buf), 0, 'D')) > 0 )
+         total += rd;
+      return total;
+   }
+   flags = fcntl(fd, F_GETFL);
+   if ( flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1 )
+      return 0;
+   while ( (rd = read(fd, buf, sizeof(buf))) > 0 )
+   {
+      cost()->reads++;
+      if ( t != NULL )
+         captureRecord(t, 'D', buf, rd);
+      total += rd;
+   }
+   cost()->reads++;
+   fcntl(fd, F_SETFL, flags);
+
+   if ( debugD4 )
+      fprintf(stderr,"quickClearSndBuf: %d bytes dropped\n", total);
+   return total;
+}
+
+/*******************************************************************/
+/* Function ProbeIEEE()                                            */
+/*        check if the device is already in IEEE 1284.4 mode by    */
+/*        sending a single Init with a short timeout               */
+/* Input:  int   fd    file handle                                 */
+/*         int   resync  if set, send an Exit first in order to    */
+/*                       terminate a half-open session             */
+/*                                                                 */
+/* Return: 0 if the device don't answer, 1 if all is OK, -1 if it  */
+/*         answered, but not with Init reply (stale or partial     */
+/*         packets of a half-open session, worth a resync)         */
+/*                                                                 */
+/*******************************************************************/
+
+int ProbeIEEE(int fd, int resync)
+{
+   int rdTimeout = d4RdTimeout;
+   int wrTimeout = d4WrTimeout;
+   unsigned long received;
+   int ret;
+
+   d4RdTimeout = d4ProbeTimeout;
+   d4WrTimeout = d4ProbeTimeout;
+   d4Probing   = 1;
+
+   if ( resync )
+   {
+      /* the old session may still have replies pending */
+      Exit(fd);
+      quickClearSndBuf(fd);
+   }
+   received = d4Received;
+   ret = Init(fd);
+   if ( !ret && (d4Received != received || quickClearSndBuf(fd) > 0) )
+      ret = -1;
+
+   d4Probing   = 0;
+   d4RdTimeout = rdTimeout;
+   d4WrTimeout = wrTimeout;
+   return ret;
 }
 
 void setDebug(int debug)
@@ -1320,21 +3118,6 @@ int GetSocketIDReply(int fd, unsigned char socketID)
    
 }
 
-int GetServiceName(inf fd, unsigned char socketID)
-{
-   int rd;
-   unsigned char buf[100];
-   cmdHeader_t *cmd = buf;
-   cmd->psid     = 0;
-   cmd->ssid     = 0;
-   cmd->lengthH  = 0;
-   cmd->lengthL  = 8;
-   cmd->credit   = 1;
-   cmd->control  = 0;
-   cmd->command  = 0x0a;
-   buf[sizeof(cmdHeader_t)] = socketID;
-}
-
 /* as GetSocketIDReply but with command 0x8a instead 0f 0x89 */
 int GetServiceNameReply(inf fd)
 {
@@ -22,9 +22,11 @@
 extern int debugD4;   /* allow printout of debug informations */
 
 extern int EnterIEEE(int fd);
+extern int ProbeIEEE(int fd, int resync);  /* 1 - ready, 0 - silent, -1 - resync */
 extern int Init(int fd);
 extern int Exit(int fd);
 extern int GetSocketID(int fd, const char *serviceName);
+extern int GetServiceName(int fd, unsigned char socketID, char *name, int len);
 extern int OpenChannel(int fd, unsigned char sockId, int *sndSz, int *rcvSz);
 extern int CloseChannel(int fd, unsigned char socketID);
 extern int CreditRequest(int fd, unsigned char socketID);
@@ -34,14 +36,110 @@ extern int Credit(int fd, unsigned char socketID, int credit);
 extern int SafeWrite(int fd, const void *data, int len);
 extern int askForCredit(int fd, unsigned char socketID, int *sndSz, int *rcvSz);
 extern int writeData(int fd, unsigned char socketID, const unsigned char *buf, int len, int eoj);
+extern int writeDataCredit(int fd, unsigned char socketID, const unsigned char *buf, int len, int eoj, int credit);
+extern int writePackets(int fd, const unsigned char *buf, int len);
 extern int readData(int fd, unsigned char socketID, unsigned char *buf, int len);
+extern int receiveData(int fd, unsigned char socketID, unsigned char *buf, int len);
+extern int getCredits(int fd, unsigned char socketID, int *peerCredits);
+extern void resetCredits(int fd, unsigned char socketID);
+extern void dropQueued(int fd, unsigned char socketID);
+extern int getPacketSize(int fd, unsigned char socketID);
 extern int readAnswer(int fd, unsigned char *buf, int len);
 extern void flushData(int fd, unsigned char socketID);
 extern void clearSndBuf(int fd);
+extern int quickClearSndBuf(int fd);
 extern void setDebug(int debug);
 
-extern int d4WrTimeout;
-extern int d4RdTimeout;
+/* operation deadline (per thread) and cancellation (of all threads) */
+extern void d4SetDeadline(int ms);
+extern void d4SetCleanupDeadline(int ms);
+extern void d4Cancel(void);
+extern int d4Remaining(void);
+extern int d4Expired(void);
+
+/* capture and replay of the device traffic (see d4lib.c for format) */
+#define D4_CAPTURE_MAGIC "RKC1"
+extern int d4Capture(int fd, const char *file);
+extern int d4Replay(int fd, const char *file, int realtime);
+extern long d4Detach(int fd);
+
+/* fault injection to the device traffic (see d4lib.c for spec) */
+extern int d4Faults(int fd, const char *spec);
+
+/* service discovery, GetServiceName and GetSocketID pipelined */
+#define D4_SOCKETS       0xfe  /* sockets 1 .. 0xfe may have services */
+#define D4_SERVICE_LEN   40    /* the longest service name            */
+typedef struct
+{
+   unsigned char socketID;
+   char          name[D4_SERVICE_LEN + 1];
+} d4Service_t;
+extern int d4Discover(int fd, const char **names, d4Service_t *services, int max, int window);
+
+extern __thread int d4WrTimeout;
+extern __thread int d4RdTimeout;
+extern __thread int d4ProbeTimeout;
+
+/* result of the last rejected command, per thread, cleared by the caller */
+#define D4_RESULT_BUSY      0x01  /* unable to begin conversation   */
+#define D4_RESULT_RESOURCES 0x04  /* no sufficient resources now    */
+#define D4_OPEN_RETRIES     6     /* OpenChannel tries while no resources */
+#define D4_OPEN_BACKOFF     10    /* ms, doubled after each of them */
+extern __thread int d4LastResult;
+extern int d4Overloaded(void);
+
+/* cost of the transport: what the device takes (waiting for it in  */
+/* poll()) and what we take (syscalls, sleeps, CPU), per transaction */
+/* type (index is the command byte), for channel data and the rest   */
+#define D4_COST_DATA      0x0b    /* writeData(), readData(), receiveData() */
+#define D4_COST_OTHER     0x0c    /* outside of transactions                */
+#define D4_COSTS          0x0d
+typedef struct
+{
+   unsigned long count;          /* transactions or data transfers  */
+   unsigned long reads;          /* read() calls                    */
+   unsigned long writes;         /* write() calls                   */
+   unsigned long polls;          /* poll() calls                    */
+   unsigned long sleeps;         /* usleep() calls                  */
+   unsigned long csw;            /* voluntary context switches (*)  */
+   double        waited;         /* seconds in poll() for device    */
+   double        slept;          /* seconds in usleep()             */
+   double        cpu;            /* seconds of user+system CPU (*)  */
+   double        wall;           /* seconds in total                */
+} d4Cost_t;                      /* (*) only if d4Accounting is set */
+
+/* places usleep() is called from, time slept there is counted too */
+#define D4_SLEEP_WRITE    0       /* SafeWrite(), writeCmd()         */
+#define D4_SLEEP_ANSWER   1       /* readAnswer()                    */
+#define D4_SLEEP_FLUSH    2       /* flushData(), _flushData()       */
+#define D4_SLEEP_CREDIT   3       /* askForCredit()                  */
+#define D4_SLEEP_DATA     4       /* readData()                      */
+#define D4_SLEEP_OPEN     5       /* OpenChannel() backoff           */
+#define D4_SLEEP_SITES    6
+
+extern const char *d4CostNames[D4_COSTS];       /* NULL - not a transaction */
+extern const char *d4SleepNames[D4_SLEEP_SITES];
+extern int d4Accounting;   /* get CPU time and context switches of each */
+                           /* transaction (2 more syscalls for each)    */
+
+/* transport statistics, per thread as the timeouts */
+#define D4_LATENCY_BUCKETS 8
+typedef struct
+{
+   unsigned long transactions;   /* command transactions done       */
+   unsigned long retries;        /* repeated attempts               */
+   unsigned long timeouts;       /* read or write timeouts          */
+   unsigned long faults;         /* faults injected (d4Faults())    */
+   unsigned long latency[D4_LATENCY_BUCKETS + 1]; /* transactions   */
+                                 /* by latency, the last one counts */
+                                 /* slower than all the bounds      */
+   double        latencySum;     /* total latency in seconds        */
+   d4Cost_t      cost[D4_COSTS]; /* cost by transaction type        */
+   double        slept[D4_SLEEP_SITES]; /* seconds slept by place   */
+} d4Stats_t;
+
+extern const int d4LatencyBounds[D4_LATENCY_BUCKETS]; /* in ms */
+extern __thread d4Stats_t d4Stats;
 extern int ppid;
 
 #if D4_DEBUG
@@ -0,0 +1,261 @@
+/* This file is part of ReInk.
+ * Copyright (C) 2008-2016 Alexey Osipov public@alexey.osipov.name
+ *
+ * ReInk is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReInk is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReInk. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>	//malloc
+#include <string.h>	//strcmp
+#include <errno.h>	//errno
+#include <unistd.h>	//isatty
+
+#include "eeimage.h"
+
+static char stdout_buf[IMG_BUF_LEN]; //stays attached to stdout until exit
+
+static int ihex_flush(eeimage_t* img)
+{
+	int i;
+	unsigned char sum;
+
+	if (!img->rec_len)
+		return 0;
+
+	sum = img->rec_len + ((img->rec_addr >> 8) & 0xFF) + (img->rec_addr & 0xFF);
+	fprintf(img->f, ":%02X%04X00", img->rec_len, img->rec_addr & 0xFFFF);
+	for (i = 0; i < img->rec_len; i++)
+	{
+		fprintf(img->f, "%02X", img->rec[i]);
+		sum += img->rec[i];
+	}
+	fprintf(img->f, "%02X\n", (unsigned char)(0x100 - sum));
+
+	img->rec_len = 0;
+	return ferror(img->f) ? -1 : 0;
+}
+
+int eeimage_format(const char* name)
+{
+	if (!strcmp(name, "text"))
+		return IMG_TEXT;
+	if (!strcmp(name, "bin"))
+		return IMG_BINARY;
+	if (!strcmp(name, "ihex"))
+		return IMG_IHEX;
+	return -1;
+}
+
+int eeimage_open(eeimage_t* img, const char* path, int format)
+{
+	memset(img, 0, sizeof(eeimage_t));
+	img->format = format;
+
+	if (!path || !strcmp(path, "-"))
+		img->f = stdout;
+	else
+	{
+		img->f = fopen(path, "w");
+		if (!img->f)
+		{
+			fprintf(stderr, "Error opening image file '%s': %s\n", path, strerror(errno));
+			return -1;
+		}
+		img->close_f = 1;
+	}
+
+	//line buffering is more friendly for the text on terminal
+	if (format != IMG_TEXT || !isatty(fileno(img->f)))
+	{
+		if (img->close_f)
+			img->buf = malloc(IMG_BUF_LEN);
+		setvbuf(img->f, img->close_f ? img->buf : stdout_buf, _IOFBF, IMG_BUF_LEN);
+	}
+
+	img->seekable = (format == IMG_BINARY) && (fseek(img->f, 0, SEEK_CUR) == 0);
+
+	return 0;
+}
+
+int eeimage_put(eeimage_t* img, unsigned int addr, unsigned char data)
+{
+	switch (img->format)
+	{
+	case IMG_TEXT:
+		fprintf(img->f, "0x%04X = 0x%02X\n", addr, data);
+		break;
+
+	case IMG_BINARY:
+		if (img->seekable)
+		{
+			if ((!img->started || addr != img->next) && fseek(img->f, addr, SEEK_SET))
+				return -1;
+		}
+		else if (img->started)
+		{
+			//pipe, image starts from the first address and can't go back
+			if (addr < img->next)
+				return -1;
+			for (; img->next < addr; img->next++)
+				fputc(0xFF, img->f); //erased EEPROM cell
+		}
+		fputc(data, img->f);
+		break;
+
+	case IMG_IHEX:
+		if (img->rec_len && (addr != img->rec_addr + img->rec_len || img->rec_len == IMG_IHEX_REC))
+			if (ihex_flush(img))
+				return -1;
+		if (!img->rec_len)
+			img->rec_addr = addr;
+		img->rec[img->rec_len++] = data;
+		break;
+
+	default:
+		return -1;
+	}
+
+	img->started = 1;
+	img->next = addr + 1;
+	return ferror(img->f) ? -1 : 0;
+}
+
+int eeimage_close(eeimage_t* img)
+{
+	int ret = 0;
+
+	if (img->format == IMG_IHEX)
+	{
+		ret = ihex_flush(img);
+		fprintf(img->f, ":00000001FF\n");
+	}
+
+	if (fflush(img->f) || ferror(img->f))
+		ret = -1;
+
+	if (img->close_f && fclose(img->f))
+		ret = -1;
+
+	free(img->buf);
+	img->buf = NULL;
+
+	if (ret)
+		fprintf(stderr, "Error writing EEPROM image: %s\n", strerror(errno));
+
+	return ret;
+}
+
+int eeimage_load(const char* path, int format, unsigned char* data, unsigned char* covered)
+{
+	FILE* f;
+	char line[IMG_LINE_LEN]; //current line of text or Intel HEX image
+	unsigned int addr; //address from the image
+	unsigned int byte; //data from the image
+	unsigned int len, type; //Intel HEX record fields
+	unsigned char sum; //Intel HEX record checksum
+	unsigned int i;
+	int c;
+	int count = 0;
+	int eof = 0; //Intel HEX end record found?
+	int ret = 0;
+
+	if (!path || !strcmp(path, "-"))
+		f = stdin;
+	else if (!(f = fopen(path, "r")))
+	{
+		fprintf(stderr, "Error opening image file '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	switch (format)
+	{
+	case IMG_TEXT:
+		while (fgets(line, IMG_LINE_LEN, f))
+		{
+			if (sscanf(line, "0x%x = 0x%x", &addr, &byte) != 2 || addr > 0xFFFF || byte > 0xFF)
+			{
+				ret = -1;
+				break;
+			}
+			count += !covered[addr];
+			data[addr] = byte;
+			covered[addr] = 1;
+		}
+		break;
+
+	case IMG_BINARY:
+		for (addr = 0; (c = fgetc(f)) != EOF; addr++)
+		{
+			if (addr > 0xFFFF)
+			{
+				ret = -1;
+				break;
+			}
+			count += !covered[addr];
+			data[addr] = c;
+			covered[addr] = 1;
+		}
+		break;
+
+	case IMG_IHEX:
+		while (!eof && fgets(line, IMG_LINE_LEN, f))
+		{
+			if (sscanf(line, ":%2x%4x%2x", &len, &addr, &type) != 3 || strlen(line) < 11 + 2 * len)
+			{
+				ret = -1;
+				break;
+			}
+
+			sum = len + (addr >> 8) + (addr & 0xFF) + type;
+			for (i = 0; i <= len; i++)
+			{
+				sscanf(line + 9 + 2 * i, "%2x", &byte);
+				sum += byte;
+				if (i < len && type == 0)
+				{
+					if (addr + i > 0xFFFF)
+						break;
+					count += !covered[addr + i];
+					data[addr + i] = byte;
+					covered[addr + i] = 1;
+				}
+			}
+
+			if (sum || i <= len || (type != 0 && type != 1))
+			{
+				ret = -1;
+				break;
+			}
+			eof = (type == 1);
+		}
+		if (!eof)
+			ret = -1;
+		break;
+
+	default:
+		ret = -1;
+	}
+
+	if (ferror(f))
+		ret = -1;
+	if (f != stdin)
+		fclose(f);
+
+	if (ret)
+	{
+		fprintf(stderr, "Error reading EEPROM image '%s': malformed %s.\n", path ? path : "-", format == IMG_IHEX ? "Intel HEX" : "image");
+		return -1;
+	}
+
+	return count;
+}
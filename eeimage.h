@@ -0,0 +1,86 @@
+/* This file is part of ReInk.
+ * Copyright (C) 2008-2016 Alexey Osipov public@alexey.osipov.name
+ *
+ * ReInk is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReInk is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReInk. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EEIMAGE_H
+
+#define EEIMAGE_H
+
+#include <stdio.h>
+
+//EEPROM image formats
+#define IMG_TEXT		0	//"0x0000 = 0x00" line per byte
+#define IMG_BINARY		1	//raw image, file offset is EEPROM address
+#define IMG_IHEX		2	//Intel HEX
+
+#define IMG_BUF_LEN		0x10000	//output buffer size
+#define IMG_IHEX_REC	16		//data bytes per Intel HEX record
+#define IMG_LINE_LEN	256		//maximum line length of loaded image
+
+typedef struct _eeimage {
+	FILE* f;				//output stream
+	int format;				//IMG_*
+	int close_f;			//is f opened by eeimage_open?
+	int seekable;			//can we seek in f?
+	int started;			//was any byte put?
+	unsigned int next;		//next expected address
+	unsigned char rec[IMG_IHEX_REC];	//pending Intel HEX record
+	unsigned int rec_addr;	//address of rec[0]
+	int rec_len;			//bytes in rec
+	char* buf;				//stdio buffer of f
+} eeimage_t;
+
+/*
+   Returns IMG_* for format name ("text", "bin" or "ihex").
+   If name is unknown returns -1.
+*/
+int eeimage_format(const char* name);
+
+/*
+   Opens image output to <path> (stdout if <path> is NULL or "-").
+   Binary image written to a regular file is placed at file offset
+   equal to EEPROM address, so it may be mmap'ed by address.
+   On success returns 0.
+   On fail prints error message to stderr and returns -1.
+*/
+int eeimage_open(eeimage_t* img, const char* path, int format);
+
+/*
+   Puts one byte <data> from EEPROM address <addr> to image.
+   On success returns 0.
+   On fail returns -1.
+*/
+int eeimage_put(eeimage_t* img, unsigned int addr, unsigned char data);
+
+/*
+   Finishes image (writes Intel HEX end record, flushes buffer)
+   and closes the output.
+   On success returns 0.
+   On fail prints error message to stderr and returns -1.
+*/
+int eeimage_close(eeimage_t* img);
+
+/*
+   Loads image of <format> from <path> (stdin if <path> is NULL or "-").
+   Byte of EEPROM address <addr> goes to <data>[addr] and
+   <covered>[addr] is set to 1 (both are at least 0x10000 bytes).
+   Binary image starts from address 0.
+   On success returns count of loaded addresses.
+   On fail prints error message to stderr and returns -1.
+*/
+int eeimage_load(const char* path, int format, unsigned char* data, unsigned char* covered);
+
+#endif
@@ -0,0 +1,2294 @@
+/* This file is part of ReInk.
+ * Copyright (C) 2008-2016 Alexey Osipov public@alexey.osipov.name
+ *
+ * ReInk is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReInk is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReInk. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>	//strtol
+#include <unistd.h>	//close
+#include <stdio.h>	//fprintf, stderr
+#include <string.h>	//strcmp
+#include <stdarg.h>	//va_list
+#include <ctype.h>	//isalnum
+
+#include <sys/types.h>	//fileIO
+#include <sys/socket.h>	//reinkd connection
+#include <sys/un.h>		//reinkd connection
+#include <sys/stat.h>	//fileIO
+#include <fcntl.h>	//fileIO
+
+#include <errno.h>	//errno
+#include <poll.h>	//reinkd reply deadline
+#include <sys/time.h>	//pipeline round trips
+#include <sys/ioctl.h>	//IEEE 1284 device ID
+
+#include "d4lib.h"	//IEEE 1284.4
+#include "libreink.h"
+#include "reinkd.h"	//reinkd protocol
+
+//EPSON factory commands classes and names
+#define EFCMD_EEPROM_READ	0x41
+#define EFCLS_EEPROM_READ	0x7c
+#define EFCMD_EEPROM_WRITE	0x42
+#define EFCLS_EEPROM_WRITE	0x7c
+
+//LPIOC_GET_DEVICE_ID of usblp driver, not exported to user space headers
+#define IOC_DEVICE_ID(len)	_IOC(_IOC_READ, 'P', 1, len)
+
+#define FRAME_ADDR		15	//offset of address in EEPROM command packet (after IEEE 1284.4 and factory command headers)
+
+#define PROBE_SIG_LEN	8	//how many bytes to compare to detect EEPROM wraparound
+#define PROBE_MIN_BITS	4	//smallest EEPROM size to check (in address bits)
+#define PROBE_SCAN_MAX	0x400	//how many bytes from the beginning to search for not blank signature
+
+#define D(__c) 	if (s && s->debug) {__c;};
+#define D_OK 	D(fprintf(stderr, "OK\n"))
+
+//epson factory command header
+typedef struct _fcmd_header_t {
+	unsigned char cls1;
+	unsigned char cls2;
+	unsigned char lenL;
+	unsigned char lenH;
+	unsigned char mcode1;
+	unsigned char mcode2;
+	unsigned char cmd;
+	unsigned char cmd1;
+	unsigned char cmd2;
+} fcmd_header_t;
+
+/*
+    cmd - pointer to uninitialized epson factory command header.
+    printer - the printer.
+    class - factory command class.
+    name - factory command name.
+    extra_length - length of command arguments.
+    Initialize given header based on passed in information.
+*/
+static void init_command(fcmd_header_t* cmd, const printer_t* printer, unsigned char class, unsigned char name, unsigned short int extra_length);
+
+/*
+    Builds EEPROM read command for <addr> in <cmd> (at least 11 bytes).
+    Returns length of the command.
+*/
+static int read_command(reink_session_t* s, unsigned short int addr, char* cmd);
+
+/*
+    Parses reply to EEPROM read command for <addr> as
+    reink_read_eeprom_reply does.
+    On success returns 0.
+    On fail returns -1.
+*/
+static int parse_read_reply(reink_session_t* s, unsigned short int addr, const char* reply, int actual, unsigned char* data, unsigned short int* reply_addr, int* reply_twobyte);
+
+/*
+    Builds EEPROM write command of <data> to <addr> in <cmd> (at least
+    12 bytes).
+    Returns length of the command.
+*/
+static int write_command(reink_session_t* s, unsigned short int addr, unsigned char data, char* cmd);
+
+/*
+    Checks that printer confirmed write to <addr> by <reply>.
+    On success returns 0.
+    On fail returns -1.
+*/
+static int check_write_reply(reink_session_t* s, unsigned short int addr, const char* reply, int actual);
+
+/*
+    Reads EEPROM from the beginning to <head> up to <limit> bytes (but
+    not more than PROBE_SCAN_MAX), <*known> bytes of it are read already,
+    and finds the first PROBE_SIG_LEN bytes window which is not blank (not
+    all the bytes are the same, as in erased 0x00 or 0xFF areas).
+    Sets <*sig_at> to it's offset, -1 if there is no such window yet.
+    On success returns 0.
+    On fail returns -1.
+*/
+static int probe_signature(reink_session_t* s, int limit, unsigned char* head, int* known, int* sig_at);
+
+/*
+    Checks whether PROBE_SIG_LEN bytes at <addr> are equal to <sig>.
+    On success returns 1 if they are, 0 if not.
+    On fail returns -1.
+*/
+static int probe_mirror(reink_session_t* s, unsigned short int addr, const unsigned char* sig);
+
+/*
+    Builds s->frames: "EPSON-CTRL" packets of EEPROM read and write
+    commands with everything but address and data, unless they are
+    built for the current socket, model code and address width.
+*/
+static void frames_prepare(reink_session_t* s);
+
+/*
+    Puts packet of EEPROM read (<write> is 0) or write of <data>
+    command for <addr> to <packet> (at least REINK_FRAME_LEN bytes)
+    patching s->frames.
+    Returns length of the packet.
+*/
+static int frame_command(reink_session_t* s, int write, unsigned short int addr, unsigned char data, unsigned char* packet);
+
+/*
+    Reads (<write> is 0) or writes <count> bytes of <data> from/to
+    <addrs>, keeping up to s->window commands in flight and adapting
+    s->window to reply round trips.
+    Count of items already done is kept in <done>, the first one
+    is <*done>.
+    On success returns 0.
+    On fail returns -1 (channel state is unknown then).
+*/
+static int pipeline(reink_session_t* s, const unsigned short int* addrs, unsigned char* data, int count, int write, int* done);
+
+/*
+    Does pipeline and, if it fails, recovers the channel and continues
+    it, up to REINK_READ_RETRIES times. Then does the rest of items one
+    by one (as reink_read_eeprom_retry and reink_write_eeprom do).
+    On success returns 0.
+    On fail returns -1.
+*/
+static int batch(reink_session_t* s, const unsigned short int* addrs, unsigned char* data, int count, int write);
+
+/*
+    Saves error message to s->error (and prints it in debug mode).
+*/
+static void set_error(reink_session_t* s, const char* format, ...);
+
+/*
+    If operations of the thread are cancelled or their deadline has
+    expired, saves it as error of <s> and returns 1.
+    Otherwise returns 0.
+*/
+static int check_expired(reink_session_t* s);
+
+/*
+    If operations of the thread are cancelled or their deadline has
+    expired, gives REINK_CLOSE_TIMEOUT to close channels and exit
+    IEEE 1284.4 mode.
+*/
+static void begin_cleanup();
+
+/*
+    reink_transact without deadline checks.
+*/
+static int transact(reink_session_t* s, int socket_id, const char* buf_send, int send_len, char* buf_recv, int* recv_len);
+
+/*
+    Waits for reinkd reply on s->fd until the deadline of the thread.
+    On success returns 0.
+    On fail returns -1.
+*/
+static int daemon_wait(reink_session_t* s);
+
+/*
+    Same as reink_get_tag, but prints debug messages for session <s>.
+*/
+static int get_tag(reink_session_t* s, const char* source, int source_len, const char* tag, char* value, int max_value_len);
+
+/*
+    Tries to connect to reinkd on s->daemon_socket.
+    On success sets s->fd, s->remote and returns 0.
+    If daemon is not running returns 1.
+*/
+static int daemon_connect(reink_session_t* s);
+
+/*
+    Tries to connect to reinkd on s->daemon_socket and to open
+    <raw_device> there.
+    On success sets s->fd, s->remote and returns 0.
+    If daemon is not running returns 1.
+    On fail returns -1.
+*/
+static int daemon_open(reink_session_t* s, const char* raw_device);
+
+/*
+    Sends request <op> with <payload> to reinkd and reads the reply
+    to <reply> (<reply_len> - IN: maximum length, OUT: actual length).
+    On success returns 0.
+    On fail (including error reply) returns -1.
+*/
+static int daemon_request(reink_session_t* s, unsigned char op, const char* payload, int payload_len, char* reply, int* reply_len);
+
+/*
+    Sends whole <buf> of <len> bytes to reinkd. Lost connection
+    doesn't raise SIGPIPE.
+    On success returns 0.
+    On fail returns -1 with errno set.
+*/
+static int daemon_send(reink_session_t* s, const void* buf, int len);
+
+/*
+    Sets s->journal_file for printer opened on <raw_device> and
+    completes the batch left in it, if any. Journal which can't be
+    completed only sets s->journal_block.
+    On success returns 0.
+    On fail returns -1.
+*/
+static int journal_open(reink_session_t* s, const char* raw_device);
+
+/*
+    Saves the reason why writes are refused to s->journal_block (and
+    prints it in debug mode).
+*/
+static void journal_block(reink_session_t* s, const char* format, ...);
+
+/*
+    Saves <count> writes of <data> over <original> bytes of <addrs>
+    to s->journal_file (synchronously).
+    On success returns 0.
+    On fail returns -1.
+*/
+static int journal_begin(reink_session_t* s, const unsigned short int* addrs, const unsigned char* original, const unsigned char* data, int count);
+
+/*
+    Removes s->journal_file after all the writes are done.
+    On success returns 0.
+    On fail returns -1.
+*/
+static int journal_end(reink_session_t* s);
+
+/*
+    Returns socket of <service_name> of the session printer from
+    s->sockets or 0 if it is not there (or cache is not used).
+*/
+static int sockets_lookup(reink_session_t* s, const char* service_name);
+
+/*
+    Puts <socket> of <service_name> of the session printer to
+    s->sockets instead of the known one (0 - just removes it).
+    Errors are ignored: without cache sockets are asked from printer.
+*/
+static void sockets_store(reink_session_t* s, const char* service_name, int socket);
+
+/////////////////////////////////////////////////////////////////////////////////
+//	SESSION
+/////////////////////////////////////////////////////////////////////////////////
+//
+
+void reink_init(reink_session_t* s)
+{
+	memset(s, 0, sizeof(reink_session_t));
+	s->fd = -1;
+	s->ctrl_socket = -1;
+	s->pm = PM_UNKNOWN;
+	s->printer = printers[PM_UNKNOWN];
+	s->daemon_socket = getenv(REINKD_SOCKET_ENV);
+	if (!s->daemon_socket)
+		s->daemon_socket = REINKD_SOCKET;
+	else if (*s->daemon_socket == '\0')
+		s->daemon_socket = NULL; //explicitly disabled
+	s->capture = getenv(REINK_CAPTURE_ENV);
+	s->replay = getenv(REINK_REPLAY_ENV);
+	s->replay_fast = getenv(REINK_REPLAY_FAST_ENV) && strcmp(getenv(REINK_REPLAY_FAST_ENV), "0");
+	s->faults = getenv(REINK_FAULTS_ENV);
+	if (s->faults && *s->faults == '\0')
+		s->faults = NULL;
+	if (getenv(REINK_JOURNAL_ENV))
+		snprintf(s->journal, REINK_PATH_LEN, "%s", getenv(REINK_JOURNAL_ENV));
+	else
+		snprintf(s->journal, REINK_PATH_LEN, REINK_JOURNAL_DIR, (int)getuid());
+	if (getenv(REINK_SOCKETS_ENV))
+		snprintf(s->sockets, REINK_PATH_LEN, "%s", getenv(REINK_SOCKETS_ENV));
+	else
+		snprintf(s->sockets, REINK_PATH_LEN, REINK_SOCKETS_FILE, (int)getuid());
+}
+
+int reink_open(reink_session_t* s, const char* raw_device)
+{
+	int model;
+
+	D(fprintf(stderr, "=== reink_open ===\n"))
+
+	if (s->daemon_socket && !s->capture && !s->replay && !s->faults)
+	{
+		model = daemon_open(s, raw_device);
+		if (model < 0)
+			return -1;
+		if (model == 0)
+		{
+			D(fprintf(stderr, "^^^ reink_open ^^^\n"))
+			return journal_open(s, raw_device);
+		}
+	}
+
+	if (reink_connect(s, raw_device) < 0)
+	{
+		check_expired(s); //the reason of failure
+		return -1;
+	}
+
+	if ((s->ctrl_socket = reink_open_channel(s, "EPSON-CTRL")) < 0)
+	{
+		check_expired(s);
+		reink_disconnect(s);
+		return -1;
+	}
+
+	if ((model = reink_identify(s)) < 0)
+	{
+		reink_close(s);
+		return -1;
+	}
+
+	s->pm = model;
+	s->printer = printers[model];
+
+	D(fprintf(stderr, "^^^ reink_open ^^^\n"))
+
+	return journal_open(s, raw_device);
+}
+
+int reink_close(reink_session_t* s)
+{
+	int ret = 0;
+
+	D(fprintf(stderr, "=== reink_close ===\n"))
+
+	if (s->remote)
+	{
+		//printer session is owned by reinkd
+		close(s->fd);
+		s->fd = -1;
+		s->remote = 0;
+		D(fprintf(stderr, "^^^ reink_close ^^^\n"))
+		return 0;
+	}
+
+	begin_cleanup();
+
+	if (s->ctrl_socket >= 0 && reink_close_channel(s, s->ctrl_socket) < 0)
+		ret = -1;
+	s->ctrl_socket = -1;
+
+	if (s->fd >= 0 && reink_disconnect(s) < 0)
+		ret = -1;
+
+	D(fprintf(stderr, "^^^ reink_close ^^^\n"))
+
+	return ret;
+}
+
+int reink_ping(reink_session_t* s, const char* raw_device, int timeout)
+{
+	int rd_timeout = d4RdTimeout;
+	int wr_timeout = d4WrTimeout;
+	int probe_timeout = d4ProbeTimeout;
+	int device;
+	char payload[2 + REINKD_MAX_PAYLOAD];
+	char reply[1];
+	int reply_len = 1;
+	int ret = -1;
+
+	D(fprintf(stderr, "=== reink_ping ===\n"))
+
+	reink_set_deadline(timeout);
+
+	if (s->fd >= 0 && !s->remote)
+	{
+		//session is opened: the cheapest round trip which changes nothing
+		D(fprintf(stderr, "Pinging opened session... "))
+		if (GetSocketID(s->fd, "EPSON-CTRL") > 0)
+			ret = REINK_ALIVE;
+		else
+			set_error(s, "IEEE 1284.4: \"GetSocketID\" transaction failed.");
+	}
+	else if (s->fd < 0 && s->daemon_socket && !s->capture && !s->replay && !s->faults && strlen(raw_device) <= REINKD_MAX_PAYLOAD && !daemon_connect(s))
+	{
+		//reinkd pings it's session or the device itself
+		D(fprintf(stderr, "Pinging through reinkd... "))
+		payload[0] = (timeout >> 8) & 0xFF;
+		payload[1] = timeout & 0xFF;
+		memcpy(payload + 2, raw_device, strlen(raw_device));
+		if (!daemon_request(s, REINKD_OP_PING, payload, 2 + strlen(raw_device), reply, &reply_len))
+		{
+			if (reply_len == 1 && (reply[0] == REINK_ALIVE || reply[0] == REINK_BUSY))
+				ret = reply[0];
+			else
+				set_error(s, "reinkd: Invalid reply to ping request.");
+		}
+		close(s->fd);
+		s->fd = -1;
+		s->remote = 0;
+	}
+	else if (s->fd < 0)
+	{
+		//only Init and Exit transactions, no channels
+		D(fprintf(stderr, "Pinging device... "))
+		if ((device = open(raw_device, O_RDWR | O_SYNC)) == -1)
+		{
+			if (errno == EBUSY)
+				ret = REINK_BUSY; //i.e. printing by another process
+			else
+				set_error(s, "Error opening device file '%s': %s", raw_device, strerror(errno));
+		}
+		else
+		{
+			//replies are waited up to three times of d4lib timeouts
+			d4ProbeTimeout = timeout / 8;
+			d4RdTimeout = timeout / 4;
+			d4WrTimeout = timeout / 4;
+
+			quickClearSndBuf(device);
+			if (ProbeIEEE(device, 0) <= 0 && (quickClearSndBuf(device), !EnterIEEE(device) || !Init(device)))
+				set_error(s, "Printer doesn't enter IEEE 1284.4 mode.");
+			else if (!Exit(device))
+				set_error(s, "IEEE 1284.4: \"Exit\" transaction failed.");
+			else
+				ret = REINK_ALIVE;
+
+			d4RdTimeout = rd_timeout;
+			d4WrTimeout = wr_timeout;
+			d4ProbeTimeout = probe_timeout;
+			close(device);
+		}
+	}
+	else
+		set_error(s, "Ping is not available through opened reinkd session.");
+
+	if (ret < 0)
+		check_expired(s); //the reason of failure
+	else
+		D(fprintf(stderr, "%s.\n", ret == REINK_ALIVE ? "alive" : "busy"))
+
+	reink_set_deadline(0);
+
+	D(fprintf(stderr, "^^^ reink_ping ^^^\n"))
+	return ret;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+//	PROTOCOL, CHANNEL INITIALIZATION, FINILIZING
+/////////////////////////////////////////////////////////////////////////////////
+//
+
+int reink_connect(reink_session_t* s, const char* raw_device)
+{
+	int device;
+	char id[REINK_BUF_LEN]; //IEEE 1284 device ID
+	char* model;
+	const char* key; //of the printer in s->sockets
+	int probe; //ProbeIEEE result
+	int len;
+	int i;
+
+	D(fprintf(stderr, "=== reink_connect ===\n"));
+
+	//replies of the previous connection may be of another printer
+	s->ident_len = 0;
+	s->status_len = 0;
+	s->sockets_key[0] = '\0';
+	s->device_id[0] = '\0';
+
+	if (s->replay)
+	{
+		//fd is only a handle for d4lib, all the data come from the capture
+		D(fprintf(stderr, "Opening capture to replay... "))
+		device = open("/dev/null", O_RDWR);
+		if (device == -1 || d4Replay(device, s->replay, !s->replay_fast))
+		{
+			set_error(s, "Error opening capture file '%s': %s", s->replay, strerror(errno));
+			if (device != -1)
+				close(device);
+			return -1;
+		}
+		D_OK
+	}
+	else
+	{
+		D(fprintf(stderr, "Opening raw device... "))
+		device = open(raw_device, O_RDWR | O_SYNC);
+		if (device == -1)
+		{
+			set_error(s, "Error opening device file '%s': %s", raw_device, strerror(errno));
+			return -1;
+		}
+		D_OK
+
+		//sockets of services are the same for all the printers of a model,
+		//usblp tells the model without IEEE 1284.4
+		model = NULL;
+		if (ioctl(device, IOC_DEVICE_ID(sizeof(id)), id) == 0)
+		{
+			len = ((unsigned char)id[0] << 8) | (unsigned char)id[1]; //including these two bytes
+			id[len < (int)sizeof(id) ? len : (int)sizeof(id) - 1] = '\0';
+			if (len > 2)
+				model = strstr(id + 2, "MDL:");
+			for (i = 0; len > 2 && id[i + 2] && i < REINK_DEVICE_ID_LEN - 1; i++)
+				s->device_id[i] = isprint((unsigned char)id[i + 2]) ? id[i + 2] : '_';
+			s->device_id[i] = '\0';
+		}
+		key = model ? model : raw_device;
+		for (i = 0; key[i] && (!model || key[i] != ';') && i < REINK_PATH_LEN - 1; i++)
+			s->sockets_key[i] = isprint((unsigned char)key[i]) ? key[i] : '_';
+		s->sockets_key[i] = '\0';
+		D(fprintf(stderr, "Printer is known as '%s' in sockets cache.\n", s->sockets_key))
+
+		if (s->capture && d4Capture(device, s->capture))
+		{
+			set_error(s, "Error creating capture file '%s': %s", s->capture, strerror(errno));
+			close(device);
+			return -1;
+		}
+	}
+
+	if (s->faults && d4Faults(device, s->faults))
+	{
+		set_error(s, "Wrong fault injection rules '%s'.", s->faults);
+		d4Detach(device);
+		close(device);
+		return -1;
+	}
+
+	quickClearSndBuf(device); //if there are some data from previous incoreectly terminated session
+
+	D(fprintf(stderr, "Probing for IEEE 1284.4 mode... "))
+	if ((probe = ProbeIEEE(device, 0)) > 0)
+	{
+		D(fprintf(stderr, "OK, printer is already in packet mode.\n"));
+		D(fprintf(stderr, "^^^ reink_connect ^^^\n"));
+		s->fd = device;
+		return 0;
+	}
+	D(fprintf(stderr, "NO.\n"))
+
+	//only a printer which answered with something else is left in half-open
+	//session, a silent one is just out of packet mode (as reink_close leaves it)
+	if (probe < 0)
+	{
+		D(fprintf(stderr, "Trying to resynchronize half-open IEEE 1284.4 session... "))
+		if (ProbeIEEE(device, 1) > 0)
+		{
+			D_OK
+			D(fprintf(stderr, "^^^ reink_connect ^^^\n"));
+			s->fd = device;
+			return 0;
+		}
+		D(fprintf(stderr, "NO.\n"))
+	}
+
+	quickClearSndBuf(device); //drop probe leftovers
+
+	D(fprintf(stderr, "Entering IEEE 1284.4 mode... "))
+	if (!EnterIEEE(device))
+	{
+		set_error(s, "Can't enter in IEEE 1284.4 mode. Wrong printer device file?");
+		d4Detach(device);
+		close(device);
+		return -1;
+	}
+	D_OK
+
+	D(fprintf(stderr, "Perfoming IEEE 1284.4 Init transaction... "))
+	if (!Init(device))
+	{
+		set_error(s, "IEEE 1284.4: \"Init\" transaction failed.");
+		d4Detach(device);
+		close(device);
+		return -1;
+	}
+	D_OK
+
+	D(fprintf(stderr, "^^^ reink_connect ^^^\n"));
+
+	s->fd = device;
+	return 0;
+}
+
+int reink_disconnect(reink_session_t* s)
+{
+	int ret = 0;
+
+	D(fprintf(stderr, "=== reink_disconnect ===\n"));
+
+	begin_cleanup();
+
+	D(fprintf(stderr, "Perfoming IEEE 1284.4 Exit transaction... "))
+	if (!Exit(s->fd))
+	{
+		set_error(s, "IEEE 1284.4: \"Exit\" transaction failed.");
+		ret = -1;
+	}
+	else
+		D_OK
+
+	if (d4Detach(s->fd) > 0)
+	{
+		set_error(s, "Session differs from the replayed capture (not all of it was used).");
+		ret = -1;
+	}
+
+	D(fprintf(stderr, "Closing raw device... "))
+	if (close(s->fd) == -1)
+	{
+		set_error(s, "Error closing printer device file: %s", strerror(errno));
+		ret = -1;
+	}
+	else
+		D_OK
+	s->fd = -1;
+
+	D(fprintf(stderr, "^^^ reink_disconnect ^^^\n"));
+
+	return ret;
+}
+
+int reink_open_channel(reink_session_t* s, const char* service_name)
+{
+	int socket;
+	int cached; //socket from s->sockets (0 - not known)
+	int max_send_packet = 0x0200; //maximum size of PC to printer packet (this value may be changed by the printer while opening a channel)
+	int max_recv_packet = 0x0200; //maximum size of printer to PC packet (this value may be changed by the printer while opening a channel)
+
+	D(fprintf(stderr, "=== reink_open_channel ===\n"));
+
+	d4LastResult = 0;
+	if ((cached = sockets_lookup(s, service_name)))
+	{
+		D(fprintf(stderr, "Opening IEEE 1284.4 channel %d-%d of \"%s\" service known from cache... ", cached, cached, service_name))
+		if (1 == OpenChannel(s->fd, cached, &max_send_packet, &max_recv_packet))
+		{
+			D_OK
+			D(fprintf(stderr, "^^^ reink_open_channel ^^^\n"));
+			return cached;
+		}
+		if (d4Overloaded())
+		{
+			set_error(s, "IEEE 1284.4: Printer has no resources for channel now, try later.");
+			return -1;
+		}
+		//socket may be of another model or channel is stale, ask the printer
+		D(fprintf(stderr, "FAIL.\n"))
+		max_send_packet = 0x0200;
+		max_recv_packet = 0x0200;
+	}
+
+	D(fprintf(stderr, "Obtaining IEEE 1284.4 socket for \"%s\" service... ", service_name))
+	if (!(socket = GetSocketID(s->fd, service_name)))
+	{
+		if (cached)
+			sockets_store(s, service_name, 0);
+		set_error(s, "IEEE 1284.4: \"GetSocketID\" transaction failed.");
+		return -1;
+	}
+	D(fprintf(stderr, "OK, socket=%d.\n", socket));
+	if (socket != cached)
+		sockets_store(s, service_name, socket);
+
+	D(fprintf(stderr, "Opening IEEE 1284.4 channel %d-%d... ", socket, socket))
+	if (1 != OpenChannel(s->fd, socket, &max_send_packet, &max_recv_packet))
+	{
+		//channel may be left open by previous incorrectly terminated session
+		D(fprintf(stderr, "FAIL, closing stale channel and retrying... "))
+		d4Stats.retries++;
+		CloseChannel(s->fd, socket);
+		max_send_packet = 0x0200;
+		max_recv_packet = 0x0200;
+		if (1 != OpenChannel(s->fd, socket, &max_send_packet, &max_recv_packet))
+		{
+			if (d4Overloaded())
+				set_error(s, "IEEE 1284.4: Printer has no resources for channel now, try later.");
+			else
+				set_error(s, "IEEE 1284.4: \"OpenChannel\" transaction failed.");
+			return -1;
+		}
+	}
+	D_OK
+
+	D(fprintf(stderr, "^^^ reink_open_channel ^^^\n"));
+
+	return socket;
+}
+
+int reink_close_channel(reink_session_t* s, int socket_id)
+{
+	D(fprintf(stderr, "=== reink_close_channel ===\n"));
+
+	begin_cleanup();
+
+	D(fprintf(stderr, "Closing IEEE 1284.4 channel %d-%d... ", socket_id, socket_id))
+	if (1 != CloseChannel(s->fd, socket_id))
+	{
+		set_error(s, "IEEE 1284.4: \"CloseChannel\" transaction failed.");
+		return -1;
+	}
+	D_OK
+
+	D(fprintf(stderr, "^^^ reink_close_channel ^^^\n"));
+
+	return 0;
+}
+
+int reink_transact(reink_session_t* s, int socket_id, const char* buf_send, int send_len, char* buf_recv, int* recv_len)
+{
+	if (check_expired(s) || transact(s, socket_id, buf_send, send_len, buf_recv, recv_len))
+	{
+		check_expired(s); //the reason of failure
+		return -1;
+	}
+
+	return 0;
+}
+
+static int transact(reink_session_t* s, int socket_id, const char* buf_send, int send_len, char* buf_recv, int* recv_len)
+{
+	int credits;	//count of ieee1284.4 credits I have left
+	int peer_credits;	//count of credits printer has left
+	int give_credits = 1; //how many credits to give printer at once
+	int buf_len;	//the length of recieve buffer
+
+	D(fprintf(stderr, "=== reink_transact ===\n"));
+
+	if (s->remote)
+	{
+		//reinkd serves only "EPSON-CTRL" channel, socket_id is ignored
+		if (daemon_request(s, REINKD_OP_TRANSACT, buf_send, send_len, buf_recv, recv_len))
+			return -1;
+		D(fprintf(stderr, "^^^ reink_transact ^^^\n"));
+		return 0;
+	}
+
+	buf_len = *recv_len;
+
+	if (socket_id == s->ctrl_socket)
+		give_credits = REINK_PEER_CREDITS;
+
+	//credits are tracked by d4lib per channel, so usually no credit transactions are needed
+	credits = getCredits(s->fd, socket_id, &peer_credits);
+
+	if (credits < 1)
+	{
+		D(fprintf(stderr, "Requesting some IEEE 1284.4 credits on channel %d-%d... ", socket_id, socket_id))
+		credits = CreditRequest(s->fd, socket_id);
+		if (credits < 1)
+		{
+			set_error(s, "IEEE 1284.4: \"CreditRequest\" transaction failed.");
+			return -1;
+		}
+		D(fprintf(stderr, "OK, got %d credits.\n", credits))
+	}
+
+	D(fprintf(stderr, "Writing data to printer... "))
+	if (writeData(s->fd, socket_id, (const unsigned char*)buf_send, send_len, 0) < send_len)
+	{
+		resetCredits(s->fd, socket_id); //unknown state
+		set_error(s, "IEEE 1284.4: Error sending data to channel %d-%d.", socket_id, socket_id);
+		return -1;
+	}
+	D_OK
+
+	if (peer_credits < 1)
+	{
+		D(fprintf(stderr, "Giving %d IEEE 1284.4 credits to printer... ", give_credits))
+		if (Credit(s->fd, socket_id, give_credits) != 1)
+		{
+			resetCredits(s->fd, socket_id);
+			set_error(s, "IEEE 1284.4: \"Credit\" transaction failed.");
+			return -1;
+		}
+		D_OK
+	}
+
+	D(fprintf(stderr, "Get the answer... "))
+	if ((*recv_len = receiveData(s->fd, socket_id, (unsigned char*)buf_recv, buf_len)) < 0)
+	{
+		resetCredits(s->fd, socket_id);
+		set_error(s, "IEEE 1284.4: Error recieving data from channel %d-%d.", socket_id, socket_id);
+		return -1;
+	}
+	D_OK
+
+	D(fprintf(stderr, "^^^ reink_transact ^^^\n"));
+
+	return 0;
+}
+
+int reink_recover_channel(reink_session_t* s)
+{
+	int max_send_packet = 0x0200; //needed by askForCredit to reopen the channel
+	int max_recv_packet = 0x0200;
+
+	if (s->remote)
+		return 0; //reinkd recovers it's channel itself
+
+	quickClearSndBuf(s->fd); //drop late reply to the failed command
+	resetCredits(s->fd, s->ctrl_socket); //channel may be reopened
+	if (askForCredit(s->fd, s->ctrl_socket, &max_send_packet, &max_recv_packet) < 1)
+	{
+		set_error(s, "IEEE 1284.4: Can't recover channel %d-%d.", s->ctrl_socket, s->ctrl_socket);
+		return -1;
+	}
+	dropQueued(s->fd, s->ctrl_socket); //late replies came meanwhile
+
+	return 0;
+}
+
+int reink_send(reink_session_t* s, int socket_id, const char* buf, int len)
+{
+	int packet_len;	//max payload of one packet
+	int chunk;		//bytes sent in current packet
+	int peer_credits;
+	int sent = 0;
+	int wait = 0;	//how many times printer granted no credits in a row
+
+	D(fprintf(stderr, "=== reink_send ===\n"));
+
+	if (s->remote)
+	{
+		set_error(s, "Sending data is not available through reinkd.");
+		return -1;
+	}
+
+	packet_len = getPacketSize(s->fd, socket_id);
+	if (packet_len <= 6)
+		packet_len = 0x0200;
+	packet_len -= 6; //IEEE 1284.4 header
+
+	while (sent < len)
+	{
+		if (check_expired(s))
+			return -1;
+
+		if (getCredits(s->fd, socket_id, &peer_credits) < 1)
+		{
+			D(fprintf(stderr, "Requesting some IEEE 1284.4 credits on channel %d-%d... ", socket_id, socket_id))
+			if (CreditRequest(s->fd, socket_id) < 1)
+			{
+				//printer is busy (i.e. printing), try a bit later
+				if (++wait > REINK_SEND_WAITS)
+				{
+					set_error(s, "IEEE 1284.4: Printer gives no credits on channel %d-%d.", socket_id, socket_id);
+					return -1;
+				}
+				D(fprintf(stderr, "no credits, waiting.\n"))
+				usleep(REINK_SEND_WAIT_MS * 1000);
+				continue;
+			}
+			D_OK
+			wait = 0;
+		}
+
+		chunk = len - sent;
+		if (chunk > packet_len)
+			chunk = packet_len;
+
+		if (writeData(s->fd, socket_id, (const unsigned char*)buf + sent, chunk, 0) < chunk)
+		{
+			resetCredits(s->fd, socket_id);
+			set_error(s, "IEEE 1284.4: Error sending data to channel %d-%d.", socket_id, socket_id);
+			return -1;
+		}
+		sent += chunk;
+	}
+
+	D(fprintf(stderr, "^^^ reink_send ^^^\n"));
+
+	return 0;
+}
+
+int reink_services(reink_session_t* s, reink_service_t* services, int max)
+{
+	static const char* known[] = { "EPSON-CTRL", "EPSON-DATA", NULL }; //asked by name too
+	d4Service_t found[D4_SOCKETS];
+	int count;
+	int i;
+
+	D(fprintf(stderr, "=== reink_services ===\n"));
+
+	if (s->remote)
+	{
+		set_error(s, "Services can't be discovered through reinkd.");
+		return -1;
+	}
+
+	D(fprintf(stderr, "Discovering IEEE 1284.4 services... "))
+	if ((count = d4Discover(s->fd, known, found, D4_SOCKETS, REINK_DISCOVER_WINDOW)) < 0)
+	{
+		set_error(s, "IEEE 1284.4: Service discovery failed.");
+		check_expired(s);
+		return -1;
+	}
+	D(fprintf(stderr, "OK, %d found.\n", count))
+
+	for (i = 0; i < count; i++)
+	{
+		if (sockets_lookup(s, found[i].name) != found[i].socketID)
+			sockets_store(s, found[i].name, found[i].socketID);
+		if (i < max)
+		{
+			services[i].socket = found[i].socketID;
+			snprintf(services[i].name, sizeof(services[i].name), "%s", found[i].name);
+		}
+	}
+
+	D(fprintf(stderr, "^^^ reink_services ^^^\n"));
+
+	return count < max ? count : max;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+//	INFORMATION
+/////////////////////////////////////////////////////////////////////////////////
+//
+
+int reink_handshake(reink_session_t* s)
+{
+	int credits = 0;
+	int peer_credits = 0;
+
+	D(fprintf(stderr, "=== reink_handshake ===\n"))
+
+	s->ident_len = 0;
+	s->status_len = 0;
+
+	if (!s->remote)
+	{
+		//two commands to send: ask for credits if printer didn't give enough yet
+		if ((credits = getCredits(s->fd, s->ctrl_socket, &peer_credits)) < 2)
+		{
+			D(fprintf(stderr, "Requesting some IEEE 1284.4 credits on channel %d-%d... ", s->ctrl_socket, s->ctrl_socket))
+			if (CreditRequest(s->fd, s->ctrl_socket) < 1)
+			{
+				set_error(s, "IEEE 1284.4: \"CreditRequest\" transaction failed.");
+				return -1;
+			}
+			D_OK
+			credits = getCredits(s->fd, s->ctrl_socket, &peer_credits);
+		}
+	}
+
+	if (s->remote || credits < 2)
+	{
+		D(fprintf(stderr, "Executing \"di\" and \"st\" commands one by one... "))
+		s->ident_len = REINK_BUF_LEN;
+		s->status_len = REINK_BUF_LEN;
+		if (reink_transact(s, s->ctrl_socket, "di\1\0\1", 5, s->ident, &s->ident_len)
+			|| reink_transact(s, s->ctrl_socket, "st\1\0\1", 5, s->status, &s->status_len))
+		{
+			s->ident_len = 0;
+			s->status_len = 0;
+			return -1;
+		}
+		D_OK
+	}
+	else
+	{
+		D(fprintf(stderr, "Executing \"di\" and \"st\" commands at once... "))
+		if (check_expired(s))
+			return -1;
+		//credits for replies go in the header of the first command, not in Credit
+		//transaction: it would cost a round trip and printer may ignore the second
+		//command while it holds the first reply for credit
+		if (writeDataCredit(s->fd, s->ctrl_socket, (const unsigned char*)"di\1\0\1", 5, 0, peer_credits < 2 ? REINK_PEER_CREDITS : 0) < 5
+			|| writeData(s->fd, s->ctrl_socket, (const unsigned char*)"st\1\0\1", 5, 0) < 5)
+		{
+			resetCredits(s->fd, s->ctrl_socket); //unknown state
+			set_error(s, "IEEE 1284.4: Error sending data to channel %d-%d.", s->ctrl_socket, s->ctrl_socket);
+			check_expired(s);
+			return -1;
+		}
+
+		//replies come in order of commands
+		if ((s->ident_len = receiveData(s->fd, s->ctrl_socket, (unsigned char*)s->ident, REINK_BUF_LEN)) < 0
+			|| (s->status_len = receiveData(s->fd, s->ctrl_socket, (unsigned char*)s->status, REINK_BUF_LEN)) < 0)
+		{
+			s->ident_len = 0;
+			s->status_len = 0;
+			resetCredits(s->fd, s->ctrl_socket);
+			set_error(s, "IEEE 1284.4: Error recieving data from channel %d-%d.", s->ctrl_socket, s->ctrl_socket);
+			check_expired(s);
+			return -1;
+		}
+		D_OK
+	}
+	gettimeofday(&s->status_time, NULL);
+
+	D(fprintf(stderr, "^^^ reink_handshake ^^^\n"))
+	return 0;
+}
+
+int reink_identify(reink_session_t* s)
+{
+	unsigned int i;
+
+	char strModel[MAX_MODEL_LEN];
+
+	int model = PM_UNKNOWN;
+
+	D(fprintf(stderr, "=== reink_identify ===\n"))
+
+	if (!s->ident_len && reink_handshake(s))
+		return -1;
+
+	D(fprintf(stderr, "Parsing \"di\" reply... "))
+	if (get_tag(s, s->ident, s->ident_len, "MDL:", strModel, MAX_MODEL_LEN))
+	{
+		set_error(s, "Can't find printer model in printer answer.");
+		return -1;
+	}
+	D_OK
+
+	for(i = 0; i < printers_count; i++)
+	{
+		if (!strcmp(strModel, (const char*)printers[i].model_name))
+		{
+			D(fprintf(stderr, "Printer \"%s\".\n", printers[i].name));
+			model = i;
+			break;
+		}
+	}
+
+	D(fprintf(stderr, "^^^ reink_identify ^^^\n"))
+	return model;
+}
+
+int reink_ink_levels(reink_session_t* s, reink_ink_levels_t* levels)
+{
+	char buf[REINK_BUF_LEN]; //buffer for input data
+	int readed; //number of readed bytes
+	struct timeval now;
+
+	D(fprintf(stderr, "=== reink_ink_levels ===\n"))
+
+	gettimeofday(&now, NULL);
+	if (s->status_len > 0 && (now.tv_sec - s->status_time.tv_sec) * 1000L
+		+ (now.tv_usec - s->status_time.tv_usec) / 1000 <= REINK_STATUS_AGE)
+	{
+		D(fprintf(stderr, "Using \"st\" reply of handshake.\n"))
+		if (reink_parse_ink_levels(s, s->status, s->status_len, levels))
+			return -1;
+		D(fprintf(stderr, "^^^ reink_ink_levels ^^^\n"))
+		return 0;
+	}
+
+	D(fprintf(stderr, "Let's get ink level. Executing \"st\" command... "))
+	readed = REINK_BUF_LEN;
+	if (reink_transact(s, s->ctrl_socket, "st\1\0\1", 5, buf, &readed))
+		return -1;
+	D_OK
+
+	if (reink_parse_ink_levels(s, buf, readed, levels))
+		return -1;
+
+	D(fprintf(stderr, "^^^ reink_ink_levels ^^^\n"))
+	return 0;
+}
+
+int reink_parse_ink_levels(reink_session_t* s, const char* buf, int len, reink_ink_levels_t* levels)
+{
+	char ink_info[REINK_MAX_INKS * 2 + 1];
+	char ink_val[3];
+	int i;
+
+	D(fprintf(stderr, "=== reink_parse_ink_levels ===\n"))
+
+	D(fprintf(stderr, "Getting the \"IQ:\" tag... "));
+	if (get_tag(s, buf, len, "IQ:", ink_info, sizeof(ink_info)))
+	{
+		set_error(s, "Can't find ink levels information in printer answer.");
+		return -1;
+	}
+	D(fprintf(stderr, "OK, have string \"%s\".\n", ink_info));
+
+	if ((strlen(ink_info)) % 2 != 0)
+	{
+		set_error(s, "Malformed output in printer answer.");
+		return -1;
+	}
+
+	ink_val[2] = '\0';
+	levels->count = strlen(ink_info) / 2;
+	for (i = 0; i < levels->count; i++)
+	{
+		strncpy(ink_val, ink_info + i * 2, 2);
+		levels->level[i] = strtol(ink_val, NULL, 16);
+	}
+
+	D(fprintf(stderr, "^^^ reink_parse_ink_levels ^^^\n"))
+
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+//	HELPERS
+/////////////////////////////////////////////////////////////////////////////////
+//
+
+void reink_set_deadline(int ms)
+{
+	d4SetDeadline(ms);
+}
+
+void reink_cancel()
+{
+	d4Cancel();
+}
+
+int reink_expired()
+{
+	return d4Expired();
+}
+
+static int check_expired(reink_session_t* s)
+{
+	if (!d4Expired())
+		return 0;
+
+	set_error(s, "Operation is cancelled or its deadline has expired.");
+	return 1;
+}
+
+static void begin_cleanup()
+{
+	if (d4Expired())
+		d4SetCleanupDeadline(REINK_CLOSE_TIMEOUT);
+}
+
+static void set_error(reink_session_t* s, const char* format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	vsnprintf(s->error, REINK_ERROR_LEN, format, ap);
+	va_end(ap);
+
+	D(fprintf(stderr, "%s\n", s->error))
+}
+
+int reink_get_tag(const char* source, int source_len, const char* tag, char* value, int max_value_len)
+{
+	return get_tag(NULL, source, source_len, tag, value, max_value_len);
+}
+
+static int get_tag(reink_session_t* s, const char* source, int source_len, const char* tag, char* value, int max_value_len)
+{
+	int tag_len;
+	int pos;
+	int pos_end;
+	int val_len;
+
+	D(fprintf(stderr, "=== get_tag ===\n"))
+
+	D(fprintf(stderr, "Searching for \"%s\" substring... ", tag));
+
+	tag_len = strlen(tag);
+	pos = 0;
+	while ((pos + tag_len < source_len) &&  (0 != strncmp(source+pos, tag, tag_len)))
+		pos++;
+
+	if (pos + tag_len >= source_len)
+	{
+		D(fprintf(stderr, "NOT FOUND.\n"));
+		return -1;
+	}
+
+	D(fprintf(stderr, "FOUND, pos=%d.\n", pos));
+
+	pos += tag_len;
+
+	D(fprintf(stderr, "Searching for \";\" character... "));
+	pos_end = pos;
+	while ((pos_end < source_len) && (source[pos_end] != ';'))
+		pos_end++;
+	if (pos_end  == source_len)
+	{
+		D(fprintf(stderr, "NOT FOUND.\n"));
+		return -1;
+	}
+	D(fprintf(stderr, "FOUND, pos_end=%d.\n", pos_end));
+
+	val_len = pos_end - pos;
+	if (val_len+1 > max_value_len)
+	{
+		D(fprintf(stderr, "Value(+'\\0') too long (%d) for given buffer (%d).\n", val_len+1, max_value_len));
+		return 1;
+	}
+
+	memcpy(value, source + pos, val_len);
+	value[val_len] = '\0';
+	D(fprintf(stderr, "Tag value:\"%s\".\n", value));
+
+	D(fprintf(stderr, "^^^ get_tag ^^^\n"))
+
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+//	EPSON FACTORY COMMANDS
+/////////////////////////////////////////////////////////////////////////////////
+
+static void init_command(fcmd_header_t* cmd, const printer_t* printer, unsigned char class, unsigned char name, unsigned short int extra_length)
+{
+	unsigned short int full_length;
+
+	full_length = 5 + extra_length;
+
+	cmd->cls1 = class;
+	cmd->cls2 = class;
+
+	cmd->lenL = full_length & 0xFF;
+	cmd->lenH = (full_length >> 8) & 0xFF;
+
+	cmd->cmd = name;
+	cmd->cmd1 = ~name;
+	cmd->cmd2 = ((name >> 1) & 0x7F) | ((name << 7) & 0x80); //round shift by one bit to the right
+
+	cmd->mcode1 = printer->model_code[0];
+	cmd->mcode2 = printer->model_code[1];
+}
+
+static int read_command(reink_session_t* s, unsigned short int addr, char* cmd)
+{
+	int cmd_len = 10; //length of the command
+	int cmd_args_count = 1; //command arguments count
+
+	cmd[9] = addr & 0xFF;
+	if (s->printer.twobyte_addresses)
+	{
+		cmd[10] = (addr >> 8) & 0xFF;
+		cmd_len = 11;
+		cmd_args_count = 2;
+	}
+	else
+	{
+		if ((addr >> 8) != 0)
+			D(fprintf(stderr, "Printer \"%s\" don't support two-byte addresses. Continuing using low byte only.\n", s->printer.name));
+	}
+
+	init_command((fcmd_header_t*)cmd, &s->printer, EFCLS_EEPROM_READ, EFCMD_EEPROM_READ, cmd_args_count);
+
+	return cmd_len;
+}
+
+static int parse_read_reply(reink_session_t* s, unsigned short int addr, const char* reply, int actual, unsigned char* data, unsigned short int* reply_addr, int* reply_twobyte)
+{
+	char reply_data[7]; // buffer for "EE" tag (contains readed byte)
+	int reply_data_len = 4; //expected reply_data length
+
+	char onebyte[5]; //contains one or two HEX byte string ("B2\0" for example)
+
+	if (s->printer.twobyte_addresses)
+		reply_data_len = 6;
+
+	if (get_tag(s, reply, actual, "EE:", reply_data, 7))
+	{
+		set_error(s, "Can't get EEPROM data from printer reply for address %#x.", addr);
+		return -1;
+	}
+
+	if (strlen(reply_data) != reply_data_len)
+	{
+		D(fprintf(stderr, "ReplyData length != %d\n", reply_data_len))
+		reply_data_len -= 2; //assuming this is one-byte addresses printer
+		if (strlen(reply_data) == reply_data_len)
+		{
+			D(fprintf(stderr, "Seems like printer with one-byte addresses EEPROM.\n"))
+		}
+		else
+		{
+			set_error(s, "Malformed EEPROM data in printer reply for address %#x.", addr);
+			return -1;
+		}
+	}
+	*reply_twobyte = (reply_data_len == 6);
+
+	strncpy(onebyte, reply_data, reply_data_len - 2);
+	onebyte[reply_data_len - 2] = '\0';
+	*reply_addr = strtol(onebyte, NULL, 16);
+
+	strncpy(onebyte, reply_data + reply_data_len - 2, 2); //the data itself
+	onebyte[2] = '\0';
+	*data = strtol(onebyte, NULL, 16);
+
+	D(fprintf(stderr, "EEPROM addr %#x = %#x.\n", *reply_addr, *data))
+
+	return 0;
+}
+
+int reink_read_eeprom_reply(reink_session_t* s, unsigned short int addr, unsigned char* data, unsigned short int* reply_addr, int* reply_twobyte)
+{
+	char cmd[11]; // full command with address
+	int cmd_len; //length of the command
+
+	char reply[REINK_BUF_LEN]; // buffer for printer reply
+	int actual; // actual reply length
+
+	D(fprintf(stderr, "=== reink_read_eeprom_reply ===\n"))
+
+	if (!s->printer.twobyte_addresses)
+		addr = addr & 0xFF;
+	cmd_len = read_command(s, addr, cmd);
+
+	D(fprintf(stderr, "Reading eeprom address %#x... ", addr))
+	actual = REINK_BUF_LEN;
+	if (reink_transact(s, s->ctrl_socket, cmd, cmd_len, reply, &actual))
+		return -1;
+
+	if (parse_read_reply(s, addr, reply, actual, data, reply_addr, reply_twobyte))
+		return -1;
+
+	D(fprintf(stderr, "^^^ reink_read_eeprom_reply ^^^\n"))
+
+	return 0;
+}
+
+int reink_read_eeprom(reink_session_t* s, unsigned short int addr, unsigned char* data)
+{
+	unsigned short int replyaddr; //reply address (for confirmation)
+	int twobyte; //reply address length
+
+	D(fprintf(stderr, "=== reink_read_eeprom ===\n"))
+
+	if (!s->printer.twobyte_addresses)
+		addr = addr & 0xFF;
+
+	if (reink_read_eeprom_reply(s, addr, data, &replyaddr, &twobyte))
+		return -1;
+
+	if (replyaddr != addr)
+	{
+		set_error(s, "Reply address (%x) don't match requested (%x).", replyaddr, addr);
+		return -1;
+	}
+
+	D(fprintf(stderr, "^^^ reink_read_eeprom ^^^\n"))
+
+	return 0;
+}
+
+int reink_read_eeprom_retry(reink_session_t* s, unsigned short int addr, unsigned char* data)
+{
+	int retry;
+
+	for (retry = 0; retry <= REINK_READ_RETRIES && !reink_expired(); retry++)
+	{
+		if (retry)
+		{
+			D(fprintf(stderr, "Retrying to read eeprom address %#x (%d of %d)...\n", addr, retry, REINK_READ_RETRIES))
+			d4Stats.retries++;
+			if (reink_recover_channel(s))
+				continue;
+		}
+
+		if (!reink_read_eeprom(s, addr, data))
+			return 0;
+	}
+
+	return -1;
+}
+
+int reink_probe_eeprom(reink_session_t* s)
+{
+	unsigned char head[PROBE_SCAN_MAX]; //the beginning of EEPROM
+	int known = 0; //bytes of head read
+	int sig_at = -1; //offset of not blank signature in head
+	unsigned char data; //one byte from eeprom
+	unsigned short int replyaddr; //address printer replied for
+	int twobyte; //printer replied with two-byte address?
+	int addr_bits; //address width in bits
+	int bits; //current power of two
+	int mirror;
+
+	D(fprintf(stderr, "=== reink_probe_eeprom ===\n"))
+
+	s->probe_blank = 0;
+
+	//two-byte read command is answered with one-byte address by one-byte printers
+	D(fprintf(stderr, "Detecting EEPROM address width... "))
+	s->printer.twobyte_addresses = 1;
+	if (reink_read_eeprom_reply(s, 0x00, &data, &replyaddr, &twobyte) || replyaddr != 0)
+	{
+		set_error(s, "Can't read EEPROM address 0.");
+		return -1;
+	}
+	s->printer.twobyte_addresses = twobyte;
+	addr_bits = twobyte ? 16 : 8;
+	D(fprintf(stderr, "%d bits.\n", addr_bits))
+
+	D(fprintf(stderr, "Detecting EEPROM size... "))
+	for (bits = PROBE_MIN_BITS; bits < addr_bits; bits++)
+	{
+		//printer refuses address or replies for the wrapped one,
+		//but a failed read may be just a lost reply
+		if (reink_read_eeprom_reply(s, 1 << bits, &data, &replyaddr, &twobyte))
+		{
+			if (reink_read_eeprom_retry(s, 1 << bits, &data))
+			{
+				if (check_expired(s))
+					return -1;
+				break;
+			}
+		}
+		else if (replyaddr != (1 << bits))
+			break;
+
+		//contents mirror the beginning of EEPROM, blank areas mirror each other anyway
+		if (probe_signature(s, 1 << bits, head, &known, &sig_at))
+			return -1;
+		if ((mirror = probe_mirror(s, (1 << bits) + (sig_at < 0 ? 0 : sig_at), head + (sig_at < 0 ? 0 : sig_at))) < 0)
+			return -1;
+		if (sig_at >= 0)
+		{
+			if (mirror)
+				break;
+			s->probe_blank = 0; //EEPROM is bigger than any blank mirror seen
+		}
+		else if (mirror)
+		{
+			D(fprintf(stderr, "blank area at %#x mirrors the beginning, ignored... ", 1 << bits))
+			s->probe_blank = 1;
+		}
+	}
+	if (bits < addr_bits)
+		s->probe_blank = 0; //the end is found anyway
+	s->printer.eeprom_size = 1 << bits;
+	D(fprintf(stderr, "%#x bytes.\n", s->printer.eeprom_size))
+
+	D(fprintf(stderr, "^^^ reink_probe_eeprom ^^^\n"))
+
+	return 0;
+}
+
+static int probe_signature(reink_session_t* s, int limit, unsigned char* head, int* known, int* sig_at)
+{
+	unsigned short int addrs[PROBE_SCAN_MAX];
+	int o;
+	int i;
+
+	if (*sig_at >= 0)
+		return 0;
+
+	if (limit > PROBE_SCAN_MAX)
+		limit = PROBE_SCAN_MAX;
+	if (*known < limit)
+	{
+		for (i = *known; i < limit; i++)
+			addrs[i - *known] = i;
+		if (reink_read_eeprom_batch(s, addrs, limit - *known, head + *known))
+			return -1;
+		*known = limit;
+	}
+
+	for (o = 0; o + PROBE_SIG_LEN <= *known; o++)
+	{
+		for (i = 1; i < PROBE_SIG_LEN && head[o + i] == head[o]; i++)
+			;
+		if (i < PROBE_SIG_LEN)
+		{
+			*sig_at = o;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static int probe_mirror(reink_session_t* s, unsigned short int addr, const unsigned char* sig)
+{
+	unsigned short int addrs[PROBE_SIG_LEN];
+	unsigned char data[PROBE_SIG_LEN];
+	int i;
+
+	for (i = 0; i < PROBE_SIG_LEN; i++)
+		addrs[i] = addr + i;
+	if (reink_read_eeprom_batch(s, addrs, PROBE_SIG_LEN, data))
+		return -1;
+
+	return !memcmp(data, sig, PROBE_SIG_LEN);
+}
+
+static int write_command(reink_session_t* s, unsigned short int addr, unsigned char data, char* cmd)
+{
+	int cmd_len = 11; // full length of the command
+	int cmd_args_len = 2; // command arguments count
+
+	cmd[9] = addr & 0xFF;
+	if (s->printer.twobyte_addresses)
+	{
+		cmd[10] = (addr >> 8) & 0xFF;
+		cmd[11] = (char)data;
+		cmd_len = 12;
+		cmd_args_len = 3;
+	}
+	else
+	{
+		cmd[10] = (char)data;
+
+		if ((addr >> 8) != 0)
+			D(fprintf(stderr, "Printer \"%s\" don't support two-byte addresses. Continuing using low byte only.\n", s->printer.name));
+	}
+
+	init_command((fcmd_header_t*)cmd, &s->printer, EFCLS_EEPROM_WRITE, EFCMD_EEPROM_WRITE, cmd_args_len);
+
+	return cmd_len;
+}
+
+static int check_write_reply(reink_session_t* s, unsigned short int addr, const char* reply, int actual)
+{
+	char reply_data[6]; // buffer for "OK" tag
+
+	if (get_tag(s, reply, actual, "OK", reply_data, 6))
+	{
+		set_error(s, "Printer didn't confirm write to EEPROM address %#x.", addr);
+		return -1;
+	}
+
+	return 0;
+}
+
+int reink_write_eeprom(reink_session_t* s, unsigned short int addr, unsigned char data)
+{
+	char cmd[12]; // full command with address
+	int cmd_len; // full length of the command
+
+	char reply[REINK_BUF_LEN]; // buffer for printer reply
+	int actual; // actual reply length
+
+	D(fprintf(stderr, "=== reink_write_eeprom ===\n"))
+
+	if (s->journal_block[0])
+	{
+		set_error(s, "%s", s->journal_block);
+		return -1;
+	}
+
+	s->status_len = 0; //ink levels may change
+
+	cmd_len = write_command(s, addr, data, cmd);
+
+	D(fprintf(stderr, "Writing %#x to eeprom address %#x... ", data, addr))
+	actual = REINK_BUF_LEN;
+	if (reink_transact(s, s->ctrl_socket, cmd, cmd_len, reply, &actual))
+		return -1;
+
+	if (check_write_reply(s, addr, reply, actual))
+		return -1;
+	D_OK
+
+	D(fprintf(stderr, "^^^ reink_write_eeprom ^^^\n"))
+
+	return 0;
+}
+
+static void frames_prepare(reink_session_t* s)
+{
+	char cmd[REINK_FRAME_LEN - 6];
+	int write;
+	int len;
+
+	if (s->frames_len[0] && s->frames_key[0] == s->ctrl_socket && s->frames_key[1] == s->printer.model_code[0]
+		&& s->frames_key[2] == s->printer.model_code[1] && s->frames_key[3] == s->printer.twobyte_addresses)
+		return;
+
+	for (write = 0; write < 2; write++)
+	{
+		len = write ? write_command(s, 0, 0, cmd) : read_command(s, 0, cmd);
+		s->frames[write][0] = s->ctrl_socket;
+		s->frames[write][1] = s->ctrl_socket;
+		s->frames[write][2] = ((6 + len) >> 8) & 0xFF;
+		s->frames[write][3] = (6 + len) & 0xFF;
+		s->frames[write][4] = 0; //credit
+		s->frames[write][5] = 0; //control
+		memcpy(s->frames[write] + 6, cmd, len);
+		s->frames_len[write] = 6 + len;
+	}
+
+	s->frames_key[0] = s->ctrl_socket;
+	s->frames_key[1] = s->printer.model_code[0];
+	s->frames_key[2] = s->printer.model_code[1];
+	s->frames_key[3] = s->printer.twobyte_addresses;
+}
+
+static int frame_command(reink_session_t* s, int write, unsigned short int addr, unsigned char data, unsigned char* packet)
+{
+	int len = s->frames_len[write];
+
+	memcpy(packet, s->frames[write], len);
+	packet[FRAME_ADDR] = addr & 0xFF;
+	if (s->printer.twobyte_addresses)
+		packet[FRAME_ADDR + 1] = (addr >> 8) & 0xFF;
+	if (write)
+		packet[len - 1] = data;
+
+	return len;
+}
+
+static int pipeline(reink_session_t* s, const unsigned short int* addrs, unsigned char* data, int count, int write, int* done)
+{
+	unsigned char out[REINK_PIPELINE_DEPTH * REINK_FRAME_LEN]; //packets sent by one write
+	int out_len;
+	int queued; //packets in out
+	int given; //credits given to printer in out
+	char reply[REINK_BUF_LEN]; //current reply
+	int actual;
+	unsigned short int reply_addr; //address printer replied for
+	int twobyte;
+	unsigned short int addr;
+	int peer_credits;
+	int sent = *done; //commands sent, replies are awaited for sent - *done of them
+	struct timeval sent_at[REINK_PIPELINE_DEPTH]; //when command <n> was sent, at n % REINK_PIPELINE_DEPTH
+	struct timeval now;
+	long rtt;
+	int acked = 0; //replies since the window was changed
+	int cut = *done; //window isn't halved again for commands sent before it was halved
+
+	if (s->window < 1)
+		s->window = REINK_PIPELINE_START;
+	frames_prepare(s);
+
+	while (*done < count)
+	{
+		//keep the pipeline full as far as credits allow, all the new commands go by one write
+		out_len = 0;
+		queued = 0;
+		given = 0;
+		while (sent < count && sent - *done < s->window)
+		{
+			if (check_expired(s))
+				return -1;
+
+			if (getCredits(s->fd, s->ctrl_socket, &peer_credits) - queued < 1)
+			{
+				if (sent > *done)
+					break; //printer may give credits back with replies
+				D(fprintf(stderr, "Requesting some IEEE 1284.4 credits on channel %d-%d... ", s->ctrl_socket, s->ctrl_socket))
+				if (CreditRequest(s->fd, s->ctrl_socket) < 1)
+				{
+					set_error(s, "IEEE 1284.4: \"CreditRequest\" transaction failed.");
+					return -1;
+				}
+				D_OK
+			}
+
+			addr = s->printer.twobyte_addresses ? addrs[sent] : addrs[sent] & 0xFF;
+			frame_command(s, write, addr, write ? data[sent] : 0, out + out_len);
+			if (peer_credits + given <= sent - *done)
+			{
+				//credit for replies goes in the packet header, not by Credit transaction
+				D(fprintf(stderr, "Giving %d IEEE 1284.4 credits to printer with command.\n", REINK_PEER_CREDITS))
+				out[out_len + 4] = REINK_PEER_CREDITS;
+				given += REINK_PEER_CREDITS;
+			}
+			out_len += s->frames_len[write];
+			sent++;
+			queued++;
+		}
+
+		if (queued)
+		{
+			if (writePackets(s->fd, out, out_len) < out_len)
+			{
+				set_error(s, "IEEE 1284.4: Error sending data to channel %d-%d.", s->ctrl_socket, s->ctrl_socket);
+				return -1;
+			}
+			gettimeofday(&now, NULL);
+			for (; queued > 0; queued--)
+				sent_at[(sent - queued) % REINK_PIPELINE_DEPTH] = now;
+		}
+
+		//replies come in order of commands
+		if ((actual = receiveData(s->fd, s->ctrl_socket, (unsigned char*)reply, REINK_BUF_LEN)) < 0)
+		{
+			set_error(s, "IEEE 1284.4: Error recieving data from channel %d-%d.", s->ctrl_socket, s->ctrl_socket);
+			return -1;
+		}
+
+		addr = s->printer.twobyte_addresses ? addrs[*done] : addrs[*done] & 0xFF;
+		if (write)
+		{
+			if (check_write_reply(s, addr, reply, actual))
+				return -1;
+		}
+		else
+		{
+			if (parse_read_reply(s, addr, reply, actual, &data[*done], &reply_addr, &twobyte))
+				return -1;
+			if (reply_addr != addr)
+			{
+				set_error(s, "Reply address (%x) don't match requested (%x).", reply_addr, addr);
+				return -1;
+			}
+		}
+
+		//additive increase while replies are quick, multiplicative decrease when they queue up
+		gettimeofday(&now, NULL);
+		rtt = (now.tv_sec - sent_at[*done % REINK_PIPELINE_DEPTH].tv_sec) * 1000000L
+			+ now.tv_usec - sent_at[*done % REINK_PIPELINE_DEPTH].tv_usec;
+		if (s->min_rtt <= 0 || rtt < s->min_rtt)
+			s->min_rtt = rtt;
+		if (rtt > REINK_PIPELINE_SLOW * s->min_rtt && *done >= cut && s->window > 1)
+		{
+			s->window /= 2;
+			acked = 0;
+			cut = sent;
+			D(fprintf(stderr, "Reply took %ld us, pipeline window is %d.\n", rtt, s->window))
+		}
+		else if (++acked >= s->window && s->window < REINK_PIPELINE_DEPTH)
+		{
+			s->window++;
+			acked = 0;
+		}
+		(*done)++;
+	}
+
+	return 0;
+}
+
+static int batch(reink_session_t* s, const unsigned short int* addrs, unsigned char* data, int count, int write)
+{
+	int done = 0; //items with reply
+	int retry;
+
+	for (retry = 0; !s->remote && retry <= REINK_READ_RETRIES; retry++)
+	{
+		if (!pipeline(s, addrs, data, count, write, &done))
+			return 0;
+
+		//continue from the first item without reply, after the late replies are dropped
+		D(fprintf(stderr, "Pipeline failed at item %d of %d: %s\n", done, count, s->error))
+		s->window = s->window > 1 ? s->window / 2 : 1;
+		if (check_expired(s))
+			return -1;
+		d4Stats.retries++;
+		if (reink_recover_channel(s))
+			return -1;
+	}
+
+	//printer doesn't keep up with pipeline, the rest one by one
+	for (; done < count; done++)
+	{
+		if (write ? reink_write_eeprom(s, addrs[done], data[done]) : reink_read_eeprom_retry(s, addrs[done], &data[done]))
+			return -1;
+	}
+
+	return 0;
+}
+
+int reink_read_eeprom_batch(reink_session_t* s, const unsigned short int* addrs, int count, unsigned char* data)
+{
+	int ret;
+
+	D(fprintf(stderr, "=== reink_read_eeprom_batch ===\n"))
+	ret = batch(s, addrs, data, count, 0);
+	D(fprintf(stderr, "^^^ reink_read_eeprom_batch ^^^\n"))
+
+	return ret;
+}
+
+int reink_write_eeprom_batch(reink_session_t* s, const unsigned short int* addrs, const unsigned char* data, int count)
+{
+	unsigned char* original = NULL; //bytes before the batch
+	int ret = -1;
+
+	D(fprintf(stderr, "=== reink_write_eeprom_batch ===\n"))
+
+	if (s->journal_block[0])
+	{
+		set_error(s, "%s", s->journal_block);
+		return -1;
+	}
+
+	s->status_len = 0; //ink levels may change
+
+	if (s->journal_file[0])
+	{
+		if (!(original = malloc(count)))
+		{
+			set_error(s, "Not enough memory.");
+			return -1;
+		}
+		if (batch(s, addrs, original, count, 0) || journal_begin(s, addrs, original, data, count))
+			goto out;
+	}
+
+	if (batch(s, addrs, (unsigned char*)data, count, 1))
+		goto out; //journal is left to complete the batch next time
+
+	if (s->journal_file[0] && journal_end(s))
+		goto out;
+
+	ret = 0;
+
+out:
+	free(original);
+	D(fprintf(stderr, "^^^ reink_write_eeprom_batch ^^^\n"))
+	return ret;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+//	WRITE JOURNAL
+/////////////////////////////////////////////////////////////////////////////////
+//
+
+/*
+    Journal is a text file:
+
+    reink-journal <model code> <printer name>
+    device <IEEE 1284 device ID or "-" if unknown>
+    0x<addr> 0x<original> 0x<data>
+    ...
+
+    It exists only while a batch is being written, so the printer
+    contents are the original bytes, the new ones or their mix.
+    Journal which doesn't match the printer only blocks writes
+    (s->journal_block), as they would replace it.
+*/
+
+static int journal_open(reink_session_t* s, const char* raw_device)
+{
+	char name[REINK_PATH_LEN]; //raw_device as file name
+	char line[REINK_BUF_LEN];
+	char header[REINK_BUF_LEN];
+	char device[REINK_BUF_LEN]; //device line of this printer
+	int left; //space for name in s->journal_file
+	unsigned short int* addrs; //journaled writes
+	unsigned char* original;
+	unsigned char* data;
+	unsigned char* current; //printer contents now
+	unsigned int addr, orig, byte;
+	int count = 0;
+	int pending = 0; //writes not done yet
+	int ret = -1;
+	int i;
+	FILE* f;
+
+	s->journal_file[0] = '\0';
+	s->journal_block[0] = '\0';
+	if (!s->journal[0] || s->replay || s->pm == PM_UNKNOWN)
+		return 0; //nothing to journal or to replay writes on
+
+	//"<journal>/" and "-XXXX.journal" take the rest
+	left = REINK_PATH_LEN - (int)strlen(s->journal) - (int)strlen("/-XXXX.journal");
+	for (i = 0; raw_device[i] && i < left - 1; i++)
+		name[i] = isalnum((unsigned char)raw_device[i]) || raw_device[i] == '.' || raw_device[i] == '-' ? raw_device[i] : '_';
+	name[i] = '\0';
+	if (raw_device[i] || snprintf(s->journal_file, REINK_PATH_LEN, "%s/%s-%02X%02X.journal", s->journal, name, s->printer.model_code[0], s->printer.model_code[1]) >= REINK_PATH_LEN)
+	{
+		//a shortened name may be of another device
+		s->journal_file[0] = '\0';
+		journal_block(s, "Journal path for '%s' in '%s' is too long, writes are refused.", raw_device, s->journal);
+		return 0;
+	}
+
+	if (!(f = fopen(s->journal_file, "r")))
+		return 0; //no interrupted batch
+
+	D(fprintf(stderr, "=== journal_open ===\n"))
+
+	if (!(addrs = malloc(REINK_JOURNAL_MAX * (sizeof(unsigned short int) + 3))))
+	{
+		fclose(f);
+		set_error(s, "Not enough memory.");
+		reink_close(s);
+		return -1;
+	}
+	original = (unsigned char*)(addrs + REINK_JOURNAL_MAX);
+	data = original + REINK_JOURNAL_MAX;
+	current = data + REINK_JOURNAL_MAX;
+
+	snprintf(header, REINK_BUF_LEN, "reink-journal %02X%02X %s\n", s->printer.model_code[0], s->printer.model_code[1], s->printer.name);
+	snprintf(device, REINK_BUF_LEN, "device %s\n", s->device_id[0] ? s->device_id : "-");
+	if (!fgets(line, REINK_BUF_LEN, f) || strcmp(line, header))
+		count = -1;
+	while (count >= 0 && fgets(line, REINK_BUF_LEN, f))
+	{
+		if (count == 0 && !strncmp(line, "device ", 7))
+		{
+			//unknown device ID matches any
+			if (strcmp(line, device) && strcmp(line, "device -\n") && s->device_id[0])
+			{
+				line[strcspn(line, "\n")] = '\0';
+				journal_block(s, "Journal '%s' is of another printer (%s), writes are refused. Remove it to continue.", s->journal_file, line + 7);
+				ret = 0;
+				fclose(f);
+				goto out;
+			}
+			continue;
+		}
+		if (count == REINK_JOURNAL_MAX || sscanf(line, "0x%x 0x%x 0x%x", &addr, &orig, &byte) != 3 || addr > 0xFFFF || orig > 0xFF || byte > 0xFF)
+		{
+			count = -1;
+			break;
+		}
+		addrs[count] = addr;
+		original[count] = orig;
+		data[count] = byte;
+		count++;
+	}
+	fclose(f);
+
+	if (count < 0)
+	{
+		journal_block(s, "Journal '%s' is damaged, writes are refused. Remove it to continue.", s->journal_file);
+		ret = 0;
+		goto out;
+	}
+
+	D(fprintf(stderr, "Journal '%s' has %d writes of interrupted batch, reading them... ", s->journal_file, count))
+	if (batch(s, addrs, current, count, 0))
+		goto out;
+	D_OK
+
+	//every byte must be either written or not yet
+	for (i = 0; i < count; i++)
+	{
+		if (current[i] != data[i] && current[i] != original[i])
+		{
+			journal_block(s, "EEPROM address %#x is %#x, neither %#x nor %#x as journal '%s' expects. Another printer? Writes are refused, remove the journal to continue.",
+				addrs[i], current[i], original[i], data[i], s->journal_file);
+			ret = 0;
+			goto out;
+		}
+		if (current[i] != data[i])
+		{
+			addrs[pending] = addrs[i];
+			data[pending] = data[i];
+			pending++;
+		}
+	}
+
+	D(fprintf(stderr, "Completing the batch: %d writes of %d left... ", pending, count))
+	if (batch(s, addrs, data, pending, 1) || journal_end(s))
+		goto out;
+	D_OK
+
+	ret = 0;
+
+out:
+	free(addrs);
+	if (ret)
+		reink_close(s);
+	D(fprintf(stderr, "^^^ journal_open ^^^\n"))
+	return ret;
+}
+
+static void journal_block(reink_session_t* s, const char* format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	vsnprintf(s->journal_block, REINK_ERROR_LEN, format, ap);
+	va_end(ap);
+
+	D(fprintf(stderr, "%s\n", s->journal_block))
+}
+
+static int journal_begin(reink_session_t* s, const unsigned short int* addrs, const unsigned char* original, const unsigned char* data, int count)
+{
+	char tmp[REINK_PATH_LEN + 4]; //journal is complete once renamed
+	FILE* f;
+	int i;
+	int dir;
+
+	if (count > REINK_JOURNAL_MAX)
+	{
+		set_error(s, "Too many writes for journal (%d, maximum is %d).", count, REINK_JOURNAL_MAX);
+		return -1;
+	}
+
+	if (mkdir(s->journal, 0700) && errno != EEXIST)
+	{
+		set_error(s, "Can't create journal directory '%s': %s", s->journal, strerror(errno));
+		return -1;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", s->journal_file);
+	if (!(f = fopen(tmp, "w")))
+	{
+		set_error(s, "Can't create journal '%s': %s", tmp, strerror(errno));
+		return -1;
+	}
+
+	fprintf(f, "reink-journal %02X%02X %s\n", s->printer.model_code[0], s->printer.model_code[1], s->printer.name);
+	fprintf(f, "device %s\n", s->device_id[0] ? s->device_id : "-");
+	for (i = 0; i < count; i++)
+		fprintf(f, "0x%04X 0x%02X 0x%02X\n", addrs[i], original[i], data[i]);
+
+	if (fflush(f) || fsync(fileno(f)))
+	{
+		set_error(s, "Can't write journal '%s': %s", tmp, strerror(errno));
+		fclose(f);
+		unlink(tmp);
+		return -1;
+	}
+
+	if (fclose(f) || rename(tmp, s->journal_file))
+	{
+		set_error(s, "Can't write journal '%s': %s", s->journal_file, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+
+	//make the rename durable too
+	if ((dir = open(s->journal, O_RDONLY)) >= 0)
+	{
+		fsync(dir);
+		close(dir);
+	}
+
+	return 0;
+}
+
+static int journal_end(reink_session_t* s)
+{
+	if (unlink(s->journal_file))
+	{
+		set_error(s, "Can't remove journal '%s': %s", s->journal_file, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+//	SOCKETS CACHE
+/////////////////////////////////////////////////////////////////////////////////
+//
+/*
+    s->sockets is a text file with a line per service:
+    "<printer>\t<service>\t<socket>\n", where <printer> is s->sockets_key.
+    It is replaced as a whole on change, so it is never seen half
+    written.
+*/
+
+static int sockets_lookup(reink_session_t* s, const char* service_name)
+{
+	char line[REINK_PATH_LEN + REINK_SERVICE_LEN + 8];
+	char* service;
+	char* socket;
+	int found = 0;
+	FILE* f;
+
+	if (!s->sockets[0] || !s->sockets_key[0] || s->capture || s->replay)
+		return 0; //the traffic must be the same every time
+	if (!(f = fopen(s->sockets, "r")))
+		return 0;
+
+	while (!found && fgets(line, sizeof(line), f))
+	{
+		if (!(service = strchr(line, '\t')) || !(socket = strchr(service + 1, '\t')))
+			continue;
+		*service++ = '\0';
+		*socket++ = '\0';
+		if (!strcmp(line, s->sockets_key) && !strcmp(service, service_name))
+			found = strtol(socket, NULL, 10);
+	}
+	fclose(f);
+
+	return found > 0 && found < 0xFF ? found : 0;
+}
+
+static void sockets_store(reink_session_t* s, const char* service_name, int socket)
+{
+	char tmp[REINK_PATH_LEN + 8];
+	char line[REINK_PATH_LEN + REINK_SERVICE_LEN + 8];
+	char* slash;
+	char* tab;
+	FILE* in;
+	FILE* out;
+	int fd;
+
+	if (!s->sockets[0] || !s->sockets_key[0] || s->capture || s->replay || strpbrk(service_name, "\t\n"))
+		return;
+
+	snprintf(tmp, sizeof(tmp), "%s", s->sockets);
+	if ((slash = strrchr(tmp, '/')) && slash != tmp)
+	{
+		*slash = '\0';
+		mkdir(tmp, 0700);
+	}
+
+	//concurrent sessions may store at once: the last one wins
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", s->sockets);
+	if ((fd = mkstemp(tmp)) < 0)
+		return;
+	if (!(out = fdopen(fd, "w")))
+	{
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+
+	if ((in = fopen(s->sockets, "r")))
+	{
+		while (fgets(line, sizeof(line), in))
+		{
+			//lines of other printers and services are kept as they are
+			tab = strchr(line, '\t');
+			if (tab && tab - line == (int)strlen(s->sockets_key) && !strncmp(line, s->sockets_key, tab - line)
+				&& !strncmp(tab + 1, service_name, strlen(service_name)) && tab[1 + strlen(service_name)] == '\t')
+				continue;
+			fputs(line, out);
+		}
+		fclose(in);
+	}
+	if (socket)
+		fprintf(out, "%s\t%s\t%d\n", s->sockets_key, service_name, socket);
+
+	if (fclose(out) || rename(tmp, s->sockets))
+		unlink(tmp);
+	else
+		D(fprintf(stderr, "Socket of \"%s\" is %d in cache '%s'.\n", service_name, socket, s->sockets))
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+//	REINKD CLIENT
+/////////////////////////////////////////////////////////////////////////////////
+//
+
+static int daemon_connect(reink_session_t* s)
+{
+	struct sockaddr_un addr;
+	int sock;
+
+	if (strlen(s->daemon_socket) >= sizeof(addr.sun_path))
+		return 1;
+
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return 1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, s->daemon_socket);
+	if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+	{
+		D(fprintf(stderr, "reinkd is not running on %s, using device directly.\n", s->daemon_socket))
+		close(sock);
+		return 1;
+	}
+
+	s->fd = sock;
+	s->remote = 1;
+	return 0;
+}
+
+static int daemon_open(reink_session_t* s, const char* raw_device)
+{
+	char reply[1];
+	int reply_len = 1;
+
+	if (strlen(raw_device) > REINKD_MAX_PAYLOAD || daemon_connect(s))
+		return 1;
+
+	D(fprintf(stderr, "Opening printer session through reinkd... "))
+	if (daemon_request(s, REINKD_OP_OPEN, raw_device, strlen(raw_device), reply, &reply_len))
+	{
+		reink_close(s);
+		return -1;
+	}
+
+	if (reply_len != 1 || (unsigned char)reply[0] >= printers_count)
+	{
+		set_error(s, "reinkd: Invalid reply to open request.");
+		reink_close(s);
+		return -1;
+	}
+	D_OK
+
+	s->pm = (unsigned char)reply[0];
+	s->printer = printers[s->pm];
+
+	return 0;
+}
+
+static int daemon_wait(reink_session_t* s)
+{
+	struct pollfd pfd;
+
+	pfd.fd = s->fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, d4Remaining()) == 1)
+		return 0;
+
+	//the reply may come later, so the connection is out of sync
+	if (!check_expired(s))
+		set_error(s, "reinkd: Connection lost.");
+	return -1;
+}
+
+static int daemon_send(reink_session_t* s, const void* buf, int len)
+{
+	int done, n;
+
+	for (done = 0; done < len; done += n)
+		if ((n = send(s->fd, (const char*)buf + done, len - done, MSG_NOSIGNAL)) < 0)
+		{
+			if (errno != EINTR)
+				return -1;
+			n = 0;
+		}
+
+	return 0;
+}
+
+static int daemon_request(reink_session_t* s, unsigned char op, const char* payload, int payload_len, char* reply, int* reply_len)
+{
+	unsigned char header[REINKD_HEADER_LEN];
+	char error[REINK_ERROR_LEN];
+	char drop[64]; //for the part of reply which does not fit
+	int len; //length of reply payload
+	int done, n;
+
+	header[0] = op;
+	header[1] = (payload_len >> 8) & 0xFF;
+	header[2] = payload_len & 0xFF;
+
+	if (daemon_send(s, header, REINKD_HEADER_LEN) || daemon_send(s, payload, payload_len))
+	{
+		set_error(s, "reinkd: Error sending request: %s", strerror(errno));
+		return -1;
+	}
+
+	for (done = 0; done < REINKD_HEADER_LEN; done += n)
+		if (daemon_wait(s) || (n = read(s->fd, header + done, REINKD_HEADER_LEN - done)) <= 0)
+		{
+			set_error(s, "reinkd: Connection lost.");
+			return -1;
+		}
+
+	len = (header[1] << 8) | header[2];
+
+	for (done = 0; done < len; done += n)
+	{
+		if (daemon_wait(s))
+			return -1;
+
+		if (header[0] == REINKD_ST_OK && done < *reply_len)
+			n = read(s->fd, reply + done, (len < *reply_len ? len : *reply_len) - done);
+		else if (header[0] != REINKD_ST_OK && done < REINK_ERROR_LEN - 1)
+			n = read(s->fd, error + done, (len < REINK_ERROR_LEN - 1 ? len : REINK_ERROR_LEN - 1) - done);
+		else
+			n = read(s->fd, drop, len - done < (int)sizeof(drop) ? len - done : (int)sizeof(drop));
+
+		if (n <= 0)
+		{
+			set_error(s, "reinkd: Connection lost.");
+			return -1;
+		}
+	}
+
+	if (header[0] != REINKD_ST_OK)
+	{
+		error[len < REINK_ERROR_LEN - 1 ? len : REINK_ERROR_LEN - 1] = '\0';
+		set_error(s, "%s", error);
+		return -1;
+	}
+
+	if (len > *reply_len)
+	{
+		set_error(s, "reinkd: Reply is too long.");
+		return -1;
+	}
+	*reply_len = len;
+
+	return 0;
+}
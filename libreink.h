@@ -0,0 +1,429 @@
+/* This file is part of ReInk.
+ * Copyright (C) 2008-2016 Alexey Osipov public@alexey.osipov.name
+ *
+ * ReInk is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReInk is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReInk. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+   libreink - ReInk as a library.
+
+   All the state of the connection to the printer lives in the session
+   (reink_session_t), library functions don't print anything (except
+   debug output when session debug is enabled) and return structured
+   results. Error message of the last failed call is available in
+   session's error field.
+
+   Different sessions may be used from different threads at the same
+   time, but a session may only be used from the thread that opened
+   it: IEEE 1284.4 channel state (credits, queued replies), timeouts,
+   deadlines and statistics are kept per thread, so another thread
+   would see the printer with no channels opened.
+*/
+
+#ifndef LIBREINK_H
+
+#define LIBREINK_H
+
+#include <sys/time.h>
+
+#include "printers.h"
+
+#define REINK_VERSION_MAJOR 0
+#define REINK_VERSION_MINOR 6
+#define REINK_VERSION_REV   0
+
+#define REINK_ERROR_LEN		256	//maximum length of error message
+#define REINK_MAX_INKS		16	//maximum count of inks reported by printer
+#define REINK_BUF_LEN		1024	//buffer for printer replies
+#define REINK_CAPTURE_ENV	"REINK_CAPTURE"	//environment variable to set s->capture
+#define REINK_REPLAY_ENV	"REINK_REPLAY"	//environment variable to set s->replay
+#define REINK_REPLAY_FAST_ENV	"REINK_REPLAY_FAST"	//environment variable to set s->replay_fast
+#define REINK_FAULTS_ENV	"REINK_FAULTS"	//environment variable to set s->faults
+#define REINK_PEER_CREDITS	16		//credits given to printer on "EPSON-CTRL" at once
+#define REINK_JOURNAL_ENV	"REINK_JOURNAL"	//environment variable to set s->journal
+#define REINK_JOURNAL_DIR	"/var/tmp/reink-%d"	//default s->journal (%d is user id)
+#define REINK_PATH_LEN		1024	//maximum length of journal paths
+#define REINK_DEVICE_ID_LEN	256		//maximum kept length of IEEE 1284 device ID
+#define REINK_SOCKETS_ENV	"REINK_SOCKETS"	//environment variable to set s->sockets
+#define REINK_SOCKETS_FILE	"/var/tmp/reink-%d/sockets"	//default s->sockets (%d is user id)
+#define REINK_SERVICE_LEN	40		//maximum length of IEEE 1284.4 service name
+#define REINK_FRAME_LEN		18		//the longest EEPROM command packet (with IEEE 1284.4 header)
+
+//the session (context) of connection to one printer
+typedef struct _reink_session {
+	int fd;					//file descriptor of printer raw_device (-1 if not connected)
+	int ctrl_socket;		//IEEE 1284.4 socket of "EPSON-CTRL" channel (-1 if not opened)
+	unsigned int pm;		//printer model (PM_*)
+	printer_t printer;		//session copy of printers[pm], probing results go here
+	int debug;				//print debug messages to stderr?
+	const char* daemon_socket;	//reinkd socket to try in reink_open (NULL - always use the device directly)
+	int remote;				//1 if fd is connection to reinkd, which owns the printer session
+	const char* capture;	//file to record all the device traffic to (NULL - don't record)
+	const char* replay;		//capture file to replay instead of the device (NULL - use the device)
+	int replay_fast;		//replay as fast as possible instead of with the original timing
+	const char* faults;		//faults to inject to the device traffic, see d4Faults (NULL - none)
+	char journal[REINK_PATH_LEN];	//directory of write journals ("" - don't journal writes)
+	char journal_file[REINK_PATH_LEN];	//journal of the opened printer (set by reink_open)
+	char journal_block[REINK_ERROR_LEN];	//why writes are refused, e.g. journal of another printer ("" - they aren't)
+	char device_id[REINK_DEVICE_ID_LEN];	//IEEE 1284 device ID of the printer ("" - unknown, set by reink_connect)
+	char sockets[REINK_PATH_LEN];	//file caching sockets of services per model ("" - always ask printer)
+	char sockets_key[REINK_PATH_LEN];	//the printer in s->sockets (set by reink_connect)
+	int window;				//pipelined commands in flight, adapted by batches (0 - not yet)
+	long min_rtt;			//the fastest command round trip seen by batches (us)
+	unsigned char frames[2][REINK_FRAME_LEN];	//EEPROM read and write packets built for batches
+	int frames_len[2];		//their lengths (0 - not built yet)
+	unsigned char frames_key[4];	//socket, model code and address width the packets are built for
+	int probe_blank;		//reink_probe_eeprom saw only blank data mirrored, the size is not sure
+	char ident[REINK_BUF_LEN];	//"di" reply got by reink_handshake
+	int ident_len;			//its length (0 - not got on this connection)
+	char status[REINK_BUF_LEN];	//"st" reply got by reink_handshake
+	int status_len;			//its length (0 - not got or outdated)
+	struct timeval status_time;	//when status was got
+	char error[REINK_ERROR_LEN];	//the last error message
+} reink_session_t;
+
+//ink levels as reported by printer ("IQ:" tag of "st" reply)
+typedef struct _reink_ink_levels {
+	int count;					//count of inks
+	int level[REINK_MAX_INKS];	//remaining ink in percents, in order of printer reply
+} reink_ink_levels_t;
+
+//IEEE 1284.4 service found by reink_services
+typedef struct _reink_service {
+	int socket;							//socket ID
+	char name[REINK_SERVICE_LEN + 1];	//service name
+} reink_service_t;
+
+/* === deadlines === */
+/*
+    Sets deadline of all the following operations of calling thread
+    to <ms> milliseconds from now (0 - no deadline). After the
+    deadline every operation fails at once, only reink_close,
+    reink_close_channel and reink_disconnect get REINK_CLOSE_TIMEOUT
+    more to close channels and exit IEEE 1284.4 mode, so printer is
+    not left with opened channels.
+*/
+#define REINK_CLOSE_TIMEOUT	1000	//ms
+void reink_set_deadline(int ms);
+
+/*
+    Cancels operations of all threads as if their deadline has expired.
+    The cancellation lasts until the thread sets a new deadline with
+    reink_set_deadline, so operations started after it (e.g. next
+    request of a daemon) are not affected. May be called from signal
+    handler.
+*/
+void reink_cancel();
+
+/*
+    Returns 1 if operations of calling thread are cancelled or their
+    deadline has expired, 0 otherwise.
+*/
+int reink_expired();
+/* ------------------- */
+
+/* === session === */
+/*
+    Initializes session <s> (no connection is made).
+    s->daemon_socket is set from REINKD_SOCKET environment variable
+    or to the default reinkd socket.
+    s->capture, s->replay, s->replay_fast and s->faults are set from
+    REINK_CAPTURE, REINK_REPLAY, REINK_REPLAY_FAST and REINK_FAULTS
+    environment variables.
+    s->journal is set from REINK_JOURNAL environment variable or to
+    REINK_JOURNAL_DIR.
+    s->sockets is set from REINK_SOCKETS environment variable or to
+    REINK_SOCKETS_FILE.
+*/
+void reink_init(reink_session_t* s);
+
+/*
+    Connects to <raw_device>, enters IEEE 1284.4 mode, opens
+    "EPSON-CTRL" channel and identifies printer model.
+    If reinkd is listening on s->daemon_socket, printer session of
+    the daemon is used instead, and only "EPSON-CTRL" transactions
+    (reink_transact and everything built on it) are available.
+    If s->capture or s->replay is set, reinkd is not used.
+    If printer is unknown, session is still opened with PM_UNKNOWN model.
+    If journal of the printer (see reink_write_eeprom_batch) is left by
+    interrupted batch, the batch is completed. If the journal is of
+    another printer (device ID or contents don't match) or is damaged,
+    it is left, reink_open succeeds, but all the writes are refused with
+    the reason in s->journal_block, so read-only commands still work.
+    On success returns 0.
+    On fail returns -1.
+*/
+int reink_open(reink_session_t* s, const char* raw_device);
+
+/*
+    Closes the channel, exits IEEE 1284.4 mode and closes the device.
+    On success returns 0.
+    On fail returns -1 (the device is closed anyway).
+*/
+int reink_close(reink_session_t* s);
+
+/*
+    Checks that printer on <raw_device> is alive in <timeout> ms doing
+    as little as possible:
+    - if <s> is opened, by one IEEE 1284.4 transaction in it's session;
+    - if reinkd is listening on s->daemon_socket, by asking the daemon,
+      which does the same with it's own session of the printer;
+    - otherwise by IEEE 1284.4 Init and Exit transactions, without
+      opening any channel (s->capture and s->replay are ignored).
+    The deadline of calling thread is reset.
+    Returns REINK_ALIVE if printer replied or REINK_BUSY if device is
+    used by another process (i.e. printing).
+    On fail returns -1.
+*/
+#define REINK_ALIVE	0
+#define REINK_BUSY	1
+int reink_ping(reink_session_t* s, const char* raw_device, int timeout);
+/* --------------- */
+
+/* === protocol, channel initialization === */
+/*
+    Tries to connect to raw_device and open it for RW.
+    Then tries to initialize IEEE 1284.4 packet mode.
+    If printer is already in packet mode (i.e. previous session
+    was not closed properly) EJL escape is not sent again.
+    If s->replay is set, raw_device is not opened and printer replies
+    are taken from the capture file, data sent must match the capture.
+    If s->capture is set, all the traffic is recorded to it.
+    The printer is known in s->sockets by model from it's IEEE 1284
+    device ID if the device reports it, otherwise by raw_device.
+    On success sets s->fd and returns 0.
+    On fail returns -1.
+*/
+int reink_connect(reink_session_t* s, const char* raw_device);
+
+/*
+    Tries to carefully exit from IEEE 1284.4 mode
+    and close printer raw_device.
+    On success returns 0.
+    On fail returns -1.
+*/
+int reink_disconnect(reink_session_t* s);
+
+/*
+    Tries to get socket_id for service_name and then open it.
+    Socket got from s->sockets cache is opened without asking printer,
+    if it fails, printer is asked and the cache is corrected. Cache is
+    not used if s->capture or s->replay is set.
+    On success returns positive socket_id.
+    On fail returns -1.
+*/
+int reink_open_channel(reink_session_t* s, const char* service_name);
+
+/*
+    Tries to close socket_id.
+    On success returns 0.
+    On fail returns -1.
+*/
+int reink_close_channel(reink_session_t* s, int socket_id);
+
+/*
+    socket_id - opened IEEE 1284.4 socket.
+    buf_send - data to send.
+    send_len - bytes count to send.
+    buf_recv - buffer for recieved data.
+    recv_len - IN:  maximum length of buf_recv,
+	       OUT: actual bytes read.
+    Tries to write to printer channel socket_id data specified by
+    buf_send and read it's answer to buf_recv. Handles IEEE 1284.4
+    credits internally. Credits are tracked per channel by d4lib, so
+    usually no credit transactions are needed. Packets coming for other
+    channels meanwhile are queued, so "EPSON-CTRL" transactions may be
+    done while a job is being sent by reink_send on "EPSON-DATA".
+    On success returns 0.
+    On fail returns -1.
+*/
+int reink_transact(reink_session_t* s, int socket_id, const char* buf_send, int send_len, char* buf_recv, int* recv_len);
+
+/*
+    Tries to recover "EPSON-CTRL" channel after failed transaction:
+    drops late replies and asks for credit again.
+    On success returns 0.
+    On fail returns -1.
+*/
+int reink_recover_channel(reink_session_t* s);
+
+/*
+    Sends <len> bytes of <buf> (i.e. print job) to channel <socket_id>
+    without waiting for reply, splitting it into packets of negotiated
+    size and waiting for credits when needed (up to REINK_SEND_WAITS
+    times by REINK_SEND_WAIT_MS milliseconds, if printer is busy).
+    On success returns 0.
+    On fail returns -1.
+*/
+#define REINK_SEND_WAITS	50
+#define REINK_SEND_WAIT_MS	100
+int reink_send(reink_session_t* s, int socket_id, const char* buf, int len);
+
+/*
+    Finds IEEE 1284.4 services of connected printer (see reink_connect),
+    asking name of service on every socket and socket of every known
+    service name, up to REINK_DISCOVER_WINDOW questions at once. Found
+    services are put to s->sockets cache.
+    On success returns count of services put to <services> (up to
+    <max>, in order of socket).
+    On fail returns -1.
+*/
+#define REINK_DISCOVER_WINDOW	8
+int reink_services(reink_session_t* s, reink_service_t* services, int max);
+/* -------------------------------- */
+
+/* === information === */
+/*
+    Sends "di" and "st" commands back to back under one credit grant
+    and reads both replies to s->ident and s->status, so identity and
+    status of printer cost one round trip. Through reinkd the commands
+    are sent one by one.
+    On success returns 0.
+    On fail returns -1.
+*/
+int reink_handshake(reink_session_t* s);
+
+/*
+    Finds printer model in s->ident, getting it by reink_handshake
+    if it is not got on this connection yet.
+    On success returns printer model (PM_*), PM_UNKNOWN if model is
+    not supported.
+    On fail returns -1.
+*/
+int reink_identify(reink_session_t* s);
+
+/*
+    Parses ink levels to <levels> from s->status if it is got not
+    more than REINK_STATUS_AGE ms ago and nothing is written to EEPROM
+    since then, otherwise from reply of "st" command executed now.
+    On success returns 0.
+    On fail returns -1.
+*/
+#define REINK_STATUS_AGE	1000
+int reink_ink_levels(reink_session_t* s, reink_ink_levels_t* levels);
+
+/*
+    Parses ink levels from "st" reply <buf>.
+    On success returns 0.
+    On fail returns -1.
+*/
+int reink_parse_ink_levels(reink_session_t* s, const char* buf, int len, reink_ink_levels_t* levels);
+
+/*
+   Searches <source> for string: "<tag>*****;"
+   Returns ***** as null-terminated string in <value>.
+   <tag> must be null-terminated string.
+
+   On success returns 0.
+   If not found returns -1.
+   If found, but insufficient space in value, returns 1.
+*/
+int reink_get_tag(const char* source, int source_len, const char* tag, char* value, int max_value_len);
+/* ------------------- */
+
+/* === EEPROM access === */
+/*
+    Tries to read one byte form printer's EEPROM address <addr> to <data>.
+    On success returns 0.
+    On fail returns -1.
+*/
+int reink_read_eeprom(reink_session_t* s, unsigned short int addr, unsigned char* data);
+
+/*
+    Same as reink_read_eeprom, but don't check that printer
+    replied for requested address.
+    Address printer replied for is returned in <reply_addr>,
+    <reply_twobyte> is set to 1 if printer replied with two-byte
+    address or to 0 otherwise.
+    On success returns 0.
+    On fail returns -1.
+*/
+int reink_read_eeprom_reply(reink_session_t* s, unsigned short int addr, unsigned char* data, unsigned short int* reply_addr, int* reply_twobyte);
+
+/*
+    Same as reink_read_eeprom, but on fail tries to recover
+    IEEE 1284.4 channel (by means of askForCredit) and to read
+    <addr> again, up to REINK_READ_RETRIES times.
+    On success returns 0.
+    On fail returns -1.
+*/
+#define REINK_READ_RETRIES	5
+int reink_read_eeprom_retry(reink_session_t* s, unsigned short int addr, unsigned char* data);
+
+/*
+    Tries to write one byte <data> to printer's EEPROM address <addr>.
+    On success returns 0.
+    On fail returns -1.
+*/
+int reink_write_eeprom(reink_session_t* s, unsigned short int addr, unsigned char data);
+
+/*
+    Reads <count> bytes from EEPROM addresses <addrs> to <data>.
+    Up to s->window read commands are sent before waiting for replies
+    (as IEEE 1284.4 credits allow), so the round trip to printer is
+    not waited for every byte. Commands that can be sent at once go
+    by one write, as packets patched from s->frames. The window starts at
+    REINK_PIPELINE_START and grows by one after each window of replies
+    up to REINK_PIPELINE_DEPTH, it is halved when pipeline fails or
+    a reply takes more than REINK_PIPELINE_SLOW times the fastest
+    round trip (printer queues the commands, so more of them in flight
+    give no more speed). If pipeline fails, it is continued after
+    channel recovery, up to REINK_READ_RETRIES times, then the rest
+    of addresses is read by reink_read_eeprom_retry.
+    Through reinkd addresses are read one by one.
+    On success returns 0.
+    On fail returns -1.
+*/
+#define REINK_PIPELINE_START	2
+#define REINK_PIPELINE_DEPTH	8
+#define REINK_PIPELINE_SLOW		4
+int reink_read_eeprom_batch(reink_session_t* s, const unsigned short int* addrs, int count, unsigned char* data);
+
+/*
+    Writes <count> bytes <data> to EEPROM addresses <addrs>, pipelined
+    and retried as reink_read_eeprom_batch does (writes not confirmed
+    are repeated), then the rest of bytes is written by
+    reink_write_eeprom.
+    If s->journal is set, original bytes are read first and saved with
+    <data> to the journal of the printer in s->journal directory, which
+    is removed when all the bytes are written. So a batch interrupted
+    halfway (i.e. multi-byte counter half-written) is completed by
+    reink_open of the printer next time. The journal keeps the original
+    bytes too, but the batch is only rolled forward: the user asked for
+    the new contents, and rolling back would take the same writes.
+    On success returns 0.
+    On fail returns -1.
+*/
+#define REINK_JOURNAL_MAX	0x10000	//maximum count of journaled writes in a batch
+int reink_write_eeprom_batch(reink_session_t* s, const unsigned short int* addrs, const unsigned char* data, int count);
+
+/*
+    Detects whether printer's EEPROM uses two-byte addresses and
+    EEPROM size. Size is found by looking for the smallest power of
+    two address which printer refuses, replies for another address
+    (echo mismatch) or which contents mirrors the beginning of EEPROM
+    (wraparound), so only a few reads are needed. A failed read is
+    retried before it is taken as the end of EEPROM. Wraparound is
+    looked for by the first not blank bytes of EEPROM (erased 0x00 or
+    0xFF areas are alike everywhere), if the beginning is blank up to
+    an address, mirror found there is ignored and s->probe_blank is set
+    (the size may be too big then).
+    Results are stored in s->printer.
+    On success returns 0.
+    On fail returns -1.
+*/
+int reink_probe_eeprom(reink_session_t* s);
+/* --------------------- */
+
+#endif
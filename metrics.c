@@ -0,0 +1,342 @@
+/* This file is part of ReInk.
+ * Copyright (C) 2008-2016 Alexey Osipov public@alexey.osipov.name
+ *
+ * ReInk is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReInk is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReInk. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>	//snprintf
+#include <stdarg.h>	//va_list
+#include <stdlib.h>	//atoi
+#include <string.h>	//strlen
+#include <unistd.h>	//close
+#include <pthread.h>	//server thread
+#include <poll.h>	//poll
+#include <errno.h>	//errno
+
+#include <sys/types.h>	//sockets
+#include <sys/stat.h>	//chmod
+#include <sys/socket.h>	//sockets
+#include <sys/un.h>		//sockaddr_un
+#include <netinet/in.h>	//sockaddr_in
+#include <arpa/inet.h>	//htonl
+
+#include "metrics.h"
+#include "reinkd.h"	//REINKD_MAX_DEVICES
+
+#define METRICS_REQUEST_TIMEOUT	1000	//ms to wait for HTTP request
+#define METRICS_ACCEPT_BACKOFF	100		//ms to wait after failed accept (i.e. out of descriptors)
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static printer_metrics_t printers_state[REINKD_MAX_DEVICES];
+static int printers_state_count = 0;
+static d4Stats_t transport;
+
+static int listener = -1;
+static char unix_path[PATH_MAX] = "";	//Unix socket to remove on stop
+static char page[METRICS_PAGE_LEN];	//metrics page, used by server thread only
+static int page_len;
+
+/*
+   Appends formatted text to metrics page.
+*/
+static void page_printf(const char* format, ...);
+
+/*
+   Appends <value> to metrics page as label value
+   (with '\', '"' and newline escaped).
+*/
+static void page_label(const char* value);
+
+/*
+   Renders metrics page from the stored state.
+*/
+static void render_page();
+
+/*
+   Server thread: answers every connection with metrics page.
+*/
+static void* serve(void* arg);
+
+int metrics_start(const char* listen_addr)
+{
+	struct sockaddr_un uaddr;
+	struct sockaddr_in iaddr;
+	pthread_t thread;
+	const char* p;
+	int on = 1;
+
+	for (p = listen_addr; *p >= '0' && *p <= '9'; p++);
+
+	if (*listen_addr != '\0' && *p == '\0')
+	{
+		//TCP port, loopback only
+		if ((listener = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		{
+			perror("metrics: socket");
+			return -1;
+		}
+		setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		memset(&iaddr, 0, sizeof(iaddr));
+		iaddr.sin_family = AF_INET;
+		iaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		iaddr.sin_port = htons(atoi(listen_addr));
+		if (bind(listener, (struct sockaddr*)&iaddr, sizeof(iaddr)) == -1)
+		{
+			perror("metrics: bind");
+			close(listener);
+			return -1;
+		}
+	}
+	else
+	{
+		if (strlen(listen_addr) >= sizeof(uaddr.sun_path))
+		{
+			fprintf(stderr, "metrics: Socket path is too long.\n");
+			return -1;
+		}
+		if ((listener = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		{
+			perror("metrics: socket");
+			return -1;
+		}
+		memset(&uaddr, 0, sizeof(uaddr));
+		uaddr.sun_family = AF_UNIX;
+		strcpy(uaddr.sun_path, listen_addr);
+		unlink(listen_addr); //left from previous run
+		if (bind(listener, (struct sockaddr*)&uaddr, sizeof(uaddr)) == -1)
+		{
+			perror("metrics: bind");
+			close(listener);
+			return -1;
+		}
+		strcpy(unix_path, listen_addr);
+		chmod(listen_addr, 0660);
+	}
+
+	if (listen(listener, 8) == -1 || pthread_create(&thread, NULL, serve, NULL))
+	{
+		perror("metrics: listen");
+		metrics_stop();
+		return -1;
+	}
+	pthread_detach(thread);
+
+	return 0;
+}
+
+void metrics_stop()
+{
+	if (listener >= 0)
+		close(listener);
+	listener = -1;
+
+	if (*unix_path)
+		unlink(unix_path);
+	*unix_path = '\0';
+}
+
+void metrics_update_printer(int index, const printer_metrics_t* m)
+{
+	if (index < 0 || index >= REINKD_MAX_DEVICES)
+		return;
+
+	pthread_mutex_lock(&lock);
+	printers_state[index] = *m;
+	if (index >= printers_state_count)
+		printers_state_count = index + 1;
+	pthread_mutex_unlock(&lock);
+}
+
+void metrics_update_transport(const d4Stats_t* stats)
+{
+	pthread_mutex_lock(&lock);
+	transport = *stats;
+	pthread_mutex_unlock(&lock);
+}
+
+static void page_printf(const char* format, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, format);
+	n = vsnprintf(page + page_len, METRICS_PAGE_LEN - page_len, format, ap);
+	va_end(ap);
+
+	if (n > 0)
+		page_len += n;
+	if (page_len >= METRICS_PAGE_LEN)
+		page_len = METRICS_PAGE_LEN - 1; //truncated
+}
+
+static void page_label(const char* value)
+{
+	for (; *value; value++)
+	{
+		if (*value == '\\' || *value == '"')
+			page_printf("\\%c", *value);
+		else if (*value == '\n')
+			page_printf("\\n");
+		else
+			page_printf("%c", *value);
+	}
+}
+
+//starts metric line: name{device="...",printer="..."
+#define PRINTER_LABELS(__name, __m) \
+	page_printf(__name "{device=\""); \
+	page_label((__m)->device); \
+	page_printf("\",printer=\""); \
+	page_label((__m)->printer); \
+	page_printf("\"");
+
+static void render_page()
+{
+	printer_metrics_t* m;
+	unsigned long cumulative;
+	int i, j;
+
+	page_len = 0;
+
+	page_printf("# HELP reink_printer_up Whether the last poll of the printer succeeded.\n");
+	page_printf("# TYPE reink_printer_up gauge\n");
+	for (i = 0; i < printers_state_count; i++)
+	{
+		PRINTER_LABELS("reink_printer_up", &printers_state[i])
+		page_printf("} %d\n", printers_state[i].up);
+	}
+
+	page_printf("# HELP reink_last_poll_timestamp_seconds Time of the last successful poll of the printer.\n");
+	page_printf("# TYPE reink_last_poll_timestamp_seconds gauge\n");
+	for (i = 0; i < printers_state_count; i++)
+	{
+		PRINTER_LABELS("reink_last_poll_timestamp_seconds", &printers_state[i])
+		page_printf("} %ld\n", (long)printers_state[i].updated);
+	}
+
+	page_printf("# HELP reink_polls_total Polls of the printer.\n");
+	page_printf("# TYPE reink_polls_total counter\n");
+	for (i = 0; i < printers_state_count; i++)
+	{
+		PRINTER_LABELS("reink_polls_total", &printers_state[i])
+		page_printf("} %lu\n", printers_state[i].polls);
+	}
+
+	page_printf("# HELP reink_poll_errors_total Failed polls of the printer.\n");
+	page_printf("# TYPE reink_poll_errors_total counter\n");
+	for (i = 0; i < printers_state_count; i++)
+	{
+		PRINTER_LABELS("reink_poll_errors_total", &printers_state[i])
+		page_printf("} %lu\n", printers_state[i].poll_errors);
+	}
+
+	page_printf("# HELP reink_ink_level_percent Remaining ink as reported by the printer.\n");
+	page_printf("# TYPE reink_ink_level_percent gauge\n");
+	for (i = 0; i < printers_state_count; i++)
+	{
+		m = &printers_state[i];
+		if (!m->updated)
+			continue;
+		for (j = 0; j < m->inks.count; j++)
+		{
+			PRINTER_LABELS("reink_ink_level_percent", m)
+			page_printf(",ink=\"%d\"} %d\n", j + 1, m->inks.level[j]);
+		}
+	}
+
+	page_printf("# HELP reink_waste_counter_byte Raw byte of the waste ink counter in printer EEPROM.\n");
+	page_printf("# TYPE reink_waste_counter_byte gauge\n");
+	for (i = 0; i < printers_state_count; i++)
+	{
+		m = &printers_state[i];
+		if (!m->updated)
+			continue;
+		for (j = 0; j < m->waste_len; j++)
+		{
+			PRINTER_LABELS("reink_waste_counter_byte", m)
+			page_printf(",address=\"0x%04X\"} %d\n", m->waste_addr[j], m->waste[j]);
+		}
+	}
+
+	page_printf("# HELP reink_d4_transactions_total IEEE 1284.4 command transactions.\n");
+	page_printf("# TYPE reink_d4_transactions_total counter\n");
+	page_printf("reink_d4_transactions_total %lu\n", transport.transactions);
+
+	page_printf("# HELP reink_d4_retries_total Repeated IEEE 1284.4 attempts.\n");
+	page_printf("# TYPE reink_d4_retries_total counter\n");
+	page_printf("reink_d4_retries_total %lu\n", transport.retries);
+
+	page_printf("# HELP reink_d4_timeouts_total IEEE 1284.4 read and write timeouts.\n");
+	page_printf("# TYPE reink_d4_timeouts_total counter\n");
+	page_printf("reink_d4_timeouts_total %lu\n", transport.timeouts);
+
+	page_printf("# HELP reink_d4_transaction_latency_seconds Latency of IEEE 1284.4 command transactions.\n");
+	page_printf("# TYPE reink_d4_transaction_latency_seconds histogram\n");
+	cumulative = 0;
+	for (i = 0; i < D4_LATENCY_BUCKETS; i++)
+	{
+		cumulative += transport.latency[i];
+		page_printf("reink_d4_transaction_latency_seconds_bucket{le=\"%g\"} %lu\n", d4LatencyBounds[i] / 1000.0, cumulative);
+	}
+	cumulative += transport.latency[D4_LATENCY_BUCKETS];
+	page_printf("reink_d4_transaction_latency_seconds_bucket{le=\"+Inf\"} %lu\n", cumulative);
+	page_printf("reink_d4_transaction_latency_seconds_sum %f\n", transport.latencySum);
+	page_printf("reink_d4_transaction_latency_seconds_count %lu\n", cumulative);
+}
+
+static void* serve(void* arg)
+{
+	struct pollfd pfd;
+	char request[1024];
+	char header[128];
+	int header_len;
+	int fd;
+	int failing = 0; //accept error is logged
+
+	while ((fd = accept(listener, NULL, NULL)) >= 0 || listener >= 0)
+	{
+		if (fd < 0)
+		{
+			//EMFILE and the like last, don't spin until they are gone
+			if (errno != EINTR && listener >= 0)
+			{
+				if (!failing)
+					perror("metrics: accept");
+				failing = 1;
+				poll(NULL, 0, METRICS_ACCEPT_BACKOFF);
+			}
+			continue;
+		}
+		failing = 0;
+
+		//the request itself doesn't matter, but read it to be polite to HTTP clients
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, METRICS_REQUEST_TIMEOUT) > 0)
+			read(fd, request, sizeof(request));
+
+		pthread_mutex_lock(&lock);
+		render_page();
+		pthread_mutex_unlock(&lock);
+
+		header_len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n", page_len);
+		if (write(fd, header, header_len) == header_len)
+			write(fd, page, page_len);
+
+		close(fd);
+	}
+
+	return NULL;
+}
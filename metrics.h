@@ -0,0 +1,77 @@
+/* This file is part of ReInk.
+ * Copyright (C) 2008-2016 Alexey Osipov public@alexey.osipov.name
+ *
+ * ReInk is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReInk is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReInk. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+   Metrics exporter of reinkd.
+
+   Printer state is refreshed by reinkd poller and kept in memory,
+   metrics are served by a separate thread in Prometheus text format
+   over HTTP, so scrapes never wait for printer I/O.
+*/
+
+#ifndef METRICS_H
+
+#define METRICS_H
+
+#include <time.h>
+#include <limits.h>
+
+#include "d4lib.h"
+#include "libreink.h"
+
+#define METRICS_PAGE_LEN	0x10000	//maximum size of metrics page
+#define METRICS_WASTE_LEN	4		//maximum length of waste counter (as in waste_map_t)
+
+//the last known state of one printer
+typedef struct _printer_metrics {
+	char device[PATH_MAX];			//raw device path
+	char printer[MAX_NAME_LEN];		//printer name (empty if unknown)
+	int up;							//was the last poll successful?
+	time_t updated;					//time of the last successful poll (0 - never)
+	unsigned long polls;			//count of polls
+	unsigned long poll_errors;		//count of failed polls
+	reink_ink_levels_t inks;		//ink levels ("IQ:" tag of "st" reply)
+	int waste_len;					//count of waste counter bytes
+	unsigned short int waste_addr[METRICS_WASTE_LEN];	//waste counter EEPROM addresses
+	unsigned char waste[METRICS_WASTE_LEN];				//raw waste counter bytes
+} printer_metrics_t;
+
+/*
+   Starts metrics server thread listening on <listen_addr>.
+   <listen_addr> is either TCP port on loopback interface
+   or Unix socket path.
+   On success returns 0.
+   On fail prints error message to stderr and returns -1.
+*/
+int metrics_start(const char* listen_addr);
+
+/*
+   Stops metrics server (removes Unix socket).
+*/
+void metrics_stop();
+
+/*
+   Stores state of printer number <index> to be served.
+*/
+void metrics_update_printer(int index, const printer_metrics_t* m);
+
+/*
+   Stores transport statistics to be served.
+*/
+void metrics_update_transport(const d4Stats_t* stats);
+
+#endif
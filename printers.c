@@ -24,6 +24,7 @@ printer_t printers[] = {
 		.model_name = "Unknown printer",
 		.model_code = {0x00, 0x00},
 		.twobyte_addresses = 0,
+		.eeprom_size = 0,
 		.inkmap = {
 			.mask = 			0,
 			.black = 			{0x00, 0x00, 0x00, 0x00},
@@ -43,6 +44,7 @@ printer_t printers[] = {
 		.model_name = "Stylus Photo 790",
 		.model_code = {0x06, 0x31},
 		.twobyte_addresses = 0,
+		.eeprom_size = 0,
 		.inkmap = {
 			.mask = INK_BLACK | INK_CYAN | INK_MAGENTA | INK_YELLOW | INK_LIGHTCYAN | INK_LIGHTMAGENTA,
 			.black = 			{0x02, 0x03, 0x04, 0x05},
@@ -62,6 +64,7 @@ printer_t printers[] = {
 		.model_name = "Stylus COLOR 580",
 		.model_code = {0x06, 0x1b},
 		.twobyte_addresses = 0,
+		.eeprom_size = 0,
 		.inkmap = {
 			.mask = INK_BLACK | INK_CYAN | INK_MAGENTA | INK_YELLOW,
 			.black = 			{0x44, 0x45, 0x46, 0x47},
@@ -81,6 +84,7 @@ printer_t printers[] = {
 		.model_name = "Stylus Photo 1290",
 		.model_code = {0x07, 0x19},
 		.twobyte_addresses = 0,
+		.eeprom_size = 0,
 		.inkmap = {
 			.mask = INK_BLACK | INK_CYAN | INK_MAGENTA | INK_YELLOW | INK_LIGHTCYAN | INK_LIGHTMAGENTA,
 			.black = 			{0x44, 0x45, 0x46, 0x47},
@@ -100,6 +104,7 @@ printer_t printers[] = {
 		.model_name = "Stylus COLOR 680",
 		.model_code = {0x06, 0x15},
 		.twobyte_addresses = 0,
+		.eeprom_size = 0,
 		.inkmap = {
 			.mask = INK_BLACK | INK_CYAN | INK_MAGENTA | INK_YELLOW | INK_LIGHTCYAN | INK_LIGHTMAGENTA,
 			.black = 			{0x02, 0x03, 0x04, 0x05},
@@ -119,6 +124,7 @@ printer_t printers[] = {
 		.model_name = "Epson Stylus Photo T50",
 		.model_code = {0x77, 0x00},
 		.twobyte_addresses = 0,
+		.eeprom_size = 0,
 		.inkmap = {
 			.mask = INK_BLACK | INK_CYAN | INK_MAGENTA | INK_YELLOW | INK_LIGHTCYAN | INK_LIGHTMAGENTA,
 			.black = 			{0x02, 0x03, 0x04, 0x05},
@@ -138,6 +144,7 @@ printer_t printers[] = {
 		.model_name = "Epson Stylus Photo P50",
 		.model_code = {0x77, 0x00},
 		.twobyte_addresses = 0,
+		.eeprom_size = 0,
 		.inkmap = {
 			.mask = INK_BLACK | INK_CYAN | INK_MAGENTA | INK_YELLOW | INK_LIGHTCYAN | INK_LIGHTMAGENTA,
 			.black = 			{0x02, 0x03, 0x04, 0x05},
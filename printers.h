@@ -14,7 +14,10 @@
  * You should have received a copy of the GNU General Public License
  * along with ReInk. If not, see <http://www.gnu.org/licenses/>.
  */
- 
+
+#ifndef PRINTERS_H
+
+#define PRINTERS_H
  
 //printer models 
 #define PM_UNKNOWN		0	//Unknown model
@@ -56,9 +59,12 @@ typedef struct _printer_s {
 	unsigned char model_name[MAX_MODEL_LEN];	//printer model name as returned by printer itself
 	unsigned char model_code[2];	//"password" for this printer
 	int twobyte_addresses;			//is printer's EEPROM uses two-byte addresses?
+	unsigned int eeprom_size;		//EEPROM size in bytes (0 - unknown, probe it)
 	ink_map_t inkmap;
 	waste_map_t wastemap;
 } printer_t;
 
 extern printer_t printers[];
 extern const unsigned int printers_count;
+
+#endif
@@ -99,6 +99,13 @@
 	<addr> - two-byte address of EEPROM to read
 	Two addresses recognized as range.
 	Example: ./reink -d 0000-0FA0 -r /dev/usb/lp0
+	Use "all" as <addr> to detect EEPROM size and dump it whole.
+	Add -c <state_file> to checkpoint progress to <state_file>. If dump
+	is interrupted, rerun it with the same range, printer device and
+	<state_file> to continue from the last successfully read address.
+	Add -f <format> to select output format: text (default), bin (raw
+	image, offset in file is EEPROM address) or ihex (Intel HEX).
+	Add -o <file> to write the dump to <file> instead of stdout.
 
     - to write to arbitary EEPROM address (CAUTION: THIS MAY DAMAGE YOUR PRINTER!)
 	./reink -w <addr>=<data> -r printer_raw_device
@@ -117,6 +124,11 @@
     - to make an test report, containing some information about your printer
 	./reink -t -r printer_raw_device > testreport.log
 
+    - to find addresses of ink and waste counters of your printer
+	./reink -x[model_code] -r printer_raw_device
+	<model_code> - printer secret model code found by test report,
+	required only if printer is not supported yet.
+
     You can set REINK_DEBUG environment variable to enable debug  output to
  stderr.
  REINK_DEBUG=0 - no debug;
@@ -131,20 +143,27 @@
 #include <stdio.h>	//printf, stdin, stderr, stdout
 #include <string.h>	//strdup
 
-#include <sys/types.h>	//fileIO
-#include <sys/stat.h>	//fileIO
-#include <fcntl.h>	//fileIO
-
 #include <errno.h>	//errno
 
 #include <sys/utsname.h> //uname -a
+#include <glob.h>	//devices enumeration
+#include <limits.h>	//PATH_MAX
+#include <pthread.h>	//parallel inventory
+#include <sys/time.h>	//gettimeofday
+#include <sys/resource.h>	//cost report
+#include <sys/inotify.h>	//watch mode
+#include <dirent.h>	//watch mode
+#include <signal.h>	//sampler stop
+#include <time.h>	//clock_gettime
+#include <math.h>	//sqrt
 
 #include "d4lib.h"	//IEEE 1284.4
 #include "printers.h" //printers defs
-
-#define REINK_VERSION_MAJOR 0
-#define REINK_VERSION_MINOR 6
-#define REINK_VERSION_REV   0
+#include "libreink.h" //printer session
+#include "reinkd.h" //reinkd socket
+#include "eeimage.h" //EEPROM image output
+#include "snapdiff.h" //EEPROM snapshots comparison
+#include "snapstore.h" //EEPROM snapshots archive
 
 #define CMD_NONE			0	//no command
 #define CMD_GETINK			1	//command to display current ink levels
@@ -153,173 +172,127 @@
 #define CMD_ZEROINK			4	//command to reset ink levels
 #define CMD_REPORT			5	//command to make test report
 #define CMD_ZEROWASTE		6	//command to reset waste ink counter
+#define CMD_FINDCOUNTERS	7	//command to find ink and waste counters addresses
+#define CMD_INVENTORY		8	//command to list printers on all devices
+#define CMD_SAMPLE			9	//command to sample EEPROM addresses continuously
+#define CMD_PRINTJOB		10	//command to send print job and watch ink levels
+#define CMD_ARCHIVELIST		11	//command to list snapshots of archive
+#define CMD_ARCHIVEGET		12	//command to extract snapshot from archive
+#define CMD_ARCHIVEDIFF		13	//command to compare two snapshots of archive
+#define CMD_RESTORE			14	//command to restore EEPROM from image
+#define CMD_PING			15	//command to check that printer is alive
+#define CMD_SERVICES		16	//command to list IEEE 1284.4 services of printer
 
-//EPSON factory commands classes and names
-#define EFCMD_EEPROM_READ	0x41
-#define EFCLS_EEPROM_READ	0x7c
-#define EFCMD_EEPROM_WRITE	0x42
-#define EFCLS_EEPROM_WRITE	0x7c
+#define INVENTORY_DEVICES	"/dev/usb/lp*"	//default devices to scan
+#define INVENTORY_MAX		64		//maximum count of devices to scan
+#define INVENTORY_TIMEOUT	300		//IEEE 1284.4 timeouts for inventory (ms)
+#define INVENTORY_PROBE_TIME	(3 * INVENTORY_TIMEOUT)	//the slowest probe: Init, then resync of half-open session (Exit, Init)
+#define INVENTORY_DEADLINE	(INVENTORY_PROBE_TIME + 2000)	//time to wait for all devices: probe, then entering IEEE 1284.4 and identifying (ms)
+#define INVENTORY_HUB_START	8		//concurrent probes on one hub at first
+#define INVENTORY_HUB_SLOW	3		//probe this times slower than the fastest on hub means hub is overloaded
 
-#define INPUT_BUF_LEN	1024
+#define WATCH_DIR			"/dev/usb"	//default directory to watch for devices
+#define WATCH_PREFIX		"lp"	//names of printer devices start with it
+#define WATCH_MAX			64		//maximum count of watched devices
 
-#define D(__c) 	if (ri_debug) {__c;};
-#define D_OK 	D(fprintf(stderr, "OK\n"))
+#define SAMPLE_MAGIC		"RKS1"	//sample file signature
+#define SAMPLE_MAX_ADDRS	64		//maximum count of sampled addresses
 
-int ri_debug = 0;
+#define PRINTJOB_CHUNK		0x4000	//bytes of job file sent at once
+#define PRINTJOB_POLL		1000	//interval of status polling while printing (ms)
 
-void print_usage(const char* progname);
+#define PING_TIMEOUT		500		//default time to wait for printer alive (ms)
 
-/* === protocol, channel initialization === */
-/*
-    Tries to connect to raw_device and open it for RW.
-    Then tries to initialize IEEE 1284.4 packet mode.
-    On success returns filedescriptor of opened device.
-    On fail prints various error messages to stderr and returns -1.
-*/
-int printer_connect(const char* raw_device);
+#define ARCHIVE_MAX_CHANGES	0x10000	//maximum count of differences printed by CMD_ARCHIVEDIFF
 
-/*
-    fd - file descriptor for printer raw_device
-	 initialized in IEEE 1284.4 mode.
-    Tries to carefully exit from IEEE 1284.4 mode
-    and close printer raw_device (fd).
-    On success returns 0.
-    On fail prints various error messages to stderr and returns -1.
-*/
-int printer_disconnect(int fd);
+#define COST_ENV			"REINK_COST"	//environment variable to report cost of command: "text" or "json"
 
-/*
-    fd - file descriptor for printer raw_device
-	 initialized in IEEE 1284.4 mode.
-    Tries to get socket_id for service_name and
-    then open it.
-    On success returns positive socket_id.
-    On fail prints various error messages to stderr and returns -1.
-*/
-int open_channel(int fd, const char* service_name);
+#define INPUT_BUF_LEN	REINK_BUF_LEN
 
-/*
-    fd - file descriptor for printer raw_device
-	 initialized in IEEE 1284.4 mode.
-    socket_id - opened IEEE 1284.4 socket.
-    Tries to close socket_id.
-    On success returns 0.
-    On fail prints various error messages to stderr and returns -1.
-*/
-int close_channel(int fd, int socket_id);
+#define D(__c) 	if (ri_debug) {__c;};
+#define D_OK 	D(fprintf(stderr, "OK\n"))
 
-/*
-    fd - file descriptor for printer raw_device
-	 initialized in IEEE 1284.4 mode.
-    socket_id - opened IEEE 1284.4 socket.
-    buf_send - data to send.
-    send_len - bytes count to send.
-    buf_recv - buffer for recieved data.
-    recv_len - IN:  maximum length of buf_recv,
-	       OUT: actual bytes read.
-    Tries to write to printer channel socket_id data specified by
-    buf_send and read it's answer to buf_recv. Handles IEEE 1284.4
-    credits internally.
-    On success returns *recv_len.
-    On fail prints various error messges to stderr and returns -1.
-*/
-int printer_transact(int fd, int socket_id, const char* buf_send, int send_len, char* buf_recv, int* recv_len);
-/* -------------------------------- */
-
-/* === information === */
-unsigned int printer_model(const char* raw_device); //return printer model (PM_*) or PM_UNKNOWN
-/* ------------------- */
-
-/* === EPSON factory commands === */
-
-//epson factory command header
-typedef struct _fcmd_header_t {
-	unsigned char cls1;
-	unsigned char cls2;
-	unsigned char lenL;
-	unsigned char lenH;
-	unsigned char mcode1;
-	unsigned char mcode2;
-	unsigned char cmd;
-	unsigned char cmd1;
-	unsigned char cmd2;
-} fcmd_header_t;
+int ri_debug = 0;
 
-/*
-    cmd - pointer to uninitialized epson factory command header.
-    model - printer model.
-    class - factory command class.
-    name - factory command name.
-    extra_length - length of command arguments.
-    Initialize given header based on passed in information.
-    If model is pm_unknown, than mcode1 and mcode2 fields is set to zero
-    and have to be initialized by caller.
-*/
-void init_command(fcmd_header_t* cmd, unsigned int model, unsigned char class, unsigned char name, unsigned short int extra_length);
+//names of commands in cost report, indexed by CMD_*
+static const char* cost_operations[] = { "none", "ink_levels", "eeprom_dump", "eeprom_write", "ink_reset",
+	"make_report", "waste_reset", "find_counters", "inventory", "sample", "print_job",
+	"archive_list", "archive_get", "archive_diff", "eeprom_restore", "ping", "services" };
+static const char* cost_operation = NULL;	//command reported at exit (NULL - don't report)
+static int cost_json = 0;					//report as JSON?
+static struct timeval cost_start;			//when command started
 
-/*
-    fd - file descriptor for printer raw_device
-	 initialized in IEEE 1284.4 mode.
-    socket_id - opened IEEE 1284.4 socket for
-	        "EPSON-CTRL" service.
-    Tries to read one byte form printer's EEPROM address <addr> to <data>.
-    On success returns 0.
-    On fail returns -1.
-*/
-int read_eeprom_address(int fd, int socket_id, unsigned int model, unsigned short int addr, unsigned char* data);
+void print_usage(const char* progname);
 
-/*
-    fd - file descriptor for printer raw_device
-	 initialized in IEEE 1284.4 mode.
-    socket_id - opened IEEE 1284.4 socket for
-	        "EPSON-CTRL" service.
-    Tries to write one byte <data> to printer's EEPROM address <addr>.
-    On success returns 0.
-    On fail returns -1.
-*/
-int write_eeprom_address(int fd, int socket_id, unsigned int model, unsigned short int addr, unsigned char data);
-/* ------------------------- */
+static void on_interrupt(int signum)
+{
+	reink_cancel(); //printer session is closed properly by main
+}
 
 /* === helpers === */
 /*
-   Searches <source> for string: "<tag>*****;"
-   Returns ***** as null-terminated string in <value>.
-   <tag> must be null-terminated string.
-
-   On success returns 0.
-   If not found returns -1.
-   If found, but insufficient space in value, returns 1.
+   Opens EEPROM dump checkpoint file <state_file> for
+   dump of session printer on <raw_device> from <start_addr> to <end_addr>.
+   If file contains progress of the same dump (same range, device
+   path and IEEE 1284 device ID of the printer), already readed
+   bytes are put to <img> and <image> (indexed by address)
+   and <next_addr> is set to the
+   first address not yet readed. Otherwise file is truncated
+   and <next_addr> is set to <start_addr>.
+   On success returns opened file.
+   On fail returns NULL.
 */
-int get_tag(const char* source, int source_len, const char* tag, char* value, int max_value_len);
+FILE* checkpoint_open(reink_session_t* s, const char* state_file, const char* raw_device, unsigned short int start_addr, unsigned short int end_addr, eeimage_t* img, unsigned char* image, unsigned int* next_addr);
 
 /*
-   Parses buf and prints ink levels info to stdout.
-   On success returns 0.
-   On fail returns -1.
+   Prints to stderr what the command took (atexit handler, set if
+   REINK_COST is set): wall time split into waiting for printer,
+   sleeping and own CPU time, then cost of IEEE 1284.4 transport
+   by transaction type (of the main thread).
 */
-int parse_ink_result(const char* buf, int len);
+void print_cost();
 /* --------------- */
 
 /* === main workers === */
-int do_ink_levels(const char* raw_device, unsigned int pm);
-int do_ink_reset(const char* raw_device, unsigned int pm, unsigned char ink_type);
-int do_eeprom_dump(const char* raw_device, unsigned int pm, unsigned short int start_addr, unsigned short int end_addr);
-int do_eeprom_write(const char* raw_device, unsigned int pm, unsigned short int addr, unsigned char data);
+int do_ink_levels(reink_session_t* s);
+int do_ink_reset(reink_session_t* s, unsigned char ink_type);
+int do_eeprom_dump(reink_session_t* s, unsigned short int start_addr, unsigned short int end_addr, int probe, const char* state_file, const char* out_file, int out_format, const char* archive, const char* raw_device);
+int do_eeprom_write(reink_session_t* s, unsigned short int addr, unsigned char data);
+int do_eeprom_restore(reink_session_t* s, const char* image_file, int in_format, const char* archive);
 int do_make_report(const char* raw_device, unsigned char model_code[]);
-int do_waste_reset(const char* raw_device, unsigned int pm);
+int do_waste_reset(reink_session_t* s);
+int do_find_counters(reink_session_t* s, const char* raw_device);
+int do_inventory(const char* pattern);
+int do_watch(const char* dir, int command, unsigned char ink_type);
+int do_sample(reink_session_t* s, const char* addr_list, unsigned long samples, const char* out_file);
+int do_print_job(reink_session_t* s, const char* job_file);
+int do_ping(const char* raw_device, int timeout);
+int do_services(const char* raw_device);
+int do_archive_list(const char* archive);
+int do_archive_get(const char* archive, unsigned int id, const char* out_file, int out_format);
+int do_archive_diff(const char* archive, unsigned int id1, unsigned int id2);
 /* -------------------- */
 
 int main(int argc, char** argv)
 {
 	int opt; 					//current option
 	int command = CMD_NONE; 			//command to do
-	unsigned int pmodel = PM_UNKNOWN; 	//printer model
+	reink_session_t session;		//connection to the printer
+	int ret;				//command result
 
 	char* raw_device = NULL;	//-r option argument
 
 	char* addr_range = NULL;	//-d option argument
 	unsigned short int addr_s;	//start address for CMD_DUMPEEPROM
 	unsigned short int addr_e;	//end address for CMD_DUMPEEPROM
+	int dump_all = 0;		//dump whole EEPROM?
+	char* state_file = NULL;	//-c option argument
+	char* out_file = NULL;		//-o option argument
+	int out_format = IMG_TEXT;	//-f option argument
+	char* archive = NULL;		//-A option argument
+	char* restore_image = NULL;	//-R option argument
+	unsigned int snap_id1;		//-G and -D option argument
+	unsigned int snap_id2;		//-D option argument
 
 	char* write_data = NULL;	//-w option argument
 	unsigned short int write_addr;	//write address for CMD_WRITEEEPROM
@@ -328,11 +301,24 @@ int main(int argc, char** argv)
 	char* str_ink_type = NULL;	//-z option argument
 	unsigned char ink_type = 0;	//ink_type for CMD_ZEROINK
 
-	char* str_model_code = NULL; //-t option argument
-	unsigned char model_code[2]; //model code for CMD_REPORT
+	char* inventory_pattern = NULL; //-l option argument
+
+	char* sample_addrs = NULL;	//-S option argument
+	unsigned long samples = 0;	//-n option argument
+
+	char* job_file = NULL;		//-P option argument
+
+	int deadline = 0;			//-T option argument (seconds)
+	int ping_timeout = PING_TIMEOUT;	//-p option argument (ms)
+	struct sigaction sa;		//interruption handling
+
+	int watch = 0;				//-W option
+	char* watch_dir = NULL;		//-W option argument
+
+	char* str_model_code = NULL; //-t and -x option argument
+	unsigned char model_code[2]; //model code for CMD_REPORT and CMD_FINDCOUNTERS
 
 	char* inval_pos;		//used in strtol to indicate conversion error
-	char onebyte[3];		//holds one-byte hex value ("0A" for example), used in conversion
 
 	char* str_reink_debug = NULL;	//the value of REINK_DEBUG environmental variable
 
@@ -345,9 +331,7 @@ int main(int argc, char** argv)
 			setDebug(1);
 	}
 
-	onebyte[2] = '\0';
-
-	while ((opt = getopt(argc, argv, "sir:d:w:z::t::")) != -1)
+	while ((opt = getopt(argc, argv, "sir:d:c:f:o:w:z::t::x::l::W::S::n:P:T:A:LG:D:R:p::e")) != -1)
 	{
 		switch (opt)
 		{
@@ -371,6 +355,19 @@ int main(int argc, char** argv)
 			command = CMD_DUMPEEPROM;
 			addr_range = optarg;
 			break;
+		case 'c':
+			state_file = optarg;
+			break;
+		case 'f':
+			if ((out_format = eeimage_format(optarg)) < 0)
+			{
+				print_usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'o':
+			out_file = optarg;
+			break;
 		case 't':
 			if (command != CMD_NONE)
 			{
@@ -406,6 +403,141 @@ int main(int argc, char** argv)
 			}
 			command = CMD_ZEROWASTE;
 			break;
+		case 'x':
+			if (command != CMD_NONE)
+			{
+				print_usage(argv[0]);
+				return 1;
+			}
+			command = CMD_FINDCOUNTERS;
+			str_model_code = optarg;
+			break;
+		case 'l':
+			if (command != CMD_NONE)
+			{
+				print_usage(argv[0]);
+				return 1;
+			}
+			command = CMD_INVENTORY;
+			inventory_pattern = optarg;
+			break;
+		case 'W':
+			watch = 1;
+			watch_dir = optarg;
+			break;
+		case 'S':
+			if (command != CMD_NONE)
+			{
+				print_usage(argv[0]);
+				return 1;
+			}
+			command = CMD_SAMPLE;
+			sample_addrs = optarg;
+			break;
+		case 'P':
+			if (command != CMD_NONE)
+			{
+				print_usage(argv[0]);
+				return 1;
+			}
+			command = CMD_PRINTJOB;
+			job_file = optarg;
+			break;
+		case 'A':
+			archive = optarg;
+			break;
+		case 'R':
+			if (command != CMD_NONE)
+			{
+				print_usage(argv[0]);
+				return 1;
+			}
+			command = CMD_RESTORE;
+			restore_image = optarg;
+			break;
+		case 'L':
+			if (command != CMD_NONE)
+			{
+				print_usage(argv[0]);
+				return 1;
+			}
+			command = CMD_ARCHIVELIST;
+			break;
+		case 'G':
+			if (command != CMD_NONE)
+			{
+				print_usage(argv[0]);
+				return 1;
+			}
+			command = CMD_ARCHIVEGET;
+			snap_id1 = strtoul(optarg, &inval_pos, 10);
+			if (*inval_pos != '\0')
+			{
+				print_usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'D':
+			if (command != CMD_NONE)
+			{
+				print_usage(argv[0]);
+				return 1;
+			}
+			command = CMD_ARCHIVEDIFF;
+			snap_id1 = strtoul(optarg, &inval_pos, 10);
+			if (*inval_pos != ',')
+			{
+				print_usage(argv[0]);
+				return 1;
+			}
+			snap_id2 = strtoul(inval_pos + 1, &inval_pos, 10);
+			if (*inval_pos != '\0')
+			{
+				print_usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'p':
+			if (command != CMD_NONE)
+			{
+				print_usage(argv[0]);
+				return 1;
+			}
+			command = CMD_PING;
+			if (optarg)
+			{
+				ping_timeout = strtol(optarg, &inval_pos, 10);
+				if (*inval_pos != '\0' || ping_timeout <= 0 || ping_timeout > 0xFFFF)
+				{
+					print_usage(argv[0]);
+					return 1;
+				}
+			}
+			break;
+		case 'e':
+			if (command != CMD_NONE)
+			{
+				print_usage(argv[0]);
+				return 1;
+			}
+			command = CMD_SERVICES;
+			break;
+		case 'T':
+			deadline = strtol(optarg, &inval_pos, 10);
+			if (*inval_pos != '\0' || deadline <= 0)
+			{
+				print_usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'n':
+			samples = strtoul(optarg, &inval_pos, 10);
+			if (*inval_pos != '\0')
+			{
+				print_usage(argv[0]);
+				return 1;
+			}
+			break;
 		default:
 			return 1;
 		}
@@ -413,13 +545,58 @@ int main(int argc, char** argv)
 
 	//parameters checking...
 
-	if (command == CMD_NONE)
+	if (watch)
+	{
+		//watch mode runs identify (CMD_NONE), ink levels or reset on every device
+		if (command != CMD_NONE && command != CMD_GETINK && command != CMD_ZEROINK && command != CMD_ZEROWASTE)
+		{
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+	else if (command == CMD_NONE)
+	{
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	//checkpoint is kept only by EEPROM dump
+	if (state_file && command != CMD_DUMPEEPROM)
 	{
 		print_usage(argv[0]);
 		return 1;
 	}
 
-	if (raw_device == NULL)
+	//cost is reported whatever way the command ends
+	if ((cost_operation = getenv(COST_ENV)) && *cost_operation)
+	{
+		cost_json = !strcmp(cost_operation, "json");
+		cost_operation = watch ? "watch" : cost_operations[command];
+		d4Accounting = 1;
+		gettimeofday(&cost_start, NULL);
+		atexit(print_cost);
+	}
+
+	//CMD_INVENTORY works on many devices
+	if (command == CMD_INVENTORY)
+		return do_inventory(inventory_pattern ? inventory_pattern : INVENTORY_DEVICES);
+
+	//archive commands don't need printer
+	if (command == CMD_ARCHIVELIST || command == CMD_ARCHIVEGET || command == CMD_ARCHIVEDIFF)
+	{
+		if (!archive)
+		{
+			print_usage(argv[0]);
+			return 1;
+		}
+		if (command == CMD_ARCHIVELIST)
+			return do_archive_list(archive);
+		if (command == CMD_ARCHIVEGET)
+			return do_archive_get(archive, snap_id1, out_file, out_format);
+		return do_archive_diff(archive, snap_id1, snap_id2);
+	}
+
+	if (raw_device == NULL && !watch)
 	{
 		print_usage(argv[0]);
 		return 1;
@@ -429,7 +606,14 @@ int main(int argc, char** argv)
 	{
 		//check the range parameter..
 
-		if (strlen(addr_range) == 4)
+		if (!strcmp(addr_range, "all"))
+		{
+			//real range will be found by reink_probe_eeprom
+			dump_all = 1;
+			addr_s = 0x0000;
+			addr_e = 0xFFFF;
+		}
+		else if (strlen(addr_range) == 4)
 		{
 			addr_s = strtol(addr_range, &inval_pos, 16);
 			if (*inval_pos != '\0')
@@ -514,7 +698,7 @@ int main(int argc, char** argv)
 			}
 		}
 	}
-	else if (command == CMD_REPORT)
+	else if (command == CMD_REPORT || command == CMD_FINDCOUNTERS)
 	{
 		if (str_model_code)
 		{
@@ -547,46 +731,106 @@ int main(int argc, char** argv)
 	}
 	//end of options parsing
 
+	if (watch)
+		return do_watch(watch_dir ? watch_dir : WATCH_DIR, command, ink_type);
+
+	//CMD_PING has it's own deadline and does almost nothing to be interrupted
+	if (command == CMD_PING)
+		return do_ping(raw_device, ping_timeout);
+
+	//the rest works with one printer: bound the whole command by the deadline
+	//and leave printer with closed channels if interrupted
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_interrupt;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	if (deadline)
+		reink_set_deadline(deadline * 1000);
+
 	//CMD_REPORT is a special case
 	if (command == CMD_REPORT)
 		return do_make_report(raw_device, model_code);
 
+	//CMD_SERVICES works on unknown printers too
+	if (command == CMD_SERVICES)
+		return do_services(raw_device);
+
 	//identifing printer
-	pmodel = printer_model(raw_device);
-	if (pmodel == PM_UNKNOWN)
+	reink_init(&session);
+	session.debug = ri_debug;
+	if (reink_open(&session, raw_device))
+	{
+		fprintf(stderr, "%s\n", session.error);
+		return 1;
+	}
+
+	if (command == CMD_FINDCOUNTERS && (model_code[0] != 0 || model_code[1] != 0))
+	{
+		//CMD_FINDCOUNTERS with model code is for unknown printer
+		session.printer.model_code[0] = model_code[0];
+		session.printer.model_code[1] = model_code[1];
+	}
+	else if (session.pm == PM_UNKNOWN)
 	{
 		fprintf(stderr, "Unknown printer. Wrong device file?\n");
+		reink_close(&session);
 		return 1;
 	}
 
+	//read-only commands still work with the journal of another printer
+	if (session.journal_block[0])
+		fprintf(stderr, "Warning: %s\n", session.journal_block);
+
 	switch (command)
 	{
 	case CMD_GETINK:
-		return do_ink_levels(raw_device, pmodel);
+		ret = do_ink_levels(&session);
 		break;
 
 	case CMD_DUMPEEPROM:
-		return do_eeprom_dump(raw_device, pmodel, addr_s, addr_e);
+		ret = do_eeprom_dump(&session, addr_s, addr_e, dump_all, state_file, out_file, out_format, archive, raw_device);
 		break;
 
 	case CMD_WRITEEEPROM:
-		return do_eeprom_write(raw_device, pmodel, write_addr, write_byte);
+		ret = do_eeprom_write(&session, write_addr, write_byte);
+		break;
+
+	case CMD_RESTORE:
+		ret = do_eeprom_restore(&session, restore_image, out_format, archive);
 		break;
 
 	case CMD_ZEROINK:
-		return do_ink_reset(raw_device, pmodel, ink_type);
+		ret = do_ink_reset(&session, ink_type);
 		break;
 		
 	case CMD_ZEROWASTE:
-		return do_waste_reset(raw_device, pmodel);
+		ret = do_waste_reset(&session);
+		break;
+
+	case CMD_FINDCOUNTERS:
+		ret = do_find_counters(&session, raw_device);
+		break;
+
+	case CMD_SAMPLE:
+		ret = do_sample(&session, sample_addrs, samples, out_file);
+		break;
+
+	case CMD_PRINTJOB:
+		ret = do_print_job(&session, job_file);
 		break;
 
 	default:
 		fprintf(stderr, "Unknown command.\n");
+		ret = 1;
+	}
+
+	if (session.fd >= 0 && reink_close(&session) < 0)
+	{
+		fprintf(stderr, "%s\n", session.error);
 		return 1;
 	}
 
-	return 0;
+	return ret;
 }
 
 void print_usage(const char* progname)
@@ -601,11 +845,34 @@ Basic usage is:\n\
 	<addr> - two-byte address of EEPROM to read\n\
 	Two addresses recognized as range.\n\
 	Example: %s -d 0000-A000 -r /dev/usb/lp0\n\
+	Use \"all\" as <addr> to detect EEPROM size and dump it whole.\n\
+	Add -c <state_file> to checkpoint progress to <state_file>. If dump\n\
+	is interrupted, rerun it with the same range, printer device and\n\
+	<state_file> to continue from the last successfully read address.\n\
+	Add -f <format> to select output format: text (default), bin (raw\n\
+	image, offset in file is EEPROM address) or ihex (Intel HEX).\n\
+	Add -o <file> to write the dump to <file> instead of stdout.\n\
+	Add -A <archive> to also store the dump as a snapshot to <archive>\n\
+	directory. Blocks shared with stored snapshots are not stored again.\n\
+\n\
+    - to work with snapshots stored to <archive>\n\
+	%s -A <archive> -L\n\
+	lists snapshots;\n\
+	%s -A <archive> -G <id> [-f <format>] [-o <file>]\n\
+	writes snapshot <id> as -d does;\n\
+	%s -A <archive> -D <id1>,<id2>\n\
+	prints bytes differing between snapshots <id1> and <id2>.\n\
 \n\
     - to write to arbitary EEPROM address (CAUTION: THIS MAY DAMAGE YOUR PRINTER!)\n\
 	%s -w <addr>=<data> -r printer_raw_device\n\
 	Writes <data> to <addr>\n\
 	Example: %s -w 0006=00 -r /dev/usb/lp0\n\
+\n\
+    - to restore EEPROM from image made by -d (CAUTION: THIS MAY DAMAGE YOUR PRINTER!)\n\
+	%s -R <image> [-f <format>] -r printer_raw_device\n\
+	%s -R <id> -A <archive> -r printer_raw_device\n\
+	Addresses of <image> (or snapshot <id> of <archive>) are read, only\n\
+	differing bytes are written, then they are read again to verify.\n\
 \n\
     - to reset ink level for ink type ink_type:\n\
 	%s -z[ink_type] -r printer_raw_device\n\
@@ -618,14 +885,163 @@ Basic usage is:\n\
 \n\
     - to make an test report, containing some information about your printer\n\
 	./reink -t -r printer_raw_device > testreport.log\n\
+\n\
+    - to find addresses of ink and waste counters of your printer\n\
+	%s -x[model_code] -r printer_raw_device\n\
+	<model_code> - printer secret model code found by test report,\n\
+	required only if printer is not supported yet.\n\
+\n\
+    - to list printers on all devices (probed in parallel)\n\
+	%s -l[pattern]\n\
+	<pattern> - devices to scan, default is " INVENTORY_DEVICES "\n\
+\n\
+    - to sample EEPROM addresses continuously (i.e. during printing)\n\
+	%s -S[<addr>,<addr>,...] [-n samples] [-o file] -r printer_raw_device\n\
+	Addresses are read as fast as possible in one session (inks counters\n\
+	of the printer by default) until <samples> are taken or interrupted.\n\
+	Each sample is written to <file> (stdout by default) as binary record:\n\
+	8 bytes timestamp (microseconds since epoch, little-endian) and a byte\n\
+	per address. The file starts with \"" SAMPLE_MAGIC "\", addresses count\n\
+	and addresses (2 bytes each, little-endian).\n\
+\n\
+    - to print a job and watch ink levels while printing\n\
+	%s -P job_file -r printer_raw_device\n\
+	<job_file> - ready to print data (i.e. made by printer driver), sent\n\
+	by \"EPSON-DATA\" channel while ink levels are polled by \"EPSON-CTRL\".\n\
+\n\
+    - to check that printer is alive (i.e. for print queue health checks)\n\
+	%s -p[timeout] -r printer_raw_device\n\
+	Only IEEE 1284.4 Init and Exit are done, or reinkd session is used.\n\
+	Prints state and latency, exits with 0 if printer is alive, 2 if\n\
+	device is busy and 1 if printer doesn't reply in <timeout> ms\n\
+	(default is %d).\n\
+\n\
+    - to list IEEE 1284.4 services of printer (i.e. of a new model)\n\
+	%s -e -r printer_raw_device\n\
+	Name of service on every socket is asked. Found sockets are cached\n\
+	(see REINK_SOCKETS below).\n\
+\n\
+    - to watch for printers being plugged in or powered on\n\
+	%s -W[dir] [-i | -z[ink_type] | -s]\n\
+	<dir> - directory of " WATCH_PREFIX "* devices, default is " WATCH_DIR "\n\
+	Every printer appeared is identified, and its ink levels are printed\n\
+	if -i is given. Resets (-z, -s) are pending until the printer appears\n\
+	and are applied once per device.\n\
+\n\
+    Add -T <seconds> to any command working with one printer to limit its\n\
+ total time. When it expires or reink is interrupted, printer channels are\n\
+ closed and IEEE 1284.4 mode is exited before reink stops.\n\
 \n\
     You can set REINK_DEBUG environment variable to enable debug  output to\n\
  stderr.\n\
  REINK_DEBUG=0 - no debug;\n\
  REINK_DEBUG=1 - debug only reink.c;\n\
- REINK_DEBUG=2 - debug reink.c and d4lib.c also.\n",
+ REINK_DEBUG=2 - debug reink.c and d4lib.c also.\n\
+\n\
+    Set REINK_CAPTURE=<file> to record all the data exchanged with printer\n\
+ to <file>. Set REINK_REPLAY=<file> to replay such a capture instead of\n\
+ using the printer (printer_raw_device is not opened then), with the\n\
+ original timing or as fast as possible if REINK_REPLAY_FAST=1 is set.\n\
+\n\
+    Set REINK_FAULTS=<rules> to inject faults to the data exchanged with\n\
+ printer, comma separated rules are seed=<n> and\n\
+ <fault>[=<arg>]:<transaction>[@<n>|~<percent>], where <fault> is lose,\n\
+ short, drop, delay, truncate, corrupt, error or result (see d4lib.c),\n\
+ <transaction> is Init, OpenChannel, Credit, ..., Data, Other or any.\n\
+ Example: REINK_FAULTS=seed=7,drop:CreditRequest@1,corrupt:Data~5\n\
+ Use with REINK_COST to time the recovery.\n\
+\n\
+    Multi-byte writes (-z, -s, -R) are journaled to REINK_JOURNAL directory\n\
+ (/var/tmp/reink-<user id> by default, set it empty to disable). If such\n\
+ a write is interrupted, it is completed next time the printer is opened\n\
+ on the same device. Journal of another printer (or a damaged one) only\n\
+ makes writes refused until it is removed.\n\
+\n\
+    Sockets of IEEE 1284.4 services are cached per printer model in\n\
+ REINK_SOCKETS file (/var/tmp/reink-<user id>/sockets by default, set it\n\
+ empty to disable), so they are not asked every time. Cached socket is\n\
+ asked again if it can't be opened.\n\
+\n\
+    If reinkd is running, printer session of the daemon is used. Daemon\n\
+ socket is " REINKD_SOCKET " or the value of REINKD_SOCKET environment\n\
+ variable (set it empty to use the device directly).\n\
+\n\
+    Set REINK_COST=text or REINK_COST=json to print what the command took\n\
+ to stderr at exit: time waiting for printer, sleeping and CPU time, then\n\
+ syscalls, sleeps and context switches by IEEE 1284.4 transaction type.\n",
  REINK_VERSION_MAJOR, REINK_VERSION_MINOR, REINK_VERSION_REV,
- progname, progname, progname, progname, progname, progname, progname, progname);
+ progname, progname, progname, progname, progname, progname, progname, progname, progname, progname, progname, progname, progname, progname, progname, progname, progname, progname, PING_TIMEOUT, progname, progname);
+}
+
+void print_cost()
+{
+	struct rusage usage;
+	struct timeval now;
+	double wall, user, sys, waited = 0, slept = 0, rest;
+	const d4Cost_t* c;
+	int i, first = 1;
+
+	gettimeofday(&now, NULL);
+	getrusage(RUSAGE_SELF, &usage);
+	wall = now.tv_sec - cost_start.tv_sec + (now.tv_usec - cost_start.tv_usec) / 1e6;
+	user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+	sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+	for (i = 0; i < D4_COSTS; i++)
+	{
+		waited += d4Stats.cost[i].waited;
+		slept += d4Stats.cost[i].slept;
+	}
+	rest = wall - waited - slept - user - sys;
+
+	if (cost_json)
+	{
+		fprintf(stderr, "{\"operation\": \"%s\", \"wall\": %.6f, \"printer_wait\": %.6f, \"slept\": %.6f, "
+			"\"cpu_user\": %.6f, \"cpu_system\": %.6f, \"voluntary_switches\": %ld, \"involuntary_switches\": %ld, "
+			"\"retries\": %lu, \"timeouts\": %lu, \"faults\": %lu, \"transactions\": {",
+			cost_operation, wall, waited, slept, user, sys, usage.ru_nvcsw, usage.ru_nivcsw,
+			d4Stats.retries, d4Stats.timeouts, d4Stats.faults);
+		for (i = 0; i < D4_COSTS; i++)
+		{
+			c = &d4Stats.cost[i];
+			if (!d4CostNames[i] || (!c->count && !c->reads && !c->writes && !c->sleeps))
+				continue;
+			fprintf(stderr, "%s\"%s\": {\"count\": %lu, \"reads\": %lu, \"writes\": %lu, \"polls\": %lu, "
+				"\"sleeps\": %lu, \"voluntary_switches\": %lu, \"printer_wait\": %.6f, \"slept\": %.6f, "
+				"\"cpu\": %.6f, \"wall\": %.6f}",
+				first ? "" : ", ", d4CostNames[i], c->count, c->reads, c->writes, c->polls,
+				c->sleeps, c->csw, c->waited, c->slept, c->cpu, c->wall);
+			first = 0;
+		}
+		fprintf(stderr, "}, \"sleeps\": {");
+		for (i = 0; i < D4_SLEEP_SITES; i++)
+			fprintf(stderr, "%s\"%s\": %.6f", i ? ", " : "", d4SleepNames[i], d4Stats.slept[i]);
+		fprintf(stderr, "}}\n");
+		return;
+	}
+
+	fprintf(stderr, "Cost of %s: %.3f s, %ld voluntary and %ld involuntary context switches\n",
+		cost_operation, wall, usage.ru_nvcsw, usage.ru_nivcsw);
+	fprintf(stderr, "  %-26s %9.3f s %5.1f%%\n", "waiting for printer", waited, wall > 0 ? 100 * waited / wall : 0);
+	fprintf(stderr, "  %-26s %9.3f s %5.1f%%\n", "sleeping", slept, wall > 0 ? 100 * slept / wall : 0);
+	fprintf(stderr, "  %-26s %9.3f s %5.1f%%\n", "own CPU (user)", user, wall > 0 ? 100 * user / wall : 0);
+	fprintf(stderr, "  %-26s %9.3f s %5.1f%%\n", "own CPU (system)", sys, wall > 0 ? 100 * sys / wall : 0);
+	fprintf(stderr, "  %-26s %9.3f s %5.1f%%\n", "the rest (scheduling, ...)", rest > 0 ? rest : 0, wall > 0 && rest > 0 ? 100 * rest / wall : 0);
+	fprintf(stderr, "  %lu retries, %lu timeouts, %lu faults injected\n", d4Stats.retries, d4Stats.timeouts, d4Stats.faults);
+
+	fprintf(stderr, "%-15s %7s %7s %7s %7s %7s %7s %9s %9s %9s %9s\n", "Transaction", "count", "reads", "writes",
+		"polls", "sleeps", "vcsw", "wait, s", "sleep, s", "CPU, s", "total, s");
+	for (i = 0; i < D4_COSTS; i++)
+	{
+		c = &d4Stats.cost[i];
+		if (!d4CostNames[i] || (!c->count && !c->reads && !c->writes && !c->sleeps))
+			continue;
+		fprintf(stderr, "%-15s %7lu %7lu %7lu %7lu %7lu %7lu %9.3f %9.3f %9.3f %9.3f\n", d4CostNames[i], c->count,
+			c->reads, c->writes, c->polls, c->sleeps, c->csw, c->waited, c->slept, c->cpu, c->wall);
+	}
+
+	fprintf(stderr, "Slept in:");
+	for (i = 0; i < D4_SLEEP_SITES; i++)
+		fprintf(stderr, " %s %.3f s%s", d4SleepNames[i], d4Stats.slept[i], i < D4_SLEEP_SITES - 1 ? "," : "\n");
 }
 
 /////////////////////////////////////////////////////////////////////////////////
@@ -633,64 +1049,39 @@ Basic usage is:\n\
 /////////////////////////////////////////////////////////////////////////////////
 //
 
-int do_ink_levels(const char* raw_device, unsigned int pmodel)
+int do_ink_levels(reink_session_t* s)
 {
-	int device; //file descriptor of the printer raw_device
-	int ctrl_socket; //IEEE 1284.4 socket identifier for "EPSON-CTRL" channel
-
-	char buf[INPUT_BUF_LEN]; //buffer for input data
-	int readed; //number of readed bytes
+	reink_ink_levels_t levels; //parsed "st" reply
+	int i;
 
 	D(fprintf(stderr, "=== do_ink_levels ===\n"))
 
-	if ((device = printer_connect(raw_device)) < 0)
-		return 1;
-
-	if ((ctrl_socket = open_channel(device, "EPSON-CTRL")) < 0)
-		return 1;
-
-	D(fprintf(stderr, "Everything seems to be ready. :) Let's get ink level. Executing \"st\" command... "))
-	readed = INPUT_BUF_LEN;
-	if (printer_transact(device, ctrl_socket, "st\1\0\1", 5, buf, &readed))
-		return 1;
-	D_OK
-
-	D(fprintf(stderr, "Parsing result... "))
-	if (parse_ink_result(buf, readed))
+	if (reink_ink_levels(s, &levels))
 	{
-		fprintf(stderr, "FAIL.\n");
+		fprintf(stderr, "%s\n", s->error);
 		return 1;
 	}
-	D_OK
 
-	if (close_channel(device, ctrl_socket) < 0)
-		return 1;
-
-	if (printer_disconnect(device) < 0)
-		return 1;
+	printf("Ink levels:\n");
+	for (i = 0; i < levels.count; i++)
+		printf("Ink type (color) %d remains %d percents.\n", i+1, levels.level[i]);
 
 	D(fprintf(stderr, "^^^ do_ink_levels ^^^\n"))
 	return 0;
 }
 
-int do_ink_reset(const char* raw_device, unsigned int pm, unsigned char ink_type)
+int do_ink_reset(reink_session_t* s, unsigned char ink_type)
 {
 	int i;
 	unsigned char cur_ink;
 	unsigned char* cur_addr;
-
-	int device; //file descriptor of the printer raw_device
-	int ctrl_socket; //IEEE 1284.4 socket identifier for "EPSON-CTRL" channel
+	unsigned short int addrs[6 * 4]; //counters of all inks are reset at once
+	unsigned char zeros[6 * 4] = { 0 };
+	int count = 0;
 
 	D(fprintf(stderr, "=== do_ink_reset ===\n"))
 	
-	if (pm == PM_UNKNOWN)
-		return 1;
-
-	if ((device = printer_connect(raw_device)) < 0)
-		return 1;
-
-	if ((ctrl_socket = open_channel(device, "EPSON-CTRL")) < 0)
+	if (s->pm == PM_UNKNOWN)
 		return 1;
 
 	for(cur_ink = 1; cur_ink != 0x80; cur_ink <<= 1)
@@ -698,200 +1089,1237 @@ int do_ink_reset(const char* raw_device, unsigned int pm, unsigned char ink_type
 		if (!(cur_ink & ink_type))
 			continue;
 		
-		if (!(printers[pm].inkmap.mask & cur_ink))
+		if (!(s->printer.inkmap.mask & cur_ink))
 		{
 			if (ink_type == 0xFF) //reset all inks
 				continue;
 				
-			fprintf(stderr, "Printer \"%s\" doesn't have ink bit %d.\n", printers[pm].name, cur_ink);
+			fprintf(stderr, "Printer \"%s\" doesn't have ink bit %d.\n", s->printer.name, cur_ink);
 			return 1;
 		}
 		
 		switch(cur_ink)
 		{
 		case INK_BLACK:
-			cur_addr = printers[pm].inkmap.black;
+			cur_addr = s->printer.inkmap.black;
 			break;
 		case INK_CYAN:
-			cur_addr = printers[pm].inkmap.cyan;
+			cur_addr = s->printer.inkmap.cyan;
 			break;
 		case INK_MAGENTA:
-			cur_addr = printers[pm].inkmap.magenta;
+			cur_addr = s->printer.inkmap.magenta;
 			break;
 		case INK_YELLOW:
-			cur_addr = printers[pm].inkmap.yellow;
+			cur_addr = s->printer.inkmap.yellow;
 			break;
 		case INK_LIGHTCYAN:
-			cur_addr = printers[pm].inkmap.lightcyan;
+			cur_addr = s->printer.inkmap.lightcyan;
 			break;
 		case INK_LIGHTMAGENTA:
-			cur_addr = printers[pm].inkmap.lightmagenta;
+			cur_addr = s->printer.inkmap.lightmagenta;
 			break;
 		default:
 			fprintf(stderr, "Unknown ink bit %d.\n", cur_ink);
 			return 1;
 		}
 		
-		D(fprintf(stderr, "Resetting ink bit %d... ", cur_ink));
+		D(fprintf(stderr, "Resetting ink bit %d.\n", cur_ink));
 		for (i=0;i<4;i++)
-			if (write_eeprom_address(device, ctrl_socket, pm, cur_addr[i], 0x00))
-			{
-				fprintf(stderr, "Can't write to eeprom.\n");
-				return 1;
-			}
-		D_OK
+			addrs[count++] = cur_addr[i];
 	}
-	
-	if (close_channel(device, ctrl_socket) < 0)
-		return 1;
 
-	if (printer_disconnect(device) < 0)
+	D(fprintf(stderr, "Writing %d bytes... ", count));
+	if (reink_write_eeprom_batch(s, addrs, zeros, count))
+	{
+		fprintf(stderr, "Can't write to eeprom: %s\n", s->error);
 		return 1;
+	}
+	D_OK
 
 	D(fprintf(stderr, "^^^ do_ink_reset ^^^\n"))
 
 	return 0;
 }
 
-int do_eeprom_dump(const char* raw_device, unsigned int pm, unsigned short int start_addr, unsigned short int end_addr)
+int do_eeprom_dump(reink_session_t* s, unsigned short int start_addr, unsigned short int end_addr, int probe, const char* state_file, const char* out_file, int out_format, const char* archive, const char* raw_device)
 {
-	int device; //file descriptor of the printer raw_device
-	int ctrl_socket; //IEEE 1284.4 socket identifier for "EPSON-CTRL" channel
-
 	unsigned char data; //eeprom data (one byte)
-	unsigned short int cur_addr; //current address
-
-	int i;
+	unsigned int cur_addr; //current address
+	FILE* checkpoint = NULL; //dump progress
+	eeimage_t img; //dump output
+	unsigned char image[0x10000]; //dump indexed by address, for archive
+	snap_info_t info; //archived snapshot
 
 	D(fprintf(stderr, "=== do_eeprom_dump ===\n"))
 
-	if (pm == PM_UNKNOWN)
+	if (s->pm == PM_UNKNOWN)
 		return 1;
 
-	if ((device = printer_connect(raw_device)) < 0)
-		return 1;
-
-	if ((ctrl_socket = open_channel(device, "EPSON-CTRL")) < 0)
-		return 1;
+	if (probe && !s->printer.eeprom_size)
+	{
+		if (reink_probe_eeprom(s))
+		{
+			fprintf(stderr, "Can't detect EEPROM size: %s\n", s->error);
+			return 1;
+		}
+		if (s->probe_blank)
+			fprintf(stderr, "Warning: EEPROM wraparound was seen on blank data only, size %#x may be wrong.\n", s->printer.eeprom_size);
+	}
 
-	if (!printers[pm].twobyte_addresses && (end_addr & 0xFF00))
+	if (s->printer.eeprom_size && end_addr >= s->printer.eeprom_size)
 	{
-		fprintf(stderr, "Printer \"%s\" doesn't support two-byte addresses, I will use lower byte only.\n", printers[pm].name);
+		if (!probe)
+			fprintf(stderr, "Printer \"%s\" EEPROM size is %#x bytes, dump will be truncated.\n", s->printer.name, s->printer.eeprom_size);
+		end_addr = s->printer.eeprom_size - 1;
+		if (start_addr > end_addr)
+			return 1;
+	}
+
+	if (!s->printer.twobyte_addresses && (end_addr & 0xFF00))
+	{
+		fprintf(stderr, "Printer \"%s\" doesn't support two-byte addresses, I will use lower byte only.\n", s->printer.name);
 		start_addr &= 0xFF;
 		end_addr &= 0xFF;
 	}
 
-	D(fprintf(stderr, "Let's get the EEPROM dump (%x - %x)...\n", start_addr, end_addr))
+	if (eeimage_open(&img, out_file, out_format))
+		return 1;
 
-	for (cur_addr = start_addr; (cur_addr <= end_addr) && (cur_addr >= start_addr); cur_addr++)
+	cur_addr = start_addr;
+	if (state_file)
 	{
-		if (read_eeprom_address(device, ctrl_socket, pm, cur_addr, &data))
+		if (!(checkpoint = checkpoint_open(s, state_file, raw_device, start_addr, end_addr, &img, image, &cur_addr)))
 		{
-			fprintf(stderr, "Fail to read EEPROM data from address %x.\n", cur_addr);
+			eeimage_close(&img);
 			return 1;
 		}
-		printf("0x%04X = 0x%02X\n", cur_addr, data);
-		if (cur_addr == end_addr)
-			break; //or there may be short int overflow and infinite loop
+	}
+
+	D(fprintf(stderr, "Let's get the EEPROM dump (%x - %x)...\n", cur_addr, end_addr))
+
+	for (; cur_addr <= end_addr; cur_addr++)
+	{
+		if (reink_read_eeprom_retry(s, cur_addr, &data))
+		{
+			fprintf(stderr, "Fail to read EEPROM data from address %x: %s\n", cur_addr, s->error);
+			eeimage_close(&img);
+			if (checkpoint)
+			{
+				fclose(checkpoint);
+				fprintf(stderr, "Progress saved to '%s', rerun the same command to continue.\n", state_file);
+			}
+			return 1;
+		}
+
+		image[cur_addr] = data;
+		if (eeimage_put(&img, cur_addr, data))
+		{
+			fprintf(stderr, "Fail to write EEPROM data from address %x to image.\n", cur_addr);
+			eeimage_close(&img);
+			if (checkpoint)
+				fclose(checkpoint);
+			return 1;
+		}
+
+		if (checkpoint)
+		{
+			fprintf(checkpoint, "0x%04X = 0x%02X\n", cur_addr, data);
+			fflush(checkpoint);
+		}
 	}
 
 	D_OK
 
-	if (close_channel(device, ctrl_socket) < 0)
+	if (eeimage_close(&img))
+	{
+		if (checkpoint)
+			fclose(checkpoint);
 		return 1;
+	}
 
-	if (printer_disconnect(device) < 0)
-		return 1;
+	if (checkpoint)
+	{
+		fclose(checkpoint);
+		unlink(state_file); //dump complete, no need to continue it later
+	}
+
+	if (archive)
+	{
+		memset(&info, 0, sizeof(info));
+		snprintf(info.model, SS_NAME_LEN, "%s", s->printer.name);
+		info.model_code[0] = s->printer.model_code[0];
+		info.model_code[1] = s->printer.model_code[1];
+		info.start = start_addr;
+		info.size = end_addr - start_addr + 1;
+		snprintf(info.device, SS_DEVICE_LEN, "%s", raw_device);
+		if (snapstore_put(archive, &info, image + start_addr))
+			return 1;
+		fprintf(stderr, "Stored as snapshot %u of '%s'.\n", info.id, archive);
+	}
 
 	D(fprintf(stderr, "^^^ do_eeprom_dump ^^^\n"))
 	return 0;
 }
 
-int do_eeprom_write(const char* raw_device, unsigned int pm, unsigned short int addr, unsigned char data)
+int do_eeprom_write(reink_session_t* s, unsigned short int addr, unsigned char data)
 {
-	int device; //file descriptor of the printer raw_device
-	int ctrl_socket; //IEEE 1284.4 socket identifier for "EPSON-CTRL" channel
-
 	unsigned char readed_data; //verification data
 
 	D(fprintf(stderr, "=== do_eeprom_write ===\n"))
 
-	if (pm == PM_UNKNOWN)
+	if (s->pm == PM_UNKNOWN)
 		return 1;
 
-	if ((device = printer_connect(raw_device)) < 0)
+	D(fprintf(stderr, "Let's write %#x to EEPROM address %#x...\n", data, addr))
+	if (reink_write_eeprom(s, addr, data))
+	{
+		fprintf(stderr, "Fail to write EEPROM data to address %#x: %s\n", addr, s->error);
 		return 1;
+	}
+	D_OK
 
-	if ((ctrl_socket = open_channel(device, "EPSON-CTRL")) < 0)
+	D(fprintf(stderr, "Verify by reading that byte... "))
+	if (reink_read_eeprom(s, addr, &readed_data))
+	{
+		fprintf(stderr, "Fail to subsequent read from EEPROM address %#x: %s\n", addr, s->error);
 		return 1;
+	}
 
-	D(fprintf(stderr, "Let's write %#x to EEPROM address %#x...\n", data, addr))
-	if (write_eeprom_address(device, ctrl_socket, pm, addr, data))
+	if (readed_data != data)
 	{
-		fprintf(stderr, "Fail to write EEPROM data to address %#x.\n", addr);
+		fprintf(stderr, "Verification failed (readed byte = %#x).\n", readed_data);
 		return 1;
 	}
 	D_OK
 
-	D(fprintf(stderr, "Verify by reading that byte... "))
-	if (read_eeprom_address(device, ctrl_socket, pm, addr, &readed_data))
+	D(fprintf(stderr, "^^^ do_eeprom_write ^^^\n"))
+	return 0;
+}
+
+int do_eeprom_restore(reink_session_t* s, const char* image_file, int in_format, const char* archive)
+{
+	static unsigned char image[0x10000]; //bytes to restore, indexed by address
+	static unsigned char covered[0x10000]; //is address in image?
+	static unsigned short int addrs[0x10000]; //addresses to read, then to write
+	static unsigned char current[0x10000]; //bytes read from printer
+	snap_info_t info; //restored snapshot
+	unsigned long id; //snapshot id
+	char* inval_pos;
+	long count; //count of addresses in image
+	long changed; //count of differing bytes
+	long i;
+
+	D(fprintf(stderr, "=== do_eeprom_restore ===\n"))
+
+	if (s->pm == PM_UNKNOWN)
+		return 1;
+
+	if (archive)
+	{
+		id = strtoul(image_file, &inval_pos, 10);
+		if (*inval_pos != '\0')
+		{
+			fprintf(stderr, "Snapshot id expected instead of '%s'.\n", image_file);
+			return 1;
+		}
+		if (snapstore_get(archive, id, &info, current))
+			return 1;
+		for (i = 0; i < info.size; i++)
+		{
+			image[info.start + i] = current[i];
+			covered[info.start + i] = 1;
+		}
+		if (strcmp(info.model, (const char*)s->printer.name))
+			fprintf(stderr, "Warning: snapshot %lu is of \"%s\".\n", id, info.model);
+	}
+	else if (eeimage_load(image_file, in_format, image, covered) < 0)
+		return 1;
+
+	for (i = 0, count = 0; i < 0x10000; i++)
+	{
+		if (!covered[i])
+			continue;
+		if ((!s->printer.twobyte_addresses && i > 0xFF) || (s->printer.eeprom_size && i >= s->printer.eeprom_size))
+		{
+			fprintf(stderr, "Image address %#lx is out of printer \"%s\" EEPROM.\n", i, s->printer.name);
+			return 1;
+		}
+		addrs[count++] = i;
+	}
+
+	D(fprintf(stderr, "Reading %ld addresses of EEPROM...\n", count))
+	if (reink_read_eeprom_batch(s, addrs, count, current))
+	{
+		fprintf(stderr, "Fail to read EEPROM: %s\n", s->error);
+		return 1;
+	}
+
+	//only differing bytes are written
+	for (i = 0, changed = 0; i < count; i++)
+	{
+		if (current[i] != image[addrs[i]])
+		{
+			addrs[changed] = addrs[i];
+			current[changed] = image[addrs[i]];
+			changed++;
+		}
+	}
+
+	printf("%ld of %ld bytes differ.\n", changed, count);
+	if (!changed)
+		return 0;
+
+	D(fprintf(stderr, "Writing %ld bytes to EEPROM...\n", changed))
+	if (reink_write_eeprom_batch(s, addrs, current, changed))
+	{
+		fprintf(stderr, "Fail to write EEPROM: %s\n", s->error);
+		return 1;
+	}
+
+	D(fprintf(stderr, "Verifying...\n"))
+	if (reink_read_eeprom_batch(s, addrs, changed, current))
+	{
+		fprintf(stderr, "Fail to verify EEPROM: %s\n", s->error);
+		return 1;
+	}
+
+	for (i = 0; i < changed; i++)
+	{
+		if (current[i] != image[addrs[i]])
+		{
+			fprintf(stderr, "Verification failed: EEPROM address %#x contains %#x instead of %#x.\n", addrs[i], current[i], image[addrs[i]]);
+			return 1;
+		}
+	}
+
+	printf("%ld bytes restored.\n", changed);
+
+	D(fprintf(stderr, "^^^ do_eeprom_restore ^^^\n"))
+	return 0;
+}
+
+int do_waste_reset(reink_session_t* s)
+{
+	int i;
+	unsigned short int addrs[sizeof(s->printer.wastemap.addr)];
+	unsigned char zeros[sizeof(s->printer.wastemap.addr)] = { 0 };
+
+	D(fprintf(stderr, "=== do_waste_reset ===\n"))
+
+	if (s->pm == PM_UNKNOWN)
+		return 1;
+
+	D(fprintf(stderr, "Resetting... "));
+	for (i=0;i<s->printer.wastemap.len;i++)
+		addrs[i] = s->printer.wastemap.addr[i];
+	if (reink_write_eeprom_batch(s, addrs, zeros, s->printer.wastemap.len))
+	{
+		fprintf(stderr, "Can't write to eeprom: %s\n", s->error);
+		return 1;
+	}
+	D_OK
+
+	D(fprintf(stderr, "^^^ do_waste_reset ^^^\n"))
+
+	return 0;
+}
+
+/*
+    Reads EEPROM addresses marked in <mask> (all if <mask> is NULL)
+    up to session printer EEPROM size to <snap>.
+    On success returns 0.
+    On fail returns -1.
+*/
+static int take_snapshot(reink_session_t* s, unsigned char* snap, const unsigned char* mask)
+{
+	unsigned int addr;
+
+	for (addr = 0; addr < s->printer.eeprom_size; addr++)
+	{
+		if (mask && !mask[addr])
+			continue;
+
+		if (reink_read_eeprom_retry(s, addr, &snap[addr]))
+		{
+			fprintf(stderr, "Fail to read EEPROM data from address %x: %s\n", addr, s->error);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int do_find_counters(reink_session_t* s, const char* raw_device)
+{
+	unsigned char before[0x10000]; //baseline snapshot
+	unsigned char after[0x10000]; //snapshot after user action
+	unsigned char scanned[0x10000]; //addresses read into after
+	counter_guess_t guesses[SD_MAX_GUESSES]; //ranked candidates
+	printer_t printer; //probed printer, survives reconnect
+	unsigned int likely; //count of likely addresses
+	unsigned int i;
+	int count; //count of candidates
+	int c;
+
+	D(fprintf(stderr, "=== do_find_counters ===\n"))
+
+	if (!s->printer.eeprom_size)
+	{
+		if (reink_probe_eeprom(s))
+		{
+			fprintf(stderr, "Can't detect EEPROM size: %s\n", s->error);
+			return 1;
+		}
+		if (s->probe_blank)
+			fprintf(stderr, "Warning: EEPROM wraparound was seen on blank data only, size %#x may be wrong.\n", s->printer.eeprom_size);
+	}
+
+	fprintf(stderr, "Taking baseline EEPROM snapshot (%#x bytes)...\n", s->printer.eeprom_size);
+	if (take_snapshot(s, before, NULL))
+		return 1;
+
+	//printer have to be free for cleaning or printing
+	printer = s->printer;
+	if (reink_close(s) < 0)
+	{
+		fprintf(stderr, "%s\n", s->error);
+		return 1;
+	}
+
+	fprintf(stderr, "Now run printer head cleaning (or print something),\n\
+wait until printer finishes and press Enter.\n");
+	while ((c = getchar()) != '\n' && c != EOF)
+		;
+
+	if (reink_open(s, raw_device))
+	{
+		fprintf(stderr, "%s\n", s->error);
+		return 1;
+	}
+	s->printer = printer;
+
+	likely = snapdiff_likely(s->printer.eeprom_size, scanned);
+	fprintf(stderr, "Rescanning %u likely addresses...\n", likely);
+	if (take_snapshot(s, after, scanned))
+		return 1;
+
+	count = snapdiff_rank(before, after, scanned, s->printer.eeprom_size, guesses, SD_MAX_GUESSES);
+	for (c = 0; c < count && guesses[c].kind == SD_UNKNOWN; c++)
+		;
+	if (c == count)
+	{
+		fprintf(stderr, "No counters found there, rescanning whole EEPROM...\n");
+		for (i = 0; i < s->printer.eeprom_size; i++)
+			scanned[i] = !scanned[i]; //don't read twice
+		if (take_snapshot(s, after, scanned))
+			return 1;
+		count = snapdiff_rank(before, after, NULL, s->printer.eeprom_size, guesses, SD_MAX_GUESSES);
+	}
+
+	if (!count)
+	{
+		printf("EEPROM was not changed. Did printer really use some ink?\n");
+		return 1;
+	}
+
+	printf("Changed EEPROM areas, most probable counters first:\n");
+	for (c = 0; c < count; c++)
+	{
+		printf("0x%04X-0x%04X %-20s %s-endian 0x%08lX -> 0x%08lX", guesses[c].addr, guesses[c].addr + guesses[c].len - 1,
+		       snapdiff_kind_name(guesses[c].kind), guesses[c].big_endian ? "big" : "little", guesses[c].before, guesses[c].after);
+		if (guesses[c].layout[0])
+			printf(" (as %s)", guesses[c].layout);
+		printf("\n");
+	}
+
+	D(fprintf(stderr, "^^^ do_find_counters ^^^\n"))
+
+	return 0;
+}
+
+//concurrency limit of probes of devices on one USB hub
+typedef struct _inventory_hub {
+	char path[PATH_MAX];	//hub sysfs path (directory of device if not known)
+	double limit;			//concurrent probes allowed, adapted to probe results
+	int active;				//probes running now
+	long fastest;			//the fastest probe time on hub (us), 0 - none yet
+} inventory_hub_t;
+
+//result of one device probe
+typedef struct _inventory_item {
+	const char* device;		//raw device path
+	inventory_hub_t* hub;	//hub device is on
+	int started;			//is probe started (hub limit allows it)?
+	int done;				//is probe finished?
+	int pm;					//printer model (PM_*), -1 if not an IEEE 1284.4 EPSON printer
+	printer_t printer;		//identified printer
+	char error[REINK_ERROR_LEN];	//why probe failed
+} inventory_item_t;
+
+static pthread_mutex_t inventory_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inventory_cond = PTHREAD_COND_INITIALIZER;
+static int inventory_done = 0; //count of finished probes
+
+/*
+    Finds USB hub of <device> (sysfs path of usbmisc device's parent
+    of its USB device) to <hub>. Devices not found in sysfs are grouped
+    by their directory.
+*/
+static void inventory_hub_of(const char* device, char* hub)
+{
+	char link[PATH_MAX];
+	const char* name;
+	char* slash;
+	int i;
+
+	name = (name = strrchr(device, '/')) ? name + 1 : device;
+	snprintf(link, sizeof(link), "/sys/class/usbmisc/%s/device", name);
+	if (realpath(link, hub))
+	{
+		//interface -> USB device -> hub
+		for (i = 0; i < 2 && (slash = strrchr(hub, '/')) && slash != hub; i++)
+			*slash = '\0';
+		return;
+	}
+
+	snprintf(hub, PATH_MAX, "%s", device);
+	if ((slash = strrchr(hub, '/')))
+		*slash = '\0';
+	else
+		strcpy(hub, ".");
+}
+
+/*
+    Probe thread: identifies printer on item->device with short timeouts.
+    Waits until hub of the device allows one more probe. Hub limit is
+    adapted the way TCP does with congestion window: it grows by one
+    after every <limit> successful probes and is halved when printer
+    answers it has no resources or is busy (IEEE 1284.4 results 0x04,
+    0x01) or a probe takes INVENTORY_HUB_SLOW times the fastest probe
+    on the hub. Timeouts are not counted, as printer not in IEEE 1284.4
+    mode doesn't answer the first probe anyway.
+*/
+static void* inventory_probe(void* arg)
+{
+	inventory_item_t* item = (inventory_item_t*)arg;
+	inventory_hub_t* hub = item->hub;
+	reink_session_t s;
+	inventory_item_t result;
+	struct timeval beg, end;
+	long took;
+	int overloaded;
+
+	pthread_mutex_lock(&inventory_lock);
+	while (hub->active >= (int)hub->limit)
+		pthread_cond_wait(&inventory_cond, &inventory_lock);
+	hub->active++;
+	item->started = 1;
+	pthread_mutex_unlock(&inventory_lock);
+
+	//timeouts are per thread, so they don't affect other probes
+	d4RdTimeout = INVENTORY_TIMEOUT;
+	d4WrTimeout = INVENTORY_TIMEOUT;
+	d4ProbeTimeout = INVENTORY_TIMEOUT;
+
+	gettimeofday(&beg, NULL);
+	result = *item;
+	reink_init(&s);
+	s.debug = ri_debug;
+
+	//reink_open goes through reinkd if it is running, which is the cheapest way
+	if (reink_open(&s, item->device))
+	{
+		result.pm = -1;
+		strcpy(result.error, s.error);
+	}
+	else
+	{
+		result.pm = s.pm;
+		result.printer = s.printer;
+		reink_close(&s);
+	}
+	result.done = 1;
+	gettimeofday(&end, NULL);
+	took = (end.tv_sec - beg.tv_sec) * 1000000L + end.tv_usec - beg.tv_usec;
+	overloaded = d4Overloaded();
+
+	pthread_mutex_lock(&inventory_lock);
+	*item = result;
+	inventory_done++;
+	hub->active--;
+	if (result.pm >= 0 && (hub->fastest == 0 || took < hub->fastest))
+		hub->fastest = took;
+	if (overloaded || (result.pm >= 0 && took > INVENTORY_HUB_SLOW * hub->fastest))
+	{
+		hub->limit = hub->limit / 2 < 1 ? 1 : hub->limit / 2;
+		D(fprintf(stderr, "%s: hub overloaded, %d probes at once.\n", item->device, (int)hub->limit))
+	}
+	else if (result.pm >= 0)
+		hub->limit += 1 / hub->limit;
+	pthread_cond_broadcast(&inventory_cond);
+	pthread_mutex_unlock(&inventory_lock);
+
+	return NULL;
+}
+
+int do_inventory(const char* pattern)
+{
+	static inventory_item_t items[INVENTORY_MAX]; //probe threads may outlive this function
+	static inventory_hub_t hubs[INVENTORY_MAX];
+	int hub_count = 0;
+	char hub[PATH_MAX];
+	int h;
+	glob_t devices;
+	pthread_t thread;
+	struct timeval now;
+	struct timespec deadline;
+	int count = 0;
+	int i;
+
+	D(fprintf(stderr, "=== do_inventory ===\n"))
+
+	if (glob(pattern, 0, NULL, &devices) || devices.gl_pathc == 0)
+	{
+		fprintf(stderr, "No devices match '%s'.\n", pattern);
+		return 1;
+	}
+
+	gettimeofday(&now, NULL);
+	deadline.tv_sec = now.tv_sec + INVENTORY_DEADLINE / 1000;
+	deadline.tv_nsec = now.tv_usec * 1000 + (INVENTORY_DEADLINE % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	//probe all devices at once (as far as their hubs keep up), so scan takes about one probe time
+	for (i = 0; i < devices.gl_pathc && count < INVENTORY_MAX; i++)
+	{
+		inventory_hub_of(devices.gl_pathv[i], hub);
+		for (h = 0; h < hub_count && strcmp(hubs[h].path, hub); h++)
+			;
+		if (h == hub_count)
+		{
+			strcpy(hubs[h].path, hub);
+			hubs[h].limit = INVENTORY_HUB_START;
+			hubs[h].active = 0;
+			hubs[h].fastest = 0;
+			hub_count++;
+		}
+		items[count].device = devices.gl_pathv[i];
+		items[count].hub = &hubs[h];
+		items[count].started = 0;
+		items[count].done = 0;
+		if (pthread_create(&thread, NULL, inventory_probe, &items[count]))
+		{
+			fprintf(stderr, "Can't start probe of %s.\n", items[count].device);
+			continue;
+		}
+		pthread_detach(thread);
+		count++;
+	}
+
+	pthread_mutex_lock(&inventory_lock);
+	while (inventory_done < count)
+		if (pthread_cond_timedwait(&inventory_cond, &inventory_lock, &deadline))
+			break; //the rest don't answer in time
+
+	printf("%-20s %-30s %-3s %-10s %s\n", "Device", "Model", "PM", "Model code", "Two-byte");
+	for (i = 0; i < count; i++)
+	{
+		if (!items[i].started)
+			printf("%-20s %-30s\n", items[i].device, "(not probed, hub is busy)");
+		else if (!items[i].done)
+			printf("%-20s %-30s\n", items[i].device, "(no answer)");
+		else if (items[i].pm < 0)
+			printf("%-20s %-30s\n", items[i].device, "(not an IEEE 1284.4 EPSON printer)");
+		else if (items[i].pm == PM_UNKNOWN)
+			printf("%-20s %-30s %-3d\n", items[i].device, "(unknown EPSON printer)", items[i].pm);
+		else
+			printf("%-20s %-30s %-3d 0x%02X 0x%02X  %s\n", items[i].device, items[i].printer.name, items[i].pm,
+				items[i].printer.model_code[0], items[i].printer.model_code[1],
+				items[i].printer.twobyte_addresses ? "yes" : "no");
+
+		D(if (items[i].done && items[i].pm < 0) fprintf(stderr, "%s: %s\n", items[i].device, items[i].error))
+	}
+	pthread_mutex_unlock(&inventory_lock);
+
+	//devices list is still used by unfinished probes, so it is not freed
+
+	D(fprintf(stderr, "^^^ do_inventory ^^^\n"))
+	return 0;
+}
+
+//device in watched directory
+typedef struct _watch_device {
+	char name[NAME_MAX + 1];	//device file name ("" if slot is free)
+	int present;				//is device file present now?
+	int handled;				//was action done since device appeared?
+	int applied;				//was reset applied to this device?
+} watch_device_t;
+
+/*
+    Finds device <name> in <devices>, or allocates a slot for it
+    if <create> is set.
+    On success returns the device.
+    If not found (or no free slots) returns NULL.
+*/
+static watch_device_t* watch_find(watch_device_t* devices, const char* name, int create)
+{
+	int i;
+	watch_device_t* free_slot = NULL;
+
+	for (i = 0; i < WATCH_MAX; i++)
+	{
+		if (!strcmp(devices[i].name, name))
+			return &devices[i];
+		if (!free_slot && devices[i].name[0] == '\0')
+			free_slot = &devices[i];
+	}
+
+	if (create && free_slot)
+	{
+		strcpy(free_slot->name, name);
+		free_slot->present = 0;
+		free_slot->handled = 0;
+		free_slot->applied = 0;
+		return free_slot;
+	}
+
+	return NULL;
+}
+
+/*
+    Opens session on appeared device and runs watch action.
+*/
+static void watch_attach(const char* dir, watch_device_t* device, int command, unsigned char ink_type)
+{
+	reink_session_t s;
+	char path[PATH_MAX];
+	int ret = 0;
+	int appeared = !device->present; //is it the first event for this device?
+
+	device->present = 1;
+	if (device->handled)
+		return;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, device->name);
+
+	reink_init(&s);
+	s.debug = ri_debug;
+	if (reink_open(&s, path))
+	{
+		//device node may be not accessible yet, it will be retried on the next event
+		if (appeared)
+			printf("%s: appeared, but printer doesn't answer (%s)\n", path, s.error);
+		fflush(stdout);
+		return;
+	}
+
+	printf("%s: %s\n", path, s.pm == PM_UNKNOWN ? "unknown printer" : (char*)s.printer.name);
+
+	if (s.pm != PM_UNKNOWN)
+	{
+		switch (command)
+		{
+		case CMD_GETINK:
+			ret = do_ink_levels(&s);
+			break;
+
+		case CMD_ZEROINK:
+		case CMD_ZEROWASTE:
+			if (device->applied)
+			{
+				printf("%s: reset was already applied.\n", path);
+				break;
+			}
+			ret = command == CMD_ZEROINK ? do_ink_reset(&s, ink_type) : do_waste_reset(&s);
+			if (!ret)
+			{
+				device->applied = 1;
+				printf("%s: reset applied.\n", path);
+			}
+			break;
+		}
+	}
+
+	if (reink_close(&s) < 0)
+		fprintf(stderr, "%s: %s\n", path, s.error);
+
+	device->handled = !ret;
+	fflush(stdout);
+}
+
+int do_watch(const char* dir, int command, unsigned char ink_type)
+{
+	static watch_device_t devices[WATCH_MAX];
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event* ev;
+	watch_device_t* device;
+	struct dirent* de;
+	DIR* d;
+	int fd;
+	int len;
+	char* p;
+
+	D(fprintf(stderr, "=== do_watch ===\n"))
+
+	if ((fd = inotify_init()) == -1)
+	{
+		fprintf(stderr, "Can't initialize inotify: %s\n", strerror(errno));
+		return 1;
+	}
+
+	//start watching before scan, so no device is missed
+	if (inotify_add_watch(fd, dir, IN_CREATE | IN_ATTRIB | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM) == -1)
+	{
+		fprintf(stderr, "Can't watch '%s': %s\n", dir, strerror(errno));
+		close(fd);
+		return 1;
+	}
+
+	//devices already present
+	if ((d = opendir(dir)))
+	{
+		while ((de = readdir(d)))
+			if (!strncmp(de->d_name, WATCH_PREFIX, strlen(WATCH_PREFIX)) && (device = watch_find(devices, de->d_name, 1)))
+				watch_attach(dir, device, command, ink_type);
+		closedir(d);
+	}
+
+	fprintf(stderr, "Watching %s for printers...\n", dir);
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0)
+	{
+		for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len)
+		{
+			ev = (const struct inotify_event*)p;
+
+			if (!ev->len || strncmp(ev->name, WATCH_PREFIX, strlen(WATCH_PREFIX)))
+				continue;
+
+			if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+			{
+				if (!(device = watch_find(devices, ev->name, 0)))
+					continue;
+
+				printf("%s/%s: removed.\n", dir, ev->name);
+				fflush(stdout);
+				device->present = 0;
+				device->handled = 0;
+				if (!device->applied)
+					device->name[0] = '\0'; //nothing to remember
+			}
+			else if ((device = watch_find(devices, ev->name, 1)))
+				watch_attach(dir, device, command, ink_type);
+		}
+	}
+
+	fprintf(stderr, "Watch stopped: %s\n", strerror(errno));
+	close(fd);
+
+	D(fprintf(stderr, "^^^ do_watch ^^^\n"))
+	return 1;
+}
+
+static volatile sig_atomic_t sample_stop = 0;
+
+static void on_sample_stop(int signum)
+{
+	sample_stop = 1;
+}
+
+/*
+    Puts <len> bytes of <value> to <buf> as little-endian.
+*/
+static void put_le(unsigned char* buf, unsigned long long value, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = (value >> (8 * i)) & 0xFF;
+}
+
+int do_sample(reink_session_t* s, const char* addr_list, unsigned long samples, const char* out_file)
+{
+	unsigned short int addrs[SAMPLE_MAX_ADDRS]; //sampled addresses
+	int count = 0;	//count of sampled addresses
+	unsigned char rec[8 + SAMPLE_MAX_ADDRS]; //current record
+	unsigned char* inks[] = { s->printer.inkmap.black, s->printer.inkmap.cyan, s->printer.inkmap.magenta,
+	                          s->printer.inkmap.yellow, s->printer.inkmap.lightcyan, s->printer.inkmap.lightmagenta };
+	struct sigaction sa, old_sa;
+	struct timespec now, mono, prev;
+	unsigned long taken = 0;	//samples taken
+	double interval, mean = 0, m2 = 0, delta; //interval statistics (Welford's method)
+	double min_interval = 0, max_interval = 0;
+	double elapsed = 0;	//seconds from the first sample
+	const char* p;
+	char* end;
+	FILE* out;
+	int i, j, ret = 0;
+
+	D(fprintf(stderr, "=== do_sample ===\n"))
+
+	if (addr_list)
+	{
+		for (p = addr_list; *p; p = *end ? end + 1 : end)
+		{
+			if (count == SAMPLE_MAX_ADDRS)
+			{
+				fprintf(stderr, "Too many addresses (maximum is %d).\n", SAMPLE_MAX_ADDRS);
+				return 1;
+			}
+			addrs[count++] = strtol(p, &end, 16);
+			if (end == p || (*end != ',' && *end != '\0'))
+			{
+				fprintf(stderr, "Invalid address list '%s'.\n", addr_list);
+				return 1;
+			}
+		}
+	}
+	else
+	{
+		//all ink counters of the printer
+		for (i = 0; i < 6; i++)
+			if (s->printer.inkmap.mask & (1 << i))
+				for (j = 0; j < 4 && count < SAMPLE_MAX_ADDRS; j++)
+					addrs[count++] = inks[i][j];
+	}
+
+	if (!count)
+	{
+		fprintf(stderr, "Nothing to sample.\n");
+		return 1;
+	}
+
+	if (out_file && strcmp(out_file, "-"))
+		out = fopen(out_file, "wb");
+	else
+		out = stdout;
+	if (!out)
+	{
+		fprintf(stderr, "Can't open '%s': %s\n", out_file, strerror(errno));
+		return 1;
+	}
+
+	//header
+	fwrite(SAMPLE_MAGIC, 1, 4, out);
+	put_le(rec, count, 2);
+	fwrite(rec, 1, 2, out);
+	for (i = 0; i < count; i++)
+	{
+		put_le(rec, addrs[i], 2);
+		fwrite(rec, 1, 2, out);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_sample_stop;
+	sigaction(SIGINT, &sa, &old_sa);
+
+	fprintf(stderr, "Sampling %d address(es), press Ctrl+C to stop...\n", count);
+
+	while (!sample_stop && (!samples || taken < samples))
+	{
+		clock_gettime(CLOCK_REALTIME, &now);
+		clock_gettime(CLOCK_MONOTONIC, &mono);
+
+		for (i = 0; i < count; i++)
+			if (reink_read_eeprom_retry(s, addrs[i], &rec[8 + i]))
+				break;
+		if (i < count)
+		{
+			fprintf(stderr, "Can't read from eeprom: %s\n", s->error);
+			ret = 1;
+			break;
+		}
+
+		put_le(rec, (unsigned long long)now.tv_sec * 1000000 + now.tv_nsec / 1000, 8);
+		if (fwrite(rec, 1, 8 + count, out) != 8 + count)
+		{
+			fprintf(stderr, "Can't write sample: %s\n", strerror(errno));
+			ret = 1;
+			break;
+		}
+
+		if (taken)
+		{
+			interval = (mono.tv_sec - prev.tv_sec) + (mono.tv_nsec - prev.tv_nsec) / 1e9;
+			elapsed += interval;
+			delta = interval - mean;
+			mean += delta / taken;
+			m2 += delta * (interval - mean);
+			if (taken == 1 || interval < min_interval)
+				min_interval = interval;
+			if (interval > max_interval)
+				max_interval = interval;
+		}
+		prev = mono;
+		taken++;
+	}
+
+	sigaction(SIGINT, &old_sa, NULL);
+
+	if (out != stdout)
+		fclose(out);
+	else
+		fflush(out);
+
+	fprintf(stderr, "%lu samples", taken);
+	if (taken > 1)
+		fprintf(stderr, " in %.3f s: %.1f samples/s, interval %.3f/%.3f/%.3f ms (min/mean/max), jitter %.3f ms (stddev)",
+			elapsed, (taken - 1) / elapsed, min_interval * 1000, mean * 1000, max_interval * 1000, sqrt(m2 / (taken - 1)) * 1000);
+	fprintf(stderr, ".\n");
+
+	D(fprintf(stderr, "^^^ do_sample ^^^\n"))
+	return ret;
+}
+
+int do_print_job(reink_session_t* s, const char* job_file)
+{
+	char buf[PRINTJOB_CHUNK];
+	reink_ink_levels_t levels;
+	struct timespec now, last;
+	unsigned long sent = 0;	//bytes of job sent
+	int data_socket;	//"EPSON-DATA" channel
+	FILE* job;
+	size_t len;
+	int i, ret = 0;
+
+	D(fprintf(stderr, "=== do_print_job ===\n"))
+
+	if (s->remote)
+	{
+		fprintf(stderr, "Printing is not available through reinkd.\n");
+		return 1;
+	}
+
+	job = fopen(job_file, "rb");
+	if (!job)
+	{
+		fprintf(stderr, "Error opening job file '%s': %s\n", job_file, strerror(errno));
+		return 1;
+	}
+
+	data_socket = reink_open_channel(s, "EPSON-DATA");
+	if (data_socket < 0)
+	{
+		fprintf(stderr, "%s\n", s->error);
+		fclose(job);
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &last);
+	while ((len = fread(buf, 1, sizeof(buf), job)) > 0)
+	{
+		if (reink_send(s, data_socket, buf, len))
+		{
+			fprintf(stderr, "%s\n", s->error);
+			ret = 1;
+			break;
+		}
+		sent += len;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((now.tv_sec - last.tv_sec) * 1000 + (now.tv_nsec - last.tv_nsec) / 1000000 < PRINTJOB_POLL)
+			continue;
+		last = now;
+
+		//"EPSON-CTRL" transactions go between job packets
+		if (reink_ink_levels(s, &levels))
+		{
+			fprintf(stderr, "%s\n", s->error);
+			continue;
+		}
+		printf("Sent %lu bytes, ink levels:", sent);
+		for (i = 0; i < levels.count; i++)
+			printf(" %d%%", levels.level[i]);
+		printf("\n");
+		fflush(stdout);
+	}
+
+	if (ret == 0 && ferror(job))
+	{
+		fprintf(stderr, "Error reading job file '%s'.\n", job_file);
+		ret = 1;
+	}
+	fclose(job);
+
+	if (reink_close_channel(s, data_socket))
+	{
+		fprintf(stderr, "%s\n", s->error);
+		ret = 1;
+	}
+
+	if (ret == 0)
+		printf("Sent %lu bytes.\n", sent);
+
+	D(fprintf(stderr, "^^^ do_print_job ^^^\n"))
+	return ret;
+}
+
+int do_archive_list(const char* archive)
+{
+	snap_info_t* infos; //all snapshots
+	char when[32]; //snapshot time
+	int count;
+	int i;
+
+	D(fprintf(stderr, "=== do_archive_list ===\n"))
+
+	if ((count = snapstore_list(archive, &infos)) < 0)
+		return 1;
+
+	printf("%-6s %-19s %-30s %-10s %-11s %s\n", "Id", "Time", "Model", "Model code", "Range", "Device");
+	for (i = 0; i < count; i++)
+	{
+		strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&infos[i].time));
+		printf("%-6u %-19s %-30s 0x%02X 0x%02X  %04X-%04X   %s\n", infos[i].id, when, infos[i].model,
+			infos[i].model_code[0], infos[i].model_code[1],
+			infos[i].start, infos[i].start + infos[i].size - 1, infos[i].device);
+	}
+
+	free(infos);
+	D(fprintf(stderr, "^^^ do_archive_list ^^^\n"))
+	return 0;
+}
+
+int do_archive_get(const char* archive, unsigned int id, const char* out_file, int out_format)
+{
+	snap_info_t info; //snapshot metadata
+	unsigned char image[SS_MAX_SIZE]; //snapshot contents
+	eeimage_t img; //output
+	unsigned int i;
+
+	D(fprintf(stderr, "=== do_archive_get ===\n"))
+
+	if (snapstore_get(archive, id, &info, image))
+		return 1;
+
+	if (eeimage_open(&img, out_file, out_format))
+		return 1;
+
+	for (i = 0; i < info.size; i++)
+	{
+		if (eeimage_put(&img, info.start + i, image[i]))
+		{
+			fprintf(stderr, "Fail to write EEPROM data from address %x to image.\n", info.start + i);
+			eeimage_close(&img);
+			return 1;
+		}
+	}
+
+	if (eeimage_close(&img))
+		return 1;
+
+	D(fprintf(stderr, "^^^ do_archive_get ^^^\n"))
+	return 0;
+}
+
+int do_archive_diff(const char* archive, unsigned int id1, unsigned int id2)
+{
+	snap_change_t* changes; //differing bytes
+	long count;
+	long i;
+
+	D(fprintf(stderr, "=== do_archive_diff ===\n"))
+
+	if (!(changes = malloc(ARCHIVE_MAX_CHANGES * sizeof(snap_change_t))))
 	{
-		fprintf(stderr, "Fail to subsequent read from EEPROM address %#x.\n", addr);
+		fprintf(stderr, "Not enough memory.\n");
 		return 1;
 	}
 
-	if (readed_data != data)
+	if ((count = snapstore_diff(archive, id1, id2, changes, ARCHIVE_MAX_CHANGES)) < 0)
 	{
-		fprintf(stderr, "Verification failed (readed byte = %#x).\n", readed_data);
+		free(changes);
 		return 1;
 	}
-	D_OK
-
-	if (close_channel(device, ctrl_socket) < 0)
-		return 1;
 
-	if (printer_disconnect(device) < 0)
-		return 1;
+	for (i = 0; i < count && i < ARCHIVE_MAX_CHANGES; i++)
+	{
+		printf("0x%04X: ", changes[i].addr);
+		if (changes[i].before < 0)
+			printf("  -- -> ");
+		else
+			printf("0x%02X -> ", changes[i].before);
+		if (changes[i].after < 0)
+			printf("  --\n");
+		else
+			printf("0x%02X\n", changes[i].after);
+	}
+	printf("%ld bytes differ.\n", count);
 
-	D(fprintf(stderr, "^^^ do_eeprom_write ^^^\n"))
+	free(changes);
+	D(fprintf(stderr, "^^^ do_archive_diff ^^^\n"))
 	return 0;
 }
 
-int do_waste_reset(const char* raw_device, unsigned int pm)
+int do_ping(const char* raw_device, int timeout)
 {
-	int i;
+	reink_session_t s; //not opened session
+	struct timespec start, end;
+	double latency; //ms
+	int state;
 
-	int device; //file descriptor of the printer raw_device
-	int ctrl_socket; //IEEE 1284.4 socket identifier for "EPSON-CTRL" channel
+	D(fprintf(stderr, "=== do_ping ===\n"))
 
-	D(fprintf(stderr, "=== do_waste_reset ===\n"))
+	reink_init(&s);
+	s.debug = ri_debug;
 
-	if (pm == PM_UNKNOWN)
-		return 1;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	state = reink_ping(&s, raw_device, timeout);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	latency = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0;
 
-	if ((device = printer_connect(raw_device)) < 0)
+	if (state < 0)
+	{
+		printf("dead %.3f ms\n", latency);
+		fprintf(stderr, "%s\n", s.error);
 		return 1;
+	}
 
-	if ((ctrl_socket = open_channel(device, "EPSON-CTRL")) < 0)
-		return 1;
+	printf("%s %.3f ms\n", state == REINK_ALIVE ? "alive" : "busy", latency);
 
-	D(fprintf(stderr, "Resetting... "));
-	for (i=0;i<printers[pm].wastemap.len;i++)
-		if (write_eeprom_address(device, ctrl_socket, pm, printers[pm].wastemap.addr[i], 0x00))
-		{
-			fprintf(stderr, "Can't write to eeprom.\n");
-			return 1;
-		}
-	D_OK
+	D(fprintf(stderr, "^^^ do_ping ^^^\n"))
+	return state == REINK_ALIVE ? 0 : 2;
+}
+
+int do_services(const char* raw_device)
+{
+	reink_session_t s; //connection without channels
+	reink_service_t services[D4_SOCKETS];
+	int count;
+	int i;
+
+	D(fprintf(stderr, "=== do_services ===\n"))
+
+	reink_init(&s);
+	s.debug = ri_debug;
 
-	if (close_channel(device, ctrl_socket) < 0)
+	if (reink_connect(&s, raw_device) < 0)
+	{
+		fprintf(stderr, "%s\n", s.error);
 		return 1;
+	}
 
-	if (printer_disconnect(device) < 0)
+	if ((count = reink_services(&s, services, D4_SOCKETS)) < 0)
+	{
+		fprintf(stderr, "%s\n", s.error);
+		reink_disconnect(&s);
 		return 1;
+	}
 
-	D(fprintf(stderr, "^^^ do_waste_reset ^^^\n"))
+	for (i = 0; i < count; i++)
+		printf("0x%02X %s\n", services[i].socket, services[i].name);
+
+	if (reink_disconnect(&s) < 0)
+	{
+		fprintf(stderr, "%s\n", s.error);
+		return 1;
+	}
 
+	D(fprintf(stderr, "^^^ do_services ^^^\n"))
 	return 0;
 }
 
@@ -906,13 +2334,10 @@ What we need to know about unknown printer?
 int do_make_report(const char* raw_device, unsigned char model_code[])
 {
 	struct utsname linux_info; //uname -a reply
-	int fd; //raw_device file descriptor
-	int socket2; //socket for EPSON-CTRL
+	reink_session_t s; //connection to the printer
 	int socket40; //socket for EPSON-DATA
 	int have_model_code = 0; //do we have model code?
-	char buf[INPUT_BUF_LEN]; //buffer for input data
-	int readed;	//length of data in input buffer
-	unsigned short int caddr; //current address
+	unsigned int caddr; //current address
 	unsigned char data; //one byte from eeprom
 	int original_stderr;
 	int original_debug = ri_debug; //original value of ri_debug
@@ -938,47 +2363,38 @@ int do_make_report(const char* raw_device, unsigned char model_code[])
 	//enabling debug info
 	setDebug(1);
 	ri_debug=1;
+	reink_init(&s);
+	s.debug = 1;
 
 	//raw_device (r/w status)
 	//can enter in ieee1284.4 mode?
-	if ((fd = printer_connect(raw_device)) < 0)
+	if (reink_connect(&s, raw_device) < 0)
 		return 0;
 
 	//opening EPSON-CTRL
-	if ((socket2 = open_channel(fd, "EPSON-CTRL")) < 0)
+	if ((s.ctrl_socket = reink_open_channel(&s, "EPSON-CTRL")) < 0)
 	{
-		printer_disconnect(fd);
+		reink_close(&s);
 		return 0;
 	}
 
 	//opening EPSON-DATA (just try to open - then close)
-	if ((socket40 = open_channel(fd, "EPSON-DATA")) >= 0)
-		close_channel(fd, socket40); //no need anymore
-
-	//reply to "di" command
-	readed = INPUT_BUF_LEN;
-	if (printer_transact(fd, socket2, "di\1\0\1", 5, buf, &readed) < 0)
-	{
-		close_channel(fd, socket2);
-		printer_disconnect(fd);
-		return 0;
-	}
+	if ((socket40 = reink_open_channel(&s, "EPSON-DATA")) >= 0)
+		reink_close_channel(&s, socket40); //no need anymore
 
-	//reply to "st" command
-	readed = INPUT_BUF_LEN;
-	if (printer_transact(fd, socket2, "st\1\0\1", 5, buf, &readed) < 0)
+	//replies to "di" and "st" commands
+	if (reink_handshake(&s) < 0)
 	{
-		close_channel(fd, socket2);
-		printer_disconnect(fd);
+		reink_close(&s);
 		return 0;
 	}
 
 	//init unknown printer
-	printers[PM_UNKNOWN].model_code[0] = model_code[0];
-	printers[PM_UNKNOWN].model_code[1] = model_code[1];
+	s.printer.model_code[0] = model_code[0];
+	s.printer.model_code[1] = model_code[1];
 
 	//assume first this is two-byte addresses printer
-	printers[PM_UNKNOWN].twobyte_addresses = 1;
+	s.printer.twobyte_addresses = 1;
 
 	if (model_code[0] != 0 || model_code[1] != 0)
 		have_model_code = 1;
@@ -989,62 +2405,69 @@ int do_make_report(const char* raw_device, unsigned char model_code[])
 	}
 
 	//let's find out the model code
-	while (printers[PM_UNKNOWN].model_code[0] != 0xFF && !have_model_code)
+	while (s.printer.model_code[0] != 0xFF && !have_model_code)
 	{
 		//try to read from eeprom (address 00)
-		if (read_eeprom_address(fd, socket2, PM_UNKNOWN, 0x00, &data) == 0)
+		if (reink_read_eeprom(&s, 0x00, &data) == 0)
 		{
-			printf("We found model code: 0x%02X 0x%02X\n", printers[PM_UNKNOWN].model_code[0], printers[PM_UNKNOWN].model_code[1]);
+			printf("We found model code: 0x%02X 0x%02X\n", s.printer.model_code[0], s.printer.model_code[1]);
 			have_model_code = 1;
 			break;
 		}
 
-		if (printers[PM_UNKNOWN].model_code[1]++ == 0xFF)
-			printers[PM_UNKNOWN].model_code[0]++;
+		if (s.printer.model_code[1]++ == 0xFF)
+			s.printer.model_code[0]++;
 
 		if (ri_debug && !original_debug)
 		{
 			//disabling debug to speedup process
 			setDebug(0);
-			ri_debug = 0;
+			s.debug = ri_debug = 0;
 		}
 	}
 
 	if (!have_model_code)
 	{
-		close_channel(fd, socket2);
-		printer_disconnect(fd);
+		reink_close(&s);
 		return 0;
 	}
 
-	//on success - dump eeprom 0x00-0xFF
+	//on success - dump eeprom
 
 	//reenabling debug to see what we have when read from printer
 	setDebug(1);
-	ri_debug = 1;
+	s.debug = ri_debug = 1;
 
-	if (read_eeprom_address(fd, socket2, PM_UNKNOWN, 0x00, &data) != 0)
+	if (reink_read_eeprom(&s, 0x00, &data) != 0)
 	{
-		close_channel(fd, socket2);
-		printer_disconnect(fd);
+		reink_close(&s);
 		return 0;
 	}
 
 	//disabling debug before dump
 	setDebug(0);
-	ri_debug = 0;
+	s.debug = ri_debug = 0;
 
+	if (reink_probe_eeprom(&s) < 0)
+	{
+		printf("%s\n", s.error);
+		reink_close(&s);
+		return 0;
+	}
+	printf("\nEEPROM: %s addresses, size 0x%X bytes.\n", s.printer.twobyte_addresses ? "two-byte" : "one-byte", s.printer.eeprom_size);
+	if (s.probe_blank)
+		printf("Warning: EEPROM wraparound was seen on blank data only, size may be wrong.\n");
 
 	printf("\nEEPROM DUMP:\n");
-	for (caddr = 0; caddr <= 0xFF; caddr++)
+	for (caddr = 0; caddr < s.printer.eeprom_size; caddr++)
 	{
-		if (read_eeprom_address(fd, socket2, PM_UNKNOWN, caddr, &data) < 0)
+		if (reink_read_eeprom_retry(&s, caddr, &data) < 0)
 		{
-			close_channel(fd, socket2);
-			printer_disconnect(fd);
+			printf("%s\n", s.error);
+			reink_close(&s);
 			return 0;
 		}
-		printf("0x%02X = 0x%02X\n", caddr, data);
+		printf(s.printer.twobyte_addresses ? "0x%04X = 0x%02X\n" : "0x%02X = 0x%02X\n", caddr, data);
 	}
 
 	//redirecting stderr back to console
@@ -1057,16 +2480,14 @@ int do_make_report(const char* raw_device, unsigned char model_code[])
 		fprintf(stderr, "You will provide even more help for me if\n\
 you run printer head cleaning now and\n\
 then make another report with command:\n\
-./reink -r %s -t%02X%02X > ./testreport2.log\n", raw_device, printers[PM_UNKNOWN].model_code[0], printers[PM_UNKNOWN].model_code[1]);
+./reink -r %s -t%02X%02X > ./testreport2.log\n", raw_device, s.printer.model_code[0], s.printer.model_code[1]);
 	}
 	else if (model_code[0] != 0 || model_code[1] != 0)
 	{
 		fprintf(stderr, "Now send me both reports.\n");
 	}
 
-	close_channel(fd, socket2);
-	printer_disconnect(fd);
-	close(fd);
+	reink_close(&s);
 
 	return 0;
 }
@@ -1076,478 +2497,74 @@ then make another report with command:\n\
 /////////////////////////////////////////////////////////////////////////////////
 //
 
-int parse_ink_result(const char* buf, int len)
-{
-	char ink_info[20];
-	char ink_val[3];
-	int i;
-	int val;
-
-	D(fprintf(stderr, "=== parse_ink_result ===\n"))
-
-	D(fprintf(stderr, "Getting the \"IQ:\" tag... "));
-	if (get_tag(buf, len, "IQ:", ink_info, 20))
-	{
-		fprintf(stderr, "Can't find ink levels information in printer answer.\n");
-		return 1;
-	}
-	D(fprintf(stderr, "OK, have string \"%s\".\n", ink_info));
-
-	if ((strlen(ink_info)) % 2 != 0)
-	{
-		fprintf(stderr, "Malformed output in printer answer.\n");
-		return 1;
-	}
-
-	printf("Ink levels:\n");
-	ink_val[2] = '\0';
-	for (i=0; i<strlen(ink_info); i += 2)
-	{
-		strncpy(ink_val, ink_info+i, 2);
-		val = strtol(ink_val, NULL, 16);
-		printf("Ink type (color) %d remains %d percents.\n", i/2+1, val);
-	}
-
-	D(fprintf(stderr, "^^^ parse_ink_result ^^^\n"))
-
-	return 0;
-}
-
-int get_tag(const char* source, int source_len, const char* tag, char* value, int max_value_len)
-{
-	int tag_len;
-	int pos;
-	int pos_end;
-	int val_len;
-
-	D(fprintf(stderr, "=== get_tag ===\n"))
-
-	D(fprintf(stderr, "Searching for \"%s\" substring... ", tag));
-
-	tag_len = strlen(tag);
-	pos = 0;
-	while ((pos + tag_len < source_len) &&  (0 != strncmp(source+pos, tag, tag_len)))
-		pos++;
-
-	if (pos + tag_len == source_len)
-	{
-		D(fprintf(stderr, "NOT FOUND.\n"));
-		return -1;
-	}
-
-	D(fprintf(stderr, "FOUND, pos=%d.\n", pos));
-
-	pos += tag_len;
-
-	D(fprintf(stderr, "Searching for \";\" character... "));
-	pos_end = pos;
-	while ((pos_end < source_len) && (source[pos_end] != ';'))
-		pos_end++;
-	if (pos_end  == source_len)
-	{
-		D(fprintf(stderr, "NOT FOUND.\n"));
-		return -1;
-	}
-	D(fprintf(stderr, "FOUND, pos_end=%d.\n", pos_end));
-
-	val_len = pos_end - pos;
-	if (val_len+1 > max_value_len)
-	{
-		D(fprintf(stderr, "Value(+'\\0') too long (%d) for given buffer (%d).\n", val_len+1, max_value_len));
-		return 1;
-	}
-
-	memcpy(value, source + pos, val_len);
-	value[val_len] = '\0';
-	D(fprintf(stderr, "Tag value:\"%s\".\n", value));
-
-	D(fprintf(stderr, "^^^ get_tag ^^^\n"))
-
-	return 0;
-}
-
-/////////////////////////////////////////////////////////////////////////////////
-//	INFORMATION
-/////////////////////////////////////////////////////////////////////////////////
-//
-
-unsigned int printer_model(const char* raw_device)
-{
-	int device; //file descriptor of the printer raw_device
-	int ctrl_socket; //IEEE 1284.4 socket identifier for "EPSON-CTRL" channel
-
-	unsigned int i;
-
-	char buf[INPUT_BUF_LEN]; //buffer for input data
-	int readed; //number of readed bytes
-
-	char strModel[MAX_MODEL_LEN];
-
-	unsigned int model = PM_UNKNOWN;
-
-	D(fprintf(stderr, "=== printer_model ===\n"))
-
-	if ((device = printer_connect(raw_device)) < 0)
-		return PM_UNKNOWN;
-
-	if ((ctrl_socket = open_channel(device, "EPSON-CTRL")) < 0)
-		return PM_UNKNOWN;
-
-	D(fprintf(stderr, "Let's get printer info. Executing \"di\" command... "))
-	readed = INPUT_BUF_LEN;
-	if (printer_transact(device, ctrl_socket, "di\1\0\1", 5, buf, &readed))
-		return PM_UNKNOWN;
-	D_OK
-
-	D(fprintf(stderr, "Parsing result... "))
-	if (get_tag(buf, readed, "MDL:", strModel, MAX_MODEL_LEN))
-	{
-		D(fprintf(stderr, "Parse failed.\n"));
-		return PM_UNKNOWN;
-	}
-	D_OK
-
-	for(i = 0; i < printers_count; i++)
-	{
-		if (!strcmp(strModel, printers[i].model_name))
-		{
-			D(fprintf(stderr, "Printer \"%s\".\n", printers[i].name));
-			model = i;
-			break;
-		}
-	}
-	
-	if (close_channel(device, ctrl_socket) < 0)
-		return model;
-
-	if (printer_disconnect(device) < 0)
-		return model;
-
-	D(fprintf(stderr, "^^^ printer_model ^^^\n"))
-	return model;
-}
-
-/////////////////////////////////////////////////////////////////////////////////
-//	PROTOCOL, CHANNEL INITIALIZATION, FINILIZING
-/////////////////////////////////////////////////////////////////////////////////
-//
-
-int printer_connect(const char* raw_device)
-{
-	int device;
-
-	D(fprintf(stderr, "=== printer_connect ===\n"));
-
-	D(fprintf(stderr, "Opening raw device... "))
-	device = open(raw_device, O_RDWR | O_SYNC);
-	if (device == -1)
-	{
-		fprintf(stderr, "Error opening device file '%s': %s\n", raw_device, strerror(errno));
-		return -1;
-	}
-	D_OK
-
-	clearSndBuf(device); //if there are some data from previous incoreectly terminated session
-
-	D(fprintf(stderr, "Entering IEEE 1284.4 mode... "))
-	if (!EnterIEEE(device))
-	{
-		fprintf(stderr, "Can't enter in IEEE 1284.4 mode. Wrong printer device file?\n");
-		return -1;
-	}
-	D_OK
-
-	D(fprintf(stderr, "Perfoming IEEE 1284.4 Init transaction... "))
-	if (!Init(device))
-	{
-		fprintf(stderr, "IEEE 1284.4: \"Init\" transaction failed.\n");
-		return -1;
-	}
-	D_OK
-
-	D(fprintf(stderr, "^^^ printer_connect ^^^\n"));
-
-	return device;
-}
-
-int printer_disconnect(int fd)
-{
-	D(fprintf(stderr, "=== printer_disconnect ===\n"));
-
-	D(fprintf(stderr, "Perfoming IEEE 1284.4 Exit transaction... "))
-	if (!Exit(fd))
-	{
-		fprintf(stderr, "IEEE 1284.4: \"Exit\" transaction failed.\n");
-		return -1;
-	}
-	D_OK
-
-	D(fprintf(stderr, "Closing raw device... "))
-	fd = close(fd);
-	if (fd == -1)
-	{
-		fprintf(stderr, "Error closing printer device file: %s\n", strerror(errno));
-		return -1;
-	}
-	D_OK
-
-	D(fprintf(stderr, "^^^ printer_disconnect ^^^\n"));
-
-	return 0;
-}
-
-
-int open_channel(int fd, const char* service_name)
-{
-	int socket;
-	int max_send_packet = 0x0200; //maximum size of PC to printer packet (this value may be changed by the printer while opening a channel)
-	int max_recv_packet = 0x0200; //maximum size of printer to PC packet (this value may be changed by the printer while opening a channel)
-
-	D(fprintf(stderr, "=== open_channel ===\n"));
-
-	D(fprintf(stderr, "Obtaining IEEE 1284.4 socket for \"%s\" service... ", service_name))
-	if (!(socket = GetSocketID(fd, service_name)))
-	{
-		fprintf(stderr, "IEEE 1284.4: \"GetSocketID\" transaction failed.\n");
-		return -1;
-	}
-	D(fprintf(stderr, "OK, socket=%d.\n", socket));
-
-	D(fprintf(stderr, "Opening IEEE 1284.4 channel %d-%d... ", socket, socket))
-	if (1 != OpenChannel(fd, socket, &max_send_packet, &max_recv_packet))
-	{
-		fprintf(stderr, "IEEE 1284.4: \"OpenChannel\" transaction failed.\n");
-		return -1;
-	}
-	D_OK
-
-	D(fprintf(stderr, "^^^ open_channel ^^^\n"));
-
-	return socket;
-}
-
-int close_channel(int fd, int socket_id)
-{
-	D(fprintf(stderr, "=== close_channel ===\n"));
-
-	D(fprintf(stderr, "Closing IEEE 1284.4 channel %d-%d... ", socket_id, socket_id))
-	if (1 != CloseChannel(fd, socket_id))
-	{
-		fprintf(stderr, "IEEE 1284.4: \"CloseChannel\" transaction failed.\n");
-		return -1;
-	}
-	D_OK
-
-	D(fprintf(stderr, "^^^ close_channel ^^^\n"));
-
-	return 0;
-}
-
-int printer_transact(int fd, int socket_id, const char* buf_send, int send_len, char* buf_recv, int* recv_len)
-{
-	int credits = 0; //count of ieee1284.4 credits I have left
-	int buf_len;	//the length of recieve buffer
-
-	D(fprintf(stderr, "=== printer_transact ===\n"));
-
-	buf_len = *recv_len;
-
-	D(fprintf(stderr, "Requesting some IEEE 1284.4 credits on channel %d-%d... ", socket_id, socket_id))
-	credits = CreditRequest(fd, socket_id);
-	if (credits < 1)
-	{
-		fprintf(stderr, "IEEE 1284.4: \"CreditRequest\" transaction failed.\n");
-		return -1;
-	}
-	D(fprintf(stderr, "OK, got %d credits.\n", credits))
-
-	/* // made automatically by readData later
-	D(fprintf(stderr, "Giving one IEEE 1284.4 credit to printer on channel %d-%d... ", ctrl_socket, ctrl_socket))
-	if (1 != Credit(device, ctrl_socket, 1))
-	{
-	fprintf(stderr, "IEEE 1284.4: \"Credit\" transaction failed.\n");
-	return -1;
-	}
-	D_OK
-	*/
-
-	D(fprintf(stderr, "Writing data to printer... "))
-	if (writeData(fd, socket_id, buf_send, send_len, 0) < send_len)
-	{
-		fprintf(stderr, "IEEE 1284.4: Error sending data to channel %d-%d.\n", socket_id, socket_id);
-		return -1;
-	}
-	D_OK
-
-	D(fprintf(stderr, "Get the answer... "))
-	if ((*recv_len = readData(fd, socket_id, buf_recv, buf_len)) < 0)
-	{
-		fprintf(stderr, "IEEE 1284.4: Error recieving data from channel %d-%d.\n", socket_id, socket_id);
-		return -1;
-	}
-	D_OK
-
-	D(fprintf(stderr, "^^^ printer_transact ^^^\n"));
-
-	return 0;
-}
-
-
-
-/////////////////////////////////////////////////////////////////////////////////
-//	EPSON FACTORY COMMANDS
-/////////////////////////////////////////////////////////////////////////////////
-
-void init_command(fcmd_header_t* cmd, unsigned int pm, unsigned char class, unsigned char name, unsigned short int extra_length)
-{
-	unsigned short int full_length;
-
-	full_length = 5 + extra_length;
-
-	cmd->cls1 = class;
-	cmd->cls2 = class;
-
-	cmd->lenL = full_length & 0xFF;
-	cmd->lenH = (full_length >> 8) & 0xFF;
-
-	cmd->cmd = name;
-	cmd->cmd1 = ~name;
-	cmd->cmd2 = ((name >> 1) & 0x7F) | ((name << 7) & 0x80); //round shift by one bit to the right
-
-	cmd->mcode1 = printers[pm].model_code[0];
-	cmd->mcode2 = printers[pm].model_code[1];
-}
-
-int read_eeprom_address(int fd, int socket_id, unsigned int pm, unsigned short int addr, unsigned char* data)
+FILE* checkpoint_open(reink_session_t* s, const char* state_file, const char* raw_device, unsigned short int start_addr, unsigned short int end_addr, eeimage_t* img, unsigned char* image, unsigned int* next_addr)
 {
-	char cmd[11]; // full command with address
-	int cmd_len = 10; //length of the command
-	int cmd_args_count = 1; //command arguments count
-
-	char reply[INPUT_BUF_LEN]; // buffer for printer reply
-	int actual; // actual reply length
-
-	char reply_data[7]; // buffer for "EE" tag (contains readed byte)
-	int reply_data_len = 4; //expected reply_data length
-
-	char onebyte[5]; //contains one or two HEX byte string ("B2\0" for example)
-	unsigned short int replyaddr; //reply address (for confirmation)
-
-	D(fprintf(stderr, "=== read_eeprom_address ===\n"))
-
-	cmd[9] = addr & 0xFF;
-	if (printers[pm].twobyte_addresses)
-	{
-		cmd[10] = (addr >> 8) & 0xFF;
-		cmd_len = 11;
-		cmd_args_count = 2;
-		reply_data_len = 6;
-	}
-	else
-	{
-		if ((addr >> 8) != 0)
-		{
-			D(fprintf(stderr, "Printer \"%s\" don't support two-byte addresses. Continuing using low byte only.\n", printers[pm].name));
-			addr = addr & 0xFF;
-		}
-	}
+	FILE* f;
+	char header[INPUT_BUF_LEN]; //first line of the file
+	char line[INPUT_BUF_LEN]; //current line of the file
+	unsigned char saved[0x10000]; //bytes already readed by previous run
+	unsigned int addr; //address from the file
+	unsigned int data; //data from the file
 
-	init_command((fcmd_header_t*)cmd, pm, EFCLS_EEPROM_READ, EFCMD_EEPROM_READ, cmd_args_count);
-
-	D(fprintf(stderr, "Reading eeprom address %#x... ", addr))
-	actual = INPUT_BUF_LEN;
-	if (printer_transact(fd, socket_id, cmd, cmd_len, reply, &actual))
-	{
-		D(fprintf(stderr, "Transact failed.\n"))
-		return -1;
-	}
+	D(fprintf(stderr, "=== checkpoint_open ===\n"))
 
-	if (get_tag(reply, actual, "EE:", reply_data, 7))
-	{
-		D(fprintf(stderr, "Can't get reply data.\n"))
-		return -1;
-	}
-	D_OK
+	//printer identity, so progress of another printer is never mixed in
+	snprintf(header, INPUT_BUF_LEN, "reink-dump \"%s\" 0x%04X-0x%04X \"%s\" \"%s\"\n",
+	         s->printer.name, start_addr, end_addr, raw_device, s->device_id[0] ? s->device_id : "-");
+	*next_addr = start_addr;
 
-	if (strlen(reply_data) != reply_data_len)
+	if ((f = fopen(state_file, "r")))
 	{
-		D(fprintf(stderr, "ReplyData length != %d\n", reply_data_len))
-		reply_data_len -= 2; //assuming this is one-byte addresses printer
-		if (strlen(reply_data) == reply_data_len)
+		if (!fgets(line, INPUT_BUF_LEN, f))
+			; //empty file, nothing to continue
+		else if (strcmp(line, header))
+			fprintf(stderr, "State file '%s' belongs to another dump or printer, starting over.\n", state_file);
+		else
 		{
-			D(fprintf(stderr, "Seems like printer with one-byte addresses EEPROM.\n"))
+			D(fprintf(stderr, "Continuing previous dump from '%s'... ", state_file))
+			while (fgets(line, INPUT_BUF_LEN, f))
+			{
+				if (sscanf(line, "0x%x = 0x%x", &addr, &data) != 2 || addr != *next_addr || data > 0xFF || addr > end_addr)
+					break; //last line may be incomplete
+				saved[addr] = data;
+				image[addr] = data;
+				(*next_addr)++;
+			}
+			D(fprintf(stderr, "OK, next address is %#x.\n", *next_addr))
 		}
-		else
-			return -1;
+		fclose(f);
 	}
 
-	strncpy(onebyte, reply_data, reply_data_len - 2);
-	onebyte[reply_data_len - 2] = '\0';
-
-	replyaddr = strtol(onebyte, NULL, 16);
-	if (replyaddr != addr)
+	//rewrite the file to drop possibly incomplete tail
+	if (!(f = fopen(state_file, "w")))
 	{
-		D(fprintf(stderr, "Reply address (%x) don't match requested (%x).\n", replyaddr, addr))
-		return -1;
+		fprintf(stderr, "Error opening state file '%s': %s\n", state_file, strerror(errno));
+		return NULL;
 	}
 
-	strncpy(onebyte, reply_data + reply_data_len - 2, 2); //the data itself
-	onebyte[2] = '\0';
-	*data = strtol(onebyte, NULL, 16);
-
-	D(fprintf(stderr, "EEPROM addr %#x = %#x.\n", addr, *data))
-
-	D(fprintf(stderr, "^^^ read_eeprom_address ^^^\n"))
-
-	return 0;
-}
-
-int write_eeprom_address(int fd, int socket_id, unsigned int pm, unsigned short int addr, unsigned char data)
-{
-	char cmd[12]; // full command with address
-	int cmd_len = 11; // full length of the command
-	int cmd_args_len = 2; // command arguments count
-
-	char reply[INPUT_BUF_LEN]; // buffer for printer reply
-	int actual; // actual reply length
-	char reply_data[6]; // buffer for "OK" tag
-
-	D(fprintf(stderr, "=== write_eeprom_address ===\n"))
-
-	cmd[9] = addr & 0xFF;
-	if (printers[pm].twobyte_addresses)
+	fputs(header, f);
+	for (addr = start_addr; addr < *next_addr; addr++)
 	{
-		cmd[10] = (addr >> 8) & 0xFF;
-		cmd[11] = (char)data;
-		cmd_len = 12;
-		cmd_args_len = 3;
-	}
-	else
-	{
-		cmd[10] = (char)data;
-
-		if ((addr >> 8) != 0)
-			D(fprintf(stderr, "Printer \"%s\" don't support two-byte addresses. Continuing using low byte only.\n", printers[pm].name));
+		fprintf(f, "0x%04X = 0x%02X\n", addr, saved[addr]);
+		if (eeimage_put(img, addr, saved[addr]))
+			break;
 	}
 
-	init_command((fcmd_header_t*)cmd, pm, EFCLS_EEPROM_WRITE, EFCMD_EEPROM_WRITE, cmd_args_len);
-
-	D(fprintf(stderr, "Writing %#x to eeprom address %#x... ", data, addr))
-	actual = INPUT_BUF_LEN;
-	if (printer_transact(fd, socket_id, cmd, cmd_len, reply, &actual))
+	if (addr < *next_addr)
 	{
-		D(fprintf(stderr, "Transact failed.\n"))
-		return -1;
+		fprintf(stderr, "Error writing EEPROM image.\n");
+		fclose(f);
+		return NULL;
 	}
 
-	if (get_tag(reply, actual, "OK", reply_data, 6))
+	if (fflush(f))
 	{
-		D(fprintf(stderr, "Can't get reply data.\n"))
-		return -1;
+		fprintf(stderr, "Error writing state file '%s': %s\n", state_file, strerror(errno));
+		fclose(f);
+		return NULL;
 	}
-	D_OK
 
-	D(fprintf(stderr, "^^^ write_eeprom_address ^^^\n"))
+	D(fprintf(stderr, "^^^ checkpoint_open ^^^\n"))
 
-	return 0;
+	return f;
 }
@@ -0,0 +1,633 @@
+/* This file is part of ReInk.
+ * Copyright (C) 2008-2016 Alexey Osipov public@alexey.osipov.name
+ *
+ * ReInk is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReInk is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReInk. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>	//getenv, realpath
+#include <unistd.h>	//getopt, daemon
+#include <stdio.h>	//fprintf
+#include <string.h>	//strcmp
+#include <signal.h>	//sigaction
+#include <time.h>	//time
+#include <limits.h>	//PATH_MAX
+
+#include <errno.h>	//errno
+#include <fcntl.h>	//O_NONBLOCK
+
+#include <sys/types.h>	//sockets
+#include <sys/stat.h>	//chmod
+#include <sys/select.h>	//select
+#include <sys/socket.h>	//sockets
+#include <sys/un.h>		//sockaddr_un
+
+#include "d4lib.h"	//setDebug
+#include "libreink.h"	//printer session
+#include "reinkd.h"	//reinkd protocol
+#include "metrics.h"	//metrics exporter
+
+#define D(__c) 	if (rd_debug) {__c;};
+
+//printer served by daemon
+typedef struct _reinkd_device {
+	char path[PATH_MAX];	//canonical raw device path
+	reink_session_t s;		//printer session (s.fd is -1 if not opened)
+	time_t last_used;		//time of the last request
+	printer_metrics_t metrics;	//the last polled state
+} reinkd_device_t;
+
+//connected client
+typedef struct _reinkd_client {
+	int fd;						//client socket (-1 if slot is free)
+	reinkd_device_t* device;	//device opened by client
+	unsigned char in[REINKD_HEADER_LEN + REINKD_MAX_PAYLOAD];	//incoming data
+	int in_len;					//bytes in <in>
+	unsigned char out[REINKD_MAX_REPLIES * (REINKD_HEADER_LEN + REINKD_MAX_PAYLOAD)];	//replies not sent yet
+	int out_len;				//bytes in <out>
+} reinkd_client_t;
+
+int rd_debug = 0;
+
+static reinkd_device_t devices[REINKD_MAX_DEVICES];
+static int devices_count = 0;
+static reinkd_client_t clients[REINKD_MAX_CLIENTS];
+static volatile sig_atomic_t terminate = 0;
+
+void print_usage(const char* progname);
+
+/*
+    Puts canonical form of <path> to <canonical> (PATH_MAX bytes),
+    or <path> itself if it can't be resolved (i.e. printer is off).
+*/
+void canonical_path(const char* path, char* canonical);
+
+/*
+    Opens printer session of <device> if it is not opened.
+    On success returns 0.
+    On fail returns -1.
+*/
+int device_open(reinkd_device_t* device);
+
+/*
+    Closes printer sessions, which were not used for REINKD_IDLE_TIMEOUT,
+    so printer may be used by the print system.
+*/
+void close_idle_devices();
+
+/*
+    Reads ink levels and waste counter of device number <index>
+    and passes them to metrics exporter. The poll is bounded by
+    REINKD_POLL_DEADLINE, as clients wait for it.
+*/
+void poll_device(int index);
+
+/*
+    Handles all complete requests received from <client>, while there
+    is room for their replies. Every request is bounded by
+    REINKD_REQUEST_DEADLINE.
+    On success returns 0.
+    On fail (client should be disconnected) returns -1.
+*/
+int serve_client(reinkd_client_t* client);
+
+/*
+    Queues reply frame with <status> and <payload> to <client>
+    (serve_client makes sure there is room for it).
+    Always returns 0.
+*/
+int send_reply(reinkd_client_t* client, unsigned char status, const char* payload, int payload_len);
+
+/*
+    Sends as much of queued replies of <client> as its socket takes
+    without blocking.
+    On success returns 0.
+    On fail (client should be disconnected) returns -1.
+*/
+int flush_client(reinkd_client_t* client);
+
+static void on_terminate(int signum)
+{
+	terminate = 1;
+}
+
+int main(int argc, char** argv)
+{
+	int opt;						//current option
+	const char* socket_path = NULL;	//-s option argument
+	int foreground = 0;				//-F option
+	const char* metrics_addr = NULL;	//-m option argument
+	int poll_interval = REINKD_POLL_INTERVAL;	//-p option argument
+	time_t next_poll = 0;			//when to poll printers for metrics
+	int polling = -1;				//device to poll next in this round (-1 - none)
+	char* str_reink_debug = NULL;	//the value of REINK_DEBUG environmental variable
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	struct timeval tv;
+	fd_set readfds;
+	fd_set writefds;
+	int listener;		//listening socket
+	int maxfd;
+	int accept_failing = 0;	//accept error is logged
+	int fd, i, n;
+
+	setDebug(0);
+	str_reink_debug = getenv("REINK_DEBUG");
+	if (str_reink_debug)
+	{
+		rd_debug = atoi(str_reink_debug);
+		if (rd_debug > 1)
+			setDebug(1);
+	}
+
+	socket_path = getenv(REINKD_SOCKET_ENV);
+	if (!socket_path || *socket_path == '\0')
+		socket_path = REINKD_SOCKET;
+
+	while ((opt = getopt(argc, argv, "r:s:Fm:p:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'r':
+				if (devices_count == REINKD_MAX_DEVICES)
+				{
+					fprintf(stderr, "Too many devices, at most %d are supported.\n", REINKD_MAX_DEVICES);
+					return 1;
+				}
+				if (strlen(optarg) >= PATH_MAX)
+				{
+					print_usage(argv[0]);
+					return 1;
+				}
+				canonical_path(optarg, devices[devices_count].path);
+				reink_init(&devices[devices_count].s);
+				devices[devices_count].s.daemon_socket = NULL; //we are the daemon
+				devices[devices_count].s.debug = rd_debug;
+				strcpy(devices[devices_count].metrics.device, devices[devices_count].path);
+				devices_count++;
+				break;
+			case 's':
+				socket_path = optarg;
+				break;
+			case 'F':
+				foreground = 1;
+				break;
+			case 'm':
+				metrics_addr = optarg;
+				break;
+			case 'p':
+				poll_interval = atoi(optarg);
+				if (poll_interval < 1)
+				{
+					print_usage(argv[0]);
+					return 1;
+				}
+				break;
+			default:
+				print_usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (!devices_count || strlen(socket_path) >= sizeof(addr.sun_path))
+	{
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	for (i = 0; i < REINKD_MAX_CLIENTS; i++)
+		clients[i].fd = -1;
+
+	if ((listener = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+	{
+		fprintf(stderr, "Can't create socket: %s\n", strerror(errno));
+		return 1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	unlink(socket_path); //left from previous run
+	if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(listener, REINKD_MAX_CLIENTS) == -1)
+	{
+		fprintf(stderr, "Can't listen on '%s': %s\n", socket_path, strerror(errno));
+		return 1;
+	}
+	chmod(socket_path, 0660); //the same access as printer devices usually have
+
+	if (!foreground && daemon(0, 0) == -1)
+	{
+		fprintf(stderr, "Can't become a daemon: %s\n", strerror(errno));
+		unlink(socket_path);
+		return 1;
+	}
+
+	if (metrics_addr && metrics_start(metrics_addr) < 0)
+	{
+		unlink(socket_path);
+		return 1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_terminate;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL); //clients may go away at any time
+
+	D(fprintf(stderr, "Listening on %s, serving %d device(s).\n", socket_path, devices_count))
+
+	while (!terminate)
+	{
+		FD_ZERO(&readfds);
+		FD_ZERO(&writefds);
+		FD_SET(listener, &readfds);
+		maxfd = listener;
+		for (i = 0; i < REINKD_MAX_CLIENTS; i++)
+			if (clients[i].fd >= 0)
+			{
+				//requests of client which doesn't read replies wait in <in>
+				if (clients[i].in_len < (int)sizeof(clients[i].in))
+					FD_SET(clients[i].fd, &readfds);
+				if (clients[i].out_len > 0)
+					FD_SET(clients[i].fd, &writefds);
+				if (clients[i].fd > maxfd)
+					maxfd = clients[i].fd;
+			}
+
+		//while printers are being polled, wait only to see that clients are quiet
+		tv.tv_sec = polling < 0 ? 1 : 0;
+		tv.tv_usec = polling < 0 ? 0 : REINKD_POLL_QUIET * 1000;
+		n = select(maxfd + 1, &readfds, &writefds, NULL, &tv);
+		if (n == -1 && errno != EINTR)
+		{
+			fprintf(stderr, "select: %s\n", strerror(errno));
+			break;
+		}
+
+		if (n > 0 && FD_ISSET(listener, &readfds) && (fd = accept(listener, NULL, NULL)) < 0)
+		{
+			//listener stays readable while i.e. out of descriptors, don't spin on it
+			if (errno != EINTR)
+			{
+				if (!accept_failing)
+					fprintf(stderr, "accept: %s\n", strerror(errno));
+				accept_failing = 1;
+				usleep(REINKD_ACCEPT_BACKOFF * 1000);
+			}
+		}
+		else if (n > 0 && FD_ISSET(listener, &readfds))
+		{
+			accept_failing = 0;
+			for (i = 0; i < REINKD_MAX_CLIENTS && clients[i].fd >= 0; i++);
+			if (i == REINKD_MAX_CLIENTS)
+			{
+				D(fprintf(stderr, "Too many clients, connection refused.\n"))
+				close(fd);
+			}
+			else if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1)
+				close(fd); //would block the others
+			else
+			{
+				clients[i].fd = fd;
+				clients[i].device = NULL;
+				clients[i].in_len = 0;
+				clients[i].out_len = 0;
+			}
+		}
+
+		for (i = 0; n > 0 && i < REINKD_MAX_CLIENTS; i++)
+		{
+			if (clients[i].fd < 0)
+				continue;
+
+			fd = 1;
+			if (FD_ISSET(clients[i].fd, &readfds))
+			{
+				fd = read(clients[i].fd, clients[i].in + clients[i].in_len, sizeof(clients[i].in) - clients[i].in_len);
+				if (fd > 0)
+					clients[i].in_len += fd;
+				else if (fd < 0 && (errno == EAGAIN || errno == EINTR))
+					fd = 1;
+			}
+
+			//replies sent make room for waiting requests
+			if (fd <= 0 || flush_client(&clients[i]) < 0 || serve_client(&clients[i]) < 0 || flush_client(&clients[i]) < 0)
+			{
+				close(clients[i].fd);
+				clients[i].fd = -1;
+			}
+		}
+
+		//one printer per quiet loop turn, so requests are served between polls,
+		//but busy clients don't hold the round longer than the interval
+		if (metrics_addr && polling < 0 && time(NULL) >= next_poll)
+		{
+			polling = 0;
+			next_poll = time(NULL) + poll_interval;
+		}
+		if (polling >= 0 && (n == 0 || time(NULL) >= next_poll))
+		{
+			poll_device(polling);
+			if (++polling == devices_count)
+				polling = -1;
+		}
+
+		if (metrics_addr)
+			metrics_update_transport(&d4Stats);
+
+		close_idle_devices();
+	}
+
+	D(fprintf(stderr, "Terminating.\n"))
+
+	for (i = 0; i < devices_count; i++)
+		if (devices[i].s.fd >= 0)
+			reink_close(&devices[i].s);
+
+	close(listener);
+	unlink(socket_path);
+	if (metrics_addr)
+		metrics_stop();
+
+	return 0;
+}
+
+void print_usage(const char* progname)
+{
+	fprintf(stderr, "ReInk daemon v%d.%d.%d (http://reink.lerlan.ru)\n\
+Usage:\n\
+	%s [-s socket] [-F] [-m metrics [-p interval]] -r printer_raw_device [-r printer_raw_device ...]\n\
+\n\
+    Holds IEEE 1284.4 sessions of the given printers and serves reink\n\
+ clients over Unix socket <socket> (default is " REINKD_SOCKET " or\n\
+ the value of REINKD_SOCKET environment variable).\n\
+    Printer session is closed after %d seconds without requests, so the\n\
+ printer can be used for printing.\n\
+    -F - stay in foreground.\n\
+    -m - serve metrics (ink levels, waste counters and transport statistics)\n\
+ in Prometheus format on <metrics>, which is TCP port on loopback interface\n\
+ or Unix socket path. Printers are polled every <interval> seconds\n\
+ (default is %d).\n\
+\n\
+    You can set REINK_DEBUG environment variable to enable debug output to\n\
+ stderr (with -F only).\n",
+ REINK_VERSION_MAJOR, REINK_VERSION_MINOR, REINK_VERSION_REV,
+ progname, REINKD_IDLE_TIMEOUT, REINKD_POLL_INTERVAL);
+}
+
+void canonical_path(const char* path, char* canonical)
+{
+	if (!realpath(path, canonical))
+		strcpy(canonical, path);
+}
+
+int device_open(reinkd_device_t* device)
+{
+	device->last_used = time(NULL);
+
+	if (device->s.fd >= 0)
+		return 0;
+
+	D(fprintf(stderr, "Opening printer session for %s.\n", device->path))
+	return reink_open(&device->s, device->path);
+}
+
+void close_idle_devices()
+{
+	int i;
+	time_t now = time(NULL);
+
+	for (i = 0; i < devices_count; i++)
+		if (devices[i].s.fd >= 0 && now - devices[i].last_used >= REINKD_IDLE_TIMEOUT)
+		{
+			D(fprintf(stderr, "Closing idle printer session for %s.\n", devices[i].path))
+			reink_close(&devices[i].s);
+		}
+}
+
+void poll_device(int index)
+{
+	reinkd_device_t* device = &devices[index];
+	printer_metrics_t* m = &device->metrics;
+	unsigned char data;
+	int i;
+
+	D(fprintf(stderr, "Polling %s.\n", device->path))
+
+	m->polls++;
+	m->up = 0;
+
+	reink_set_deadline(REINKD_POLL_DEADLINE);
+	if (device_open(device) == 0 && reink_ink_levels(&device->s, &m->inks) == 0)
+	{
+		strcpy(m->printer, (char*)device->s.printer.name);
+
+		m->waste_len = device->s.printer.wastemap.len;
+		if (m->waste_len > METRICS_WASTE_LEN)
+			m->waste_len = METRICS_WASTE_LEN;
+
+		for (i = 0; i < m->waste_len; i++)
+		{
+			m->waste_addr[i] = device->s.printer.wastemap.addr[i];
+			if (reink_read_eeprom_retry(&device->s, m->waste_addr[i], &data))
+				break;
+			m->waste[i] = data;
+		}
+
+		if (i == m->waste_len)
+		{
+			m->up = 1;
+			m->updated = time(NULL);
+		}
+	}
+
+	reink_set_deadline(0);
+
+	if (!m->up)
+	{
+		D(fprintf(stderr, "Polling %s failed: %s\n", device->path, device->s.error))
+		m->poll_errors++;
+
+		//the next request will reopen session, i.e. broken by the deadline
+		if (device->s.fd >= 0)
+			reink_close(&device->s);
+	}
+
+	metrics_update_printer(index, m);
+}
+
+int serve_client(reinkd_client_t* client)
+{
+	unsigned char op;	//requested operation
+	char* payload;		//request payload
+	int len;			//request payload length
+	char path[PATH_MAX];
+	char canonical[PATH_MAX];
+	const char* error;
+	char reply[REINKD_MAX_PAYLOAD];
+	int reply_len;
+	char model;
+	char state;			//REINK_ALIVE or REINK_BUSY
+	reinkd_device_t* device;	//device to ping
+	int timeout;		//of ping
+	int i, ret;
+
+	//requests are handled in order they came, so client may pipeline them
+	while (client->in_len >= REINKD_HEADER_LEN && client->out_len <= (int)sizeof(client->out) - REINKD_HEADER_LEN - REINKD_MAX_PAYLOAD)
+	{
+		op = client->in[0];
+		len = (client->in[1] << 8) | client->in[2];
+		payload = (char*)client->in + REINKD_HEADER_LEN;
+
+		if (len > REINKD_MAX_PAYLOAD)
+			return -1; //protocol violation
+		if (client->in_len < REINKD_HEADER_LEN + len)
+			break; //wait for the rest of request
+
+		switch (op)
+		{
+			case REINKD_OP_OPEN:
+				if (len >= PATH_MAX)
+					return -1;
+				memcpy(path, payload, len);
+				path[len] = '\0';
+
+				//only devices from the command line are served
+				client->device = NULL;
+				canonical_path(path, canonical);
+				for (i = 0; i < devices_count; i++)
+					if (!strcmp(devices[i].path, canonical))
+						client->device = &devices[i];
+
+				reink_set_deadline(REINKD_REQUEST_DEADLINE);
+				if (!client->device)
+				{
+					error = "reinkd: Device is not served by the daemon.";
+					ret = send_reply(client, REINKD_ST_ERROR, error, strlen(error));
+				}
+				else if (device_open(client->device))
+					ret = send_reply(client, REINKD_ST_ERROR, client->device->s.error, strlen(client->device->s.error));
+				else
+				{
+					model = client->device->s.pm;
+					ret = send_reply(client, REINKD_ST_OK, &model, 1);
+				}
+				break;
+
+			case REINKD_OP_TRANSACT:
+				reply_len = REINKD_MAX_PAYLOAD;
+				reink_set_deadline(REINKD_REQUEST_DEADLINE);
+				if (!client->device)
+				{
+					error = "reinkd: No device opened.";
+					ret = send_reply(client, REINKD_ST_ERROR, error, strlen(error));
+				}
+				else if (device_open(client->device) || reink_transact(&client->device->s, client->device->s.ctrl_socket, payload, len, reply, &reply_len))
+				{
+					ret = send_reply(client, REINKD_ST_ERROR, client->device->s.error, strlen(client->device->s.error));
+
+					//the next request will reopen session if channel is broken
+					if (client->device->s.fd >= 0 && reink_recover_channel(&client->device->s))
+						reink_close(&client->device->s);
+				}
+				else
+					ret = send_reply(client, REINKD_ST_OK, reply, reply_len);
+				break;
+
+			case REINKD_OP_PING:
+				if (len < 2 || len - 2 >= PATH_MAX)
+					return -1;
+				memcpy(path, payload + 2, len - 2);
+				path[len - 2] = '\0';
+
+				//reink_ping bounds itself by the timeout, 0 would be no deadline
+				timeout = ((unsigned char)payload[0] << 8) | (unsigned char)payload[1];
+				if (timeout <= 0 || timeout > REINKD_REQUEST_DEADLINE)
+					timeout = REINKD_REQUEST_DEADLINE;
+
+				device = NULL;
+				canonical_path(path, canonical);
+				for (i = 0; i < devices_count; i++)
+					if (!strcmp(devices[i].path, canonical))
+						device = &devices[i];
+
+				if (!device)
+				{
+					error = "reinkd: Device is not served by the daemon.";
+					ret = send_reply(client, REINKD_ST_ERROR, error, strlen(error));
+				}
+				else if ((state = reink_ping(&device->s, device->path, timeout)) < 0)
+				{
+					ret = send_reply(client, REINKD_ST_ERROR, device->s.error, strlen(device->s.error));
+
+					//the next request will reopen session
+					if (device->s.fd >= 0)
+						reink_close(&device->s);
+				}
+				else
+					ret = send_reply(client, REINKD_ST_OK, &state, 1);
+				break;
+
+			default:
+				return -1; //protocol violation
+		}
+		reink_set_deadline(0);
+
+		if (ret < 0)
+			return -1;
+
+		client->in_len -= REINKD_HEADER_LEN + len;
+		memmove(client->in, client->in + REINKD_HEADER_LEN + len, client->in_len);
+	}
+
+	return 0;
+}
+
+int send_reply(reinkd_client_t* client, unsigned char status, const char* payload, int payload_len)
+{
+	unsigned char* frame = client->out + client->out_len;
+
+	if (payload_len > REINKD_MAX_PAYLOAD)
+		payload_len = REINKD_MAX_PAYLOAD;
+
+	frame[0] = status;
+	frame[1] = (payload_len >> 8) & 0xFF;
+	frame[2] = payload_len & 0xFF;
+	memcpy(frame + REINKD_HEADER_LEN, payload, payload_len);
+	client->out_len += REINKD_HEADER_LEN + payload_len;
+
+	return 0;
+}
+
+int flush_client(reinkd_client_t* client)
+{
+	int n;
+
+	while (client->out_len > 0)
+	{
+		if ((n = send(client->fd, client->out, client->out_len, MSG_NOSIGNAL)) < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break; //the rest goes when socket is writable
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		client->out_len -= n;
+		memmove(client->out, client->out + n, client->out_len);
+	}
+
+	return 0;
+}
@@ -0,0 +1,64 @@
+/* This file is part of ReInk.
+ * Copyright (C) 2008-2016 Alexey Osipov public@alexey.osipov.name
+ *
+ * ReInk is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReInk is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReInk. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+   reinkd - ReInk session broker daemon.
+
+   reinkd owns IEEE 1284.4 sessions of printers and serves requests
+   of many clients over local Unix socket, so clients don't race each
+   other through EnterIEEE/Init and don't corrupt credit state of
+   each other. Requests of all clients are executed one by one.
+
+   Protocol: every request and reply is a frame of REINKD_HEADER_LEN
+   bytes header (operation or status, payload length high and low
+   byte) followed by payload. Client may send several requests
+   without waiting for replies (pipelining), replies are sent in
+   order of requests.
+*/
+
+#ifndef REINKD_H
+
+#define REINKD_H
+
+#include "libreink.h"
+
+#define REINKD_SOCKET		"/var/run/reinkd.sock"	//default socket path
+#define REINKD_SOCKET_ENV	"REINKD_SOCKET"			//environment variable to override socket path
+
+//requests
+#define REINKD_OP_OPEN		0x01	//payload: raw device path, reply payload: printer model (PM_*, one byte)
+#define REINKD_OP_TRANSACT	0x02	//payload: "EPSON-CTRL" command, reply payload: printer reply
+#define REINKD_OP_PING		0x03	//payload: timeout (ms, two bytes, high first) and raw device path, reply payload: REINK_ALIVE or REINK_BUSY (one byte)
+
+//reply statuses
+#define REINKD_ST_OK		0x00	//success
+#define REINKD_ST_ERROR		0x01	//fail, reply payload: error message
+
+#define REINKD_HEADER_LEN	3				//frame header length
+#define REINKD_MAX_PAYLOAD	REINK_BUF_LEN	//maximum frame payload length
+
+#define REINKD_MAX_CLIENTS	32	//maximum count of connected clients
+#define REINKD_MAX_DEVICES	16	//maximum count of printers served
+#define REINKD_IDLE_TIMEOUT	5	//seconds to keep unused printer session opened, so printer may be used for printing
+#define REINKD_POLL_INTERVAL	60	//seconds between printer polls for metrics
+#define REINKD_POLL_DEADLINE	2000	//ms for one printer poll, clients wait for it at most
+#define REINKD_POLL_QUIET	50		//ms without requests before the next printer is polled
+#define REINKD_ACCEPT_BACKOFF	100	//ms to wait after failed accept (i.e. out of descriptors)
+#define REINKD_MAX_REPLIES	4	//replies kept for client which doesn't read them, its next requests wait
+#define REINKD_REQUEST_DEADLINE	3000	//ms for one request, so a hung printer doesn't stall other clients
+
+#endif
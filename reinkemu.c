@@ -0,0 +1,750 @@
+/* This file is part of ReInk.
+ * Copyright (C) 2008-2016 Alexey Osipov public@alexey.osipov.name
+ *
+ * ReInk is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReInk is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReInk. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+   reinkemu - emulator of many Epson printers for load testing.
+
+   Every emulated printer is a pty, which speaks EJL escape to
+   IEEE 1284.4 mode, IEEE 1284.4 transactions, "EPSON-CTRL" commands
+   (di, st, EEPROM read and write factory commands) and accepts print
+   jobs on "EPSON-DATA". Printers are served by one thread, replies are
+   delayed by the latency of the printer without blocking others.
+*/
+
+#define _GNU_SOURCE	//posix_openpt, cfmakeraw
+
+#include <stdlib.h>	//posix_openpt, rand_r
+#include <unistd.h>	//getopt
+#include <stdio.h>	//fprintf
+#include <string.h>	//strcmp
+#include <strings.h>	//strncasecmp
+#include <signal.h>	//sigaction
+#include <time.h>	//clock_gettime
+#include <limits.h>	//PATH_MAX
+#include <fcntl.h>	//O_RDWR
+#include <poll.h>	//poll
+#include <termios.h>	//raw mode
+
+#include <errno.h>	//errno
+
+#include <sys/types.h>	//mkdir
+#include <sys/stat.h>	//mkdir
+
+#include "printers.h"	//emulated models
+#include "libreink.h"	//REINK_VERSION
+
+#define EMU_DIR			"/tmp/reinkemu"	//default directory of printer device links
+#define EMU_MAX_DEVICES	256		//maximum count of emulated printers
+#define EMU_IN_LEN		0x1000	//input buffer (the largest packet accepted)
+#define EMU_REPLY_LEN	128		//the longest reply
+#define EMU_MAX_REPLIES	16		//replies scheduled at once
+#define EMU_CREDITS		8		//credits given on CreditRequest
+#define EMU_CTRL_SOCKET	0x02	//socket of "EPSON-CTRL"
+#define EMU_DATA_SOCKET	0x40	//socket of "EPSON-DATA"
+#define EMU_INK_USE		0x10000	//job bytes to increment ink counters
+#define EMU_EEPROM_SIZE	0x100	//EEPROM size when model doesn't define it
+#define EMU_EEPROM_SIZE2	0x2000	//the same for printers with two-byte addresses
+
+#define D(__c) 	if (emu_debug) {__c;};
+
+//reply waiting for its time
+typedef struct _emu_reply {
+	long due;			//when to send (ms, monotonic)
+	int len;
+	unsigned char data[EMU_REPLY_LEN];
+} emu_reply_t;
+
+//emulated printer
+typedef struct _emu_device {
+	int master;					//pty master
+	int slave;					//pty slave, kept opened so master don't get EIO between sessions
+	char link[PATH_MAX];		//link to the pty slave in the farm directory
+	unsigned int pm;			//printer model (PM_*)
+	unsigned char* eeprom;		//EEPROM image
+	unsigned int eeprom_size;
+	int latency;				//reply latency (ms)
+	int jitter;					//random addition to latency (ms)
+	int fail;					//percent of "EPSON-CTRL" commands not answered
+	unsigned int seed;			//random generator state
+	int packet_mode;			//in IEEE 1284.4 mode?
+	int ctrl_credits;			//credits given by host on "EPSON-CTRL"
+	emu_reply_t ctrl_pending;	//"EPSON-CTRL" reply waiting for credit (len 0 - none)
+	unsigned long job_bytes;	//bytes received on "EPSON-DATA"
+	unsigned char in[EMU_IN_LEN];	//incoming data
+	int in_len;					//bytes in <in>
+	emu_reply_t out[EMU_MAX_REPLIES];	//scheduled replies
+	int out_head;
+	int out_count;
+	unsigned long commands;		//"EPSON-CTRL" commands received
+	unsigned long dropped;		//"EPSON-CTRL" commands not answered (failure emulation)
+} emu_device_t;
+
+int emu_debug = 0;
+
+static emu_device_t devices[EMU_MAX_DEVICES];
+static int devices_count = 0;
+static volatile sig_atomic_t terminate = 0;
+
+void print_usage(const char* progname);
+
+/*
+    Parses printer <spec> ([count*]model[,latency=ms][,jitter=ms]
+    [,fail=percent][,image=file]) and adds the printers.
+    On success returns 0.
+    On fail returns -1.
+*/
+int add_devices(const char* spec, unsigned int seed);
+
+/*
+    Creates pty of <device> and it's link <index> in <dir>.
+    On success returns 0.
+    On fail returns -1.
+*/
+int device_start(emu_device_t* device, const char* dir, int index);
+
+/*
+    Handles all complete packets (or EJL escape) received by <device>.
+*/
+void device_input(emu_device_t* device);
+
+/*
+    Writes replies of <device> which time has come.
+    Returns time (ms, monotonic) of the next scheduled reply or -1.
+*/
+long device_output(emu_device_t* device);
+
+/*
+    Schedules reply of <len> bytes of <data> to be sent after the
+    latency of <device>.
+*/
+void schedule_reply(emu_device_t* device, const unsigned char* data, int len);
+
+/*
+    Executes "EPSON-CTRL" command and puts reply packet to <reply>.
+    Returns reply length, 0 if there is no reply.
+*/
+int ctrl_command(emu_device_t* device, const unsigned char* cmd, int len, unsigned char* reply);
+
+/*
+    Returns current monotonic time in ms.
+*/
+long now_ms();
+
+static void on_terminate(int signum)
+{
+	terminate = 1;
+}
+
+int main(int argc, char** argv)
+{
+	int opt;						//current option
+	const char* dir = EMU_DIR;		//-d option argument
+	unsigned int seed = 1;			//-s option argument
+	char* str_reink_debug = NULL;	//the value of REINK_DEBUG environmental variable
+	struct pollfd fds[EMU_MAX_DEVICES];
+	struct sigaction sa;
+	long next, due, now;
+	int ready;	//count of devices with input
+	int i, n;
+
+	str_reink_debug = getenv("REINK_DEBUG");
+	if (str_reink_debug)
+		emu_debug = atoi(str_reink_debug);
+
+	while ((opt = getopt(argc, argv, "d:s:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'd':
+			dir = optarg;
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind == argc)
+	{
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	for (i = optind; i < argc; i++)
+		if (add_devices(argv[i], seed))
+			return 1;
+
+	if (mkdir(dir, 0755) && errno != EEXIST)
+	{
+		fprintf(stderr, "Error creating directory '%s': %s\n", dir, strerror(errno));
+		return 1;
+	}
+
+	for (i = 0; i < devices_count; i++)
+	{
+		if (device_start(&devices[i], dir, i))
+		{
+			while (--i >= 0)
+				unlink(devices[i].link);
+			return 1;
+		}
+		printf("%s: %s\n", devices[i].link, printers[devices[i].pm].name);
+	}
+	fflush(stdout);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_terminate;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
+	for (i = 0; i < devices_count; i++)
+	{
+		fds[i].fd = devices[i].master;
+		fds[i].events = POLLIN;
+	}
+
+	next = -1;
+	while (!terminate)
+	{
+		now = now_ms();
+		ready = poll(fds, devices_count, next < 0 ? -1 : (next > now ? next - now : 0));
+		if (ready < 0 && errno != EINTR)
+		{
+			perror("poll");
+			break;
+		}
+
+		next = -1;
+		for (i = 0; i < devices_count; i++)
+		{
+			if (ready > 0 && (fds[i].revents & POLLIN))
+			{
+				n = read(devices[i].master, devices[i].in + devices[i].in_len, EMU_IN_LEN - devices[i].in_len);
+				if (n > 0)
+				{
+					devices[i].in_len += n;
+					device_input(&devices[i]);
+				}
+			}
+			due = device_output(&devices[i]);
+			if (due >= 0 && (next < 0 || due < next))
+				next = due;
+		}
+	}
+
+	for (i = 0; i < devices_count; i++)
+	{
+		unlink(devices[i].link);
+		fprintf(stderr, "%s: %lu commands, %lu not answered, %lu job bytes\n",
+				devices[i].link, devices[i].commands, devices[i].dropped, devices[i].job_bytes);
+	}
+
+	return 0;
+}
+
+void print_usage(const char* progname)
+{
+	fprintf(stderr, "ReInk printer emulator v%d.%d.%d (http://reink.lerlan.ru)\n\
+Usage:\n\
+	%s [-d dir] [-s seed] [count*]model[,option=value...] ...\n\
+\n\
+    Emulates printers on ptys linked as <dir>/lp0, <dir>/lp1, ... (default\n\
+ <dir> is " EMU_DIR "), so reink and reinkd may be load tested without\n\
+ printers. <model> is the printer model number (PM_*) or a part of its\n\
+ name, i.e. \"Photo 790\". Options:\n\
+    latency=<ms> - delay of every reply;\n\
+    jitter=<ms> - random addition to the latency;\n\
+    fail=<percent> - \"EPSON-CTRL\" commands left without reply;\n\
+    image=<file> - EEPROM image (binary, offset in file is EEPROM address),\n\
+ random by default.\n\
+    <seed> makes random EEPROM contents, jitter and failures repeatable.\n\
+    Example: %s 30*790,latency=20,jitter=10 2*580,fail=5\n",
+ REINK_VERSION_MAJOR, REINK_VERSION_MINOR, REINK_VERSION_REV,
+ progname, progname);
+}
+
+int add_devices(const char* spec, unsigned int seed)
+{
+	char model[MAX_NAME_LEN];
+	const char* p = spec;
+	const char* opt;
+	char* end;
+	emu_device_t* device;
+	FILE* image = NULL;
+	int count = 1;
+	int latency = 0, jitter = 0, fail = 0;
+	const char* image_file = NULL;
+	unsigned int pm, i;
+	int len, j;
+
+	count = strtol(p, &end, 10);
+	if (end != p && *end == '*')
+		p = end + 1;
+	else
+		count = 1;
+
+	len = strcspn(p, ",");
+	if (len == 0 || len >= MAX_NAME_LEN)
+	{
+		fprintf(stderr, "Invalid printer '%s'.\n", spec);
+		return -1;
+	}
+	memcpy(model, p, len);
+	model[len] = '\0';
+
+	pm = strtoul(model, &end, 10);
+	if (*end != '\0' || pm >= printers_count) //not a model number, search by name
+	{
+		for (pm = 1; pm < printers_count; pm++)
+		{
+			for (i = 0; printers[pm].name[i]; i++)
+				if (!strncasecmp((const char*)printers[pm].name + i, model, len))
+					break;
+			if (printers[pm].name[i])
+				break;
+		}
+	}
+	if (pm == PM_UNKNOWN || pm >= printers_count)
+	{
+		fprintf(stderr, "Unknown printer model '%s'.\n", model);
+		return -1;
+	}
+
+	for (opt = p + len; *opt == ','; opt += len)
+	{
+		opt++;
+		len = strcspn(opt, ",");
+		if (!strncmp(opt, "latency=", 8))
+			latency = atoi(opt + 8);
+		else if (!strncmp(opt, "jitter=", 7))
+			jitter = atoi(opt + 7);
+		else if (!strncmp(opt, "fail=", 5))
+			fail = atoi(opt + 5);
+		else if (!strncmp(opt, "image=", 6))
+			image_file = opt + 6; //the last option, may contain commas
+		else
+		{
+			fprintf(stderr, "Unknown option '%.*s'.\n", len, opt);
+			return -1;
+		}
+		if (image_file)
+			break;
+	}
+
+	if (count < 1 || devices_count + count > EMU_MAX_DEVICES)
+	{
+		fprintf(stderr, "Too many printers (maximum is %d).\n", EMU_MAX_DEVICES);
+		return -1;
+	}
+
+	for (j = 0; j < count; j++)
+	{
+		device = &devices[devices_count];
+		memset(device, 0, sizeof(emu_device_t));
+		device->master = device->slave = -1;
+		device->pm = pm;
+		device->latency = latency;
+		device->jitter = jitter;
+		device->fail = fail;
+		device->seed = seed + devices_count;
+
+		device->eeprom_size = printers[pm].eeprom_size;
+		if (device->eeprom_size == 0)
+			device->eeprom_size = printers[pm].twobyte_addresses ? EMU_EEPROM_SIZE2 : EMU_EEPROM_SIZE;
+		device->eeprom = malloc(device->eeprom_size);
+		if (!device->eeprom)
+		{
+			fprintf(stderr, "Out of memory.\n");
+			return -1;
+		}
+
+		if (image_file)
+		{
+			image = fopen(image_file, "rb");
+			if (!image)
+			{
+				fprintf(stderr, "Error opening EEPROM image '%s': %s\n", image_file, strerror(errno));
+				return -1;
+			}
+			memset(device->eeprom, 0xFF, device->eeprom_size);
+			fread(device->eeprom, 1, device->eeprom_size, image);
+			fclose(image);
+		}
+		else
+		{
+			for (i = 0; i < device->eeprom_size; i++)
+				device->eeprom[i] = rand_r(&device->seed) & 0xFF;
+		}
+
+		devices_count++;
+	}
+
+	return 0;
+}
+
+int device_start(emu_device_t* device, const char* dir, int index)
+{
+	struct termios tio;
+	char* slave_name;
+
+	device->master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (device->master < 0 || grantpt(device->master) || unlockpt(device->master) || !(slave_name = ptsname(device->master)))
+	{
+		fprintf(stderr, "Error creating pty: %s\n", strerror(errno));
+		return -1;
+	}
+
+	device->slave = open(slave_name, O_RDWR | O_NOCTTY);
+	if (device->slave < 0 || tcgetattr(device->slave, &tio))
+	{
+		fprintf(stderr, "Error opening '%s': %s\n", slave_name, strerror(errno));
+		return -1;
+	}
+	cfmakeraw(&tio); //printer data are binary
+	tcsetattr(device->slave, TCSANOW, &tio);
+
+	snprintf(device->link, PATH_MAX, "%s/lp%d", dir, index);
+	unlink(device->link);
+	if (symlink(slave_name, device->link))
+	{
+		fprintf(stderr, "Error creating link '%s': %s\n", device->link, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+void device_input(emu_device_t* device)
+{
+	unsigned char reply[EMU_REPLY_LEN];
+	unsigned char* p;
+	unsigned char* end;
+	unsigned char* name;
+	unsigned char* ejl;
+	int len, reply_len, name_len;
+
+	while (device->in_len > 0)
+	{
+		if (!device->packet_mode)
+		{
+			//everything is printed until EJL escape to IEEE 1284.4 mode
+			ejl = NULL;
+			for (p = device->in; p + 11 <= device->in + device->in_len; p++)
+				if (!memcmp(p, "@EJL 1284.4", 11))
+				{
+					ejl = p;
+					break;
+				}
+			if (!ejl)
+			{
+				device->in_len = 0;
+				return;
+			}
+
+			//drop the rest of escape ("\n@EJL\n@EJL\n")
+			end = device->in + device->in_len;
+			for (p = ejl; p < end && (p - ejl < 11 || *p == '\n' || *p == '@' || *p == 'E' || *p == 'J' || *p == 'L'); p++)
+				;
+			device->in_len = end - p;
+			memmove(device->in, p, device->in_len);
+
+			D(fprintf(stderr, "%s: entering IEEE 1284.4 mode\n", device->link))
+			device->packet_mode = 1;
+			device->ctrl_credits = 0;
+			device->ctrl_pending.len = 0;
+			schedule_reply(device, (const unsigned char*)"\0\0\0\x08\x01\0\x80\0", 8);
+			continue;
+		}
+
+		if (device->in_len < 6)
+			return;
+		len = (device->in[2] << 8) | device->in[3];
+		if (len < 6 || len > EMU_IN_LEN)
+		{
+			//malformed packet, resynchronize on the next write
+			D(fprintf(stderr, "%s: malformed packet, %d bytes dropped\n", device->link, device->in_len))
+			device->in_len = 0;
+			return;
+		}
+		if (device->in_len < len)
+			return;
+
+		p = device->in + 6; //payload
+		reply_len = 0;
+
+		if (device->in[0] == 0 && device->in[1] == 0)
+		{
+			//transaction channel
+			memcpy(reply, "\0\0\0\0\x01\0", 6);
+			reply[6] = p[0] | 0x80;
+			reply[7] = 0; //result
+			switch (p[0])
+			{
+			case 0x00: //Init
+				reply[8] = 0x10;
+				reply_len = 9;
+				device->ctrl_credits = 0;
+				device->ctrl_pending.len = 0;
+				break;
+			case 0x08: //Exit
+				reply_len = 8;
+				device->packet_mode = 0;
+				break;
+			case 0x09: //GetSocketID
+				name = p + 1;
+				name_len = len - 7;
+				if (name_len == 10 && !memcmp(name, "EPSON-CTRL", 10))
+					reply[8] = EMU_CTRL_SOCKET;
+				else if (name_len == 10 && !memcmp(name, "EPSON-DATA", 10))
+					reply[8] = EMU_DATA_SOCKET;
+				else
+				{
+					reply[7] = 0x0a; //service name to socket ID failed
+					reply[8] = 0;
+				}
+				if (name_len > EMU_REPLY_LEN - 9)
+					name_len = EMU_REPLY_LEN - 9;
+				memcpy(reply + 9, name, name_len);
+				reply_len = 9 + name_len;
+				break;
+			case 0x0a: //GetServiceName
+				reply[8] = p[1];
+				reply_len = 9;
+				if (p[1] == EMU_CTRL_SOCKET)
+					name = (unsigned char*)"EPSON-CTRL";
+				else if (p[1] == EMU_DATA_SOCKET)
+					name = (unsigned char*)"EPSON-DATA";
+				else
+				{
+					reply[7] = 0x09; //service not available on specified socket
+					break;
+				}
+				memcpy(reply + 9, name, 10);
+				reply_len = 19;
+				break;
+			case 0x01: //OpenChannel, packet sizes are accepted as requested
+				memcpy(reply + 8, p + 1, 6);
+				reply[14] = reply[15] = 0;
+				reply_len = 16;
+				if (p[1] != EMU_CTRL_SOCKET && p[1] != EMU_DATA_SOCKET)
+					reply[7] = 0x09; //service not available on specified socket
+				if (p[1] == EMU_CTRL_SOCKET)
+				{
+					device->ctrl_credits = 0;
+					device->ctrl_pending.len = 0;
+				}
+				break;
+			case 0x02: //CloseChannel
+				memcpy(reply + 8, p + 1, 2);
+				reply_len = 10;
+				break;
+			case 0x03: //Credit
+				memcpy(reply + 8, p + 1, 2);
+				reply_len = 10;
+				if (p[1] == EMU_CTRL_SOCKET)
+					device->ctrl_credits += (p[3] << 8) | p[4];
+				break;
+			case 0x04: //CreditRequest
+				memcpy(reply + 8, p + 1, 2);
+				reply[10] = 0;
+				reply[11] = EMU_CREDITS;
+				reply_len = 12;
+				break;
+			default:
+				D(fprintf(stderr, "%s: unknown transaction 0x%02x\n", device->link, p[0]))
+				break;
+			}
+		}
+		else if (device->in[0] == EMU_CTRL_SOCKET)
+		{
+			//piggybacked credit comes before the command: it releases the held reply
+			device->ctrl_credits += device->in[4];
+			if (device->ctrl_pending.len > 0 && device->ctrl_credits > 0)
+			{
+				device->ctrl_credits--;
+				schedule_reply(device, device->ctrl_pending.data, device->ctrl_pending.len);
+				device->ctrl_pending.len = 0;
+			}
+			device->commands++;
+			if (device->fail > 0 && rand_r(&device->seed) % 100 < device->fail)
+			{
+				D(fprintf(stderr, "%s: command dropped\n", device->link))
+				device->dropped++;
+			}
+			else if (device->ctrl_pending.len == 0)
+				device->ctrl_pending.len = ctrl_command(device, p, len - 6, device->ctrl_pending.data);
+		}
+		else if (device->in[0] == EMU_DATA_SOCKET)
+		{
+			//print job: ink is used up while printing
+			if ((device->job_bytes + len - 6) / EMU_INK_USE != device->job_bytes / EMU_INK_USE)
+			{
+				const ink_map_t* inkmap = &printers[device->pm].inkmap;
+				const unsigned char* inks[] = { inkmap->black, inkmap->cyan, inkmap->magenta,
+				                                inkmap->yellow, inkmap->lightcyan, inkmap->lightmagenta };
+				int i;
+
+				for (i = 0; i < 6; i++)
+					if ((inkmap->mask & (1 << i)) && device->eeprom[inks[i][0] % device->eeprom_size] < 0xFF)
+						device->eeprom[inks[i][0] % device->eeprom_size]++;
+				if (printers[device->pm].wastemap.len > 0 && device->eeprom[printers[device->pm].wastemap.addr[0] % device->eeprom_size] < 0xFF)
+					device->eeprom[printers[device->pm].wastemap.addr[0] % device->eeprom_size]++;
+			}
+			device->job_bytes += len - 6;
+		}
+
+		if (reply_len > 0)
+		{
+			reply[2] = reply_len >> 8;
+			reply[3] = reply_len & 0xFF;
+			schedule_reply(device, reply, reply_len);
+		}
+
+		//"EPSON-CTRL" reply goes when host gives credit for it
+		if (device->ctrl_pending.len > 0 && device->ctrl_credits > 0)
+		{
+			device->ctrl_credits--;
+			schedule_reply(device, device->ctrl_pending.data, device->ctrl_pending.len);
+			device->ctrl_pending.len = 0;
+		}
+
+		device->in_len -= len;
+		memmove(device->in, device->in + len, device->in_len);
+	}
+}
+
+long device_output(emu_device_t* device)
+{
+	emu_reply_t* reply;
+	long now = now_ms();
+
+	while (device->out_count > 0)
+	{
+		reply = &device->out[device->out_head];
+		if (reply->due > now)
+			return reply->due;
+		if (write(device->master, reply->data, reply->len) != reply->len)
+			D(fprintf(stderr, "%s: error writing reply: %s\n", device->link, strerror(errno)))
+		device->out_head = (device->out_head + 1) % EMU_MAX_REPLIES;
+		device->out_count--;
+	}
+
+	return -1;
+}
+
+void schedule_reply(emu_device_t* device, const unsigned char* data, int len)
+{
+	emu_reply_t* reply;
+	emu_reply_t* last;
+	long due;
+
+	if (device->out_count == EMU_MAX_REPLIES)
+	{
+		D(fprintf(stderr, "%s: too many replies, one dropped\n", device->link))
+		return;
+	}
+
+	due = now_ms() + device->latency;
+	if (device->jitter > 0)
+		due += rand_r(&device->seed) % (device->jitter + 1);
+
+	//replies go in order of requests
+	if (device->out_count > 0)
+	{
+		last = &device->out[(device->out_head + device->out_count - 1) % EMU_MAX_REPLIES];
+		if (due < last->due)
+			due = last->due;
+	}
+
+	reply = &device->out[(device->out_head + device->out_count) % EMU_MAX_REPLIES];
+	reply->due = due;
+	reply->len = len;
+	memcpy(reply->data, data, len);
+	device->out_count++;
+}
+
+int ctrl_command(emu_device_t* device, const unsigned char* cmd, int len, unsigned char* reply)
+{
+	const printer_t* printer = &printers[device->pm];
+	const unsigned char* inks[] = { printer->inkmap.black, printer->inkmap.cyan, printer->inkmap.magenta,
+	                                printer->inkmap.yellow, printer->inkmap.lightcyan, printer->inkmap.lightmagenta };
+	char* text = (char*)reply + 6;
+	int max = EMU_REPLY_LEN - 6;
+	unsigned int addr;
+	int n = 0, i;
+
+	if (len >= 2 && !memcmp(cmd, "di", 2))
+		n = snprintf(text, max, "di:01 @EJL ID\r\nMFG:EPSON;CMD:ESCPL2,BDC,D4;MDL:%s;CLS:PRINTER;\r\n\f", printer->model_name);
+	else if (len >= 2 && !memcmp(cmd, "st", 2))
+	{
+		//ink level is computed from the first byte of ink counter
+		n = snprintf(text, max, "st:01 @BDC ST\r\nST:04;ER:00;IQ:");
+		for (i = 0; i < 6; i++)
+			if (printer->inkmap.mask & (1 << i))
+				n += snprintf(text + n, max - n, "%02X", 100 - device->eeprom[inks[i][0] % device->eeprom_size] * 100 / 0xFF);
+		n += snprintf(text + n, max - n, ";\r\n\f");
+	}
+	else if (len >= 9 && cmd[0] == 0x7c && cmd[1] == 0x7c)
+	{
+		if (cmd[4] != printer->model_code[0] || cmd[5] != printer->model_code[1])
+			n = snprintf(text, max, "||:NA;\f");
+		else if (cmd[6] == 0x41 && len >= (printer->twobyte_addresses ? 11 : 10)) //EEPROM read
+		{
+			addr = cmd[9];
+			if (printer->twobyte_addresses)
+				addr |= cmd[10] << 8;
+			n = snprintf(text, max, "@BDC PS\r\nEE:%0*X%02X;\f", printer->twobyte_addresses ? 4 : 2, addr,
+						 device->eeprom[addr % device->eeprom_size]);
+		}
+		else if (cmd[6] == 0x42 && len >= (printer->twobyte_addresses ? 12 : 11)) //EEPROM write
+		{
+			addr = cmd[9];
+			if (printer->twobyte_addresses)
+				addr |= cmd[10] << 8;
+			device->eeprom[addr % device->eeprom_size] = cmd[printer->twobyte_addresses ? 11 : 10];
+			n = snprintf(text, max, "||:42:OK;\f");
+		}
+		else
+			n = snprintf(text, max, "||:NA;\f");
+	}
+	else if (len >= 2)
+		n = snprintf(text, max, "%c%c:NA;\f", cmd[0], cmd[1]);
+
+	if (n <= 0)
+		return 0;
+	if (n >= max)
+		n = max - 1;
+
+	n += 6;
+	reply[0] = reply[1] = EMU_CTRL_SOCKET;
+	reply[2] = n >> 8;
+	reply[3] = n & 0xFF;
+	reply[4] = 0; //no piggybacked credit
+	reply[5] = 0;
+	return n;
+}
+
+long now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,234 @@
+/* This file is part of ReInk.
+ * Copyright (C) 2008-2016 Alexey Osipov public@alexey.osipov.name
+ *
+ * ReInk is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReInk is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReInk. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+   How counters are recognized.
+
+   Ink counters store USED ink, so any ink consumption (head cleaning
+   or printing) makes them grow by a small amount. Mostly the lower
+   bytes of the counter are changed, so changed bytes form a cluster
+   not wider than counter itself. Waste ink counter grows together
+   with every ink counter used, so it is the one with largest growth.
+*/
+
+#include <string.h>	//memset
+#include <stdio.h>	//snprintf
+#include <stdlib.h>	//qsort
+
+#include "printers.h"
+#include "snapdiff.h"
+
+static void mark_around(unsigned int eeprom_size, unsigned char* likely, unsigned int addr)
+{
+	unsigned int a;
+
+	a = addr > SD_NEIGHBOURS ? addr - SD_NEIGHBOURS : 0;
+	for (; a <= addr + SD_NEIGHBOURS && a < eeprom_size; a++)
+		likely[a] = 1;
+}
+
+unsigned int snapdiff_likely(unsigned int eeprom_size, unsigned char* likely)
+{
+	unsigned int i, j;
+	unsigned int count = 0;
+	const ink_map_t* im;
+
+	memset(likely, 0, eeprom_size);
+
+	for (i = 0; i < printers_count; i++)
+	{
+		if (i == PM_UNKNOWN)
+			continue;
+
+		im = &printers[i].inkmap;
+		for (j = 0; j < SD_COUNTER_LEN; j++)
+		{
+			if (im->mask & INK_BLACK)
+				mark_around(eeprom_size, likely, im->black[j]);
+			if (im->mask & INK_CYAN)
+				mark_around(eeprom_size, likely, im->cyan[j]);
+			if (im->mask & INK_MAGENTA)
+				mark_around(eeprom_size, likely, im->magenta[j]);
+			if (im->mask & INK_YELLOW)
+				mark_around(eeprom_size, likely, im->yellow[j]);
+			if (im->mask & INK_LIGHTCYAN)
+				mark_around(eeprom_size, likely, im->lightcyan[j]);
+			if (im->mask & INK_LIGHTMAGENTA)
+				mark_around(eeprom_size, likely, im->lightmagenta[j]);
+		}
+
+		for (j = 0; j < printers[i].wastemap.len; j++)
+			mark_around(eeprom_size, likely, printers[i].wastemap.addr[j]);
+	}
+
+	for (i = 0; i < eeprom_size; i++)
+		count += likely[i];
+
+	return count;
+}
+
+static unsigned long counter_value(const unsigned char* snap, unsigned int addr, int len, int big_endian)
+{
+	unsigned long val = 0;
+	int i;
+
+	for (i = 0; i < len; i++)
+		val = (val << 8) | snap[big_endian ? addr + i : addr + len - 1 - i];
+
+	return val;
+}
+
+static void find_layout(counter_guess_t* g)
+{
+	unsigned int i;
+	const ink_map_t* im;
+	const char* what;
+
+	for (i = 0; i < printers_count; i++)
+	{
+		if (i == PM_UNKNOWN)
+			continue;
+
+		im = &printers[i].inkmap;
+		what = NULL;
+		if ((im->mask & INK_BLACK) && im->black[0] == g->addr)
+			what = "black ink";
+		else if ((im->mask & INK_CYAN) && im->cyan[0] == g->addr)
+			what = "cyan ink";
+		else if ((im->mask & INK_MAGENTA) && im->magenta[0] == g->addr)
+			what = "magenta ink";
+		else if ((im->mask & INK_YELLOW) && im->yellow[0] == g->addr)
+			what = "yellow ink";
+		else if ((im->mask & INK_LIGHTCYAN) && im->lightcyan[0] == g->addr)
+			what = "light cyan ink";
+		else if ((im->mask & INK_LIGHTMAGENTA) && im->lightmagenta[0] == g->addr)
+			what = "light magenta ink";
+		else if (printers[i].wastemap.len && printers[i].wastemap.addr[0] == g->addr)
+			what = "waste ink";
+
+		if (what)
+		{
+			snprintf(g->layout, sizeof(g->layout), "%s counter of %s", what, printers[i].name);
+			return;
+		}
+	}
+	g->layout[0] = '\0';
+}
+
+static int cmp_guess(const void* a, const void* b)
+{
+	const counter_guess_t* ga = a;
+	const counter_guess_t* gb = b;
+	unsigned long da, db;
+
+	//counters which grew go first, largest growth first
+	if ((ga->after > ga->before) != (gb->after > gb->before))
+		return ga->after > ga->before ? -1 : 1;
+
+	da = ga->after > ga->before ? ga->after - ga->before : 0;
+	db = gb->after > gb->before ? gb->after - gb->before : 0;
+	if (da != db)
+		return da > db ? -1 : 1;
+
+	return ga->addr < gb->addr ? -1 : 1;
+}
+
+static void fill_guess(counter_guess_t* g, const unsigned char* before, const unsigned char* after, unsigned int addr, int big_endian)
+{
+	g->addr = addr;
+	g->len = SD_COUNTER_LEN;
+	g->big_endian = big_endian;
+	g->before = counter_value(before, addr, g->len, big_endian);
+	g->after = counter_value(after, addr, g->len, big_endian);
+}
+
+int snapdiff_rank(const unsigned char* before, const unsigned char* after, const unsigned char* scanned, unsigned int size, counter_guess_t* guesses, int max_guesses)
+{
+	unsigned int a, first, last;
+	counter_guess_t le, be; //little- and big-endian interpretations
+	int count = 0;
+	int grown = 0;
+	int i;
+	counter_guess_t* g;
+
+	if (size < SD_COUNTER_LEN)
+		return 0;
+
+	for (a = 0; a < size && count < max_guesses; a++)
+	{
+		if ((scanned && !scanned[a]) || before[a] == after[a])
+			continue;
+
+		//cluster of changed bytes not wider than a counter
+		first = last = a;
+		for (a++; a < size && a < first + SD_COUNTER_LEN; a++)
+			if ((!scanned || scanned[a]) && before[a] != after[a])
+				last = a;
+		a = last;
+
+		//least significant byte changes first, so cluster starts
+		//the counter if it is little-endian and ends it otherwise
+		fill_guess(&le, before, after, first + SD_COUNTER_LEN <= size ? first : size - SD_COUNTER_LEN, 0);
+		fill_guess(&be, before, after, last + 1 >= SD_COUNTER_LEN ? last + 1 - SD_COUNTER_LEN : 0, 1);
+
+		//counter grows by small amount
+		g = &guesses[count++];
+		if (be.after > be.before && (le.after <= le.before || be.after - be.before < le.after - le.before))
+			*g = be;
+		else
+			*g = le;
+
+		if (g->after > g->before)
+		{
+			g->kind = SD_INK;
+			grown++;
+		}
+		else
+			g->kind = SD_UNKNOWN;
+
+		find_layout(g);
+	}
+
+	qsort(guesses, count, sizeof(counter_guess_t), cmp_guess);
+
+	//waste counter collects all the ink used
+	if (grown > 1)
+		guesses[0].kind = SD_WASTE;
+	else if (grown == 1)
+		guesses[0].kind = SD_COUNTER;
+
+	for (i = 0; i < count; i++)
+		if (guesses[i].kind != SD_UNKNOWN && strstr(guesses[i].layout, "waste"))
+			guesses[i].kind = SD_WASTE;
+
+	return count;
+}
+
+const char* snapdiff_kind_name(int kind)
+{
+	switch (kind)
+	{
+	case SD_INK:
+		return "ink counter";
+	case SD_WASTE:
+		return "waste counter";
+	case SD_COUNTER:
+		return "ink or waste counter";
+	default:
+		return "changed data";
+	}
+}
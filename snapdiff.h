@@ -0,0 +1,64 @@
+/* This file is part of ReInk.
+ * Copyright (C) 2008-2016 Alexey Osipov public@alexey.osipov.name
+ *
+ * ReInk is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReInk is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReInk. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SNAPDIFF_H
+
+#define SNAPDIFF_H
+
+#define SD_COUNTER_LEN		4	//maximum counter width in bytes
+#define SD_NEIGHBOURS		8	//addresses around known counters to rescan
+#define SD_MAX_GUESSES		64	//maximum count of ranked candidates
+
+//counter kinds
+#define SD_UNKNOWN		0	//changed, but doesn't look like a counter
+#define SD_INK			1	//ink counter candidate
+#define SD_WASTE		2	//waste ink counter candidate
+#define SD_COUNTER		3	//ink or waste counter candidate
+
+typedef struct _counter_guess {
+	unsigned int addr;		//first address of the counter
+	int len;				//counter width in bytes
+	int big_endian;			//is most significant byte first?
+	unsigned long before;	//value in baseline snapshot
+	unsigned long after;	//value in second snapshot
+	int kind;				//SD_*
+	char layout[200];		//known printer with counter at the same address ("" if none)
+} counter_guess_t;
+
+/*
+   Marks in <likely> addresses below <eeprom_size> which are worth
+   to rescan first: counter addresses of all known printers and
+   SD_NEIGHBOURS addresses around them.
+   Returns count of marked addresses.
+*/
+unsigned int snapdiff_likely(unsigned int eeprom_size, unsigned char* likely);
+
+/*
+   Compares snapshots <before> and <after> of <size> bytes and fills
+   <guesses> (up to <max_guesses>) with candidate counters, most
+   probable first. Only addresses marked in <scanned> are compared
+   (pass NULL to compare all).
+   Returns count of filled guesses.
+*/
+int snapdiff_rank(const unsigned char* before, const unsigned char* after, const unsigned char* scanned, unsigned int size, counter_guess_t* guesses, int max_guesses);
+
+/*
+   Returns textual name of SD_* kind.
+*/
+const char* snapdiff_kind_name(int kind);
+
+#endif
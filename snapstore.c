@@ -0,0 +1,646 @@
+/* This file is part of ReInk.
+ * Copyright (C) 2008-2016 Alexey Osipov public@alexey.osipov.name
+ *
+ * ReInk is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReInk is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReInk. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+   Snapshot file "<id>.snap" starts with the same line as the one
+   of the snapshot in "index":
+
+   <id>\t<time>\t<model code>\t<start>\t<size>\t<device>\t<model>\n
+
+   followed by block numbers (4 bytes each, little-endian). The last
+   block of snapshot is padded by zeros.
+
+   "hashes" is an open addressing hash table of blocks, so put reads
+   only the blocks it looks for. It starts with 8 bytes header:
+
+   <count of blocks indexed> <count of slots (power of two)>
+
+   followed by slots of 8 bytes: <block number + 1 (0 - empty)> and
+   <upper 32 bits of block hash>, all little-endian. Blocks appended
+   after <count> (i.e. by interrupted put) are indexed by the next put.
+   The table is rebuilt from "blocks" twice as big when it is half full,
+   missing or damaged.
+*/
+
+#include <stdlib.h>	//malloc
+#include <string.h>	//memcmp
+#include <stdio.h>	//fprintf
+#include <errno.h>	//errno
+#include <unistd.h>	//pread
+#include <fcntl.h>	//open
+#include <sys/stat.h>	//mkdir
+#include <sys/file.h>	//flock
+
+#include "snapstore.h"
+
+#define SS_LINE_LEN		(SS_DEVICE_LEN + SS_NAME_LEN + 64)	//maximum index line length
+#define SS_HASHES_MIN	1024	//slots of the smallest hash table
+
+//blocks of snapshot being read
+typedef struct _snap_blocks {
+	snap_info_t info;
+	unsigned int count;					//count of blocks
+	unsigned int block[SS_MAX_BLOCKS];	//block numbers
+	unsigned int cached;				//number of block in data (count if none)
+	unsigned char data[SS_BLOCK_LEN];	//last block read
+} snap_blocks_t;
+
+static void archive_path(char* path, const char* archive, const char* name)
+{
+	snprintf(path, SS_LINE_LEN, "%s/%s", archive, name);
+}
+
+static unsigned long long block_hash(const unsigned char* block)
+{
+	unsigned long long h = 0xcbf29ce484222325ULL; //FNV-1a
+	int i;
+
+	for (i = 0; i < SS_BLOCK_LEN; i++)
+	{
+		h ^= block[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static unsigned int get_le32(const unsigned char* le)
+{
+	return le[0] | (le[1] << 8) | (le[2] << 16) | ((unsigned int)le[3] << 24);
+}
+
+static void put_le32(unsigned char* le, unsigned int value)
+{
+	le[0] = value & 0xFF;
+	le[1] = (value >> 8) & 0xFF;
+	le[2] = (value >> 16) & 0xFF;
+	le[3] = (value >> 24) & 0xFF;
+}
+
+//replaces characters which would break index line
+static void copy_field(char* dst, const char* src, int len)
+{
+	int i;
+
+	for (i = 0; i < len - 1 && src[i]; i++)
+		dst[i] = (src[i] == '\t' || src[i] == '\n') ? ' ' : src[i];
+	dst[i] = '\0';
+}
+
+static void format_line(char* line, const snap_info_t* info)
+{
+	snprintf(line, SS_LINE_LEN, "%u\t%ld\t%02X%02X\t%04X\t%X\t%s\t%s\n",
+		info->id, (long)info->time, info->model_code[0], info->model_code[1],
+		info->start, info->size, info->device, info->model);
+}
+
+static int parse_line(char* line, snap_info_t* info)
+{
+	unsigned int code;
+	long t;
+	int pos;
+	char* model;
+
+	if (sscanf(line, "%u\t%ld\t%4x\t%x\t%x\t%n", &info->id, &t, &code, &info->start, &info->size, &pos) != 5)
+		return -1;
+	//snapshot must fit EEPROM image of SS_MAX_SIZE bytes
+	if (info->start > SS_MAX_SIZE || info->size > SS_MAX_SIZE - info->start || !(model = strchr(line + pos, '\t')))
+		return -1;
+
+	*model++ = '\0';
+	model[strcspn(model, "\n")] = '\0';
+	info->time = t;
+	info->model_code[0] = code >> 8;
+	info->model_code[1] = code & 0xFF;
+	copy_field(info->device, line + pos, SS_DEVICE_LEN);
+	copy_field(info->model, model, SS_NAME_LEN);
+	return 0;
+}
+
+static int read_snap(const char* archive, unsigned int id, snap_blocks_t* sb)
+{
+	char path[SS_LINE_LEN];
+	char line[SS_LINE_LEN];
+	unsigned char le[4];
+	unsigned int i;
+	FILE* f;
+
+	snprintf(line, SS_LINE_LEN, "%u.snap", id);
+	archive_path(path, archive, line);
+	if (!(f = fopen(path, "r")))
+	{
+		fprintf(stderr, "Error opening snapshot '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (!fgets(line, SS_LINE_LEN, f) || parse_line(line, &sb->info) || sb->info.id != id)
+	{
+		fprintf(stderr, "Snapshot '%s' is damaged.\n", path);
+		fclose(f);
+		return -1;
+	}
+
+	sb->count = (sb->info.size + SS_BLOCK_LEN - 1) / SS_BLOCK_LEN;
+	for (i = 0; i < sb->count; i++)
+	{
+		if (fread(le, 4, 1, f) != 1)
+		{
+			fprintf(stderr, "Snapshot '%s' is truncated.\n", path);
+			fclose(f);
+			return -1;
+		}
+		sb->block[i] = get_le32(le);
+	}
+
+	fclose(f);
+	sb->cached = sb->count;
+	return 0;
+}
+
+static int read_block(int fd, unsigned int block, unsigned char* data)
+{
+	if (pread(fd, data, SS_BLOCK_LEN, (off_t)block * SS_BLOCK_LEN) != SS_BLOCK_LEN)
+	{
+		fprintf(stderr, "Error reading block %u of archive.\n", block);
+		return -1;
+	}
+	return 0;
+}
+
+static int open_blocks(const char* archive, int flags)
+{
+	char path[SS_LINE_LEN];
+	int fd;
+
+	archive_path(path, archive, "blocks");
+	if ((fd = open(path, flags, 0644)) < 0)
+		fprintf(stderr, "Error opening '%s': %s\n", path, strerror(errno));
+	return fd;
+}
+
+//adds block <number> with hash <h> to hash table <hfd> of <slots>
+static int hashes_insert(int hfd, unsigned int slots, unsigned long long h, unsigned int number)
+{
+	unsigned char slot[8];
+	unsigned int i;
+
+	for (i = h & (slots - 1); ; i = (i + 1) & (slots - 1))
+	{
+		if (pread(hfd, slot, 8, 8 + (off_t)i * 8) != 8)
+			return -1;
+		if (!get_le32(slot))
+			break;
+	}
+	put_le32(slot, number + 1);
+	put_le32(slot + 4, h >> 32);
+	return pwrite(hfd, slot, 8, 8 + (off_t)i * 8) == 8 ? 0 : -1;
+}
+
+/*
+   Looks for <block> with hash <h> in hash table <hfd> of <slots>,
+   comparing candidates with blocks of <fd> (<nblocks> of them).
+   Returns 1 and block <*number> if found, 0 if not, -1 on fail.
+*/
+static int hashes_find(int hfd, unsigned int slots, int fd, unsigned int nblocks, unsigned long long h, const unsigned char* block, unsigned int* number)
+{
+	unsigned char slot[8];
+	unsigned char data[SS_BLOCK_LEN];
+	unsigned int i;
+
+	for (i = h & (slots - 1); ; i = (i + 1) & (slots - 1))
+	{
+		if (pread(hfd, slot, 8, 8 + (off_t)i * 8) != 8)
+			return -1;
+		if (!get_le32(slot))
+			return 0;
+		*number = get_le32(slot) - 1;
+		if (get_le32(slot + 4) != (unsigned int)(h >> 32) || *number >= nblocks)
+			continue; //another block or entry of damaged table
+		if (read_block(fd, *number, data))
+			return -1;
+		if (!memcmp(data, block, SS_BLOCK_LEN))
+			return 1;
+	}
+}
+
+/*
+   Opens hash table of <archive> with blocks <fd> (<nblocks> of them)
+   with room for <need> blocks, indexing blocks it misses.
+   On success returns its descriptor and sets <*slots>.
+   On fail prints error message to stderr and returns -1.
+*/
+static int hashes_open(const char* archive, int fd, unsigned int nblocks, unsigned int need, unsigned int* slots)
+{
+	char path[SS_LINE_LEN];
+	char tmp[SS_LINE_LEN];
+	unsigned char header[8];
+	unsigned char block[SS_BLOCK_LEN];
+	unsigned int count = 0;
+	struct stat st;
+	int rebuilt = 0; //table is new, in hashes.tmp
+	int hfd;
+
+	*slots = 0;
+	archive_path(path, archive, "hashes");
+	if ((hfd = open(path, O_RDWR)) >= 0)
+	{
+		if (fstat(hfd, &st) || pread(hfd, header, 8, 0) != 8)
+			count = nblocks + 1; //damaged
+		else
+		{
+			count = get_le32(header);
+			*slots = get_le32(header + 4);
+		}
+		if (count > nblocks || *slots < SS_HASHES_MIN || (*slots & (*slots - 1)) ||
+			st.st_size != 8 + (off_t)*slots * 8 || *slots < 2 * need)
+		{
+			close(hfd);
+			hfd = -1;
+		}
+	}
+
+	if (hfd < 0)
+	{
+		//new table gets all the blocks, it replaces the old one once complete
+		for (*slots = SS_HASHES_MIN; *slots < 4 * need; *slots <<= 1);
+		archive_path(tmp, archive, "hashes.tmp");
+		if ((hfd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 ||
+			ftruncate(hfd, 8 + (off_t)*slots * 8))
+		{
+			fprintf(stderr, "Error creating '%s': %s\n", tmp, strerror(errno));
+			if (hfd >= 0)
+				close(hfd);
+			return -1;
+		}
+		count = 0;
+		rebuilt = 1;
+	}
+
+	for (; count < nblocks; count++)
+		if (read_block(fd, count, block) || hashes_insert(hfd, *slots, block_hash(block), count))
+		{
+			fprintf(stderr, "Error indexing blocks of archive '%s'.\n", archive);
+			close(hfd);
+			return -1;
+		}
+
+	put_le32(header, count);
+	put_le32(header + 4, *slots);
+	if (pwrite(hfd, header, 8, 0) != 8)
+	{
+		fprintf(stderr, "Error writing '%s': %s\n", path, strerror(errno));
+		close(hfd);
+		return -1;
+	}
+
+	if (rebuilt && rename(tmp, path))
+	{
+		fprintf(stderr, "Error replacing '%s': %s\n", path, strerror(errno));
+		close(hfd);
+		return -1;
+	}
+
+	return hfd;
+}
+
+int snapstore_put(const char* archive, snap_info_t* info, const unsigned char* image)
+{
+	char path[SS_LINE_LEN];
+	char line[SS_LINE_LEN];
+	char name[32]; //snapshot file name
+	snap_info_t last; //the last snapshot in index
+	int fd; //blocks file
+	int hfd = -1; //hash table of blocks
+	struct stat st;
+	unsigned int nblocks; //count of blocks in archive
+	unsigned int nsnap; //count of blocks in snapshot
+	unsigned int slots; //hash table size
+	unsigned long long h;
+	unsigned char block[SS_BLOCK_LEN];
+	unsigned int numbers[SS_MAX_BLOCKS]; //block numbers of snapshot
+	unsigned int first; //the first block appended by this put
+	unsigned int i;
+	unsigned char le[4];
+	FILE* f;
+	int found;
+	int ret = -1;
+
+	if (info->size > SS_MAX_SIZE || info->start + info->size > SS_MAX_SIZE)
+	{
+		fprintf(stderr, "Snapshot is too large.\n");
+		return -1;
+	}
+
+	if (mkdir(archive, 0755) && errno != EEXIST)
+	{
+		fprintf(stderr, "Error creating archive '%s': %s\n", archive, strerror(errno));
+		return -1;
+	}
+
+	if ((fd = open_blocks(archive, O_RDWR | O_CREAT)) < 0)
+		return -1;
+
+	//blocks file is the lock of the whole archive
+	if (flock(fd, LOCK_EX) || fstat(fd, &st))
+	{
+		fprintf(stderr, "Error locking archive '%s': %s\n", archive, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	//drop partial block of interrupted put
+	nblocks = st.st_size / SS_BLOCK_LEN;
+	if (st.st_size % SS_BLOCK_LEN && ftruncate(fd, (off_t)nblocks * SS_BLOCK_LEN))
+	{
+		fprintf(stderr, "Error truncating blocks of archive '%s': %s\n", archive, strerror(errno));
+		goto out;
+	}
+
+	nsnap = (info->size + SS_BLOCK_LEN - 1) / SS_BLOCK_LEN;
+	if ((hfd = hashes_open(archive, fd, nblocks, nblocks + nsnap, &slots)) < 0)
+		goto out;
+
+	//find or append every block of the snapshot, only the blocks looked for are read
+	first = nblocks;
+	for (i = 0; i < nsnap; i++)
+	{
+		memset(block, 0, SS_BLOCK_LEN);
+		memcpy(block, image + i * SS_BLOCK_LEN, i == nsnap - 1 ? info->size - i * SS_BLOCK_LEN : SS_BLOCK_LEN);
+		h = block_hash(block);
+
+		if ((found = hashes_find(hfd, slots, fd, nblocks, h, block, &numbers[i])) < 0)
+		{
+			fprintf(stderr, "Error reading blocks of archive '%s'.\n", archive);
+			goto out;
+		}
+		if (!found)
+		{
+			if (pwrite(fd, block, SS_BLOCK_LEN, (off_t)nblocks * SS_BLOCK_LEN) != SS_BLOCK_LEN ||
+				hashes_insert(hfd, slots, h, nblocks))
+			{
+				fprintf(stderr, "Error writing blocks of archive '%s'.\n", archive);
+				goto out;
+			}
+			numbers[i] = nblocks++;
+		}
+	}
+
+	if (fdatasync(fd))
+	{
+		fprintf(stderr, "Error writing blocks of archive '%s': %s\n", archive, strerror(errno));
+		goto out;
+	}
+
+	//appended blocks are indexed now (the table is only a cache of blocks file)
+	if (nblocks > first)
+	{
+		put_le32(le, nblocks);
+		if (pwrite(hfd, le, 4, 0) != 4)
+		{
+			fprintf(stderr, "Error writing hashes of archive '%s'.\n", archive);
+			goto out;
+		}
+	}
+
+	//next id follows the last snapshot in index
+	info->id = 1;
+	archive_path(path, archive, "index");
+	if ((f = fopen(path, "r")))
+	{
+		while (fgets(line, SS_LINE_LEN, f))
+			if (!parse_line(line, &last) && last.id >= info->id)
+				info->id = last.id + 1;
+		fclose(f);
+	}
+
+	info->time = time(NULL);
+	copy_field(info->device, info->device, SS_DEVICE_LEN);
+	copy_field(info->model, info->model, SS_NAME_LEN);
+	format_line(line, info);
+
+	snprintf(name, sizeof(name), "%u.snap", info->id);
+	archive_path(path, archive, name);
+	if (!(f = fopen(path, "w")))
+	{
+		fprintf(stderr, "Error creating snapshot '%s': %s\n", path, strerror(errno));
+		goto out;
+	}
+	fputs(line, f);
+	for (i = 0; i < nsnap; i++)
+	{
+		put_le32(le, numbers[i]);
+		fwrite(le, 4, 1, f);
+	}
+	if (fclose(f))
+	{
+		fprintf(stderr, "Error writing snapshot '%s': %s\n", path, strerror(errno));
+		goto out;
+	}
+
+	//snapshot exists once it is in index
+	archive_path(path, archive, "index");
+	if (!(f = fopen(path, "a")))
+	{
+		fprintf(stderr, "Error opening '%s': %s\n", path, strerror(errno));
+		goto out;
+	}
+	fputs(line, f);
+	if (fclose(f))
+	{
+		fprintf(stderr, "Error writing '%s': %s\n", path, strerror(errno));
+		goto out;
+	}
+
+	ret = 0;
+
+out:
+	if (hfd >= 0)
+		close(hfd);
+	close(fd); //releases the lock
+	return ret;
+}
+
+int snapstore_list(const char* archive, snap_info_t** infos)
+{
+	char path[SS_LINE_LEN];
+	char line[SS_LINE_LEN];
+	snap_info_t* list = NULL;
+	snap_info_t* grown;
+	int count = 0;
+	int allocated = 0;
+	FILE* f;
+
+	archive_path(path, archive, "index");
+	if (!(f = fopen(path, "r")))
+	{
+		if (errno != ENOENT)
+		{
+			fprintf(stderr, "Error opening '%s': %s\n", path, strerror(errno));
+			return -1;
+		}
+		*infos = NULL; //no snapshots yet
+		return 0;
+	}
+
+	while (fgets(line, SS_LINE_LEN, f))
+	{
+		if (count == allocated)
+		{
+			allocated = allocated ? allocated * 2 : 64;
+			if (!(grown = realloc(list, allocated * sizeof(snap_info_t))))
+			{
+				fprintf(stderr, "Not enough memory.\n");
+				free(list);
+				fclose(f);
+				return -1;
+			}
+			list = grown;
+		}
+		if (!parse_line(line, &list[count]))
+			count++;
+	}
+
+	fclose(f);
+	*infos = list;
+	return count;
+}
+
+int snapstore_get(const char* archive, unsigned int id, snap_info_t* info, unsigned char* image)
+{
+	snap_blocks_t* sb;
+	unsigned int i;
+	int fd;
+	int ret = -1;
+
+	if (!(sb = malloc(sizeof(snap_blocks_t))))
+	{
+		fprintf(stderr, "Not enough memory.\n");
+		return -1;
+	}
+
+	if (read_snap(archive, id, sb) || (fd = open_blocks(archive, O_RDONLY)) < 0)
+	{
+		free(sb);
+		return -1;
+	}
+
+	for (i = 0; i < sb->count; i++)
+	{
+		if (read_block(fd, sb->block[i], sb->data))
+			break;
+		memcpy(image + i * SS_BLOCK_LEN, sb->data, i == sb->count - 1 ? sb->info.size - i * SS_BLOCK_LEN : SS_BLOCK_LEN);
+	}
+
+	if (i == sb->count)
+	{
+		*info = sb->info;
+		ret = 0;
+	}
+
+	close(fd);
+	free(sb);
+	return ret;
+}
+
+//returns byte of <sb> at EEPROM address <addr> (-1 if not covered, -2 on fail)
+static int byte_at(int fd, snap_blocks_t* sb, unsigned int addr)
+{
+	unsigned int i;
+
+	if (addr < sb->info.start || addr >= sb->info.start + sb->info.size)
+		return -1;
+
+	i = (addr - sb->info.start) / SS_BLOCK_LEN;
+	if (sb->cached != i)
+	{
+		if (read_block(fd, sb->block[i], sb->data))
+			return -2;
+		sb->cached = i;
+	}
+	return sb->data[(addr - sb->info.start) % SS_BLOCK_LEN];
+}
+
+long snapstore_diff(const char* archive, unsigned int id1, unsigned int id2, snap_change_t* changes, long max_changes)
+{
+	snap_blocks_t* sb; //both snapshots
+	unsigned int addr, end, skip_end;
+	unsigned int i1, i2;
+	int before, after;
+	long count = 0;
+	int fd;
+
+	if (!(sb = malloc(2 * sizeof(snap_blocks_t))))
+	{
+		fprintf(stderr, "Not enough memory.\n");
+		return -1;
+	}
+
+	if (read_snap(archive, id1, &sb[0]) || read_snap(archive, id2, &sb[1]) || (fd = open_blocks(archive, O_RDONLY)) < 0)
+	{
+		free(sb);
+		return -1;
+	}
+
+	addr = sb[0].info.start < sb[1].info.start ? sb[0].info.start : sb[1].info.start;
+	end = sb[0].info.start + sb[0].info.size;
+	if (sb[1].info.start + sb[1].info.size > end)
+		end = sb[1].info.start + sb[1].info.size;
+
+	while (addr < end)
+	{
+		//the same block at the same offset in both snapshots
+		if (addr >= sb[0].info.start && addr >= sb[1].info.start &&
+			(addr - sb[0].info.start) % SS_BLOCK_LEN == (addr - sb[1].info.start) % SS_BLOCK_LEN)
+		{
+			i1 = (addr - sb[0].info.start) / SS_BLOCK_LEN;
+			i2 = (addr - sb[1].info.start) / SS_BLOCK_LEN;
+			if (i1 < sb[0].count && i2 < sb[1].count && sb[0].block[i1] == sb[1].block[i2])
+			{
+				skip_end = addr - (addr - sb[0].info.start) % SS_BLOCK_LEN + SS_BLOCK_LEN;
+				if (skip_end > sb[0].info.start + sb[0].info.size)
+					skip_end = sb[0].info.start + sb[0].info.size;
+				if (skip_end > sb[1].info.start + sb[1].info.size)
+					skip_end = sb[1].info.start + sb[1].info.size;
+				addr = skip_end;
+				continue;
+			}
+		}
+
+		before = byte_at(fd, &sb[0], addr);
+		after = byte_at(fd, &sb[1], addr);
+		if (before == -2 || after == -2)
+		{
+			count = -1;
+			break;
+		}
+
+		if (before != after)
+		{
+			if (count < max_changes)
+			{
+				changes[count].addr = addr;
+				changes[count].before = before;
+				changes[count].after = after;
+			}
+			count++;
+		}
+		addr++;
+	}
+
+	close(fd);
+	free(sb);
+	return count;
+}
@@ -0,0 +1,108 @@
+/* This file is part of ReInk.
+ * Copyright (C) 2008-2016 Alexey Osipov public@alexey.osipov.name
+ *
+ * ReInk is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReInk is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReInk. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+   snapstore - archive of EEPROM snapshots of many printers.
+
+   Archive is a directory with four kinds of files:
+
+   "blocks"    - all distinct SS_BLOCK_LEN bytes blocks of all
+                 snapshots, appended as they first appear. Blocks
+                 are found by hash of their contents, so block
+                 equal to one already stored (the same model, the
+                 same printer yesterday) is not stored again.
+   "index"     - a line per snapshot with its metadata, so listing
+                 doesn't touch the blocks.
+   "<id>.snap" - block numbers of snapshot <id>, so retrieval reads
+                 only the blocks of that snapshot.
+   "hashes"    - hash table of "blocks", so put reads only the blocks
+                 it looks for and takes time by the snapshot size,
+                 not by the archive size.
+
+   All files but "hashes" are only appended to (or created), so archive
+   is never left damaged by interrupted put: at worst some blocks are
+   unused. "hashes" is only a cache, every block found by it is
+   compared, and it is rebuilt from "blocks" if it is damaged.
+*/
+
+#ifndef SNAPSTORE_H
+
+#define SNAPSTORE_H
+
+#include <time.h>
+
+#define SS_BLOCK_LEN		64		//bytes per block
+#define SS_MAX_SIZE			0x10000	//maximum snapshot size
+#define SS_MAX_BLOCKS		(SS_MAX_SIZE / SS_BLOCK_LEN)
+#define SS_DEVICE_LEN		256		//maximum device name length
+#define SS_NAME_LEN			200		//maximum model name length
+
+//snapshot metadata
+typedef struct _snap_info {
+	unsigned int id;			//snapshot number in archive (from 1)
+	time_t time;				//when snapshot was taken
+	char model[SS_NAME_LEN];	//printer name from printers[]
+	unsigned char model_code[2];	//printer secret model code
+	unsigned int start;			//EEPROM address of the first byte
+	unsigned int size;			//bytes count
+	char device[SS_DEVICE_LEN];	//device printer was connected to
+} snap_info_t;
+
+//one byte differing between two snapshots
+typedef struct _snap_change {
+	unsigned int addr;			//EEPROM address
+	int before;					//byte in the first snapshot (-1 if it doesn't cover addr)
+	int after;					//byte in the second snapshot (-1 if it doesn't cover addr)
+} snap_change_t;
+
+/*
+   Stores <info->size> bytes of <image> (EEPROM from address
+   <info->start>) to <archive>, creating it if needed.
+   Fields id and time of <info> are set.
+   On success returns 0.
+   On fail prints error message to stderr and returns -1.
+*/
+int snapstore_put(const char* archive, snap_info_t* info, const unsigned char* image);
+
+/*
+   Reads metadata of all snapshots in <archive> to newly allocated
+   array <*infos>, oldest first (free it with free()).
+   On success returns count of snapshots.
+   On fail prints error message to stderr and returns -1.
+*/
+int snapstore_list(const char* archive, snap_info_t** infos);
+
+/*
+   Reads snapshot <id> from <archive>: metadata to <info> and
+   <info->size> bytes to <image> (at least SS_MAX_SIZE bytes).
+   On success returns 0.
+   On fail prints error message to stderr and returns -1.
+*/
+int snapstore_get(const char* archive, unsigned int id, snap_info_t* info, unsigned char* image);
+
+/*
+   Compares snapshots <id1> and <id2> of <archive> byte by byte over
+   all addresses covered by any of them and fills <changes> (up to
+   <max_changes>) in order of address. Blocks shared by both
+   snapshots are skipped without reading.
+   On success returns count of differing bytes (may be more than
+   <max_changes>).
+   On fail prints error message to stderr and returns -1.
+*/
+long snapstore_diff(const char* archive, unsigned int id1, unsigned int id2, snap_change_t* changes, long max_changes);
+
+#endif